@@ -0,0 +1,691 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "bench.h"
+#include "version.h"
+#include "timespan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <sys/resource.h>
+#endif
+
+#define BENCH_MAX_PHASES 16
+#define BENCH_MAX_SETS 16
+
+struct bench_params {
+	int dirs;
+	int fanout;
+	int files;
+	int depth;
+	int rules;
+	int variants;
+	int jobs;
+	const char *dir;
+	const char *output;
+	const char *sets[BENCH_MAX_SETS];
+	int num_sets;
+};
+
+struct bench_phase {
+	char name[64];
+	double seconds;
+};
+
+struct bench_result {
+	const char *name;
+	int status;
+	double seconds;
+	long max_rss_kb;
+	long sql_statements;
+	double sql_seconds;
+	struct bench_phase phases[BENCH_MAX_PHASES];
+	int num_phases;
+};
+
+static const char *bench_usage = "Usage: tup bench [--dirs=N] [--fanout=N] [--files=N] [--depth=N] [--rules=N] [--variants=N] [-jN] [--set=section.name=value] [--output=FILE] [DIR]\n";
+
+static int parse_int_arg(const char *arg, const char *name, int min, int *result)
+{
+	int len = strlen(name);
+	char *endp;
+	long value;
+
+	if(strncmp(arg, name, len) != 0 || arg[len] != '=')
+		return 0;
+	value = strtol(arg + len + 1, &endp, 10);
+	if(*endp || endp == arg + len + 1 || value < min || value > INT_MAX) {
+		fprintf(stderr, "tup error: %s requires a number of at least %i.\n", name, min);
+		return -1;
+	}
+	*result = value;
+	return 1;
+}
+
+static int parse_args(struct bench_params *bp, int argc, char **argv)
+{
+	int x;
+
+	for(x=0; x<argc; x++) {
+		const char *arg = argv[x];
+		int rc;
+
+		if((rc = parse_int_arg(arg, "--dirs", 1, &bp->dirs)) != 0 ||
+		   (rc = parse_int_arg(arg, "--fanout", 0, &bp->fanout)) != 0 ||
+		   (rc = parse_int_arg(arg, "--files", 1, &bp->files)) != 0 ||
+		   (rc = parse_int_arg(arg, "--depth", 1, &bp->depth)) != 0 ||
+		   (rc = parse_int_arg(arg, "--rules", 0, &bp->rules)) != 0 ||
+		   (rc = parse_int_arg(arg, "--variants", 0, &bp->variants)) != 0) {
+			if(rc < 0)
+				return -1;
+		} else if(strncmp(arg, "-j", 2) == 0) {
+			bp->jobs = atoi(arg + 2);
+			if(bp->jobs < 1) {
+				fprintf(stderr, "tup error: -j requires a number of at least 1.\n");
+				return -1;
+			}
+		} else if(strncmp(arg, "--set=", 6) == 0) {
+			if(bp->num_sets == BENCH_MAX_SETS) {
+				fprintf(stderr, "tup error: Too many --set options (max %i).\n", BENCH_MAX_SETS);
+				return -1;
+			}
+			if(!strchr(arg + 6, '.') || !strchr(arg + 6, '=')) {
+				fprintf(stderr, "tup error: --set requires an argument of the form section.name=value\n");
+				return -1;
+			}
+			bp->sets[bp->num_sets] = arg + 6;
+			bp->num_sets++;
+		} else if(strncmp(arg, "--output=", 9) == 0) {
+			bp->output = arg + 9;
+		} else if(arg[0] == '-') {
+			fprintf(stderr, "tup error: Unknown bench option '%s'\n", arg);
+			fprintf(stderr, "%s", bench_usage);
+			return -1;
+		} else {
+			bp->dir = arg;
+		}
+	}
+	return 0;
+}
+
+static int write_file(const char *path, const char *fmt, ...)
+{
+	FILE *f;
+	va_list ap;
+
+	f = fopen(path, "w");
+	if(!f) {
+		perror(path);
+		fprintf(stderr, "tup error: Unable to create benchmark file.\n");
+		return -1;
+	}
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	if(fclose(f) != 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static int make_dir(const char *path)
+{
+	if(mkdir(path, 0777) < 0) {
+		perror(path);
+		fprintf(stderr, "tup error: Unable to create benchmark directory.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Directory x is at the top of the project, unless there is a fan-out, in
+ * which case d0 is the root of a tree where directory x > 0 is a
+ * subdirectory of directory (x-1)/fanout.
+ */
+static int dir_path(const struct bench_params *bp, int x, char *path, int size)
+{
+	int len = 0;
+
+	if(bp->fanout > 0 && x > 0) {
+		len = dir_path(bp, (x - 1) / bp->fanout, path, size);
+		if(len < 0)
+			return -1;
+		path[len] = '/';
+		len++;
+	}
+	len += snprintf(path + len, size - len, "d%i", x);
+	if(len >= size) {
+		fprintf(stderr, "tup error: Benchmark directory path is too long.\n");
+		return -1;
+	}
+	return len;
+}
+
+/* The generated project has --dirs directories that each run the
+ * preprocessor over their C files, followed by a chain of copy rules per file
+ * and a rule that combines everything in the directory. The directories are
+ * all at the top, or nested --fanout to a directory. Every C file includes a
+ * chain of headers, so touching the last header rebuilds the whole project.
+ */
+static int generate_project(const struct bench_params *bp)
+{
+	/* Leaves room in path for the file names within the directory. */
+	char dir[PATH_MAX - 32];
+	char path[PATH_MAX];
+	int x;
+	int y;
+
+	if(make_dir("include") < 0)
+		return -1;
+	for(x=0; x<bp->depth; x++) {
+		snprintf(path, sizeof(path), "include/h%i.h", x);
+		if(x + 1 < bp->depth) {
+			if(write_file(path, "#include \"h%i.h\"\n#define H%i %i\n", x + 1, x, x) < 0)
+				return -1;
+		} else {
+			if(write_file(path, "#define H%i %i\n", x, x) < 0)
+				return -1;
+		}
+	}
+	if(write_file("Tuprules.tup", "CFLAGS = -I$(TUP_CWD)/include\nCFLAGS += -DBENCH=@(BENCH)\n") < 0)
+		return -1;
+
+	for(x=0; x<bp->dirs; x++) {
+		FILE *f;
+		int r;
+
+		if(dir_path(bp, x, dir, sizeof(dir)) < 0)
+			return -1;
+		if(make_dir(dir) < 0)
+			return -1;
+		for(y=0; y<bp->files; y++) {
+			snprintf(path, sizeof(path), "%s/f%i.c", dir, y);
+			if(write_file(path, "#include \"h0.h\"\nint f%i_%i(void) {return H0;}\n", x, y) < 0)
+				return -1;
+		}
+
+		snprintf(path, sizeof(path), "%s/Tupfile", dir);
+		f = fopen(path, "w");
+		if(!f) {
+			perror(path);
+			return -1;
+		}
+		fprintf(f, "include_rules\n");
+		fprintf(f, ": foreach *.c |> gcc -E $(CFLAGS) %%f -o %%o |> %%B.i\n");
+		for(r=0; r<bp->rules; r++) {
+			if(r == 0)
+				fprintf(f, ": foreach *.i |> cp %%f %%o |> %%B.s0\n");
+			else
+				fprintf(f, ": foreach *.s%i |> cp %%f %%o |> %%B.s%i\n", r - 1, r);
+		}
+		fprintf(f, ": *.i |> cat %%f > %%o |> all.txt\n");
+		if(fclose(f) != 0) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	for(x=0; x<bp->variants; x++) {
+		snprintf(path, sizeof(path), "build-%i", x);
+		if(make_dir(path) < 0)
+			return -1;
+		snprintf(path, sizeof(path), "build-%i/tup.config", x);
+		if(write_file(path, "CONFIG_BENCH=%i\n", x) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int write_options(const struct bench_params *bp)
+{
+	FILE *f;
+	int x;
+
+	f = fopen(".tup/options", "a");
+	if(!f) {
+		perror(".tup/options");
+		return -1;
+	}
+	fprintf(f, "[display]\ncolor = never\nprogress = 0\njob_time = 1\n");
+	for(x=0; x<bp->num_sets; x++) {
+		const char *dot = strchr(bp->sets[x], '.');
+		const char *eq = strchr(bp->sets[x], '=');
+
+		fprintf(f, "[%.*s]\n%.*s = %s\n",
+			(int)(dot - bp->sets[x]), bp->sets[x],
+			(int)(eq - dot - 1), dot + 1, eq + 1);
+	}
+	if(fclose(f) != 0) {
+		perror(".tup/options");
+		return -1;
+	}
+	return 0;
+}
+
+/* Moves the mtime forward by a second so the change is seen even if the
+ * filesystem has coarse timestamps.
+ */
+static int bump_mtime(const char *path)
+{
+	struct stat st;
+	struct timespec ts[2];
+
+	if(stat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	ts[0].tv_sec = st.st_mtime + 1;
+	ts[0].tv_nsec = 0;
+	ts[1] = ts[0];
+	if(utimensat(AT_FDCWD, path, ts, 0) < 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Progress lines look like "[ tup ] [1.234s] Executing Commands...", where
+ * the time is since tup started. Each phase runs until the next line.
+ */
+static void parse_phases(struct bench_result *br, char *output)
+{
+	static const char prefix[] = "[ tup ] [";
+	char *line = output;
+	double last = 0.0;
+	int have_last = 0;
+
+	while(line && *line) {
+		char *nl = strchr(line, '\n');
+		char *endp;
+		double t;
+
+		if(nl)
+			*nl = 0;
+		if(strncmp(line, prefix, sizeof(prefix) - 1) == 0) {
+			t = strtod(line + sizeof(prefix) - 1, &endp);
+			if(strncmp(endp, "s] ", 3) == 0) {
+				char *msg = endp + 3;
+				int len = strlen(msg);
+
+				if(have_last && br->num_phases > 0)
+					br->phases[br->num_phases-1].seconds = t - last;
+				while(len > 0 && (msg[len-1] == '.' || msg[len-1] == '\r'))
+					len--;
+				if(br->num_phases < BENCH_MAX_PHASES) {
+					struct bench_phase *bph = &br->phases[br->num_phases];
+					snprintf(bph->name, sizeof(bph->name), "%.*s", len, msg);
+					bph->seconds = 0.0;
+					br->num_phases++;
+				}
+				last = t;
+				have_last = 1;
+			}
+		}
+		line = nl ? nl + 1 : NULL;
+	}
+	/* The final "Updated." line isn't a phase of its own. */
+	if(br->num_phases > 1 && strcmp(br->phases[br->num_phases-1].name, "Updated") == 0)
+		br->num_phases--;
+}
+
+/* Totals the statement counts and times in a --profile-sql JSON file. */
+static void parse_sql_profile(struct bench_result *br, const char *path)
+{
+	FILE *f;
+	char line[1024];
+
+	f = fopen(path, "r");
+	if(!f)
+		return;
+	while(fgets(line, sizeof(line), f)) {
+		char *p;
+
+		p = strstr(line, "\"count\": ");
+		if(p)
+			br->sql_statements += strtol(p + 9, NULL, 10);
+		p = strstr(line, "\"total\": ");
+		if(p)
+			br->sql_seconds += strtod(p + 9, NULL);
+	}
+	fclose(f);
+	unlink(path);
+}
+
+#ifndef _WIN32
+static int run_tup(const char *exe, struct bench_result *br, const char *name,
+		   const char *tupcmd, const struct bench_params *bp)
+{
+	char sqlfile[PATH_MAX];
+	char sqlarg[PATH_MAX + 16];
+	char jobsarg[32];
+	char tupname[] = "tup";
+	char cmdarg[16];
+	char *args[6];
+	int nargs = 0;
+	int fds[2];
+	pid_t pid;
+	int status;
+	struct rusage ru;
+	struct timespan ts;
+	char *output = NULL;
+	int outlen = 0;
+	int outsize = 0;
+
+	memset(br, 0, sizeof(*br));
+	br->name = name;
+
+	if(!getcwd(sqlfile, sizeof(sqlfile) - 20)) {
+		perror("getcwd");
+		return -1;
+	}
+	strcat(sqlfile, "/.tup/bench-sql.json");
+	snprintf(sqlarg, sizeof(sqlarg), "--profile-sql=%s", sqlfile);
+	snprintf(jobsarg, sizeof(jobsarg), "-j%i", bp->jobs);
+	snprintf(cmdarg, sizeof(cmdarg), "%s", tupcmd);
+
+	args[nargs++] = tupname;
+	args[nargs++] = sqlarg;
+	args[nargs++] = cmdarg;
+	if(bp->jobs > 0 && strcmp(tupcmd, "upd") == 0)
+		args[nargs++] = jobsarg;
+	args[nargs] = NULL;
+
+	if(pipe(fds) < 0) {
+		perror("pipe");
+		return -1;
+	}
+	timespan_start(&ts);
+	pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if(pid == 0) {
+		if(dup2(fds[1], STDOUT_FILENO) < 0) {
+			perror("dup2");
+			_exit(1);
+		}
+		close(fds[0]);
+		close(fds[1]);
+		if(strchr(exe, '/'))
+			execv(exe, args);
+		else
+			execvp(exe, args);
+		perror(exe);
+		_exit(1);
+	}
+	close(fds[1]);
+	while(1) {
+		ssize_t rc;
+
+		if(outsize - outlen < 4096) {
+			char *tmp;
+			outsize = outsize ? outsize * 2 : 16384;
+			tmp = realloc(output, outsize);
+			if(!tmp) {
+				perror("realloc");
+				free(output);
+				close(fds[0]);
+				return -1;
+			}
+			output = tmp;
+		}
+		rc = read(fds[0], output + outlen, outsize - outlen - 1);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		if(rc == 0)
+			break;
+		outlen += rc;
+	}
+	close(fds[0]);
+	output[outlen] = 0;
+
+	if(wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		free(output);
+		return -1;
+	}
+	timespan_end(&ts);
+
+	br->seconds = timespan_seconds(&ts);
+#ifdef __APPLE__
+	br->max_rss_kb = ru.ru_maxrss / 1024;
+#else
+	br->max_rss_kb = ru.ru_maxrss;
+#endif
+	br->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	parse_phases(br, output);
+	parse_sql_profile(br, sqlfile);
+	free(output);
+
+	if(br->status != 0) {
+		fprintf(stderr, "tup error: Benchmark scenario '%s' failed ('tup %s' returned %i).\n", name, tupcmd, br->status);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static void json_escape(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if((unsigned char)*s >= 0x20)
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void write_report(FILE *f, const struct bench_params *bp,
+			 const struct bench_result *results, int num)
+{
+	int x;
+	int y;
+	long commands;
+
+	commands = (long)bp->dirs * ((long)bp->files * (1 + bp->rules) + 1);
+	if(bp->variants > 0)
+		commands *= bp->variants;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"tup_version\": ");
+	json_escape(f, tup_version);
+	fprintf(f, ",\n");
+	fprintf(f, "  \"params\": {\"dirs\": %i, \"fanout\": %i, \"files\": %i, \"depth\": %i, \"rules\": %i, \"variants\": %i, \"jobs\": %i},\n",
+		bp->dirs, bp->fanout, bp->files, bp->depth, bp->rules, bp->variants, bp->jobs);
+	fprintf(f, "  \"commands\": %li,\n", commands);
+	fprintf(f, "  \"scenarios\": [\n");
+	for(x=0; x<num; x++) {
+		const struct bench_result *br = &results[x];
+
+		fprintf(f, "    {\"name\": \"%s\", \"status\": %i, \"seconds\": %f, \"max_rss_kb\": %li, \"sql_statements\": %li, \"sql_seconds\": %f, \"phases\": [",
+			br->name, br->status, br->seconds, br->max_rss_kb, br->sql_statements, br->sql_seconds);
+		for(y=0; y<br->num_phases; y++) {
+			fprintf(f, "%s{\"name\": ", y ? ", " : "");
+			json_escape(f, br->phases[y].name);
+			fprintf(f, ", \"seconds\": %f}", br->phases[y].seconds);
+		}
+		fprintf(f, "]}%s\n", x + 1 < num ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+}
+
+static void write_summary(FILE *f, const struct bench_result *results, int num)
+{
+	int x;
+
+	fprintf(f, "%-16s %10s %10s %12s %10s\n", "scenario", "time(s)", "rss(kB)", "statements", "sql(s)");
+	for(x=0; x<num; x++) {
+		const struct bench_result *br = &results[x];
+		fprintf(f, "%-16s %10.3f %10li %12li %10.3f\n", br->name, br->seconds, br->max_rss_kb, br->sql_statements, br->sql_seconds);
+	}
+}
+
+#ifdef _WIN32
+int bench_command(const char *progname, int argc, char **argv)
+{
+	if(progname || argc || argv) {}
+	fprintf(stderr, "tup error: 'tup bench' is not supported on Windows.\n");
+	return -1;
+}
+#else
+int bench_command(const char *progname, int argc, char **argv)
+{
+	struct bench_params bp = {
+		.dirs = 10,
+		.fanout = 0,
+		.files = 10,
+		.depth = 3,
+		.rules = 1,
+		.variants = 0,
+		.jobs = 0,
+		.dir = "tup-bench",
+		.output = NULL,
+		.num_sets = 0,
+	};
+	static const struct {
+		const char *name;
+		const char *tupcmd;
+	} scenarios[] = {
+		{"scan", "scan"},
+		{"parse", "parse"},
+		{"full_build", "upd"},
+		{"noop_update", "upd"},
+		{"one_file_update", "upd"},
+		{"full_rebuild", "upd"},
+	};
+	struct bench_result results[sizeof(scenarios) / sizeof(scenarios[0])];
+	char exe[PATH_MAX];
+	char path[PATH_MAX];
+	FILE *outf = NULL;
+	int num = 0;
+	int rc = 0;
+	int x;
+	ssize_t len;
+
+	if(parse_args(&bp, argc, argv) < 0)
+		return -1;
+
+	/* Re-run the same tup binary rather than whatever is in the PATH. */
+	len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if(len > 0) {
+		exe[len] = 0;
+	} else {
+		snprintf(exe, sizeof(exe), "%s", progname);
+		if(strchr(exe, '/') && exe[0] != '/') {
+			char cwd[PATH_MAX];
+			if(!getcwd(cwd, sizeof(cwd))) {
+				perror("getcwd");
+				return -1;
+			}
+			if(snprintf(exe, sizeof(exe), "%s/%s", cwd, progname) >= (signed)sizeof(exe)) {
+				fprintf(stderr, "tup error: Path to the tup executable is too long.\n");
+				return -1;
+			}
+		}
+	}
+
+	if(bp.output) {
+		outf = fopen(bp.output, "w");
+		if(!outf) {
+			perror(bp.output);
+			return -1;
+		}
+	}
+	if(make_dir(bp.dir) < 0) {
+		fprintf(stderr, "tup error: The benchmark directory '%s' must not already exist.\n", bp.dir);
+		return -1;
+	}
+	if(chdir(bp.dir) < 0) {
+		perror(bp.dir);
+		return -1;
+	}
+	if(generate_project(&bp) < 0)
+		return -1;
+	{
+		pid_t pid;
+		int status;
+
+		pid = fork();
+		if(pid < 0) {
+			perror("fork");
+			return -1;
+		}
+		if(pid == 0) {
+			int fd = open("/dev/null", O_WRONLY);
+			if(fd >= 0)
+				dup2(fd, STDOUT_FILENO);
+			if(strchr(exe, '/'))
+				execl(exe, "tup", "init", "--force", (char*)NULL);
+			else
+				execlp(exe, "tup", "init", "--force", (char*)NULL);
+			perror(exe);
+			_exit(1);
+		}
+		if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "tup error: Unable to initialize the benchmark project.\n");
+			return -1;
+		}
+	}
+	if(write_options(&bp) < 0)
+		return -1;
+
+	for(x=0; x<(signed)(sizeof(scenarios) / sizeof(scenarios[0])); x++) {
+		if(strcmp(scenarios[x].name, "one_file_update") == 0) {
+			if(bump_mtime("d0/f0.c") < 0)
+				return -1;
+		} else if(strcmp(scenarios[x].name, "full_rebuild") == 0) {
+			snprintf(path, sizeof(path), "include/h%i.h", bp.depth - 1);
+			if(bump_mtime(path) < 0)
+				return -1;
+		}
+		rc = run_tup(exe, &results[num], scenarios[x].name, scenarios[x].tupcmd, &bp);
+		num++;
+		if(rc < 0)
+			break;
+	}
+
+	if(outf) {
+		write_report(outf, &bp, results, num);
+		fclose(outf);
+		write_summary(stdout, results, num);
+	} else {
+		write_report(stdout, &bp, results, num);
+	}
+	return rc;
+}
+#endif
@@ -0,0 +1,433 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#include "builtin.h"
+#include "server.h"
+#include "file.h"
+#include "entry.h"
+#include "variant.h"
+#include "vardict.h"
+#include "varsed.h"
+#include "fslurp.h"
+#include "estring.h"
+#include "config.h"
+#include "compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BUILTIN_MAX_ARGS 16
+
+/* A command is only run in-process if the shell would have done nothing
+ * with it other than split it on whitespace. Anything that could be a
+ * redirect, quote, glob, expansion, or command separator means we let the
+ * shell have it.
+ */
+static int is_plain_char(char c)
+{
+	if(c >= 'a' && c <= 'z')
+		return 1;
+	if(c >= 'A' && c <= 'Z')
+		return 1;
+	if(c >= '0' && c <= '9')
+		return 1;
+	switch(c) {
+		case '_':
+		case '-':
+		case '.':
+		case '/':
+		case '+':
+		case ',':
+		case '@':
+		case '%':
+		case ':':
+		case '=':
+			return 1;
+	}
+	return 0;
+}
+
+static int split_args(char *buf, char **argv)
+{
+	char *p = buf;
+	int argc = 0;
+
+	while(*p) {
+		while(*p == ' ' || *p == '\t')
+			p++;
+		if(!*p)
+			break;
+		if(argc == BUILTIN_MAX_ARGS)
+			return -1;
+		argv[argc] = p;
+		argc++;
+		while(*p && *p != ' ' && *p != '\t') {
+			if(!is_plain_char(*p))
+				return -1;
+			p++;
+		}
+		if(*p) {
+			*p = 0;
+			p++;
+		}
+	}
+	return argc;
+}
+
+static void builtin_error(struct server *s, const char *cmd, const char *file)
+{
+	int err = errno;
+
+	pthread_mutex_lock(s->error_mutex);
+	fprintf(stderr, "tup error: %s: %s: %s\n", cmd, file, strerror(err));
+	pthread_mutex_unlock(s->error_mutex);
+}
+
+/* Report the access the same way the LD_PRELOAD shim would: relative names
+ * are taken from the directory the command runs in.
+ */
+static int record_file(struct server *s, enum access_type at,
+		       struct tup_entry *srctent, const char *file)
+{
+	char fullname[PATH_MAX];
+	int len;
+
+	if(is_full_path(file))
+		return handle_file(at, file, "", &s->finfo);
+	len = snprintf(fullname, sizeof(fullname), "%s", get_tup_top());
+	if(len < (signed)sizeof(fullname))
+		len += snprint_tup_entry(fullname + len, sizeof(fullname) - len, srctent);
+	if(len < (signed)sizeof(fullname))
+		len += snprintf(fullname + len, sizeof(fullname) - len, "/%s", file);
+	if(len >= (signed)sizeof(fullname)) {
+		fprintf(stderr, "tup error: string size too small in record_file\n");
+		return -1;
+	}
+	return handle_file(at, fullname, "", &s->finfo);
+}
+
+/* The updater has already removed the command's old outputs, so anything
+ * still at an output path isn't ours to overwrite. In that case we let the
+ * real command run, and the server sorts it out.
+ */
+static int output_exists(int dfd, const char *file)
+{
+	struct stat st;
+
+	if(fstatat(dfd, file, &st, AT_SYMLINK_NOFOLLOW) < 0 && errno == ENOENT)
+		return 0;
+	return 1;
+}
+
+static int write_output(struct server *s, int dfd, const char *cmd, const char *file,
+			const char *data, int len, mode_t mode)
+{
+	int fd;
+	int rc = 0;
+
+	fd = openat(dfd, file, O_WRONLY | O_CREAT | O_EXCL, mode);
+	if(fd < 0) {
+		builtin_error(s, cmd, file);
+		return 1;
+	}
+	while(len > 0) {
+		ssize_t ret = write(fd, data, len);
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			builtin_error(s, cmd, file);
+			rc = 1;
+			break;
+		}
+		data += ret;
+		len -= ret;
+	}
+	if(close(fd) < 0 && rc == 0) {
+		builtin_error(s, cmd, file);
+		rc = 1;
+	}
+	return rc;
+}
+
+struct varsed_arg {
+	struct server *s;
+	struct vardict *vd;
+	int rc;
+};
+
+static const char *builtin_var_lookup(void *arg, const char *var, int varlen)
+{
+	struct varsed_arg *va = arg;
+	char name[PATH_MAX];
+
+	/* The client sends ACCESS_VAR for every variable it looks up, whether
+	 * or not the variable exists.
+	 */
+	if(varlen >= PATH_MAX) {
+		va->rc = -1;
+		return NULL;
+	}
+	memcpy(name, var, varlen);
+	name[varlen] = 0;
+	if(handle_file(ACCESS_VAR, name, "", &va->s->finfo) < 0)
+		va->rc = -1;
+	return vardict_lookup(va->vd, var, varlen);
+}
+
+static int builtin_varsed(struct server *s, int dfd, struct tup_entry *dtent,
+			  int argc, char **argv)
+{
+	struct tup_entry *srctent = variant_tent_to_srctent(dtent);
+	struct vardict vd;
+	struct varsed_arg va;
+	struct estring e;
+	struct buf b;
+	int binmode = 0;
+	int x;
+	int fd;
+	int status;
+	const char *input = NULL;
+	const char *output = NULL;
+
+	for(x=2; x<argc; x++) {
+		if(strcmp(argv[x], "--binary") == 0) {
+			binmode = 1;
+		} else if(argv[x][0] == '-') {
+			return 0;
+		} else if(!input) {
+			input = argv[x];
+		} else if(!output) {
+			output = argv[x];
+		} else {
+			return 0;
+		}
+	}
+	if(!input || !output)
+		return 0;
+	if(output_exists(dfd, output))
+		return 0;
+
+	if(record_file(s, ACCESS_READ, srctent, input) < 0)
+		return -1;
+	fd = openat(dfd, input, O_RDONLY);
+	if(fd < 0) {
+		builtin_error(s, "tup varsed", input);
+		return 2;
+	}
+	if(fslurp(fd, &b) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if(vardict_open(&vd, tup_top_fd(), tup_entry_variant(dtent)->vardict_file) < 0) {
+		free(b.s);
+		return -1;
+	}
+	if(estring_init(&e) < 0) {
+		vardict_close(&vd);
+		free(b.s);
+		return -1;
+	}
+	va.s = s;
+	va.vd = &vd;
+	va.rc = 0;
+	if(varsed_buf(b.s, b.len, &e, binmode, builtin_var_lookup, &va) < 0)
+		va.rc = -1;
+	vardict_close(&vd);
+	free(b.s);
+	if(va.rc < 0) {
+		free(e.s);
+		return -1;
+	}
+
+	if(record_file(s, ACCESS_WRITE, srctent, output) < 0) {
+		free(e.s);
+		return -1;
+	}
+	status = write_output(s, dfd, "tup varsed", output, e.s, e.len, 0666);
+	free(e.s);
+	return status ? 2 : 1;
+}
+
+static int copy_data(int ifd, int ofd)
+{
+	char buf[65536];
+	ssize_t ret;
+
+#ifdef __linux__
+	/* copy_file_range() lets the filesystem share extents (reflink) or
+	 * copy in the kernel. Fall back to read/write if it isn't supported
+	 * between these two files.
+	 */
+	while(1) {
+		ret = copy_file_range(ifd, NULL, ofd, NULL, 1<<30, 0);
+		if(ret == 0)
+			return 0;
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+				break;
+			return -1;
+		}
+	}
+#endif
+	while(1) {
+		char *p = buf;
+		ret = read(ifd, buf, sizeof(buf));
+		if(ret == 0)
+			return 0;
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		while(ret > 0) {
+			ssize_t wrote = write(ofd, p, ret);
+			if(wrote < 0) {
+				if(errno == EINTR)
+					continue;
+				return -1;
+			}
+			p += wrote;
+			ret -= wrote;
+		}
+	}
+}
+
+static int builtin_cp(struct server *s, int dfd, struct tup_entry *dtent,
+		      int argc, char **argv)
+{
+	struct tup_entry *srctent = variant_tent_to_srctent(dtent);
+	struct stat st;
+	int ifd;
+	int ofd;
+	int status = 1;
+
+	if(argc != 3 || argv[1][0] == '-' || argv[2][0] == '-')
+		return 0;
+	if(output_exists(dfd, argv[2]))
+		return 0;
+
+	if(record_file(s, ACCESS_READ, srctent, argv[1]) < 0)
+		return -1;
+	ifd = openat(dfd, argv[1], O_RDONLY);
+	if(ifd < 0) {
+		builtin_error(s, "cp", argv[1]);
+		return 2;
+	}
+	if(fstat(ifd, &st) < 0) {
+		perror("fstat");
+		close(ifd);
+		return -1;
+	}
+	if(!S_ISREG(st.st_mode)) {
+		/* Let cp itself report directories and the like. */
+		close(ifd);
+		return 0;
+	}
+	if(record_file(s, ACCESS_WRITE, srctent, argv[2]) < 0) {
+		close(ifd);
+		return -1;
+	}
+	/* Same as cp without -p: the source's permission bits, less the umask. */
+	ofd = openat(dfd, argv[2], O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777);
+	if(ofd < 0) {
+		builtin_error(s, "cp", argv[2]);
+		close(ifd);
+		return 2;
+	}
+	if(copy_data(ifd, ofd) < 0) {
+		builtin_error(s, "cp", argv[2]);
+		status = 2;
+	}
+	if(close(ofd) < 0 && status == 1) {
+		builtin_error(s, "cp", argv[2]);
+		status = 2;
+	}
+	close(ifd);
+	return status;
+}
+
+static int builtin_touch(struct server *s, int dfd, struct tup_entry *dtent,
+			 int argc, char **argv)
+{
+	struct tup_entry *srctent = variant_tent_to_srctent(dtent);
+	int x;
+
+	if(argc < 2)
+		return 0;
+	for(x=1; x<argc; x++) {
+		if(argv[x][0] == '-')
+			return 0;
+		if(output_exists(dfd, argv[x]))
+			return 0;
+	}
+	for(x=1; x<argc; x++) {
+		if(record_file(s, ACCESS_WRITE, srctent, argv[x]) < 0)
+			return -1;
+		if(write_output(s, dfd, "touch", argv[x], NULL, 0, 0666) != 0)
+			return 2;
+	}
+	return 1;
+}
+
+int builtin_exec(struct server *s, int dfd, const char *cmd, struct tup_entry *dtent)
+{
+#ifdef _WIN32
+	if(s || dfd || cmd || dtent) {/* unused */}
+	return 0;
+#else
+	char buf[PATH_MAX * 2];
+	char *argv[BUILTIN_MAX_ARGS];
+	int argc;
+	int rc;
+	int len;
+
+	len = strlen(cmd);
+	if(len >= (signed)sizeof(buf))
+		return 0;
+	memcpy(buf, cmd, len + 1);
+	argc = split_args(buf, argv);
+	if(argc < 1)
+		return 0;
+
+	if(strcmp(argv[0], "tup") == 0 && argc >= 2 && strcmp(argv[1], "varsed") == 0) {
+		rc = builtin_varsed(s, dfd, dtent, argc, argv);
+	} else if(strcmp(argv[0], "cp") == 0) {
+		rc = builtin_cp(s, dfd, dtent, argc, argv);
+	} else if(strcmp(argv[0], "touch") == 0) {
+		rc = builtin_touch(s, dfd, dtent, argc, argv);
+	} else {
+		return 0;
+	}
+	if(rc <= 0)
+		return rc;
+	s->exited = 1;
+	s->exit_status = (rc == 1) ? 0 : 1;
+	return 1;
+#endif
+}
@@ -0,0 +1,35 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef tup_builtin_h
+#define tup_builtin_h
+
+struct server;
+struct tup_entry;
+
+/* Runs a few trivial commands ('tup varsed', 'cp', and 'touch') inside tup
+ * instead of forking a shell for them. The file accesses are recorded in
+ * s->finfo just as the server would have seen them. Returns 1 if the command
+ * was handled (s->exit_status is set), 0 if it should be run normally, and
+ * -1 on error.
+ */
+int builtin_exec(struct server *s, int dfd, const char *cmd, struct tup_entry *dtent);
+
+#endif
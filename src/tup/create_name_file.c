@@ -612,6 +612,13 @@ tupid_t find_dir_tupid_dt_pg(tupid_t dt, struct pel_group *pg,
 
 			if(tup_db_select_tent_part(tent, pel->path, pel->len, &tent) < 0)
 				return -1;
+			/* Variant directories are created lazily, so if the
+			 * srcdir has this directory, make it now.
+			 */
+			if(!tent || tent->type == TUP_NODE_GHOST) {
+				if(tup_db_variant_subdir(curtent, pel->path, pel->len, &tent) < 0)
+					return -1;
+			}
 			if(tent) {
 				if(sotgv == SOTGV_CREATE_DIRS) {
 					if(tent->type == TUP_NODE_GHOST) {
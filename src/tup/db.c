@@ -39,6 +39,11 @@
 #include "timespan.h"
 #include "variant.h"
 #include "logging.h"
+#include "linkcache.h"
+#include "profile.h"
+#include "lock.h"
+#include "jobserver.h"
+#include "flist.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -46,12 +51,21 @@
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include "sqlite3/sqlite3.h"
 
-#define DB_VERSION 18
+#define DB_VERSION 21
 #define PARSER_VERSION 14
 
+/* How long to wait (in ms) for another process that is reading or writing the
+ * database, since query commands may run alongside an update (see lock.c).
+ * The process that writes has to wait out any query that is in the middle of
+ * reading, while a read-only query only ever waits for a commit.
+ */
+#define DB_BUSY_TIMEOUT 60000
+#define DB_READ_ONLY_BUSY_TIMEOUT 5000
+
 enum {
 	DB_BEGIN,
 	DB_COMMIT,
@@ -107,13 +121,23 @@ enum {
 	DB_MODIFY_CMDS_BY_OUTPUT,
 	DB_MODIFY_CMDS_BY_INPUT,
 	DB_SET_DEPENDENT_DIR_FLAGS,
+	_DB_DIR_INTERFACE_NODES,
+	_DB_DIR_INTERFACE_GET,
+	_DB_DIR_INTERFACE_SET,
+	DB_CLEAR_DIR_INTERFACE,
 	DB_SET_SRCID_DIR_FLAGS,
 	DB_SET_DEPENDENT_CONFIG_FLAGS,
 	_DB_GET_OUTPUTS,
+	DB_IS_INPUT,
 	DB_SELECT_NODE_BY_GROUP_LINK,
 	DB_SELECT_NODE_BY_DISTINCT_GROUP_LINK,
 	DB_CONFIG_SET_INT,
 	DB_CONFIG_GET_INT,
+	_DB_GET_LINK_GENERATION,
+	_DB_LINK_CACHE_OUTPUTS,
+	_DB_LINK_CACHE_INPUTS,
+	_DB_LINK_CACHE_KEY_OUTPUTS,
+	_DB_LINK_CACHE_KEY_INPUTS,
 	DB_SET_VAR,
 	_DB_GET_VAR_ID,
 	DB_FILES_TO_TREE,
@@ -128,12 +152,17 @@ enum {
 	_DB_GROUP_LINK_INSERT,
 	_DB_GROUP_LINK_REMOVE,
 	_DB_DELETE_GROUP_LINKS,
+	_DB_GROUP_LINK_EXISTS,
+	_DB_GROUP_SUCCESSORS,
+	_DB_GROUP_PREDECESSORS,
+	_DB_GROUP_ORDER_LOAD,
+	_DB_GROUP_ORDER_SET,
+	_DB_GROUP_ORDER_DELETE,
 	_DB_NODE_HAS_GHOSTS,
-	_DB_EXCLUSION_RECLAIMABLE,
-	_DB_GROUP_RECLAIMABLE1,
-	_DB_GROUP_RECLAIMABLE2,
-	_DB_GHOST_RECLAIMABLE1,
-	_DB_GHOST_RECLAIMABLE2,
+	_DB_GHOST_CHECK_INSERT,
+	_DB_DELETE_CHECK_INSERT,
+	_DB_DELETE_CHECK_MODIFY,
+	_DB_DELETE_CHECK_GHOSTS,
 	DB_GET_VARDB,
 	_DB_VAR_FLAG_DIRS,
 	_DB_DELETE_VAR_ENTRY,
@@ -154,8 +183,17 @@ static struct tent_entries ghost_root = TENT_ENTRIES_INITIALIZER;
 static int tup_db_var_changed = 0;
 static int sql_debug = 0;
 static int reclaim_ghost_debug = 0;
+static int reclaim_threshold = 0;
+static int reclaim_forced = 0;
+static int reclaim_deferred = 0;
+static int ghosts_reclaimed = 0;
+static int ghost_check_created = 0;
+static int delete_check_created = 0;
 static struct vardb envdb = { {NULL}, 0, NULL, NULL};
 static int transaction = 0;
+static int checkpoint_interval = 0;
+static struct timespan checkpoint_ts;
+static int checkpoint_changes = 0;
 static tupid_t local_env_dt = -1;
 static tupid_t local_exclusion_dt = -1;
 static tupid_t local_slash_dt = -1;
@@ -168,7 +206,65 @@ static tupid_t local_slash_dt = -1;
  */
 static int sticky_count = 1;
 
+/* Cache of the members of each group (the from_id side of normal_link for a
+ * group node), used when expanding %<group> in command strings. Entries are
+ * keyed by the group's tupid. Any change to the links into a cached group
+ * drops that group, and bulk link deletions or group_link changes drop the
+ * whole cache.
+ */
+struct group_members {
+	struct tupid_tree tnode;
+	struct tupid_entries members;
+};
+static struct tupid_entries group_members_root = RB_INITIALIZER(&group_members_root);
+
+static void invalidate_group_members(tupid_t tupid);
+static void clear_group_members(void);
+
+/* The groups are kept in a topological order of the group_link graph, which
+ * is saved in the group_order table. Group links added during the parse are
+ * queued here, and checked against the order by tup_db_check_group_order().
+ */
+struct group_order_edge {
+	TAILQ_ENTRY(group_order_edge) list;
+	tupid_t from;
+	tupid_t to;
+};
+TAILQ_HEAD(group_order_edge_head, group_order_edge);
+static struct group_order_edge_head group_order_pending = TAILQ_HEAD_INITIALIZER(group_order_pending);
+
+static void clear_group_order_pending(void);
+
+/* Optional memory-mapped copy of normal_link (see linkcache.h). It is only
+ * consulted while the current transaction has not modified normal_link, and
+ * is checked against the link_generation config value once per transaction.
+ */
+static int link_cache_enabled = 0;
+static int links_dirty = 0;
+static int link_cache_checked = 0;
+static struct linkcache link_cache;
+static struct linkcache_id db_file_id;
+
+/* Nodes whose links changed since the link cache file for generation
+ * link_dirty_base was written. The final commit of an update merges just
+ * these into the mapped cache rather than reading all of normal_link again.
+ * link_dirty_generation is the generation that this process last committed,
+ * so a commit from another process in between is noticed.
+ */
+static struct tupid_entries link_dirty_root = RB_INITIALIZER(&link_dirty_root);
+static long long link_dirty_base = -1;
+static long long link_dirty_generation = -1;
+
+static int link_changed(tupid_t tupid);
+static int bump_link_generation(int merge, struct linkcache_writer *w,
+				struct linkcache_id *id);
+static void save_link_cache(struct linkcache_writer *w, const struct linkcache_id *id);
+static int link_cache_current(const struct linkcache_id *id);
+static struct linkcache *get_link_cache(void);
+static void close_link_cache(void);
+
 static int version_check(void);
+static int db_commit(void);
 static int init_virtual_dirs(void);
 static struct tup_entry *node_insert(struct tup_entry *dtent, const char *name, int namelen,
 				     const char *display, int displaylen, const char *flags, int flagslen,
@@ -187,17 +283,12 @@ static int load_existing_nodes(void);
 static int add_ghost_checks(tupid_t tupid);
 static int add_group_and_exclusion_checks(tupid_t tupid);
 static int reclaim_ghosts(void);
-static int ghost_reclaimable(struct tup_entry *tent);
-static int exclusion_reclaimable(tupid_t tupid);
-static int group_reclaimable1(tupid_t tupid);
-static int group_reclaimable2(tupid_t tupid);
-static int ghost_reclaimable1(tupid_t tupid);
-static int ghost_reclaimable2(tupid_t tupid);
 static int get_file_var_tree(struct vardb *vdb, int fd);
 static int var_flag_dirs(tupid_t tupid);
 static int delete_var_entry(tupid_t tupid);
 static int no_sync(void);
 static int delete_node(tupid_t tupid);
+static int delete_group_order(tupid_t tupid);
 static int db_print(FILE *stream, tupid_t tupid);
 static int get_dir_entries(tupid_t dt, struct half_entry_head *head);
 
@@ -205,6 +296,19 @@ static char transaction_buf[1024];
 static int transaction_started = 0;
 static struct timespan transaction_ts;
 
+/* Aggregated statistics for each entry in stmts[], enabled with
+ * --profile-sql.
+ */
+struct sql_profile {
+	int count;
+	double total;
+	double max;
+	long long rows;
+};
+static struct sql_profile sql_profile[DB_NUM_STATEMENTS];
+static int sql_profile_enabled = 0;
+static const char *sql_profile_file = NULL;
+
 static void transaction_check(const char *format, ...)
 {
 	if(transaction_started) {
@@ -212,7 +316,7 @@ static void transaction_check(const char *format, ...)
 		exit(1);
 	}
 	transaction_started = 1;
-	if(sql_debug || !transaction) {
+	if(sql_debug || sql_profile_enabled || !transaction) {
 		va_list ap;
 		va_start(ap, format);
 
@@ -227,34 +331,136 @@ static void transaction_check(const char *format, ...)
 	}
 }
 
-static int msqlite3_reset(sqlite3_stmt *stmt)
+static int is_write_statement(const char *sql)
+{
+	if(strncmp(sql, "insert", 6) == 0 ||
+	   strncmp(sql, "update", 6) == 0 ||
+	   strncmp(sql, "delete", 6) == 0)
+		return 1;
+	return 0;
+}
+
+/* The statement's slot in stmts[] is also its index into sql_profile[]. */
+static void sql_profile_add(sqlite3_stmt **stmt, double seconds)
+{
+	struct sql_profile *sp;
+
+	sp = &sql_profile[stmt - stmts];
+	sp->count++;
+	sp->total += seconds;
+	if(seconds > sp->max)
+		sp->max = seconds;
+	if(is_write_statement(sqlite3_sql(*stmt)))
+		sp->rows += sqlite3_changes(tup_db);
+}
+
+static int msqlite3_reset(sqlite3_stmt **stmt)
 {
 	transaction_started = 0;
-	if(sql_debug) {
+	profile_count(PROFILE_SQL, 1);
+	if(sql_debug || sql_profile_enabled) {
 		timespan_end(&transaction_ts);
-		if(strncmp(transaction_buf, "insert", 6) == 0 ||
-		   strncmp(transaction_buf, "update", 6) == 0 ||
-		   strncmp(transaction_buf, "delete", 6) == 0) {
+	}
+	if(sql_debug) {
+		if(is_write_statement(transaction_buf)) {
 			fprintf(stderr, "[%fs] {%i} %s\n", timespan_seconds(&transaction_ts), sqlite3_changes(tup_db), transaction_buf);
 		} else {
 			fprintf(stderr, "[%fs] %s\n", timespan_seconds(&transaction_ts), transaction_buf);
 		}
 	}
-	return sqlite3_reset(stmt);
+	if(sql_profile_enabled) {
+		sql_profile_add(stmt, timespan_seconds(&transaction_ts));
+	}
+	return sqlite3_reset(*stmt);
+}
+
+static int sql_profile_cmp(const void *a, const void *b)
+{
+	const struct sql_profile *spa = &sql_profile[*(const int*)a];
+	const struct sql_profile *spb = &sql_profile[*(const int*)b];
+
+	if(spa->total < spb->total)
+		return 1;
+	if(spa->total > spb->total)
+		return -1;
+	return spb->count - spa->count;
+}
+
+static void json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for(; *str; str++) {
+		if(*str == '"' || *str == '\\') {
+			fputc('\\', f);
+			fputc(*str, f);
+		} else if((unsigned char)*str < 0x20) {
+			fprintf(f, "\\u%04x", *str);
+		} else {
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static void sql_profile_write(void)
+{
+	int order[DB_NUM_STATEMENTS];
+	int num = 0;
+	int x;
+	FILE *f = stderr;
+
+	for(x=0; x<DB_NUM_STATEMENTS; x++) {
+		if(sql_profile[x].count && stmts[x])
+			order[num++] = x;
+	}
+	qsort(order, num, sizeof(order[0]), sql_profile_cmp);
+
+	if(sql_profile_file) {
+		f = fopen(sql_profile_file, "w");
+		if(!f) {
+			perror(sql_profile_file);
+			fprintf(stderr, "tup error: Unable to write the SQL profile.\n");
+			return;
+		}
+		fprintf(f, "[\n");
+		for(x=0; x<num; x++) {
+			struct sql_profile *sp = &sql_profile[order[x]];
+			fprintf(f, "  {\"slot\": %i, \"count\": %i, \"total\": %f, \"max\": %f, \"rows\": %lli, \"sql\": ", order[x], sp->count, sp->total, sp->max, sp->rows);
+			json_string(f, sqlite3_sql(stmts[order[x]]));
+			fprintf(f, "}%s\n", x+1 < num ? "," : "");
+		}
+		fprintf(f, "]\n");
+		fclose(f);
+	} else {
+		fprintf(f, "tup: SQL profile (%i statements, sorted by total time):\n", num);
+		fprintf(f, "%10s %10s %10s %10s  %s\n", "total(s)", "max(s)", "count", "rows", "statement");
+		for(x=0; x<num; x++) {
+			struct sql_profile *sp = &sql_profile[order[x]];
+			fprintf(f, "%10.6f %10.6f %10i %10lli  %s\n", sp->total, sp->max, sp->count, sp->rows, sqlite3_sql(stmts[order[x]]));
+		}
+	}
+	memset(sql_profile, 0, sizeof(sql_profile));
 }
 
 static int db_open(void)
 {
 	int x;
 	int db_sync;
+	int flags = SQLITE_OPEN_READWRITE;
+	int busy_timeout = DB_BUSY_TIMEOUT;
 
 	if(tup_db)
 		return 0;
-	if(sqlite3_open_v2(TUP_DB_FILE, &tup_db, SQLITE_OPEN_READWRITE, NULL) != 0) {
+	if(tup_lock_read_only()) {
+		flags = SQLITE_OPEN_READONLY;
+		busy_timeout = DB_READ_ONLY_BUSY_TIMEOUT;
+	}
+	if(sqlite3_open_v2(TUP_DB_FILE, &tup_db, flags, NULL) != 0) {
 		fprintf(stderr, "Unable to open database: %s\n",
 			sqlite3_errmsg(tup_db));
 		return -1;
 	}
+	sqlite3_busy_timeout(tup_db, busy_timeout);
 	for(x=0; x<ARRAY_SIZE(stmts); x++) {
 		stmts[x] = NULL;
 	}
@@ -263,6 +469,24 @@ static int db_open(void)
 	if(db_sync == 0)
 		if(no_sync() < 0)
 			return -1;
+	reclaim_threshold = tup_option_get_int("db.reclaim_threshold");
+	checkpoint_interval = tup_option_get_int("db.checkpoint_interval");
+#ifndef _WIN32
+	/* A read-only process can't rebuild the cache, and the process that is
+	 * writing may be about to.
+	 */
+	link_cache_enabled = tup_option_get_flag("db.link_cache") && !tup_lock_read_only();
+	if(link_cache_enabled) {
+		struct stat st;
+
+		if(stat(TUP_DB_FILE, &st) < 0) {
+			perror(TUP_DB_FILE);
+			return -1;
+		}
+		db_file_id.dev = st.st_dev;
+		db_file_id.ino = st.st_ino;
+	}
+#endif
 	return 0;
 }
 
@@ -285,6 +509,10 @@ int tup_db_close(void)
 {
 	int x;
 
+	if(sql_profile_enabled)
+		sql_profile_write();
+	close_link_cache();
+	clear_group_order_pending();
 	for(x=0; x<ARRAY_SIZE(stmts); x++) {
 		if(stmts[x])
 			sqlite3_finalize(stmts[x]);
@@ -296,6 +524,8 @@ int tup_db_close(void)
 		return -1;
 	}
 	tup_db = NULL;
+	ghost_check_created = 0;
+	delete_check_created = 0;
 	return 0;
 }
 
@@ -306,9 +536,9 @@ int tup_db_create(int db_sync, int memory_db)
 	const char *dbname;
 	const char *sql[] = {
 		"create table node (id integer primary key not null, dir integer not null, type integer not null, mtime integer not null, srcid integer not null, name varchar(4096), display varchar(4096), flags varchar(256), unique(dir, name))",
-		"create table normal_link (from_id integer, to_id integer, unique(from_id, to_id))",
-		"create table sticky_link (from_id integer, to_id integer, unique(from_id, to_id))",
-		"create table group_link (from_id integer, to_id integer, cmdid integer, unique(from_id, to_id, cmdid))",
+		"create table normal_link (from_id integer not null, to_id integer not null, primary key(from_id, to_id)) without rowid",
+		"create table sticky_link (from_id integer not null, to_id integer not null, primary key(from_id, to_id)) without rowid",
+		"create table group_link (from_id integer not null, to_id integer not null, cmdid integer not null, primary key(from_id, to_id, cmdid)) without rowid",
 		"create table var (id integer primary key not null, value varchar(4096))",
 		"create table config(lval varchar(256) unique, rval varchar(256))",
 		"create table config_list (id integer primary key not null)",
@@ -316,9 +546,12 @@ int tup_db_create(int db_sync, int memory_db)
 		"create table modify_list (id integer primary key not null)",
 		"create table variant_list (id integer primary key not null)",
 		"create table transient_list (id integer primary key not null)",
-		"create index normal_index2 on normal_link(to_id)",
-		"create index sticky_index2 on sticky_link(to_id)",
-		"create index group_index2 on group_link(cmdid)",
+		"create table dir_interface (id integer primary key not null, hash integer not null)",
+		"create index normal_index2 on normal_link(to_id, from_id)",
+		"create index sticky_index2 on sticky_link(to_id, from_id)",
+		"create table group_order (id integer primary key not null, ord integer not null)",
+		"create index group_index2 on group_link(cmdid, from_id, to_id)",
+		"create index group_index3 on group_link(to_id, from_id)",
 		"create index srcid_index on node(srcid)",
 		"insert into config values('db_version', 0)",
 		"insert into node values(1, 0, 2, -1, -1, '.', NULL, NULL)",
@@ -357,6 +590,8 @@ int tup_db_create(int db_sync, int memory_db)
 		return -1;
 	if(tup_db_config_set_int("parser_version", PARSER_VERSION) < 0)
 		return -1;
+	if(tup_db_config_set_int("group_order", 1) < 0)
+		return -1;
 	if(init_virtual_dirs() < 0)
 		return -1;
 	if(tup_db_commit() < 0)
@@ -453,7 +688,7 @@ int tup_db_get_tup_config_tent(struct tup_entry **tent)
 	return 0;
 }
 
-#define MAX_UPGRADE 13
+#define MAX_UPGRADE 16
 struct sql_upgrade {
 	const char *message;
 	const char *statements[MAX_UPGRADE];
@@ -650,6 +885,42 @@ static int version_check(void)
 				"create table transient_list (id integer primary key not null)",
 			}
 		},
+		{
+			/* Upgrade to version 19 */
+			"The link tables are now clustered on their primary keys (WITHOUT ROWID), and the reverse indexes cover the lookups, so each link is stored in two b-trees instead of three.",
+			{
+				"create table normal_link_new (from_id integer not null, to_id integer not null, primary key(from_id, to_id)) without rowid",
+				"insert or ignore into normal_link_new select from_id, to_id from normal_link where from_id not null and to_id not null",
+				"drop table normal_link",
+				"alter table normal_link_new rename to normal_link",
+				"create index normal_index2 on normal_link(to_id, from_id)",
+				"create table sticky_link_new (from_id integer not null, to_id integer not null, primary key(from_id, to_id)) without rowid",
+				"insert or ignore into sticky_link_new select from_id, to_id from sticky_link where from_id not null and to_id not null",
+				"drop table sticky_link",
+				"alter table sticky_link_new rename to sticky_link",
+				"create index sticky_index2 on sticky_link(to_id, from_id)",
+				"create table group_link_new (from_id integer not null, to_id integer not null, cmdid integer not null, primary key(from_id, to_id, cmdid)) without rowid",
+				"insert or ignore into group_link_new select from_id, to_id, cmdid from group_link where from_id not null and to_id not null and cmdid not null",
+				"drop table group_link",
+				"alter table group_link_new rename to group_link",
+				"create index group_index2 on group_link(cmdid, from_id, to_id)",
+			}
+		},
+		{
+			/* Upgrade to version 20 */
+			"A dir_interface table records a hash of the files in each directory as of its last parse, so dependent Tupfiles are only re-parsed when those files change.",
+			{
+				"create table dir_interface (id integer primary key not null, hash integer not null)",
+			}
+		},
+		{
+			/* Upgrade to version 21 */
+			"A group_order table keeps the groups in dependency order, so adding a group link only checks the groups between its two ends for circular dependencies. The order is built from the existing group links the next time one is added.",
+			{
+				"create table group_order (id integer primary key not null, ord integer not null)",
+				"create index group_index3 on group_link(to_id, from_id)",
+			}
+		},
 	};
 
 	if(tup_db_config_get_int("db_version", -1, &version) < 0)
@@ -663,6 +934,10 @@ static int version_check(void)
 		fprintf(stderr, "tup error: database is version %i, but this version of tup (%s) can only handle up to %i.\n", version, tup_version, DB_VERSION);
 		return -1;
 	}
+	if(version != DB_VERSION && tup_lock_read_only()) {
+		fprintf(stderr, "tup error: database is version %i and needs to be upgraded to %i, which can't be done while another tup process is running.\n", version, DB_VERSION);
+		return -1;
+	}
 	if(version != DB_VERSION) {
 		if(DB_VERSION > ARRAY_SIZE(upgrades)) {
 			fprintf(stderr, "tup internal error: Trying to upgrade to db version %i, but there are only upgrades available up to %i\n", DB_VERSION, ARRAY_SIZE(upgrades));
@@ -715,7 +990,7 @@ static int version_check(void)
 		fprintf(stderr, "Error getting tup parser version.\n");
 		return -1;
 	}
-	if(version != PARSER_VERSION) {
+	if(version != PARSER_VERSION && !tup_lock_read_only()) {
 		printf("Tup parser version has been updated to %i. All Tupfiles will be re-parsed to ensure that nothing broke.\n", PARSER_VERSION);
 		if(tup_db_reparse_all() < 0)
 			return -1;
@@ -733,6 +1008,9 @@ int tup_db_begin(void)
 	static char s[] = "begin";
 
 	transaction = 1;
+	link_cache_checked = 0;
+	timespan_start(&checkpoint_ts);
+	checkpoint_changes = sqlite3_total_changes(tup_db);
 	transaction_check("%s", s);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
@@ -743,7 +1021,7 @@ int tup_db_begin(void)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -757,37 +1035,133 @@ int tup_db_begin(void)
 	return 0;
 }
 
+/* Commits what the current transaction has done so far and starts a new one,
+ * once db.checkpoint_interval milliseconds have passed since the transaction
+ * began or was last checkpointed. The updater calls this as commands finish,
+ * since after each one the database is in a state that a later update can
+ * pick up from (t6006). This keeps a long update from locking out processes
+ * that only read the database (see tup_lock_allow_read_only()) once SQLite
+ * has had to spill its cache and take the exclusive lock. Unlike
+ * tup_db_commit(), ghosts are left for the final commit.
+ */
+int tup_db_checkpoint(void)
+{
+	char *errmsg = NULL;
+	int rc;
+
+	if(!transaction || checkpoint_interval <= 0)
+		return 0;
+	if(sqlite3_total_changes(tup_db) == checkpoint_changes)
+		return 0;
+	timespan_end(&checkpoint_ts);
+	if(timespan_milliseconds(&checkpoint_ts) < checkpoint_interval)
+		return 0;
+
+	profile_push(PROFILE_COMMIT);
+	/* Bump the link generation so readers don't trust a stale link
+	 * cache. The cache itself is only brought up to date by the final
+	 * commit.
+	 */
+	if(links_dirty) {
+		if(bump_link_generation(0, NULL, NULL) < 0) {
+			profile_pop();
+			return -1;
+		}
+	}
+	rc = sqlite3_exec(tup_db, "commit", NULL, NULL, &errmsg);
+	if(rc == SQLITE_BUSY) {
+		/* A reader held on for the whole busy timeout. The
+		 * transaction is still open, so just try again later.
+		 */
+		sqlite3_free(errmsg);
+		profile_pop();
+		timespan_start(&checkpoint_ts);
+		return 0;
+	}
+	if(rc == SQLITE_OK)
+		rc = sqlite3_exec(tup_db, "begin", NULL, NULL, &errmsg);
+	profile_pop();
+	if(rc != SQLITE_OK) {
+		fprintf(stderr, "SQL error: %s\n", errmsg);
+		fprintf(stderr, "tup error: Unable to checkpoint the database transaction.\n");
+		sqlite3_free(errmsg);
+		return -1;
+	}
+	timespan_start(&checkpoint_ts);
+	checkpoint_changes = sqlite3_total_changes(tup_db);
+	return 0;
+}
+
 int tup_db_commit(void)
+{
+	int rc;
+
+	profile_push(PROFILE_COMMIT);
+	rc = db_commit();
+	profile_pop();
+	return rc;
+}
+
+static int db_commit(void)
 {
 	int rc;
 	sqlite3_stmt **stmt = &stmts[DB_COMMIT];
 	static char s[] = "commit";
+	struct linkcache_writer w;
+	struct linkcache_id id;
 
-	if(reclaim_ghosts() < 0)
-		return -1;
+	if(reclaim_threshold > 0 && !reclaim_forced &&
+	   ghost_root.count > reclaim_threshold) {
+		/* Too many candidates to check without holding up the
+		 * update. They are left in the database for 'tup gc'.
+		 */
+		if(!reclaim_deferred) {
+			fprintf(stderr, "tup: Deferring reclamation of %i ghost nodes (db.reclaim_threshold=%i). Run 'tup gc' to remove them.\n", ghost_root.count, reclaim_threshold);
+			reclaim_deferred = 1;
+		}
+		free_tent_tree(&ghost_root);
+		ghost_root.count = 0;
+	} else {
+		if(reclaim_ghosts() < 0)
+			return -1;
+	}
+	clear_group_members();
+	linkcache_writer_init(&w);
+	id.generation = -1;
+	if(links_dirty) {
+		if(bump_link_generation(1, &w, &id) < 0)
+			goto out_err;
+	}
 
 	transaction_check("%s", s);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
 			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
-			return -1;
+			goto out_err;
 		}
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
-		return -1;
+		goto out_err;
 	}
 
 	if(rc != SQLITE_DONE) {
 		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
-		return -1;
+		goto out_err;
 	}
 	transaction = 0;
+	if(id.generation >= 0)
+		save_link_cache(&w, &id);
+	linkcache_writer_free(&w);
 	return 0;
+
+out_err:
+	linkcache_writer_free(&w);
+	return -1;
 }
 
 /* This counts the database changes that are "expected" during refactoring,
@@ -806,6 +1180,10 @@ int tup_db_rollback(void)
 	sqlite3_stmt **stmt = &stmts[DB_ROLLBACK];
 	static char s[] = "rollback";
 
+	clear_group_members();
+	clear_group_order_pending();
+	links_dirty = 0;
+
 	transaction_check("%s", s);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
@@ -815,7 +1193,7 @@ int tup_db_rollback(void)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -910,6 +1288,12 @@ void tup_db_enable_sql_debug(void)
 	sql_debug = 1;
 }
 
+void tup_db_enable_sql_profile(const char *filename)
+{
+	sql_profile_enabled = 1;
+	sql_profile_file = filename;
+}
+
 int tup_db_debug_add_all_ghosts(void)
 {
 	struct tent_entries root = TENT_ENTRIES_INITIALIZER;
@@ -1187,7 +1571,7 @@ int tup_db_fill_tup_entry(tupid_t tupid, struct tup_entry **dest)
 	rc = 0;
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -1279,7 +1663,7 @@ int tup_db_select_node_by_flags(int (*callback)(void *, struct tup_entry *),
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", sql);
 		return -1;
@@ -1347,7 +1731,7 @@ int tup_db_select_node_dir(int (*callback)(void *, struct tup_entry *),
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -1471,7 +1855,7 @@ int tup_db_select_node_dir_glob(int (*callback)(void *, struct tup_entry *),
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -1567,7 +1951,16 @@ int delete_node(tupid_t tupid)
 	int rc;
 	sqlite3_stmt **stmt = &stmts[DB_DELETE_NODE];
 	static char s[] = "delete from node where id=?";
+	struct tup_entry *tent;
 
+	/* If the node isn't in the cache, we don't know whether it was a
+	 * group, so clear out its order either way.
+	 */
+	tent = tup_entry_find(tupid);
+	if(!tent || tent->type == TUP_NODE_GROUP) {
+		if(delete_group_order(tupid) < 0)
+			return -1;
+	}
 	if(tup_entry_rm(tupid) < 0) {
 		return -1;
 	}
@@ -1588,7 +1981,7 @@ int delete_node(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -1613,6 +2006,8 @@ int tup_db_delete_dir(tupid_t dt, int force)
 	 */
 	if(tup_db_set_srcid_dir_flags(dt) < 0)
 		return -1;
+	if(tup_db_clear_dir_interface(dt) < 0)
+		return -1;
 
 	LIST_INIT(&subdir_list);
 	if(get_dir_entries(dt, &subdir_list) < 0)
@@ -1838,80 +2233,259 @@ static int recurse_modify_dir(tupid_t dt)
 	return 0;
 }
 
-static int duplicate_directory_structure(int fd, struct tup_entry *dest, struct tup_entry *src,
-					 struct tup_entry *destroot)
+static int rules_file_exists(struct tup_entry *dtent, const char *name, int *exists)
 {
-	struct tent_list *tl;
-	struct tent_list_head subdir_list;
+	struct tup_entry *tent;
 
-	tent_list_init(&subdir_list);
-	if(tup_db_dirtype(src->tnode.tupid, &subdir_list, NULL, TUP_NODE_DIR) < 0)
+	if(tup_db_select_tent(dtent, name, &tent) < 0)
 		return -1;
-	tent_list_foreach(tl, &subdir_list) {
-		struct tup_entry *subdest;
-		struct tup_entry *subsrc;
-		int newfd;
+	if(tent && tent->type == TUP_NODE_FILE)
+		*exists = 1;
+	return 0;
+}
 
-		subsrc = tl->tent;
-		if(subsrc == destroot)
-			continue;
-		if(is_virtual_tent(subsrc))
-			continue;
-		if(tup_entry_variant(subsrc)->tent->dt != DOT_DT)
-			continue;
+static int has_tupdefault(struct tup_entry *srctent, int *exists)
+{
+	if(rules_file_exists(srctent, "Tupdefault", exists) < 0)
+		return -1;
+	if(rules_file_exists(srctent, "Tupdefault.lua", exists) < 0)
+		return -1;
+	return 0;
+}
+
+int tup_db_variant_dir_needed(struct tup_entry *srctent, int *needed, int *tupdefault)
+{
+	struct tup_entry *tent;
+
+	*needed = 0;
+	*tupdefault = 0;
+	if(has_tupdefault(srctent, tupdefault) < 0)
+		return -1;
+	if(*tupdefault) {
+		*needed = 1;
+		return 0;
+	}
+	if(rules_file_exists(srctent, "Tupfile", needed) < 0)
+		return -1;
+	if(rules_file_exists(srctent, "Tupfile.lua", needed) < 0)
+		return -1;
+	for(tent = srctent->parent; tent && !*needed; tent = tent->parent) {
+		if(has_tupdefault(tent, needed) < 0)
+			return -1;
+	}
+	return 0;
+}
 
+struct tup_entry *tup_db_variant_mkdir(struct tup_entry *dest, struct tup_entry *subsrc, int *created)
+{
+	struct tup_entry *subdest;
+	int node_changed = 0;
+
+	subdest = tup_db_create_node_srcid(dest, subsrc->name.s, TUP_NODE_DIR, subsrc->tnode.tupid, &node_changed);
+	if(!subdest) {
+		fprintf(stderr, "tup error: Unable to create tup node for variant directory: ");
+		print_tup_entry(stderr, dest);
+		fprintf(stderr, "/%s\n", subsrc->name.s);
+		return NULL;
+	}
+	if(node_changed) {
+		int fd;
+
+		fd = tup_entry_open(dest);
+		if(fd < 0)
+			return NULL;
 		if(mkdirat(fd, subsrc->name.s, 0777) < 0) {
 			if(errno != EEXIST) {
 				perror(subsrc->name.s);
 				fprintf(stderr, "tup error: Unable to create sub-directory in variant tree.\n");
-				return -1;
+				close(fd);
+				return NULL;
 			}
 		}
-		subdest = tup_db_create_node_srcid(dest, subsrc->name.s, TUP_NODE_DIR, subsrc->tnode.tupid, NULL);
-		if(!subdest) {
-			fprintf(stderr, "tup error: Unable to create tup node for variant directory: ");
-			print_tup_entry(stderr, subdest);
-			fprintf(stderr, "\n");
-			return -1;
+		if(close(fd) < 0) {
+			perror("close(fd)");
+			return NULL;
 		}
+	}
+	if(created)
+		*created = node_changed;
+	return subdest;
+}
+
+int tup_db_variant_subdir(struct tup_entry *dtent, const char *name, int len,
+			  struct tup_entry **entry)
+{
+	struct tup_entry *srcdir;
+	struct tup_entry *subsrc;
+	int created = 0;
+
+	/* Only directories in a variant have a srcid pointing back to the
+	 * srcdir. Everything else is -1, or VARIANT_SRCDIR_REMOVED.
+	 */
+	if(dtent->srcid <= 0 || dtent->type != TUP_NODE_DIR)
+		return 0;
+	if(tup_entry_variant(dtent)->root_variant)
+		return 0;
+	if(tup_entry_add(dtent->srcid, &srcdir) < 0)
+		return -1;
+	if(srcdir->type != TUP_NODE_DIR)
+		return 0;
+	if(tup_db_select_tent_part(srcdir, name, len, &subsrc) < 0)
+		return -1;
+	if(!subsrc || subsrc->type != TUP_NODE_DIR)
+		return 0;
+	if(is_virtual_tent(subsrc))
+		return 0;
+	if(tup_entry_variant(subsrc)->tent->dt != DOT_DT)
+		return 0;
+	*entry = tup_db_variant_mkdir(dtent, subsrc, &created);
+	if(!*entry)
+		return -1;
+	if(created) {
+		int needed;
+		int tupdefault;
 
-		if(tup_db_add_create_list(subdest->tnode.tupid) < 0)
+		/* New directories are put in the create list, but there is
+		 * nothing to parse here unless the srcdir has rules.
+		 */
+		if(tup_db_variant_dir_needed(subsrc, &needed, &tupdefault) < 0)
 			return -1;
+		if(!needed)
+			if(tup_db_unflag_create((*entry)->tnode.tupid) < 0)
+				return -1;
+	}
+	return 0;
+}
+
+/* A directory in the srcdir while walking it to create the variant
+ * directories. The variant directory (dest) stays NULL until something at or
+ * below it actually needs it.
+ */
+struct variant_walk {
+	struct variant_walk *parent;
+	struct tup_entry *src;
+	struct tup_entry *dest;
+	void *arg;
+	int (*callback)(void *arg, struct tup_entry *tent);
+};
+
+static int variant_walk_materialize(struct variant_walk *w)
+{
+	int created = 0;
 
-		newfd = openat(fd, subdest->name.s, O_RDONLY);
-		if(newfd < 0) {
-			perror(subdest->name.s);
-			fprintf(stderr, "tup error: Unable to open subdirectory while duplicating the directory structure.\n");
+	if(w->dest)
+		return 0;
+	if(variant_walk_materialize(w->parent) < 0)
+		return -1;
+	w->dest = tup_db_variant_mkdir(w->parent->dest, w->src, &created);
+	if(!w->dest)
+		return -1;
+	if(created)
+		if(w->callback(w->arg, w->dest) < 0)
 			return -1;
+	return 0;
+}
+
+static int variant_walk(struct variant_walk *w, struct tup_entry *destroot, int tupdefault,
+			int flag_existing)
+{
+	struct tent_list *tl;
+	struct tent_list_head subdir_list;
+
+	tent_list_init(&subdir_list);
+	if(tup_db_dirtype(w->src->tnode.tupid, &subdir_list, NULL, TUP_NODE_DIR) < 0)
+		return -1;
+	tent_list_foreach(tl, &subdir_list) {
+		struct variant_walk sub;
+		int needed = tupdefault;
+		int sub_tupdefault = tupdefault;
+
+		sub.parent = w;
+		sub.src = tl->tent;
+		sub.dest = NULL;
+		sub.arg = w->arg;
+		sub.callback = w->callback;
+		if(sub.src == destroot)
+			continue;
+		if(is_virtual_tent(sub.src))
+			continue;
+		if(tup_entry_variant(sub.src)->tent->dt != DOT_DT)
+			continue;
+
+		if(!sub_tupdefault) {
+			if(has_tupdefault(sub.src, &sub_tupdefault) < 0)
+				return -1;
+			needed = sub_tupdefault;
 		}
-		if(duplicate_directory_structure(newfd, subdest, subsrc, destroot) < 0)
-			return -1;
-		if(close(newfd) < 0) {
-			perror("close(newfd)");
-			return -1;
+		if(!needed) {
+			if(rules_file_exists(sub.src, "Tupfile", &needed) < 0)
+				return -1;
+			if(rules_file_exists(sub.src, "Tupfile.lua", &needed) < 0)
+				return -1;
+		}
+
+		if(w->dest) {
+			if(tup_db_select_tent(w->dest, sub.src->name.s, &sub.dest) < 0)
+				return -1;
+			/* A ghost or a directory that lost track of its
+			 * srcdir gets fixed up by tup_db_variant_mkdir().
+			 */
+			if(sub.dest && sub.dest->srcid != sub.src->tnode.tupid)
+				sub.dest = NULL;
+		}
+		if(needed) {
+			if(sub.dest) {
+				if(flag_existing)
+					if(sub.callback(sub.arg, sub.dest) < 0)
+						return -1;
+			} else {
+				if(variant_walk_materialize(&sub) < 0)
+					return -1;
+			}
 		}
+
+		if(variant_walk(&sub, destroot, sub_tupdefault, flag_existing) < 0)
+			return -1;
 	}
 	free_tent_list(&subdir_list);
 	return 0;
 }
 
+static int add_create_list_cb(void *arg, struct tup_entry *tent)
+{
+	if(arg) {}
+	return tup_db_add_create_list(tent->tnode.tupid);
+}
+
 int tup_db_duplicate_directory_structure(struct tup_entry *dest)
 {
-	int fd;
-	int rc;
+	struct variant_walk w;
 	struct tup_entry *root_tent;
+	int tupdefault = 0;
 
-	fd = tup_entry_open(dest);
-	if(fd < 0)
-		return -1;
 	if(tup_entry_add(DOT_DT, &root_tent) < 0)
 		return -1;
-	rc = duplicate_directory_structure(fd, dest, root_tent, dest);
-	if(close(fd) < 0) {
-		perror("close(fd)");
+	if(has_tupdefault(root_tent, &tupdefault) < 0)
 		return -1;
-	}
-	return rc;
+	w.parent = NULL;
+	w.src = root_tent;
+	w.dest = dest;
+	w.arg = NULL;
+	w.callback = add_create_list_cb;
+	return variant_walk(&w, dest, tupdefault, 1);
+}
+
+int tup_db_materialize_variant_dirs(struct tup_entry *dest, struct tup_entry *src,
+				    void *arg, int (*callback)(void *, struct tup_entry *))
+{
+	struct variant_walk w;
+
+	w.parent = NULL;
+	w.src = src;
+	w.dest = dest;
+	w.arg = arg;
+	w.callback = callback;
+	return variant_walk(&w, tup_entry_variant(dest)->tent->parent, 1, 0);
 }
 
 int tup_db_chdir(tupid_t tupid)
@@ -1964,7 +2538,7 @@ int tup_db_chdir(tupid_t tupid)
 		rc = -1;
 		goto out_reset;
 	}
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		free(path);
@@ -1988,7 +2562,7 @@ int tup_db_chdir(tupid_t tupid)
 	return rc;
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2062,7 +2636,7 @@ int tup_db_set_name(tupid_t tupid, const char *new_name, tupid_t new_dt)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2106,7 +2680,7 @@ int tup_db_set_display(struct tup_entry *tent, const char *display, int displayl
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2150,7 +2724,7 @@ int tup_db_set_flags(struct tup_entry *tent, const char *flags, int flagslen)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2194,7 +2768,7 @@ int tup_db_set_type(struct tup_entry *tent, enum TUP_NODE_TYPE type)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2241,7 +2815,7 @@ int tup_db_set_mtime(struct tup_entry *tent, time_t mtime)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2283,7 +2857,7 @@ int tup_db_set_srcid(struct tup_entry *tent, tupid_t srcid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2308,48 +2882,30 @@ int tup_db_print(FILE *stream, tupid_t tupid)
 	return rc;
 }
 
-static int write_gitignore_line(FILE * f, const unsigned char *to_ignore)
+static int write_gitignore_line(struct estring *e, const unsigned char *to_ignore)
 {
-	const size_t str_size = PATH_MAX + 1;
-	char *const str = calloc(str_size, sizeof(*str));
-
-	if (str == NULL) {
-		perror("calloc");
-		goto abort;
-	}
-
-	size_t i = 0;
-	for (; *to_ignore != '\0'; ++i, ++to_ignore) {
-		const char c = *to_ignore;
+	const char *p = (const char*)to_ignore;
+	const char *last = p;
 
-		switch (c) {
-		case '[':
-		case ']':
-			if (i >= str_size)
-				goto abort;
-			str[i] = '\\';
-			++i;
+	if(estring_append(e, "/", 1) < 0)
+		return -1;
+	for(; *p; p++) {
+		if(*p == '[' || *p == ']') {
+			if(estring_append(e, last, p - last) < 0)
+				return -1;
+			if(estring_append(e, "\\", 1) < 0)
+				return -1;
+			last = p;
 		}
-
-		if (i >= str_size)
-			goto abort;
-		str[i] = c;
-	}
-
-	if (fprintf(f, "/%s\n", str) < 0) {
-		perror("fprintf");
-		goto abort;
 	}
-
-	free(str);
+	if(estring_append(e, last, p - last) < 0)
+		return -1;
+	if(estring_append(e, "\n", 1) < 0)
+		return -1;
 	return 0;
-
- abort:
-	free(str);
-	return -1;
 }
 
-int tup_db_write_gitignore(FILE *f, tupid_t dt)
+int tup_db_write_gitignore(struct estring *e, tupid_t dt)
 {
 	int rc;
 	int dbrc;
@@ -2393,7 +2949,7 @@ int tup_db_write_gitignore(FILE *f, tupid_t dt)
 			rc = -1;
 			goto out_reset;
 		}
-		if(write_gitignore_line(f, sqlite3_column_text(*stmt, 0)) < 0) {
+		if(write_gitignore_line(e, sqlite3_column_text(*stmt, 0)) < 0) {
 			fprintf(stderr, "tup error: Unable to write data to .gitignore file.\n");
 			rc = -1;
 			goto out_reset;
@@ -2401,7 +2957,7 @@ int tup_db_write_gitignore(FILE *f, tupid_t dt)
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2437,7 +2993,7 @@ int tup_db_rebuild_all(void)
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
 	}
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2507,7 +3063,7 @@ static int db_print(FILE *stream, tupid_t tupid)
 		rc = -1;
 		goto out_reset;
 	}
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		free(path);
@@ -2549,7 +3105,7 @@ static int db_print(FILE *stream, tupid_t tupid)
 	return 0;
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2600,7 +3156,7 @@ int tup_db_maybe_add_config_list(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2637,7 +3193,7 @@ int tup_db_add_config_list(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2684,7 +3240,7 @@ int tup_db_maybe_add_create_list(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2721,7 +3277,7 @@ int tup_db_add_create_list(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2758,7 +3314,7 @@ int tup_db_add_modify_list(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2795,7 +3351,7 @@ int tup_db_add_variant_list(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2832,7 +3388,7 @@ int tup_db_add_transient_list(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2884,7 +3440,7 @@ int tup_db_in_create_list(tupid_t tupid)
 	rc = 1;
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2930,7 +3486,7 @@ int tup_db_in_modify_list(tupid_t tupid)
 	rc = 1;
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -2976,7 +3532,7 @@ int tup_db_in_transient_list(tupid_t tupid)
 	rc = 1;
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3007,7 +3563,7 @@ int tup_db_unflag_config(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3044,7 +3600,7 @@ int tup_db_unflag_create(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3086,7 +3642,7 @@ int tup_db_unflag_modify(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3123,7 +3679,7 @@ int tup_db_unflag_variant(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3160,7 +3716,7 @@ int tup_db_unflag_transient(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3225,7 +3781,7 @@ static int get_dir_entries(tupid_t dt, struct half_entry_head *head)
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3297,7 +3853,7 @@ static int get_output_group(tupid_t cmdid, struct tup_entry **tent)
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3369,6 +3925,11 @@ int tup_db_link_exists(tupid_t a, tupid_t b, int style,
 	int sqlsize;
 
 	if(style == TUP_LINK_NORMAL) {
+		struct linkcache *lc = get_link_cache();
+		if(lc) {
+			*exists = linkcache_has(lc, LINKCACHE_OUTPUTS, a, b);
+			return 0;
+		}
 		stmt = &stmts[DB_LINK_EXISTS1];
 		sql = s1;
 		sqlsize = sizeof(s1);
@@ -3402,7 +3963,7 @@ int tup_db_link_exists(tupid_t a, tupid_t b, int style,
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", sql);
 		return -1;
@@ -3465,6 +4026,12 @@ static int delete_normal_links(tupid_t tupid)
 	sqlite3_stmt **stmt = &stmts[_DB_DELETE_NORMAL_LINKS];
 	static const char s[] = "delete from normal_link where from_id=? or to_id=?";
 
+	if(!RB_EMPTY(&group_members_root))
+		clear_group_members();
+	if(link_changed(tupid) < 0)
+		return -1;
+	reachability_cache_link_changed(tupid);
+
 	transaction_check("%s [%lli, %lli]", s, tupid, tupid);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
@@ -3486,7 +4053,7 @@ static int delete_normal_links(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3506,6 +4073,11 @@ static int delete_normal_inputs(tupid_t tupid)
 	sqlite3_stmt **stmt = &stmts[_DB_DELETE_NORMAL_INPUTS];
 	static const char s[] = "delete from normal_link where to_id=?";
 
+	invalidate_group_members(tupid);
+	if(link_changed(tupid) < 0)
+		return -1;
+	reachability_cache_link_changed(tupid);
+
 	transaction_check("%s [%lli]", s, tupid);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
@@ -3522,7 +4094,7 @@ static int delete_normal_inputs(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3565,7 +4137,7 @@ static int delete_sticky_links(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3601,7 +4173,7 @@ static int flag_group_users1(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3637,7 +4209,7 @@ static int flag_group_users2(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3746,7 +4318,7 @@ int tup_db_dirtype(tupid_t dt, struct tent_list_head *head, struct tent_entries
 		}
 	}
 
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3826,7 +4398,7 @@ int tup_db_srcid_to_tree(tupid_t srcid, struct tent_entries *root, enum TUP_NODE
 		}
 	}
 
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3893,7 +4465,7 @@ int tup_db_type_to_tree(struct tent_entries *root, enum TUP_NODE_TYPE type)
 		}
 	}
 
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -3969,7 +4541,7 @@ static int is_generated_dir1(tupid_t dt)
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4034,7 +4606,7 @@ static int is_generated_dir2(tupid_t dt)
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4088,7 +4660,7 @@ int tup_db_modify_cmds_by_output(tupid_t output, int *modified)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4139,7 +4711,7 @@ int tup_db_modify_cmds_by_input(tupid_t input)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4154,7 +4726,220 @@ int tup_db_modify_cmds_by_input(tupid_t input)
 	return 0;
 }
 
-int tup_db_set_dependent_flags(tupid_t tupid)
+static int dir_interface_hash(tupid_t dt, struct tent_entries *delete_root,
+			      sqlite3_int64 *hash)
+{
+	int rc;
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[_DB_DIR_INTERFACE_NODES];
+	static char s[] = "select id, type, name from node where dir=? and type in (?, ?, ?, ?) order by name";
+	uint64_t h = 14695981039346656037ULL;
+
+	transaction_check("%s [%lli, %i, %i, %i, %i]", s, dt, TUP_NODE_FILE, TUP_NODE_DIR, TUP_NODE_GENERATED, TUP_NODE_GENERATED_DIR);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0 ||
+	   sqlite3_bind_int(*stmt, 2, TUP_NODE_FILE) != 0 ||
+	   sqlite3_bind_int(*stmt, 3, TUP_NODE_DIR) != 0 ||
+	   sqlite3_bind_int(*stmt, 4, TUP_NODE_GENERATED) != 0 ||
+	   sqlite3_bind_int(*stmt, 5, TUP_NODE_GENERATED_DIR) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	while(1) {
+		const unsigned char *name;
+		int type;
+
+		dbrc = sqlite3_step(*stmt);
+		if(dbrc == SQLITE_DONE) {
+			rc = 0;
+			goto out_reset;
+		}
+		if(dbrc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			rc = -1;
+			goto out_reset;
+		}
+
+		/* Outputs that the parser is about to delete are already gone
+		 * as far as a dependent Tupfile is concerned.
+		 */
+		if(delete_root && tent_tree_search_tupid(delete_root, sqlite3_column_int64(*stmt, 0)) != NULL)
+			continue;
+		type = sqlite3_column_int(*stmt, 1);
+		name = sqlite3_column_text(*stmt, 2);
+		/* FNV-1a over each name and its type. */
+		for(; *name; name++) {
+			h ^= *name;
+			h *= 1099511628211ULL;
+		}
+		h ^= 0x100 | type;
+		h *= 1099511628211ULL;
+	}
+
+out_reset:
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	*hash = (sqlite3_int64)h;
+	return rc;
+}
+
+static int dir_interface_get(tupid_t dt, sqlite3_int64 *hash)
+{
+	int rc;
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[_DB_DIR_INTERFACE_GET];
+	static char s[] = "select hash from dir_interface where id=?";
+
+	transaction_check("%s [%lli]", s, dt);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	dbrc = sqlite3_step(*stmt);
+	if(dbrc == SQLITE_DONE) {
+		rc = 0;
+	} else if(dbrc == SQLITE_ROW) {
+		*hash = sqlite3_column_int64(*stmt, 0);
+		rc = 1;
+	} else {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		rc = -1;
+	}
+
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return rc;
+}
+
+static int dir_interface_set(tupid_t dt, sqlite3_int64 hash)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[_DB_DIR_INTERFACE_SET];
+	static char s[] = "insert or replace into dir_interface values(?, ?)";
+
+	transaction_check("%s [%lli, %lli]", s, dt, hash);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int64(*stmt, 2, hash) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	/* The hash is bookkeeping, not a change to the build. */
+	expected_changes += sqlite3_changes(tup_db);
+
+	return 0;
+}
+
+int tup_db_dir_interface_changed(tupid_t dt, struct tent_entries *delete_root)
+{
+	sqlite3_int64 hash;
+	sqlite3_int64 old_hash = 0;
+	int rc;
+
+	if(dir_interface_hash(dt, delete_root, &hash) < 0)
+		return -1;
+	rc = dir_interface_get(dt, &old_hash);
+	if(rc < 0)
+		return -1;
+	if(rc == 1 && old_hash == hash)
+		return 0;
+	if(dir_interface_set(dt, hash) < 0)
+		return -1;
+	return 1;
+}
+
+int tup_db_clear_dir_interface(tupid_t dt)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[DB_CLEAR_DIR_INTERFACE];
+	static char s[] = "delete from dir_interface where id=?";
+
+	transaction_check("%s [%lli]", s, dt);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+int tup_db_set_dependent_flags(tupid_t tupid)
 {
 	/* It's possible this is a file that was included by a Tupfile. Try to
 	 * set any dependent directory flags.
@@ -4198,7 +4983,7 @@ int tup_db_set_dependent_dir_flags(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4267,7 +5052,7 @@ int tup_db_set_srcid_dir_flags(tupid_t tupid)
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4317,7 +5102,7 @@ int tup_db_set_dependent_config_flags(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4332,18 +5117,13 @@ int tup_db_set_dependent_config_flags(tupid_t tupid)
 	return 0;
 }
 
-static int get_outputs(tupid_t tupid, struct tent_list_head *head)
+static int get_link_generation(long long *generation)
 {
 	int rc;
-	int dbrc;
-	sqlite3_stmt **stmt = &stmts[_DB_GET_OUTPUTS];
-	static char s[] = "select to_id from normal_link where from_id=?";
-	struct tupid_list_head tupid_list;
-	struct tupid_list *tl;
-
-	tupid_list_init(&tupid_list);
+	sqlite3_stmt **stmt = &stmts[_DB_GET_LINK_GENERATION];
+	static char s[] = "select rval from config where lval='link_generation'";
 
-	transaction_check("%s [%lli]", s, tupid);
+	transaction_check("%s", s);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
 			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
@@ -4352,73 +5132,475 @@ static int get_outputs(tupid_t tupid, struct tent_list_head *head)
 		}
 	}
 
-	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
-		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+	rc = sqlite3_step(*stmt);
+	if(rc == SQLITE_ROW) {
+		*generation = sqlite3_column_int64(*stmt, 0);
+	} else {
+		*generation = 0;
+	}
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
 	}
+	return 0;
+}
+
+static int add_link_cache_dir(struct linkcache_writer *w, int dir)
+{
+	int rc = 0;
+	int dbrc;
+	sqlite3_stmt **stmt;
+	static char s1[] = "select from_id, to_id from normal_link order by from_id, to_id";
+	static char s2[] = "select to_id, from_id from normal_link order by to_id, from_id";
+	char *sql;
+	int sqlsize;
+
+	if(dir == LINKCACHE_OUTPUTS) {
+		stmt = &stmts[_DB_LINK_CACHE_OUTPUTS];
+		sql = s1;
+		sqlsize = sizeof(s1);
+	} else {
+		stmt = &stmts[_DB_LINK_CACHE_INPUTS];
+		sql = s2;
+		sqlsize = sizeof(s2);
+	}
+
+	transaction_check("%s", sql);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, sql, sqlsize, stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", sql);
+			return -1;
+		}
+	}
 
 	while(1) {
 		dbrc = sqlite3_step(*stmt);
 		if(dbrc == SQLITE_DONE) {
-			rc = 0;
-			goto out_reset;
+			break;
 		}
 		if(dbrc != SQLITE_ROW) {
 			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
-			fprintf(stderr, "Statement was: %s\n", s);
+			fprintf(stderr, "Statement was: %s\n", sql);
 			rc = -1;
-			goto out_reset;
+			break;
 		}
 
-		if(tupid_list_add_tail(&tupid_list, sqlite3_column_int64(*stmt, 0)) < 0) {
+		if(linkcache_writer_add(w, dir, sqlite3_column_int64(*stmt, 0), sqlite3_column_int64(*stmt, 1)) < 0) {
 			rc = -1;
-			goto out_reset;
+			break;
 		}
 	}
 
-out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
+		fprintf(stderr, "Statement was: %s\n", sql);
 		return -1;
 	}
-
-	if(rc == 0) {
-		tupid_list_foreach(tl, &tupid_list) {
-			struct tup_entry *tent;
-
-			if(tup_entry_add(tl->tupid, &tent) < 0)
-				return -1;
-			if(tent_list_add_tail(head, tent) < 0)
-				return -1;
-		}
-	}
-	free_tupid_list(&tupid_list);
-
 	return rc;
 }
 
-int tup_db_select_node_by_link(int (*callback)(void *, struct tup_entry *),
-			       void *arg, tupid_t tupid)
+static int add_link_cache_key(struct linkcache_writer *w, int dir, tupid_t tupid)
 {
-	struct tent_list_head tent_list;
-	struct tent_list *tl;
+	int rc = 0;
+	int dbrc;
+	sqlite3_stmt **stmt;
+	static char s1[] = "select to_id from normal_link where from_id=? order by to_id";
+	static char s2[] = "select from_id from normal_link where to_id=? order by from_id";
+	char *sql;
+	int sqlsize;
 
-	tent_list_init(&tent_list);
+	if(dir == LINKCACHE_OUTPUTS) {
+		stmt = &stmts[_DB_LINK_CACHE_KEY_OUTPUTS];
+		sql = s1;
+		sqlsize = sizeof(s1);
+	} else {
+		stmt = &stmts[_DB_LINK_CACHE_KEY_INPUTS];
+		sql = s2;
+		sqlsize = sizeof(s2);
+	}
 
-	if(get_outputs(tupid, &tent_list) < 0)
+	if(linkcache_writer_add_key(w, dir, tupid) < 0)
 		return -1;
 
-	tent_list_foreach(tl, &tent_list) {
-		if(callback(arg, tl->tent) < 0)
-			return -1;
-	}
-	free_tent_list(&tent_list);
+	transaction_check("%s [%lli]", sql, tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, sql, sqlsize, stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", sql);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", sql);
+		return -1;
+	}
+
+	while(1) {
+		dbrc = sqlite3_step(*stmt);
+		if(dbrc == SQLITE_DONE) {
+			break;
+		}
+		if(dbrc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", sql);
+			rc = -1;
+			break;
+		}
+
+		if(linkcache_writer_add(w, dir, tupid, sqlite3_column_int64(*stmt, 0)) < 0) {
+			rc = -1;
+			break;
+		}
+	}
+
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", sql);
+		return -1;
+	}
+	return rc;
+}
+
+static int link_changed(tupid_t tupid)
+{
+	links_dirty = 1;
+	if(!link_cache_enabled)
+		return 0;
+	if(tupid_tree_search(&link_dirty_root, tupid) != NULL)
+		return 0;
+	return tupid_tree_add(&link_dirty_root, tupid);
+}
+
+static void clear_link_dirty(void)
+{
+	free_tupid_tree(&link_dirty_root);
+	link_dirty_generation = -1;
+}
+
+static int bump_link_generation(int merge, struct linkcache_writer *w,
+				struct linkcache_id *id)
+{
+	struct linkcache_writer changed;
+	struct linkcache_id base_id;
+	struct tupid_tree *tt;
+	long long generation;
+	int rc = -1;
+
+	/* Any link cache built before this commit is now stale. */
+	if(get_link_generation(&generation) < 0)
+		return -1;
+	if(tup_db_config_set_int("link_generation", generation + 1) < 0)
+		return -1;
+	/* After a checkpoint, the mapped cache is still missing the links
+	 * written so far, so leave it unused until the final commit.
+	 */
+	if(merge)
+		links_dirty = 0;
+	if(!link_cache_enabled)
+		return 0;
+
+	/* If someone else committed since our last commit, the changed nodes
+	 * are a superset of what changed since their generation.
+	 */
+	if(generation != link_dirty_generation)
+		link_dirty_base = generation;
+	link_dirty_generation = generation + 1;
+	if(!merge)
+		return 0;
+
+	base_id = db_file_id;
+	base_id.generation = link_dirty_base;
+	if(!link_cache_current(&base_id)) {
+		linkcache_unmap(&link_cache);
+		if(linkcache_map(&link_cache, tup_top_fd()) != 0 ||
+		   !link_cache_current(&base_id)) {
+			/* Nothing to merge into, so the next reader has to
+			 * rebuild the whole cache.
+			 */
+			linkcache_unmap(&link_cache);
+			clear_link_dirty();
+			return 0;
+		}
+	}
+
+	linkcache_writer_init(&changed);
+	RB_FOREACH(tt, tupid_entries, &link_dirty_root) {
+		if(add_link_cache_key(&changed, LINKCACHE_OUTPUTS, tt->tupid) < 0)
+			goto out_free;
+		if(add_link_cache_key(&changed, LINKCACHE_INPUTS, tt->tupid) < 0)
+			goto out_free;
+	}
+	if(linkcache_writer_merge(w, &link_cache, &changed) < 0)
+		goto out_free;
+	*id = db_file_id;
+	id->generation = generation + 1;
+	rc = 0;
+out_free:
+	linkcache_writer_free(&changed);
+	return rc;
+}
+
+static void save_link_cache(struct linkcache_writer *w, const struct linkcache_id *id)
+{
+	/* This is only an optimization, so a failure here just leaves a stale
+	 * file that the next reader rebuilds.
+	 */
+	linkcache_writer_save(w, tup_top_fd(), id);
+	clear_link_dirty();
+}
+
+static int rebuild_link_cache(const struct linkcache_id *id)
+{
+	struct linkcache_writer w;
+	int rc = -1;
+
+	linkcache_writer_init(&w);
+	if(add_link_cache_dir(&w, LINKCACHE_OUTPUTS) < 0)
+		goto out_free;
+	if(add_link_cache_dir(&w, LINKCACHE_INPUTS) < 0)
+		goto out_free;
+	if(linkcache_writer_save(&w, tup_top_fd(), id) < 0)
+		goto out_free;
+	rc = 0;
+out_free:
+	linkcache_writer_free(&w);
+	return rc;
+}
+
+static int link_cache_current(const struct linkcache_id *id)
+{
+	if(!link_cache.map)
+		return 0;
+	if(link_cache.id.generation != id->generation ||
+	   link_cache.id.dev != id->dev ||
+	   link_cache.id.ino != id->ino)
+		return 0;
+	return 1;
+}
+
+static struct linkcache *get_link_cache(void)
+{
+	struct linkcache_id id;
+
+	if(!link_cache_enabled || links_dirty)
+		return NULL;
+	if(link_cache_checked)
+		return link_cache.map ? &link_cache : NULL;
+	link_cache_checked = 1;
+
+	id = db_file_id;
+	if(get_link_generation(&id.generation) < 0)
+		goto out_disable;
+	if(link_cache_current(&id))
+		return &link_cache;
+
+	linkcache_unmap(&link_cache);
+	if(linkcache_map(&link_cache, tup_top_fd()) < 0)
+		goto out_disable;
+	if(link_cache_current(&id))
+		return &link_cache;
+
+	/* Missing, corrupt, or from an older generation of the database. */
+	linkcache_unmap(&link_cache);
+	if(rebuild_link_cache(&id) < 0)
+		goto out_disable;
+	if(linkcache_map(&link_cache, tup_top_fd()) != 0)
+		goto out_disable;
+	if(link_cache_current(&id))
+		return &link_cache;
+
+out_disable:
+	/* Fall back to the normal_link table for the rest of this process. */
+	fprintf(stderr, "tup warning: Unable to use the link cache in '%s'. Falling back to the database.\n", TUP_LINKCACHE_FILE);
+	linkcache_unmap(&link_cache);
+	link_cache_enabled = 0;
+	return NULL;
+}
+
+static void close_link_cache(void)
+{
+	linkcache_unmap(&link_cache);
+	link_cache_checked = 0;
+}
+
+static int get_outputs(tupid_t tupid, struct tent_list_head *head)
+{
+	int rc;
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[_DB_GET_OUTPUTS];
+	static char s[] = "select to_id from normal_link where from_id=?";
+	struct tupid_list_head tupid_list;
+	struct tupid_list *tl;
+	struct linkcache *lc;
+
+	lc = get_link_cache();
+	if(lc) {
+		const tupid_t *vals;
+		int num;
+		int x;
+
+		linkcache_get(lc, LINKCACHE_OUTPUTS, tupid, &vals, &num);
+		for(x=0; x<num; x++) {
+			struct tup_entry *tent;
+
+			if(tup_entry_add(vals[x], &tent) < 0)
+				return -1;
+			if(tent_list_add_tail(head, tent) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	tupid_list_init(&tupid_list);
+
+	transaction_check("%s [%lli]", s, tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	while(1) {
+		dbrc = sqlite3_step(*stmt);
+		if(dbrc == SQLITE_DONE) {
+			rc = 0;
+			goto out_reset;
+		}
+		if(dbrc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			rc = -1;
+			goto out_reset;
+		}
+
+		if(tupid_list_add_tail(&tupid_list, sqlite3_column_int64(*stmt, 0)) < 0) {
+			rc = -1;
+			goto out_reset;
+		}
+	}
+
+out_reset:
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc == 0) {
+		tupid_list_foreach(tl, &tupid_list) {
+			struct tup_entry *tent;
+
+			if(tup_entry_add(tl->tupid, &tent) < 0)
+				return -1;
+			if(tent_list_add_tail(head, tent) < 0)
+				return -1;
+		}
+	}
+	free_tupid_list(&tupid_list);
+
+	return rc;
+}
+
+int tup_db_select_node_by_link(int (*callback)(void *, struct tup_entry *),
+			       void *arg, tupid_t tupid)
+{
+	struct tent_list_head tent_list;
+	struct tent_list *tl;
+
+	tent_list_init(&tent_list);
+
+	if(get_outputs(tupid, &tent_list) < 0)
+		return -1;
+
+	tent_list_foreach(tl, &tent_list) {
+		if(callback(arg, tl->tent) < 0)
+			return -1;
+	}
+	free_tent_list(&tent_list);
 
 	return 0;
 }
 
+int tup_db_is_input(tupid_t dt, const char *name, int *is_input)
+{
+	/* This goes straight to the tables rather than through the link
+	 * cache or the tup_entry cache, since the monitor uses it while an
+	 * autoupdate may be changing the database. The monitor can't wait for
+	 * the autoupdate to release its lock either, so if the database is
+	 * locked this returns 1 and doesn't set *is_input.
+	 */
+	int rc;
+	int ret = -1;
+	sqlite3_stmt **stmt = &stmts[DB_IS_INPUT];
+	static char s[] = "select exists(select 1 from node, sticky_link where node.dir=?1 and node.name=?2 and node.type=?3 and sticky_link.from_id=node.id) or exists(select 1 from node, normal_link where node.dir=?1 and node.name=?2 and node.type=?3 and normal_link.from_id=node.id)";
+
+	transaction_check("%s [%lli, '%s', %i]", s, dt, name, TUP_NODE_FILE);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, dt) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_text(*stmt, 2, name, -1, SQLITE_STATIC) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 3, TUP_NODE_FILE) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	sqlite3_busy_timeout(tup_db, 0);
+	rc = sqlite3_step(*stmt);
+	sqlite3_busy_timeout(tup_db, DB_BUSY_TIMEOUT);
+	if(rc == SQLITE_BUSY) {
+		ret = 1;
+		goto out_reset;
+	}
+	if(rc != SQLITE_ROW) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		goto out_reset;
+	}
+	*is_input = sqlite3_column_int(*stmt, 0);
+	ret = 0;
+
+out_reset:
+	if(msqlite3_reset(stmt) != 0 && ret != 1) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return ret;
+}
+
 int tup_db_select_node_by_group_link(int (*callback)(void *, struct tup_entry *, struct tup_entry *),
 				     void *arg, tupid_t tupid)
 {
@@ -4475,7 +5657,7 @@ int tup_db_select_node_by_group_link(int (*callback)(void *, struct tup_entry *,
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4547,7 +5729,7 @@ int tup_db_select_node_by_distinct_group_link(int (*callback)(void *, struct tup
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4627,7 +5809,7 @@ int tup_db_config_set_int(const char *lval, int x)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4682,13 +5864,13 @@ int tup_db_config_get_int(const char *lval, int def, int *result)
 	rc = 0;
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
 	}
 
-	if(set_default) {
+	if(set_default && !tup_lock_read_only()) {
 		if(tup_db_config_set_int(lval, def) < 0)
 			return -1;
 	}
@@ -4723,7 +5905,7 @@ int tup_db_set_var(tupid_t tupid, const char *value)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4781,7 +5963,7 @@ static struct var_entry *get_var_id(struct vardb *vdb, struct tup_entry *tent,
 	ve = vardb_set2(vdb, var, varlen, value, tent);
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return NULL;
@@ -5194,6 +6376,8 @@ int tup_db_get_environ(struct tent_entries *root,
 	struct tup_entry *tent;
 	char ccache_nodirect[] = "CCACHE_NODIRECT=1";
 	int ccache_nodirect_len = strlen(ccache_nodirect);
+	const char *makeflags = jobserver_environ();
+	int makeflags_len = 0;
 	char *cur;
 
 	te->block_size = 1;
@@ -5201,6 +6385,9 @@ int tup_db_get_environ(struct tent_entries *root,
 	RB_FOREACH(tt, tent_entries, root) {
 		tent = tt->tent;
 		if(tent->dt == env_dt()) {
+			/* An exported MAKEFLAGS replaces the jobserver's. */
+			if(strcmp(tent->name.s, "MAKEFLAGS") == 0)
+				makeflags = NULL;
 			ve = vardb_get(&envdb, tent->name.s, tent->name.len);
 			if(!ve) {
 				fprintf(stderr, "tup internal error: Expected environment variable '%s' to be in envdb.\n", tent->name.s);
@@ -5224,6 +6411,11 @@ int tup_db_get_environ(struct tent_entries *root,
 	}
 	te->block_size += ccache_nodirect_len + 1;
 	te->num_entries++;
+	if(makeflags) {
+		makeflags_len = strlen(makeflags);
+		te->block_size += makeflags_len + 1;
+		te->num_entries++;
+	}
 
 	te->envblock = malloc(te->block_size);
 	if(!te->envblock) {
@@ -5249,6 +6441,11 @@ int tup_db_get_environ(struct tent_entries *root,
 	memcpy(cur, ccache_nodirect, ccache_nodirect_len);
 	cur[ccache_nodirect_len] = 0;
 	cur += ccache_nodirect_len + 1;
+	if(makeflags) {
+		memcpy(cur, makeflags, makeflags_len);
+		cur[makeflags_len] = 0;
+		cur += makeflags_len + 1;
+	}
 
 	*cur = 0;
 	return 0;
@@ -5419,7 +6616,7 @@ static int load_existing_nodes(void)
 			break;
 	}
 
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -5483,6 +6680,30 @@ static int get_normal_inputs(tupid_t cmdid, struct tent_entries *root, int ghost
 	static char s[] = "select from_id from normal_link where to_id=?";
 	struct tupid_list_head tupid_list;
 	struct tupid_list *tl;
+	struct linkcache *lc;
+
+	lc = get_link_cache();
+	if(lc) {
+		const tupid_t *vals;
+		int num;
+		int x;
+
+		linkcache_get(lc, LINKCACHE_INPUTS, cmdid, &vals, &num);
+		for(x=0; x<num; x++) {
+			struct tup_entry *tent;
+
+			if(tup_entry_add(vals[x], &tent) < 0)
+				return -1;
+			if(ghost_check) {
+				if(tup_entry_add_ghost_tree(root, tent) < 0)
+					return -1;
+			} else {
+				if(tent_tree_add(root, tent) < 0)
+					return -1;
+			}
+		}
+		return 0;
+	}
 
 	tupid_list_init(&tupid_list);
 
@@ -5522,7 +6743,7 @@ static int get_normal_inputs(tupid_t cmdid, struct tent_entries *root, int ghost
 		}
 	}
 
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -5591,7 +6812,7 @@ static int get_sticky_inputs(tupid_t cmdid, struct tent_entries *root,
 		}
 	}
 
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -5646,16 +6867,86 @@ int tup_db_get_inputs(tupid_t cmdid, struct tent_entries *sticky_root,
 	return 0;
 }
 
-static int compare_tent_trees(struct tent_entries *a, struct tent_entries *b,
-			      void *data,
-			      int (*extra_a)(struct tup_entry *tent, void *data),
-			      int (*extra_b)(struct tup_entry *tent, void *data))
+int tup_db_get_group_members(tupid_t groupid, struct tupid_entries **members)
 {
-	struct tent_tree *tta;
-	struct tent_tree *ttb;
-
-	tta = RB_MIN(tent_entries, a);
-	ttb = RB_MIN(tent_entries, b);
+	struct tupid_tree *tt;
+	struct group_members *gm;
+	struct tent_entries inputs = TENT_ENTRIES_INITIALIZER;
+	struct tent_tree *ttinput;
+
+	tt = tupid_tree_search(&group_members_root, groupid);
+	if(tt) {
+		gm = container_of(tt, struct group_members, tnode);
+		*members = &gm->members;
+		return 0;
+	}
+
+	gm = malloc(sizeof *gm);
+	if(!gm) {
+		perror("malloc");
+		return -1;
+	}
+	gm->tnode.tupid = groupid;
+	RB_INIT(&gm->members);
+	if(get_normal_inputs(groupid, &inputs, 0) < 0)
+		goto err_free;
+	RB_FOREACH(ttinput, tent_entries, &inputs) {
+		if(tupid_tree_add(&gm->members, ttinput->tent->tnode.tupid) < 0) {
+			free_tent_tree(&inputs);
+			goto err_free;
+		}
+	}
+	free_tent_tree(&inputs);
+	if(tupid_tree_insert(&group_members_root, &gm->tnode) < 0) {
+		fprintf(stderr, "tup internal error: Unable to cache members of group %lli\n", groupid);
+		goto err_free;
+	}
+	*members = &gm->members;
+	return 0;
+
+err_free:
+	free_tupid_tree(&gm->members);
+	free(gm);
+	return -1;
+}
+
+static void invalidate_group_members(tupid_t tupid)
+{
+	struct tupid_tree *tt;
+	struct group_members *gm;
+
+	tt = tupid_tree_search(&group_members_root, tupid);
+	if(tt) {
+		gm = container_of(tt, struct group_members, tnode);
+		tupid_tree_rm(&group_members_root, tt);
+		free_tupid_tree(&gm->members);
+		free(gm);
+	}
+}
+
+static void clear_group_members(void)
+{
+	struct tupid_tree *tt;
+	struct group_members *gm;
+
+	while((tt = RB_ROOT(&group_members_root)) != NULL) {
+		gm = container_of(tt, struct group_members, tnode);
+		tupid_tree_rm(&group_members_root, tt);
+		free_tupid_tree(&gm->members);
+		free(gm);
+	}
+}
+
+static int compare_tent_trees(struct tent_entries *a, struct tent_entries *b,
+			      void *data,
+			      int (*extra_a)(struct tup_entry *tent, void *data),
+			      int (*extra_b)(struct tup_entry *tent, void *data))
+{
+	struct tent_tree *tta;
+	struct tent_tree *ttb;
+
+	tta = RB_MIN(tent_entries, a);
+	ttb = RB_MIN(tent_entries, b);
 
 	while(tta || ttb) {
 		if(!tta) {
@@ -6062,17 +7353,25 @@ static int check_generated_inputs(FILE *f, struct tent_entries *missing_input_ro
 	 * generated file that we *did* specify in the Tupfile.
 	 */
 	RB_FOREACH_SAFE(tt, tent_entries, missing_input_root, tmp) {
-		struct tent_tree *grouptt;
 		int connected = 0;
 
-		RB_FOREACH(grouptt, tent_entries, group_root) {
-			int exists;
-			if(tup_db_link_exists(tt->tent->tnode.tupid, grouptt->tent->tnode.tupid, TUP_LINK_NORMAL, &exists) < 0)
+		if(!RB_EMPTY(group_root)) {
+			/* One query for the outputs of the missing input rather
+			 * than a link check against each group.
+			 */
+			struct tent_list_head output_list;
+			struct tent_list *tl;
+
+			tent_list_init(&output_list);
+			if(get_outputs(tt->tent->tnode.tupid, &output_list) < 0)
 				return -1;
-			if(exists) {
-				connected = 1;
-				break;
+			tent_list_foreach(tl, &output_list) {
+				if(tent_tree_search(group_root, tl->tent) != NULL) {
+					connected = 1;
+					break;
+				}
 			}
+			free_tent_list(&output_list);
 		}
 		if(!connected) {
 			if(nodes_are_connected(tt->tent, valid_input_root, &connected) < 0)
@@ -6474,7 +7773,7 @@ int tup_db_node_insert_tent_display(struct tup_entry *dtent, const char *name, i
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -6575,7 +7874,7 @@ static int node_select(struct tup_entry *dtent, const char *name, int len,
 	}
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -6639,7 +7938,7 @@ static int link_insert(tupid_t a, tupid_t b, int style)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", sql);
 		return -1;
@@ -6651,6 +7950,15 @@ static int link_insert(tupid_t a, tupid_t b, int style)
 		return -1;
 	}
 
+	if(style == TUP_LINK_NORMAL) {
+		invalidate_group_members(b);
+		if(link_changed(a) < 0)
+			return -1;
+		if(link_changed(b) < 0)
+			return -1;
+		reachability_cache_link_changed(a);
+	}
+
 	if(style == TUP_LINK_STICKY) {
 		struct tup_entry *tent;
 		struct tup_entry *srctent;
@@ -6717,7 +8025,7 @@ static int link_remove(tupid_t a, tupid_t b, int style)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", sql);
 		return -1;
@@ -6729,6 +8037,15 @@ static int link_remove(tupid_t a, tupid_t b, int style)
 		return -1;
 	}
 
+	if(style == TUP_LINK_NORMAL) {
+		invalidate_group_members(b);
+		if(link_changed(a) < 0)
+			return -1;
+		if(link_changed(b) < 0)
+			return -1;
+		reachability_cache_link_changed(a);
+	}
+
 	if(style == TUP_LINK_STICKY) {
 		struct tup_entry *tent;
 		struct tup_entry *srctent;
@@ -6747,12 +8064,39 @@ static int link_remove(tupid_t a, tupid_t b, int style)
 	return 0;
 }
 
+static int queue_group_order_edge(tupid_t from, tupid_t to)
+{
+	struct group_order_edge *e;
+
+	e = malloc(sizeof *e);
+	if(!e) {
+		perror("malloc");
+		return -1;
+	}
+	e->from = from;
+	e->to = to;
+	TAILQ_INSERT_TAIL(&group_order_pending, e, list);
+	return 0;
+}
+
+static void clear_group_order_pending(void)
+{
+	struct group_order_edge *e;
+
+	while((e = TAILQ_FIRST(&group_order_pending)) != NULL) {
+		TAILQ_REMOVE(&group_order_pending, e, list);
+		free(e);
+	}
+}
+
 static int group_link_insert(tupid_t a, tupid_t b, tupid_t cmdid)
 {
 	int rc;
 	sqlite3_stmt **stmt = &stmts[_DB_GROUP_LINK_INSERT];
 	static char s[] = "insert into group_link(from_id, to_id, cmdid) values(?, ?, ?)";
 
+	clear_group_members();
+
 	if(a == b) {
 		fprintf(stderr, "tup error: Attempt made to group-link a node to itself (%lli)\n", a);
 		return -1;
@@ -6788,7 +8132,7 @@ static int group_link_insert(tupid_t a, tupid_t b, tupid_t cmdid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -6800,7 +8144,7 @@ static int group_link_insert(tupid_t a, tupid_t b, tupid_t cmdid)
 		return -1;
 	}
 
-	return 0;
+	return queue_group_order_edge(a, b);
 }
 
 static int group_link_remove(tupid_t a, tupid_t b, tupid_t cmdid)
@@ -6809,6 +8153,8 @@ static int group_link_remove(tupid_t a, tupid_t b, tupid_t cmdid)
 	sqlite3_stmt **stmt = &stmts[_DB_GROUP_LINK_REMOVE];
 	static char s[] = "delete from group_link where from_id=? and to_id=? and cmdid=?";
 
+	clear_group_members();
+
 	transaction_check("%s [%lli, %lli, %lli]", s, a, b, cmdid);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
@@ -6835,7 +8181,7 @@ static int group_link_remove(tupid_t a, tupid_t b, tupid_t cmdid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -6856,6 +8202,8 @@ static int delete_group_links(tupid_t cmdid)
 	sqlite3_stmt **stmt = &stmts[_DB_DELETE_GROUP_LINKS];
 	static char s[] = "delete from group_link where cmdid=?";
 
+	clear_group_members();
+
 	transaction_check("%s [%lli]", s, cmdid);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
@@ -6872,7 +8220,7 @@ static int delete_group_links(tupid_t cmdid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -6933,7 +8281,7 @@ static int node_has_ghosts(tupid_t tupid)
 	rc = 1;
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -6973,113 +8321,217 @@ void tup_db_del_ghost_tree(struct tup_entry *tent)
 	tent_tree_remove(&ghost_root, tent);
 }
 
-static int reclaim_ghosts(void)
+static int ghost_check_init(void)
 {
-	/* All the nodes in ghost_root already are of type TUP_NODE_GHOST,
-	 * TUP_NODE_GROUP, or TUP_NODE_GENERATED_DIR. Just make sure they are
-	 * no longer needed before deleting them by checking:
-	 *  - no other node references it in 'dir'
-	 *  - no other node is pointed to by it
-	 *  - we are not a ghost 'tup.config' file used for holding @-variables.
-	 *
-	 *  (see ghost_reclaimable())
+	char *errmsg;
+	static char s[] = "create temp table if not exists ghost_check (id integer primary key not null, kind integer not null, simple integer not null, reclaim integer not null default 0)";
+
+	if(ghost_check_created)
+		return 0;
+	if(sqlite3_exec(tup_db, s, NULL, NULL, &errmsg) != 0) {
+		fprintf(stderr, "SQL error: %s\nQuery was: %s\n", errmsg, s);
+		sqlite3_free(errmsg);
+		return -1;
+	}
+	ghost_check_created = 1;
+	return 0;
+}
+
+static int ghost_check_insert(struct tup_entry *tent)
+{
+	int rc;
+	int kind;
+	int simple = 0;
+	sqlite3_stmt **stmt = &stmts[_DB_GHOST_CHECK_INSERT];
+	static char s[] = "insert into ghost_check(id, kind, simple) values(?, ?, ?)";
+
+	/* The kind determines which set of references keeps the node alive
+	 * in reclaim_ghosts():
+	 *  0: ghost or generated dir - no node in it or created by it, and no
+	 *     outputs from it.
+	 *  1: group - no inputs to or outputs from it, and no sticky outputs.
+	 *  2: exclusion - nothing points to it.
 	 *
-	 * If all those cases check out then the ghost can be removed. If the
-	 * ghost is removed then its parent directory is re-added to the list
-	 * if it is a ghost dir in order to handle things like a ghost dir
-	 * having a ghost subdir - the subdir would be removed in one pass,
-	 * then the other dir in the next pass.
+	 * Plain ghosts are candidates for the simple set-based delete, which
+	 * is confirmed by the link checks in reclaim_ghosts().
 	 */
-	struct tent_entries tmp_root = TENT_ENTRIES_INITIALIZER;
-
-	while(!RB_EMPTY(&ghost_root)) {
-		struct tup_entry *tent;
-		struct tent_tree *tt;
-		int rc;
+	if(tent->dt == exclusion_dt()) {
+		kind = 2;
+	} else if(tent->type == TUP_NODE_GROUP) {
+		kind = 1;
+	} else {
+		kind = 0;
+		if(tent->type == TUP_NODE_GHOST)
+			simple = 1;
+	}
 
-		tt = RB_MIN(tent_entries, &ghost_root);
-		tent = tt->tent;
-		tent_tree_rm(&ghost_root, tt);
-		if(tent->type != TUP_NODE_GHOST && tent->type != TUP_NODE_GROUP &&
-		   tent->type != TUP_NODE_GENERATED_DIR) {
-			fprintf(stderr, "tup internal error: tup entry %lli in the ghost_root shouldn't be type %i\n", tent->tnode.tupid, tent->type);
+	transaction_check("%s [%lli, %i, %i]", s, tent->tnode.tupid, kind, simple);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
 			return -1;
 		}
+	}
 
-		rc = ghost_reclaimable(tent);
-		if(rc < 0)
-			return -1;
-		if(rc == 1 && strcmp(tent->name.s, TUP_CONFIG) != 0) {
-			if(sql_debug || reclaim_ghost_debug) {
-				fprintf(stderr, "Ghost removed: %lli\n", tent->tnode.tupid);
-			}
+	if(sqlite3_bind_int64(*stmt, 1, tent->tnode.tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 2, kind) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 3, simple) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
 
-			/* Don't check us again later, in case we were added
-			 * there previously.
-			 */
-			tent_tree_remove(&tmp_root, tent);
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
 
-			/* Re-check the parent again later */
-			tent_tree_remove(&ghost_root, tent->parent);
-			if(tup_entry_add_ghost_tree(&tmp_root, tent->parent) < 0)
-				return -1;
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
 
-			if(rm_generated_dir(tent) < 0)
-				return -1;
+	return 0;
+}
 
-			if(delete_name_file(tent->tnode.tupid) < 0)
-				return -1;
-		}
+static int ghost_check_exec(const char *s, int (*callback)(void*,int,char**,char**), void *arg)
+{
+	char *errmsg;
 
-		if(RB_EMPTY(&ghost_root)) {
-			/* Swap the current tree with the tmp one where we
-			 * stored all the parents to check again.
-			 */
-			ghost_root.rbh_root = tmp_root.rbh_root;
-			tmp_root.rbh_root = NULL;
-		}
+	transaction_check("%s", s);
+	if(sqlite3_exec(tup_db, s, callback, arg, &errmsg) != 0) {
+		fprintf(stderr, "SQL error: %s\nQuery was: %s\n", errmsg, s);
+		sqlite3_free(errmsg);
+		return -1;
 	}
-
+	transaction_started = 0;
 	return 0;
 }
 
-static int ghost_reclaimable(struct tup_entry *tent)
+struct group_order {
+	struct tupid_tree tnode;
+	tupid_t ord;
+	int mark;
+	int dirty;
+};
+
+struct group_order_set {
+	struct group_order **nodes;
+	int num;
+	int size;
+};
+
+static int group_order_set_add(struct group_order_set *set, struct group_order *go)
 {
-	int rc1, rc2;
+	if(set->num == set->size) {
+		struct group_order **tmp;
+		int size = set->size ? set->size * 2 : 64;
 
-	if(tent->dt == exclusion_dt()) {
-		rc1 = exclusion_reclaimable(tent->tnode.tupid);
-		rc2 = rc1;
-	} else if(tent->type == TUP_NODE_GHOST || tent->type == TUP_NODE_GENERATED_DIR) {
-		rc1 = ghost_reclaimable1(tent->tnode.tupid);
-		if(rc1 == 0)
-			return 0;
-		rc2 = ghost_reclaimable2(tent->tnode.tupid);
-	} else {
-		rc1 = group_reclaimable1(tent->tnode.tupid);
-		if(rc1 == 0)
-			return 0;
-		rc2 = group_reclaimable2(tent->tnode.tupid);
+		tmp = realloc(set->nodes, sizeof(*tmp) * size);
+		if(!tmp) {
+			perror("realloc");
+			return -1;
+		}
+		set->nodes = tmp;
+		set->size = size;
 	}
+	set->nodes[set->num] = go;
+	set->num++;
+	return 0;
+}
+
+static int group_order_cmp(const void *a, const void *b)
+{
+	const struct group_order *ga = *(struct group_order * const *)a;
+	const struct group_order *gb = *(struct group_order * const *)b;
 
-	/* If either sub-query fails, we fail */
-	if(rc1 < 0 || rc2 < 0)
+	if(ga->ord < gb->ord)
 		return -1;
-	/* If both checks say it is reclaimable, then it is reclaimable */
-	if(rc1 == 1 && rc2 == 1)
+	if(ga->ord > gb->ord)
 		return 1;
-	/* Otherwise, it is not reclaimable */
 	return 0;
 }
 
-static int exclusion_reclaimable(tupid_t tupid)
+static int tupid_cmp(const void *a, const void *b)
 {
-	int rc = -1;
-	int dbrc;
-	sqlite3_stmt **stmt = &stmts[_DB_EXCLUSION_RECLAIMABLE];
-	static char s[] = "select exists(select 1 from normal_link where to_id=?)";
+	tupid_t ta = *(const tupid_t *)a;
+	tupid_t tb = *(const tupid_t *)b;
 
-	transaction_check("%s [%lli]", s, tupid);
+	if(ta < tb)
+		return -1;
+	if(ta > tb)
+		return 1;
+	return 0;
+}
+
+static void free_group_order(struct tupid_entries *root)
+{
+	struct tupid_tree *tt;
+
+	while((tt = RB_ROOT(root)) != NULL) {
+		tupid_tree_rm(root, tt);
+		free(container_of(tt, struct group_order, tnode));
+	}
+}
+
+static struct group_order *group_order_add(struct tupid_entries *root, tupid_t tupid, tupid_t ord)
+{
+	struct group_order *go;
+
+	go = malloc(sizeof *go);
+	if(!go) {
+		perror("malloc");
+		return NULL;
+	}
+	go->tnode.tupid = tupid;
+	go->ord = ord;
+	go->mark = 0;
+	go->dirty = 0;
+	if(tupid_tree_insert(root, &go->tnode) < 0) {
+		fprintf(stderr, "tup internal error: Duplicate group %lli in the group order\n", tupid);
+		free(go);
+		return NULL;
+	}
+	return go;
+}
+
+static struct group_order *group_order_get(struct tupid_entries *root, tupid_t tupid, tupid_t *max_ord)
+{
+	struct tupid_tree *tt;
+	struct group_order *go;
+
+	tt = tupid_tree_search(root, tupid);
+	if(tt)
+		return container_of(tt, struct group_order, tnode);
+
+	/* A group we haven't ordered yet goes at the end. */
+	(*max_ord)++;
+	go = group_order_add(root, tupid, *max_ord);
+	if(!go)
+		return NULL;
+	go->dirty = 1;
+	return go;
+}
+
+static int load_group_order(struct tupid_entries *root, tupid_t *max_ord)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[_DB_GROUP_ORDER_LOAD];
+	static char s[] = "select id, ord from group_order";
+
+	transaction_check("%s", s);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
 			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
@@ -7088,36 +8540,31 @@ static int exclusion_reclaimable(tupid_t tupid)
 		}
 	}
 
-	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
-		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
-		return -1;
-	}
-
-	rc = sqlite3_step(*stmt);
+	*max_ord = 0;
+	while(1) {
+		tupid_t ord;
 
-	if(rc == SQLITE_DONE) {
-		fprintf(stderr, "tup error: Expected exclusion_reclaimable() to get an SQLite row returned.\n");
-		goto out_reset;
-	}
-	if(rc != SQLITE_ROW) {
-		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
-		goto out_reset;
-	}
-	dbrc = sqlite3_column_int(*stmt, 0);
-	/* If the exists clause returns 0, then we are reclaimable, otherwise we aren't */
-	if(dbrc == 0) {
-		rc = 1;
-	} else if(dbrc == 1) {
-		rc = 0;
-	} else {
-		fprintf(stderr, "tup error: Expected exclusion_reclaimable() to get a 0 or 1 from SQLite\n");
-		goto out_reset;
+		rc = sqlite3_step(*stmt);
+		if(rc == SQLITE_DONE) {
+			rc = 0;
+			break;
+		}
+		if(rc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			rc = -1;
+			break;
+		}
+		ord = sqlite3_column_int64(*stmt, 1);
+		if(!group_order_add(root, sqlite3_column_int64(*stmt, 0), ord)) {
+			rc = -1;
+			break;
+		}
+		if(ord > *max_ord)
+			*max_ord = ord;
 	}
 
-out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -7126,14 +8573,13 @@ out_reset:
 	return rc;
 }
 
-static int group_reclaimable1(tupid_t tupid)
+static int delete_group_order(tupid_t tupid)
 {
-	int rc = -1;
-	int dbrc;
-	sqlite3_stmt **stmt = &stmts[_DB_GROUP_RECLAIMABLE1];
-	static char s[] = "select exists(select 1 from normal_link where from_id=? or to_id=?)";
+	int rc;
+	sqlite3_stmt **stmt = &stmts[_DB_GROUP_ORDER_DELETE];
+	static char s[] = "delete from group_order where id=?";
 
-	transaction_check("%s [%lli, %lli]", s, tupid, tupid);
+	transaction_check("%s [%lli]", s, tupid);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
 			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
@@ -7147,52 +8593,82 @@ static int group_reclaimable1(tupid_t tupid)
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
 	}
-	if(sqlite3_bind_int64(*stmt, 2, tupid) != 0) {
-		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
-		return -1;
-	}
 
 	rc = sqlite3_step(*stmt);
-
-	if(rc == SQLITE_DONE) {
-		fprintf(stderr, "tup error: Expected group_reclaimable1() to get an SQLite row returned.\n");
-		goto out_reset;
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
 	}
-	if(rc != SQLITE_ROW) {
+	if(rc != SQLITE_DONE) {
 		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
-		goto out_reset;
-	}
-	dbrc = sqlite3_column_int(*stmt, 0);
-	/* If the exists clause returns 0, then we are reclaimable, otherwise we aren't */
-	if(dbrc == 0) {
-		rc = 1;
-	} else if(dbrc == 1) {
-		rc = 0;
-	} else {
-		fprintf(stderr, "tup error: Expected group_reclaimable1() to get a 0 or 1 from SQLite\n");
-		goto out_reset;
+		return -1;
 	}
+	/* The order is bookkeeping, not a change to the build. */
+	expected_changes += sqlite3_changes(tup_db);
+	return 0;
+}
 
-out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
-		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
-		return -1;
-	}
+static int save_group_order(struct tupid_entries *root)
+{
+	struct tupid_tree *tt;
+	sqlite3_stmt **stmt = &stmts[_DB_GROUP_ORDER_SET];
+	static char s[] = "insert or replace into group_order(id, ord) values(?, ?)";
 
-	return rc;
+	RB_FOREACH(tt, tupid_entries, root) {
+		struct group_order *go = container_of(tt, struct group_order, tnode);
+		int rc;
+
+		if(!go->dirty)
+			continue;
+
+		transaction_check("%s [%lli, %lli]", s, go->tnode.tupid, go->ord);
+		if(!*stmt) {
+			if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+				fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+				fprintf(stderr, "Statement was: %s\n", s);
+				return -1;
+			}
+		}
+
+		if(sqlite3_bind_int64(*stmt, 1, go->tnode.tupid) != 0) {
+			fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+		if(sqlite3_bind_int64(*stmt, 2, go->ord) != 0) {
+			fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+
+		rc = sqlite3_step(*stmt);
+		if(msqlite3_reset(stmt) != 0) {
+			fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+		if(rc != SQLITE_DONE) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+		/* The order is bookkeeping, not a change to the build. */
+		expected_changes += sqlite3_changes(tup_db);
+		go->dirty = 0;
+	}
+	return 0;
 }
 
-static int group_reclaimable2(tupid_t tupid)
+static int group_link_exists(tupid_t from, tupid_t to)
 {
-	int rc = -1;
+	int rc;
 	int dbrc;
-	sqlite3_stmt **stmt = &stmts[_DB_GROUP_RECLAIMABLE2];
-	static char s[] = "select exists(select 1 from sticky_link where from_id=?)";
+	sqlite3_stmt **stmt = &stmts[_DB_GROUP_LINK_EXISTS];
+	static char s[] = "select exists(select 1 from group_link where from_id=? and to_id=?)";
 
-	transaction_check("%s [%lli]", s, tupid);
+	transaction_check("%s [%lli, %lli]", s, from, to);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
 			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
@@ -7201,36 +8677,27 @@ static int group_reclaimable2(tupid_t tupid)
 		}
 	}
 
-	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+	if(sqlite3_bind_int64(*stmt, 1, from) != 0) {
 		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
 	}
-
-	rc = sqlite3_step(*stmt);
-
-	if(rc == SQLITE_DONE) {
-		fprintf(stderr, "tup error: Expected group_reclaimable2() to get an SQLite row returned.\n");
-		goto out_reset;
-	}
-	if(rc != SQLITE_ROW) {
-		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+	if(sqlite3_bind_int64(*stmt, 2, to) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
-		goto out_reset;
+		return -1;
 	}
-	dbrc = sqlite3_column_int(*stmt, 0);
-	/* If the exists clause returns 0, then we are reclaimable, otherwise we aren't */
-	if(dbrc == 0) {
-		rc = 1;
-	} else if(dbrc == 1) {
-		rc = 0;
+
+	dbrc = sqlite3_step(*stmt);
+	if(dbrc == SQLITE_ROW) {
+		rc = sqlite3_column_int(*stmt, 0);
 	} else {
-		fprintf(stderr, "tup error: Expected group_reclaimable2() to get a 0 or 1 from SQLite\n");
-		goto out_reset;
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		rc = -1;
 	}
 
-out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -7239,16 +8706,28 @@ out_reset:
 	return rc;
 }
 
-static int ghost_reclaimable1(tupid_t tupid)
+static int group_neighbors(tupid_t tupid, int forward, struct tupid_list_head *head)
 {
-	int rc = -1;
-	int dbrc;
-	sqlite3_stmt **stmt = &stmts[_DB_GHOST_RECLAIMABLE1];
-	static char s[] = "select exists(select 1 from node where dir=? or srcid=?)";
+	int rc;
+	sqlite3_stmt **stmt;
+	const char *s;
+	int len;
+	static char succ_s[] = "select distinct to_id from group_link where from_id=?";
+	static char pred_s[] = "select distinct from_id from group_link where to_id=?";
+
+	if(forward) {
+		stmt = &stmts[_DB_GROUP_SUCCESSORS];
+		s = succ_s;
+		len = sizeof(succ_s);
+	} else {
+		stmt = &stmts[_DB_GROUP_PREDECESSORS];
+		s = pred_s;
+		len = sizeof(pred_s);
+	}
 
-	transaction_check("%s [%lli, %i]", s, tupid, tupid);
+	transaction_check("%s [%lli]", s, tupid);
 	if(!*stmt) {
-		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+		if(sqlite3_prepare_v2(tup_db, s, len, stmt, NULL) != 0) {
 			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
 			fprintf(stderr, "Statement was: %s\n", s);
 			return -1;
@@ -7260,36 +8739,26 @@ static int ghost_reclaimable1(tupid_t tupid)
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
 	}
-	if(sqlite3_bind_int64(*stmt, 2, tupid) != 0) {
-		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
-		return -1;
-	}
-
-	rc = sqlite3_step(*stmt);
 
-	if(rc == SQLITE_DONE) {
-		fprintf(stderr, "tup error: Expected ghost_reclaimable1() to get an SQLite row returned.\n");
-		goto out_reset;
-	}
-	if(rc != SQLITE_ROW) {
-		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
-		goto out_reset;
-	}
-	dbrc = sqlite3_column_int(*stmt, 0);
-	/* If the exists clause returns 0, then we are reclaimable, otherwise we aren't */
-	if(dbrc == 0) {
-		rc = 1;
-	} else if(dbrc == 1) {
-		rc = 0;
-	} else {
-		fprintf(stderr, "tup error: Expected ghost_reclaimable1() to get a 0 or 1 from SQLite\n");
-		goto out_reset;
+	while(1) {
+		rc = sqlite3_step(*stmt);
+		if(rc == SQLITE_DONE) {
+			rc = 0;
+			break;
+		}
+		if(rc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			rc = -1;
+			break;
+		}
+		if(tupid_list_add_tail(head, sqlite3_column_int64(*stmt, 0)) < 0) {
+			rc = -1;
+			break;
+		}
 	}
 
-out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -7298,73 +8767,1261 @@ out_reset:
 	return rc;
 }
 
-static int ghost_reclaimable2(tupid_t tupid)
+/* Collects the groups reachable from start (forward) or that reach start
+ * (backward) whose position is strictly between lo and hi. Returns 1 if the
+ * forward search reaches 'target', which means the new link closes a cycle.
+ */
+static int group_order_search(struct tupid_entries *root, tupid_t *max_ord,
+			      struct group_order *start, struct group_order *target,
+			      tupid_t lo, tupid_t hi, int forward,
+			      struct group_order_set *found)
 {
-	int rc = -1;
-	int dbrc;
-	sqlite3_stmt **stmt = &stmts[_DB_GHOST_RECLAIMABLE2];
-	static char s[] = "select exists(select 1 from normal_link where from_id=?)";
+	int x;
 
-	transaction_check("%s [%lli]", s, tupid);
-	if(!*stmt) {
-		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
-			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
-			fprintf(stderr, "Statement was: %s\n", s);
+	start->mark = 1;
+	if(group_order_set_add(found, start) < 0)
+		return -1;
+	/* found doubles as the DFS stack: everything after x still needs to
+	 * have its neighbors expanded.
+	 */
+	for(x=0; x<found->num; x++) {
+		struct tupid_list_head head;
+		struct tupid_list *tl;
+		int rc = 0;
+
+		tupid_list_init(&head);
+		if(group_neighbors(found->nodes[x]->tnode.tupid, forward, &head) < 0)
 			return -1;
+		tupid_list_foreach(tl, &head) {
+			struct group_order *go;
+
+			if(forward && tl->tupid == target->tnode.tupid) {
+				rc = 1;
+				break;
+			}
+			go = group_order_get(root, tl->tupid, max_ord);
+			if(!go) {
+				rc = -1;
+				break;
+			}
+			if(go->mark || go->ord <= lo || go->ord >= hi)
+				continue;
+			go->mark = 1;
+			if(group_order_set_add(found, go) < 0) {
+				rc = -1;
+				break;
+			}
 		}
+		free_tupid_list(&head);
+		if(rc != 0)
+			return rc;
+	}
+	return 0;
+}
+
+/* Adds the link from -> to into the order. Only the groups positioned between
+ * 'to' and 'from' are searched: those reachable from 'to' (F) and those that
+ * reach 'from' (B). B is then moved in front of F, re-using the same
+ * positions (Pearce & Kelly's dynamic topological sort).
+ */
+static int group_order_link(struct tupid_entries *root, tupid_t *max_ord,
+			    tupid_t from, tupid_t to)
+{
+	struct group_order *gfrom;
+	struct group_order *gto;
+	struct group_order_set fwd = {NULL, 0, 0};
+	struct group_order_set back = {NULL, 0, 0};
+	tupid_t *ords = NULL;
+	int rc = -1;
+	int x;
+
+	gfrom = group_order_get(root, from, max_ord);
+	if(!gfrom)
+		return -1;
+	gto = group_order_get(root, to, max_ord);
+	if(!gto)
+		return -1;
+	if(gfrom->ord < gto->ord)
+		return 0;
+
+	/* The link may have been removed again later in the parse. */
+	rc = group_link_exists(from, to);
+	if(rc <= 0)
+		return rc;
+
+	rc = group_order_search(root, max_ord, gto, gfrom, gto->ord, gfrom->ord, 1, &fwd);
+	if(rc != 0)
+		goto out;
+	rc = group_order_search(root, max_ord, gfrom, gto, gto->ord, gfrom->ord, 0, &back);
+	if(rc != 0)
+		goto out;
+
+	ords = malloc(sizeof(*ords) * (fwd.num + back.num));
+	if(!ords) {
+		perror("malloc");
+		rc = -1;
+		goto out;
+	}
+	for(x=0; x<back.num; x++)
+		ords[x] = back.nodes[x]->ord;
+	for(x=0; x<fwd.num; x++)
+		ords[back.num + x] = fwd.nodes[x]->ord;
+	qsort(ords, fwd.num + back.num, sizeof(*ords), tupid_cmp);
+	qsort(back.nodes, back.num, sizeof(*back.nodes), group_order_cmp);
+	qsort(fwd.nodes, fwd.num, sizeof(*fwd.nodes), group_order_cmp);
+	for(x=0; x<back.num; x++) {
+		back.nodes[x]->ord = ords[x];
+		back.nodes[x]->dirty = 1;
+	}
+	for(x=0; x<fwd.num; x++) {
+		fwd.nodes[x]->ord = ords[back.num + x];
+		fwd.nodes[x]->dirty = 1;
 	}
+	rc = 0;
 
-	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
-		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
+out:
+	for(x=0; x<fwd.num; x++)
+		fwd.nodes[x]->mark = 0;
+	for(x=0; x<back.num; x++)
+		back.nodes[x]->mark = 0;
+	free(ords);
+	free(fwd.nodes);
+	free(back.nodes);
+	return rc;
+}
+
+static int queue_group_link_cb(void *arg, int argc, char **argv, char **col)
+{
+	if(arg || col) {}
+
+	if(argc != 2) {
+		fprintf(stderr, "tup error: Expected 2 columns from group_link, got %i\n", argc);
 		return -1;
 	}
+	return queue_group_order_edge(strtoll(argv[0], NULL, 0), strtoll(argv[1], NULL, 0));
+}
 
-	rc = sqlite3_step(*stmt);
+static int queue_all_group_links(void)
+{
+	/* Throw out the old order and rebuild it from every group link. */
+	if(ghost_check_exec("delete from group_order", NULL, NULL) < 0)
+		return -1;
+	expected_changes += sqlite3_changes(tup_db);
+	clear_group_order_pending();
+	if(ghost_check_exec("select distinct from_id, to_id from group_link", queue_group_link_cb, NULL) < 0)
+		return -1;
+	return 0;
+}
 
-	if(rc == SQLITE_DONE) {
-		fprintf(stderr, "tup error: Expected ghost_reclaimable2() to get an SQLite row returned.\n");
-		goto out_reset;
+int tup_db_check_group_order(void)
+{
+	struct tupid_entries root = RB_INITIALIZER(&root);
+	struct group_order_edge *e;
+	tupid_t max_ord;
+	int valid;
+	int rc = 0;
+
+	if(TAILQ_EMPTY(&group_order_pending))
+		return 0;
+
+	if(tup_db_config_get_int("group_order", 0, &valid) < 0)
+		return -1;
+	if(!valid) {
+		if(queue_all_group_links() < 0)
+			return -1;
 	}
-	if(rc != SQLITE_ROW) {
-		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
-		goto out_reset;
+	if(load_group_order(&root, &max_ord) < 0) {
+		rc = -1;
+		goto out;
 	}
-	dbrc = sqlite3_column_int(*stmt, 0);
-	/* If the exists clause returns 0, then we are reclaimable, otherwise we aren't */
-	if(dbrc == 0) {
-		rc = 1;
-	} else if(dbrc == 1) {
-		rc = 0;
-	} else {
-		fprintf(stderr, "tup error: Expected ghost_reclaimable2() to get a 0 or 1 from SQLite\n");
-		goto out_reset;
+
+	while((e = TAILQ_FIRST(&group_order_pending)) != NULL) {
+		rc = group_order_link(&root, &max_ord, e->from, e->to);
+		if(rc != 0)
+			break;
+		TAILQ_REMOVE(&group_order_pending, e, list);
+		free(e);
 	}
 
-out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
-		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
-		fprintf(stderr, "Statement was: %s\n", s);
-		return -1;
+	if(rc == 0) {
+		if(save_group_order(&root) < 0) {
+			rc = -1;
+			goto out;
+		}
+		if(!valid) {
+			if(tup_db_config_set_int("group_order", 1) < 0)
+				rc = -1;
+		}
+	} else if(rc == 1 && valid) {
+		/* The links that would have made the cycle aren't in the
+		 * order, so rebuild it from scratch once they are fixed.
+		 */
+		if(tup_db_config_set_int("group_order", 0) < 0)
+			rc = -1;
 	}
 
+out:
+	clear_group_order_pending();
+	free_group_order(&root);
 	return rc;
 }
 
-int tup_db_reparse_all(void)
+struct reclaim_list {
+	struct tupid_entries simple_root;
+	struct tupid_entries full_root;
+};
+
+static int reclaim_list_cb(void *arg, int argc, char **argv, char **col)
 {
-	char sql_parse_all[] = "insert or replace into create_list select id from node where type=2";
-	char *errmsg;
+	struct reclaim_list *rl = arg;
+	struct tupid_entries *root;
+	tupid_t tupid;
+	if(col) {}
 
-	if(sqlite3_exec(tup_db, sql_parse_all, NULL, NULL, &errmsg) != 0) {
-		fprintf(stderr, "SQL error: %s\nQuery was: %s\n",
-			errmsg, sql_parse_all);
+	if(argc != 2) {
+		fprintf(stderr, "tup error: Expected 2 columns from ghost_check, got %i\n", argc);
+		return -1;
+	}
+	tupid = strtoll(argv[0], NULL, 0);
+	if(strcmp(argv[1], "1") == 0) {
+		root = &rl->simple_root;
+	} else {
+		root = &rl->full_root;
+	}
+	if(tupid_tree_add(root, tupid) < 0)
+		return -1;
+	return 0;
+}
+
+static int reclaim_simple_ghosts(struct tupid_entries *root)
+{
+	struct tupid_tree *tt;
+	static char s[] =
+		"delete from config_list where id in (select id from ghost_check where simple=1);"
+		"delete from create_list where id in (select id from ghost_check where simple=1);"
+		"delete from modify_list where id in (select id from ghost_check where simple=1);"
+		"delete from variant_list where id in (select id from ghost_check where simple=1);"
+		"delete from group_order where id in (select id from ghost_check where simple=1);"
+		"delete from node where id in (select id from ghost_check where simple=1)";
+
+	if(RB_EMPTY(root))
+		return 0;
+	if(ghost_check_exec(s, NULL, NULL) < 0)
 		return -1;
+
+	/* These are plain ghosts that nothing else references, so all that
+	 * is left is to drop them from the entry cache and check their
+	 * parents (and the directories that created them) in the next pass.
+	 */
+	RB_FOREACH(tt, tupid_entries, root) {
+		struct tup_entry *tent;
+
+		tent = tup_entry_find(tt->tupid);
+		if(!tent)
+			continue;
+		if(sql_debug || reclaim_ghost_debug) {
+			fprintf(stderr, "Ghost removed: %lli\n", tt->tupid);
+		}
+		if(tent->srcid >= 0) {
+			struct tup_entry *srctent;
+			if(tup_entry_add(tent->srcid, &srctent) < 0)
+				return -1;
+			if(tup_entry_add_ghost_tree(&ghost_root, srctent) < 0)
+				return -1;
+		}
+		if(tup_entry_add_ghost_tree(&ghost_root, tent->parent) < 0)
+			return -1;
+		if(tup_entry_rm(tt->tupid) < 0)
+			return -1;
+		ghosts_reclaimed++;
+	}
+	return 0;
+}
+
+static int reclaim_full_ghosts(struct tupid_entries *root)
+{
+	struct tupid_tree *tt;
+
+	/* Generated dirs, groups, and ghosts that still have links go
+	 * through the normal node deletion so the links are cleaned up and
+	 * the users of a group are flagged.
+	 */
+	RB_FOREACH(tt, tupid_entries, root) {
+		struct tup_entry *tent;
+
+		tent = tup_entry_find(tt->tupid);
+		if(!tent)
+			continue;
+		if(sql_debug || reclaim_ghost_debug) {
+			fprintf(stderr, "Ghost removed: %lli\n", tt->tupid);
+		}
+
+		/* Re-check the parent again later */
+		if(tup_entry_add_ghost_tree(&ghost_root, tent->parent) < 0)
+			return -1;
+
+		if(rm_generated_dir(tent) < 0)
+			return -1;
+
+		if(delete_name_file(tt->tupid) < 0)
+			return -1;
+		ghosts_reclaimed++;
 	}
 	return 0;
 }
 
+static int reclaim_ghosts(void)
+{
+	/* All the nodes in ghost_root already are of type TUP_NODE_GHOST,
+	 * TUP_NODE_GROUP, or TUP_NODE_GENERATED_DIR. Just make sure they are
+	 * no longer needed before deleting them by checking:
+	 *  - no other node references it in 'dir'
+	 *  - no other node is pointed to by it
+	 *  - we are not a ghost 'tup.config' file used for holding @-variables.
+	 *
+	 * Each pass moves the candidates into the ghost_check temp table so the
+	 * checks can be done with a single query, rather than a handful of
+	 * queries per node (see ghost_check_insert()).
+	 *
+	 * If all those cases check out then the ghost can be removed. If the
+	 * ghost is removed then its parent directory is re-added to the list
+	 * if it is a ghost dir in order to handle things like a ghost dir
+	 * having a ghost subdir - the subdir would be removed in one pass,
+	 * then the other dir in the next pass.
+	 */
+	static char check_s[] =
+		"update ghost_check set reclaim=1 where case kind"
+		" when 2 then not exists(select 1 from normal_link where to_id=ghost_check.id)"
+		" when 1 then not exists(select 1 from normal_link where from_id=ghost_check.id) and not exists(select 1 from normal_link where to_id=ghost_check.id) and not exists(select 1 from sticky_link where from_id=ghost_check.id)"
+		" else not exists(select 1 from node where dir=ghost_check.id) and not exists(select 1 from node where srcid=ghost_check.id) and not exists(select 1 from normal_link where from_id=ghost_check.id) end;"
+		"update ghost_check set simple=0 where simple=1 and (reclaim=0 or exists(select 1 from normal_link where to_id=ghost_check.id) or exists(select 1 from sticky_link where from_id=ghost_check.id) or exists(select 1 from sticky_link where to_id=ghost_check.id))";
+	static char list_s[] = "select id, simple from ghost_check where reclaim=1";
+	static char clear_s[] = "delete from ghost_check";
+
+	if(RB_EMPTY(&ghost_root))
+		return 0;
+	if(ghost_check_init() < 0)
+		return -1;
+
+	while(!RB_EMPTY(&ghost_root)) {
+		struct reclaim_list rl = {
+			RB_INITIALIZER(&rl.simple_root),
+			RB_INITIALIZER(&rl.full_root),
+		};
+		struct tent_tree *tt;
+
+		while((tt = RB_MIN(tent_entries, &ghost_root)) != NULL) {
+			struct tup_entry *tent = tt->tent;
+
+			if(tent->type != TUP_NODE_GHOST && tent->type != TUP_NODE_GROUP &&
+			   tent->type != TUP_NODE_GENERATED_DIR) {
+				fprintf(stderr, "tup internal error: tup entry %lli in the ghost_root shouldn't be type %i\n", tent->tnode.tupid, tent->type);
+				return -1;
+			}
+			if(strcmp(tent->name.s, TUP_CONFIG) != 0) {
+				if(ghost_check_insert(tent) < 0)
+					return -1;
+			}
+			tent_tree_rm(&ghost_root, tt);
+			ghost_root.count--;
+		}
+
+		if(ghost_check_exec(check_s, NULL, NULL) < 0)
+			return -1;
+		if(ghost_check_exec(list_s, reclaim_list_cb, &rl) < 0)
+			return -1;
+
+		if(reclaim_simple_ghosts(&rl.simple_root) < 0)
+			return -1;
+		if(ghost_check_exec(clear_s, NULL, NULL) < 0)
+			return -1;
+		if(reclaim_full_ghosts(&rl.full_root) < 0)
+			return -1;
+
+		free_tupid_tree(&rl.simple_root);
+		free_tupid_tree(&rl.full_root);
+	}
+
+	return 0;
+}
+
+static int delete_check_init(void)
+{
+	char *errmsg;
+	static char s[] = "create temp table if not exists delete_check (id integer primary key not null, simple integer not null default 1)";
+
+	if(delete_check_created)
+		return 0;
+	if(sqlite3_exec(tup_db, s, NULL, NULL, &errmsg) != 0) {
+		fprintf(stderr, "SQL error: %s\nQuery was: %s\n", errmsg, s);
+		sqlite3_free(errmsg);
+		return -1;
+	}
+	delete_check_created = 1;
+	return 0;
+}
+
+static int delete_check_insert(tupid_t tupid)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[_DB_DELETE_CHECK_INSERT];
+	static char s[] = "insert or ignore into delete_check(id) values(?)";
+
+	transaction_check("%s [%lli]", s, tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int delete_check_modify_cmds(void)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[_DB_DELETE_CHECK_MODIFY];
+	static char s[] = "insert or ignore into modify_list select to_id from normal_link, node where from_id in (select id from delete_check where simple=1) and to_id=id and (type=? or type=?)";
+
+	/* The set-based version of tup_db_modify_cmds_by_input() */
+	transaction_check("%s [%i, %i]", s, TUP_NODE_CMD, TUP_NODE_GROUP);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int(*stmt, 1, TUP_NODE_CMD) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 2, TUP_NODE_GROUP) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int delete_check_ghosts(void)
+{
+	int rc = 0;
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[_DB_DELETE_CHECK_GHOSTS];
+	static char s[] = "select id from node where (type=? or type=? or type=?) and id in (select from_id from normal_link where to_id in (select id from delete_check where simple=1) union select to_id from normal_link where from_id in (select id from delete_check where simple=1))";
+	struct tupid_list_head tupid_list;
+	struct tupid_list *tl;
+
+	/* The set-based version of add_ghost_checks() and
+	 * add_group_and_exclusion_checks(). Only the nodes that
+	 * tup_entry_add_ghost_tree() would keep are selected, so we don't
+	 * have to load every input of every command.
+	 */
+	tupid_list_init(&tupid_list);
+
+	transaction_check("%s [%i, %i, %i]", s, TUP_NODE_GHOST, TUP_NODE_GROUP, TUP_NODE_GENERATED_DIR);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int(*stmt, 1, TUP_NODE_GHOST) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 2, TUP_NODE_GROUP) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 3, TUP_NODE_GENERATED_DIR) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	while(1) {
+		dbrc = sqlite3_step(*stmt);
+		if(dbrc == SQLITE_DONE) {
+			break;
+		}
+		if(dbrc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			rc = -1;
+			break;
+		}
+
+		if(tupid_list_add_tail(&tupid_list, sqlite3_column_int64(*stmt, 0)) < 0) {
+			rc = -1;
+			break;
+		}
+	}
+
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc == 0) {
+		tupid_list_foreach(tl, &tupid_list) {
+			struct tup_entry *tent;
+			if(tup_entry_add(tl->tupid, &tent) < 0)
+				return -1;
+			if(tup_entry_add_ghost_tree(&ghost_root, tent) < 0)
+				return -1;
+		}
+	}
+	free_tupid_list(&tupid_list);
+	return rc;
+}
+
+static int delete_check_full_cb(void *arg, int argc, char **argv, char **col)
+{
+	struct tupid_entries *root = arg;
+	if(col) {}
+
+	if(argc != 1) {
+		fprintf(stderr, "tup error: Expected 1 column from delete_check, got %i\n", argc);
+		return -1;
+	}
+	if(tupid_tree_add(root, strtoll(argv[0], NULL, 0)) < 0)
+		return -1;
+	return 0;
+}
+
+int tup_db_delete_set(struct tent_entries *root, enum TUP_NODE_TYPE type)
+{
+	/* This is the set-based version of tup_del_id_force() for the
+	 * generated files and commands that the updater removes in bulk. All
+	 * of the nodes are moved into the delete_check temp table, and the
+	 * lists, links, and nodes are removed with a handful of queries
+	 * instead of a dozen queries per node.
+	 *
+	 * Anything that needs special handling goes through
+	 * tup_del_id_force() individually:
+	 *  - a tup.config file, which goes back to a ghost
+	 *  - a node of an unexpected type
+	 *  - a node that another node references in 'dir' or 'srcid', which
+	 *    has to become a ghost (see node_has_ghosts())
+	 */
+	static char mark_s[] = "update delete_check set simple=0 where exists(select 1 from node where dir=delete_check.id) or exists(select 1 from node where srcid=delete_check.id)";
+	static char full_s[] = "select id from delete_check where simple=0";
+	static char create_s[] = "delete from create_list where id in (select id from delete_check where simple=1)";
+	static char delete_s[] =
+		"delete from config_list where id in (select id from delete_check where simple=1);"
+		"delete from modify_list where id in (select id from delete_check where simple=1);"
+		"delete from variant_list where id in (select id from delete_check where simple=1);"
+		"delete from normal_link where from_id in (select id from delete_check where simple=1);"
+		"delete from normal_link where to_id in (select id from delete_check where simple=1);"
+		"delete from sticky_link where from_id in (select id from delete_check where simple=1);"
+		"delete from sticky_link where to_id in (select id from delete_check where simple=1);"
+		"delete from group_link where cmdid in (select id from delete_check where simple=1);"
+		"delete from node where id in (select id from delete_check where simple=1)";
+	static char clear_s[] = "delete from delete_check";
+	struct tupid_entries full_root = RB_INITIALIZER(&full_root);
+	struct tent_tree *tt;
+	int num_simple = 0;
+
+	if(RB_EMPTY(root))
+		return 0;
+	if(delete_check_init() < 0)
+		return -1;
+
+	RB_FOREACH(tt, tent_entries, root) {
+		struct tup_entry *tent = tt->tent;
+
+		log_debug_tent("Delete", tent, ", type=%i, force=1\n", type);
+		if(tent->type != type ||
+		   (type == TUP_NODE_GENERATED && strcmp(tent->name.s, TUP_CONFIG) == 0)) {
+			if(tupid_tree_add(&full_root, tent->tnode.tupid) < 0)
+				return -1;
+		} else {
+			if(delete_check_insert(tent->tnode.tupid) < 0)
+				return -1;
+		}
+	}
+
+	if(ghost_check_exec(mark_s, NULL, NULL) < 0)
+		return -1;
+	if(ghost_check_exec(full_s, delete_check_full_cb, &full_root) < 0)
+		return -1;
+
+	if(type == TUP_NODE_GENERATED) {
+		if(delete_check_modify_cmds() < 0)
+			return -1;
+	}
+	if(delete_check_ghosts() < 0)
+		return -1;
+
+	RB_FOREACH(tt, tent_entries, root) {
+		struct tup_entry *tent = tt->tent;
+
+		if(tupid_tree_search(&full_root, tent->tnode.tupid) != NULL)
+			continue;
+		if(tent->srcid >= 0) {
+			struct tup_entry *srctent;
+			if(tup_entry_add(tent->srcid, &srctent) < 0)
+				return -1;
+			if(tup_entry_add_ghost_tree(&ghost_root, srctent) < 0)
+				return -1;
+		}
+		if(tup_entry_add_ghost_tree(&ghost_root, tent->parent) < 0)
+			return -1;
+		if(link_changed(tent->tnode.tupid) < 0)
+			return -1;
+		num_simple++;
+	}
+
+	if(num_simple) {
+		if(!RB_EMPTY(&group_members_root))
+			clear_group_members();
+		sticky_count++;
+
+		if(ghost_check_exec(create_s, NULL, NULL) < 0)
+			return -1;
+		/* Same as tup_db_unflag_create() */
+		expected_changes += sqlite3_changes(tup_db);
+		if(ghost_check_exec(delete_s, NULL, NULL) < 0)
+			return -1;
+		reachability_cache_link_changed(-1);
+	}
+	if(ghost_check_exec(clear_s, NULL, NULL) < 0)
+		return -1;
+
+	while((tt = RB_ROOT(root)) != NULL) {
+		struct tup_entry *tent = tt->tent;
+		tupid_t tupid = tent->tnode.tupid;
+
+		tent_tree_rm(root, tt);
+		if(tupid_tree_search(&full_root, tupid) != NULL) {
+			if(tup_del_id_force(tupid, type) < 0)
+				return -1;
+		} else {
+			if(tup_entry_rm(tupid) < 0)
+				return -1;
+		}
+	}
+	root->count = 0;
+	free_tupid_tree(&full_root);
+	return 0;
+}
+
+int tup_db_gc(void)
+{
+	struct tent_entries root = TENT_ENTRIES_INITIALIZER;
+	int types[] = {TUP_NODE_GHOST, TUP_NODE_GROUP, TUP_NODE_GENERATED_DIR};
+	unsigned int x;
+	struct tent_tree *tt;
+
+	for(x=0; x<ARRAY_SIZE(types); x++) {
+		if(tup_db_type_to_tree(&root, types[x]) < 0)
+			return -1;
+		RB_FOREACH(tt, tent_entries, &root) {
+			if(tent_tree_add_dup(&ghost_root, tt->tent) < 0)
+				return -1;
+		}
+		free_tent_tree(&root);
+	}
+
+	ghosts_reclaimed = 0;
+	reclaim_forced = 1;
+	if(reclaim_ghosts() < 0)
+		return -1;
+	reclaim_forced = 0;
+	return ghosts_reclaimed;
+}
+
+int tup_db_reparse_all(void)
+{
+	char sql_parse_all[] = "insert or replace into create_list select id from node where type=2";
+	char *errmsg;
+
+	if(sqlite3_exec(tup_db, sql_parse_all, NULL, NULL, &errmsg) != 0) {
+		fprintf(stderr, "SQL error: %s\nQuery was: %s\n",
+			errmsg, sql_parse_all);
+		return -1;
+	}
+	return 0;
+}
+
+/* A snapshot is a copy of the database that can be imported into another
+ * checkout of the same project ('tup snapshot'), so the checkout doesn't
+ * have to parse every Tupfile again. Everything in the database is relative
+ * to the top of the tup hierarchy except for the mtimes, which don't survive
+ * a checkout. Instead, the export hashes the contents of each file, and the
+ * import gives each file with the same contents its new mtime so that the
+ * scan only sees the files that are actually different.
+ */
+static int snapshot_prepare(sqlite3_stmt **stmt, const char *s)
+{
+	if(sqlite3_prepare_v2(tup_db, s, -1, stmt, NULL) != 0) {
+		fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	return 0;
+}
+
+static int snapshot_step(sqlite3_stmt *stmt, const char *s)
+{
+	int rc;
+
+	rc = sqlite3_step(stmt);
+	if(rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	return rc;
+}
+
+/* Runs a statement that takes the snapshot filename as its only parameter.
+ * The snapshot database is attached under a different schema name during
+ * the export and import, so these are never kept in stmts[].
+ */
+static int snapshot_exec(const char *s, const char *filename)
+{
+	sqlite3_stmt *stmt;
+	int rc = -1;
+
+	if(snapshot_prepare(&stmt, s) < 0)
+		return -1;
+	if(filename && sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		goto out;
+	}
+	if(snapshot_step(stmt, s) < 0)
+		goto out;
+	rc = 0;
+out:
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+/* Hashes a file (relative to the top of the tup hierarchy) with FNV-1a.
+ * Returns 1 if the file doesn't exist.
+ */
+static int snapshot_hash(const char *path, sqlite3_int64 *hash, time_t *mtime)
+{
+	char buf[65536];
+	struct stat st;
+	uint64_t h = 14695981039346656037ULL;
+	int fd;
+	int rc;
+
+	fd = openat(tup_top_fd(), path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		if(errno == ENOENT || errno == ENOTDIR)
+			return 1;
+		perror(path);
+		return -1;
+	}
+	if(fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	*mtime = MTIME(st);
+	while((rc = read(fd, buf, sizeof(buf))) > 0) {
+		int x;
+		for(x=0; x<rc; x++) {
+			h ^= (unsigned char)buf[x];
+			h *= 1099511628211ULL;
+		}
+	}
+	if(rc < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	*hash = (sqlite3_int64)h;
+	return 0;
+}
+
+static int snapshot_export_files(int *num_files)
+{
+	sqlite3_stmt *select_stmt;
+	sqlite3_stmt *insert_stmt;
+	static char s1[] = "with recursive path(id, type, mtime, p) as (select id, type, mtime, name from node where dir=? and id not in (?, ?, ?) union all select node.id, node.type, node.mtime, path.p || '/' || node.name from node, path where node.dir=path.id and path.type in (?, ?)) select id, mtime, p from path where type in (?, ?)";
+	static char s2[] = "insert into snapshot.snapshot_file values(?, ?, ?)";
+	int rc = -1;
+	int dbrc;
+
+	if(snapshot_prepare(&select_stmt, s1) < 0)
+		return -1;
+	if(snapshot_prepare(&insert_stmt, s2) < 0) {
+		sqlite3_finalize(select_stmt);
+		return -1;
+	}
+	if(sqlite3_bind_int64(select_stmt, 1, DOT_DT) != 0 ||
+	   sqlite3_bind_int64(select_stmt, 2, local_env_dt) != 0 ||
+	   sqlite3_bind_int64(select_stmt, 3, local_slash_dt) != 0 ||
+	   sqlite3_bind_int64(select_stmt, 4, local_exclusion_dt) != 0 ||
+	   sqlite3_bind_int(select_stmt, 5, TUP_NODE_DIR) != 0 ||
+	   sqlite3_bind_int(select_stmt, 6, TUP_NODE_GENERATED_DIR) != 0 ||
+	   sqlite3_bind_int(select_stmt, 7, TUP_NODE_FILE) != 0 ||
+	   sqlite3_bind_int(select_stmt, 8, TUP_NODE_GENERATED) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s1);
+		goto out;
+	}
+
+	while((dbrc = snapshot_step(select_stmt, s1)) == SQLITE_ROW) {
+		tupid_t tupid = sqlite3_column_int64(select_stmt, 0);
+		time_t dbmtime = sqlite3_column_int64(select_stmt, 1);
+		const char *path = (const char*)sqlite3_column_text(select_stmt, 2);
+		sqlite3_int64 hash;
+		time_t mtime;
+		int hrc;
+
+		hrc = snapshot_hash(path, &hash, &mtime);
+		if(hrc < 0)
+			goto out;
+		if(hrc == 1)
+			continue;
+		if(sqlite3_bind_int64(insert_stmt, 1, tupid) != 0 ||
+		   sqlite3_bind_text(insert_stmt, 2, path, -1, SQLITE_TRANSIENT) != 0) {
+			fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s2);
+			goto out;
+		}
+		/* A file that changed since the last scan doesn't match what
+		 * the database says about it, so it is left without a hash
+		 * and is always treated as modified after an import.
+		 */
+		if(mtime == dbmtime) {
+			if(sqlite3_bind_int64(insert_stmt, 3, hash) != 0) {
+				fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+				goto out;
+			}
+		} else {
+			if(sqlite3_bind_null(insert_stmt, 3) != 0) {
+				fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+				goto out;
+			}
+		}
+		if(snapshot_step(insert_stmt, s2) < 0)
+			goto out;
+		if(sqlite3_reset(insert_stmt) != 0) {
+			fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+			goto out;
+		}
+		(*num_files)++;
+	}
+	if(dbrc == SQLITE_DONE)
+		rc = 0;
+out:
+	sqlite3_finalize(select_stmt);
+	sqlite3_finalize(insert_stmt);
+	return rc;
+}
+
+static int snapshot_export_vardicts(void)
+{
+	struct flist f = FLIST_INITIALIZER;
+	sqlite3_stmt *stmt;
+	static char s[] = "insert into snapshot.snapshot_vardict values(?, ?)";
+	int rc = 0;
+
+	if(snapshot_prepare(&stmt, s) < 0)
+		return -1;
+	if(fchdir(tup_top_fd()) < 0) {
+		perror("fchdir");
+		goto err_out;
+	}
+	if(chdir(TUP_DIR) < 0) {
+		perror(TUP_DIR);
+		goto err_out;
+	}
+	flist_foreach(&f, ".") {
+		struct buf b;
+		int fd;
+
+		if(rc < 0 || strncmp(f.filename, "vardict", 7) != 0)
+			continue;
+		fd = open(f.filename, O_RDONLY | O_CLOEXEC);
+		if(fd < 0) {
+			perror(f.filename);
+			rc = -1;
+			continue;
+		}
+		if(fslurp(fd, &b) < 0) {
+			close(fd);
+			rc = -1;
+			continue;
+		}
+		close(fd);
+		if(sqlite3_bind_text(stmt, 1, f.filename, -1, SQLITE_TRANSIENT) != 0 ||
+		   sqlite3_bind_blob(stmt, 2, b.s, b.len, SQLITE_TRANSIENT) != 0) {
+			fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+			rc = -1;
+		} else if(snapshot_step(stmt, s) < 0) {
+			rc = -1;
+		}
+		sqlite3_reset(stmt);
+		free(b.s);
+	}
+	if(fchdir(tup_top_fd()) < 0) {
+		perror("fchdir");
+		goto err_out;
+	}
+	sqlite3_finalize(stmt);
+	return rc;
+
+err_out:
+	sqlite3_finalize(stmt);
+	return -1;
+}
+
+int tup_db_snapshot_export(const char *filename)
+{
+	int num_files = 0;
+
+	if(unlink(filename) < 0 && errno != ENOENT) {
+		perror(filename);
+		fprintf(stderr, "tup error: Unable to remove the old snapshot.\n");
+		return -1;
+	}
+	if(snapshot_exec("vacuum into ?", filename) < 0)
+		return -1;
+	if(snapshot_exec("attach database ? as snapshot", filename) < 0)
+		return -1;
+	if(tup_db_begin() < 0)
+		return -1;
+	if(snapshot_exec("create table snapshot.snapshot_file (id integer primary key not null, path varchar(4096) not null, hash integer)", NULL) < 0)
+		goto err_rollback;
+	if(snapshot_exec("create table snapshot.snapshot_vardict (name varchar(256) primary key not null, data blob not null)", NULL) < 0)
+		goto err_rollback;
+	if(snapshot_export_files(&num_files) < 0)
+		goto err_rollback;
+	if(snapshot_export_vardicts() < 0)
+		goto err_rollback;
+	if(tup_db_commit() < 0)
+		return -1;
+	if(snapshot_exec("detach database snapshot", NULL) < 0)
+		return -1;
+	printf("tup: Exported a snapshot with %i files to '%s'.\n", num_files, filename);
+	return 0;
+
+err_rollback:
+	tup_db_rollback();
+	snapshot_exec("detach database snapshot", NULL);
+	unlink(filename);
+	return -1;
+}
+
+static int snapshot_check_version(sqlite3 *snap, const char *filename,
+				  const char *name, int expected)
+{
+	sqlite3_stmt *stmt;
+	static char s[] = "select rval from config where lval=?";
+	int version = -1;
+
+	if(sqlite3_prepare_v2(snap, s, -1, &stmt, NULL) != 0) {
+		fprintf(stderr, "tup error: '%s' is not a tup snapshot: %s\n", filename, sqlite3_errmsg(snap));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	if(sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	if(version != expected) {
+		fprintf(stderr, "tup error: Snapshot '%s' has %s %i, but this version of tup uses %i. Export a new snapshot with this version of tup.\n", filename, name, version, expected);
+		return -1;
+	}
+	return 0;
+}
+
+static int snapshot_import_files(int *num_same, int *num_changed)
+{
+	sqlite3_stmt *select_stmt;
+	sqlite3_stmt *update_stmt;
+	static char s1[] = "select id, path, hash from snapshot_file";
+	static char s2[] = "update node set mtime=? where id=?";
+	int rc = -1;
+	int dbrc;
+
+	if(snapshot_prepare(&select_stmt, s1) < 0)
+		return -1;
+	if(snapshot_prepare(&update_stmt, s2) < 0) {
+		sqlite3_finalize(select_stmt);
+		return -1;
+	}
+	while((dbrc = snapshot_step(select_stmt, s1)) == SQLITE_ROW) {
+		tupid_t tupid = sqlite3_column_int64(select_stmt, 0);
+		const char *path = (const char*)sqlite3_column_text(select_stmt, 1);
+		sqlite3_int64 hash;
+		time_t mtime = -1;
+		int hrc;
+
+		hrc = snapshot_hash(path, &hash, &mtime);
+		if(hrc < 0)
+			goto out;
+		if(hrc == 1) {
+			/* Missing files are handled by the scan. */
+			(*num_changed)++;
+			continue;
+		}
+		if(sqlite3_column_type(select_stmt, 2) == SQLITE_NULL ||
+		   sqlite3_column_int64(select_stmt, 2) != hash) {
+			/* No file has an mtime of -1, so the scan will see
+			 * it as modified.
+			 */
+			mtime = -1;
+			(*num_changed)++;
+		} else {
+			(*num_same)++;
+		}
+		if(sqlite3_bind_int64(update_stmt, 1, mtime) != 0 ||
+		   sqlite3_bind_int64(update_stmt, 2, tupid) != 0) {
+			fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s2);
+			goto out;
+		}
+		if(snapshot_step(update_stmt, s2) < 0)
+			goto out;
+		if(sqlite3_reset(update_stmt) != 0) {
+			fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+			goto out;
+		}
+	}
+	if(dbrc == SQLITE_DONE)
+		rc = 0;
+out:
+	sqlite3_finalize(select_stmt);
+	sqlite3_finalize(update_stmt);
+	return rc;
+}
+
+static int snapshot_import_vardicts(void)
+{
+	sqlite3_stmt *stmt;
+	static char s[] = "select name, data from snapshot_vardict";
+	int rc = -1;
+	int dbrc;
+
+	if(snapshot_prepare(&stmt, s) < 0)
+		return -1;
+	while((dbrc = snapshot_step(stmt, s)) == SQLITE_ROW) {
+		const char *name = (const char*)sqlite3_column_text(stmt, 0);
+		const void *data = sqlite3_column_blob(stmt, 1);
+		int len = sqlite3_column_bytes(stmt, 1);
+		char path[PATH_MAX];
+		int fd;
+
+		if(strchr(name, '/') != NULL || strncmp(name, "vardict", 7) != 0) {
+			fprintf(stderr, "tup error: Invalid vardict name in snapshot: '%s'\n", name);
+			goto out;
+		}
+		snprintf(path, sizeof(path), TUP_DIR "/%s", name);
+		fd = openat(tup_top_fd(), path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if(fd < 0) {
+			perror(path);
+			goto out;
+		}
+		if(write(fd, data, len) != len) {
+			perror(path);
+			close(fd);
+			goto out;
+		}
+		if(close(fd) < 0) {
+			perror(path);
+			goto out;
+		}
+	}
+	if(dbrc == SQLITE_DONE)
+		rc = 0;
+out:
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+/* Variant directories are normally made by tup, so they won't be in the new
+ * checkout. Creating them here keeps the scan from treating them as deleted,
+ * which would re-parse them.
+ */
+static int snapshot_import_dirs(void)
+{
+	sqlite3_stmt *stmt;
+	static char s[] = "with recursive path(id, srcid, p) as (select id, srcid, name from node where dir=? and type=? and name not in ('$', '/', '^') union all select node.id, node.srcid, path.p || '/' || node.name from node, path where node.dir=path.id and node.type=?) select p from path where srcid!=-1 order by length(p)";
+	int rc = -1;
+	int dbrc;
+
+	if(snapshot_prepare(&stmt, s) < 0)
+		return -1;
+	if(sqlite3_bind_int64(stmt, 1, DOT_DT) != 0 ||
+	   sqlite3_bind_int(stmt, 2, TUP_NODE_DIR) != 0 ||
+	   sqlite3_bind_int(stmt, 3, TUP_NODE_DIR) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		goto out;
+	}
+	while((dbrc = snapshot_step(stmt, s)) == SQLITE_ROW) {
+		const char *path = (const char*)sqlite3_column_text(stmt, 0);
+
+		if(mkdirat(tup_top_fd(), path, 0777) < 0 && errno != EEXIST) {
+			perror(path);
+			fprintf(stderr, "tup error: Unable to create variant directory from the snapshot.\n");
+			goto out;
+		}
+	}
+	if(dbrc == SQLITE_DONE)
+		rc = 0;
+out:
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+static int snapshot_count_cmds(int *num_cmds)
+{
+	sqlite3_stmt *stmt;
+	static char s[] = "select count(*) from node where type=?";
+	int rc = -1;
+
+	if(snapshot_prepare(&stmt, s) < 0)
+		return -1;
+	if(sqlite3_bind_int(stmt, 1, TUP_NODE_CMD) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		goto out;
+	}
+	if(snapshot_step(stmt, s) != SQLITE_ROW)
+		goto out;
+	*num_cmds = sqlite3_column_int(stmt, 0);
+	rc = 0;
+out:
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+int tup_db_snapshot_import(const char *filename)
+{
+	sqlite3 *snap;
+	sqlite3_backup *backup;
+	struct stat st;
+	int num_same = 0;
+	int num_changed = 0;
+	int num_cmds = 0;
+	int rc;
+
+	if(stat(filename, &st) < 0) {
+		perror(filename);
+		fprintf(stderr, "tup error: Unable to open the snapshot.\n");
+		return -1;
+	}
+	if(snapshot_count_cmds(&num_cmds) < 0)
+		return -1;
+	if(num_cmds) {
+		fprintf(stderr, "tup error: A snapshot can only be imported into a new tup database, but this one already has %i commands. Run 'tup init' in a fresh checkout instead.\n", num_cmds);
+		return -1;
+	}
+	if(sqlite3_open_v2(filename, &snap, SQLITE_OPEN_READONLY, NULL) != 0) {
+		fprintf(stderr, "tup error: Unable to open snapshot '%s': %s\n", filename, sqlite3_errmsg(snap));
+		sqlite3_close(snap);
+		return -1;
+	}
+	if(snapshot_check_version(snap, filename, "db_version", DB_VERSION) < 0 ||
+	   snapshot_check_version(snap, filename, "parser_version", PARSER_VERSION) < 0) {
+		sqlite3_close(snap);
+		return -1;
+	}
+
+	backup = sqlite3_backup_init(tup_db, "main", snap, "main");
+	if(!backup) {
+		fprintf(stderr, "tup error: Unable to import snapshot '%s': %s\n", filename, sqlite3_errmsg(tup_db));
+		sqlite3_close(snap);
+		return -1;
+	}
+	rc = sqlite3_backup_step(backup, -1);
+	sqlite3_backup_finish(backup);
+	sqlite3_close(snap);
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "tup error: Unable to import snapshot '%s': %s\n", filename, sqlite3_errstr(rc));
+		return -1;
+	}
+
+	/* The database now has the snapshot's nodes, so anything cached from
+	 * the old one is stale. The process exits after the import, and only
+	 * plain SQL is used from here on.
+	 */
+	if(tup_db_begin() < 0)
+		return -1;
+	if(snapshot_import_files(&num_same, &num_changed) < 0)
+		goto err_rollback;
+	if(snapshot_import_vardicts() < 0)
+		goto err_rollback;
+	if(snapshot_import_dirs() < 0)
+		goto err_rollback;
+	if(snapshot_exec("drop table snapshot_file", NULL) < 0)
+		goto err_rollback;
+	if(snapshot_exec("drop table snapshot_vardict", NULL) < 0)
+		goto err_rollback;
+	/* The snapshot's link_generation says nothing about the link cache
+	 * built from the old database, which could look current to the next
+	 * reader, so it has to be rebuilt.
+	 */
+	close_link_cache();
+	if(unlinkat(tup_top_fd(), TUP_LINKCACHE_FILE, 0) < 0 && errno != ENOENT) {
+		perror(TUP_LINKCACHE_FILE);
+		fprintf(stderr, "tup error: Unable to remove the link cache.\n");
+		goto err_rollback;
+	}
+	if(tup_db_commit() < 0)
+		return -1;
+	printf("tup: Imported snapshot '%s': %i files unchanged, %i changed or missing.\n", filename, num_same, num_changed);
+	return 0;
+
+err_rollback:
+	tup_db_rollback();
+	return -1;
+}
+
 int tup_db_get_vardb(struct tup_entry *dtent, struct vardb *vdb)
 {
 	int rc = -1;
@@ -7423,7 +10080,7 @@ int tup_db_get_vardb(struct tup_entry *dtent, struct vardb *vdb)
 	} while(1);
 
 out_reset:
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -7534,7 +10191,7 @@ static int var_flag_dirs(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -7571,7 +10228,7 @@ static int delete_var_entry(tupid_t tupid)
 	}
 
 	rc = sqlite3_step(*stmt);
-	if(msqlite3_reset(*stmt) != 0) {
+	if(msqlite3_reset(stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
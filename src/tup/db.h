@@ -40,6 +40,7 @@ struct vardb;
 struct tent_entries;
 struct tupid_list_head;
 struct tent_list_head;
+struct estring;
 
 /* General operations */
 int tup_db_open(void);
@@ -47,11 +48,14 @@ int tup_db_close(void);
 int tup_db_create(int db_sync, int memory_db);
 int tup_db_begin(void);
 int tup_db_commit(void);
+int tup_db_checkpoint(void);
 int tup_db_changes(void);
 int tup_db_rollback(void);
 int tup_db_check_flags(int flags);
 void tup_db_enable_sql_debug(void);
+void tup_db_enable_sql_profile(const char *filename);
 int tup_db_debug_add_all_ghosts(void);
+int tup_db_gc(void);
 void tup_db_del_ghost_tree(struct tup_entry *tent);
 const char *tup_db_type(enum TUP_NODE_TYPE type);
 
@@ -86,7 +90,17 @@ int tup_db_delete_node(tupid_t tupid);
 int tup_db_delete_dir(tupid_t dt, int force);
 int tup_db_flag_generated_dir(tupid_t dt, int force);
 int tup_db_delete_variant(struct tup_entry *tent, void *arg, int (*callback)(void *, struct tup_entry *));
+/* Creates the directories of a new variant. Only srcdirs with a Tupfile, or
+ * that are covered by a Tupdefault, get a variant directory (and any parents
+ * it needs). Everything else is created on demand by tup_db_variant_subdir().
+ */
 int tup_db_duplicate_directory_structure(struct tup_entry *dest);
+int tup_db_materialize_variant_dirs(struct tup_entry *dest, struct tup_entry *src,
+				    void *arg, int (*callback)(void *, struct tup_entry *));
+int tup_db_variant_dir_needed(struct tup_entry *srctent, int *needed, int *tupdefault);
+struct tup_entry *tup_db_variant_mkdir(struct tup_entry *dest, struct tup_entry *subsrc, int *created);
+int tup_db_variant_subdir(struct tup_entry *dtent, const char *name, int len,
+			  struct tup_entry **entry);
 int tup_db_chdir(tupid_t dt);
 int tup_db_change_node(tupid_t tupid, const char *name, struct tup_entry *new_dtent);
 int tup_db_set_name(tupid_t tupid, const char *new_name, tupid_t new_dt);
@@ -97,11 +111,13 @@ int tup_db_set_mtime(struct tup_entry *tent, time_t mtime);
 int tup_db_set_srcid(struct tup_entry *tent, tupid_t srcid);
 int tup_db_normal_dir_to_generated(struct tup_entry *tent);
 int tup_db_print(FILE *stream, tupid_t tupid);
-int tup_db_write_gitignore(FILE *f, tupid_t dt);
+int tup_db_write_gitignore(struct estring *e, tupid_t dt);
 int tup_db_rebuild_all(void);
 int tup_db_delete_slash(void);
 tupid_t slash_dt(void);
 int tup_db_reparse_all(void);
+int tup_db_snapshot_export(const char *filename);
+int tup_db_snapshot_import(const char *filename);
 int tup_db_get_vardb(struct tup_entry *dtent, struct vardb *vdb);
 int tup_db_get_tup_config_tent(struct tup_entry **tent);
 
@@ -130,6 +146,7 @@ int tup_db_link_exists(tupid_t a, tupid_t b, int style,
 		       int *exists);
 int tup_db_get_incoming_link(struct tup_entry *tent, struct tup_entry **incoming);
 int tup_db_delete_links(tupid_t tupid);
+int tup_db_delete_set(struct tent_entries *root, enum TUP_NODE_TYPE type);
 int tup_db_write_outputs(FILE *f, struct tup_entry *cmdtent,
 			 struct tent_entries *root,
 			 struct tent_entries *exclusion_root,
@@ -145,6 +162,7 @@ int tup_db_write_dir_inputs(FILE *f, tupid_t dt, struct tent_entries *root);
 int tup_db_get_inputs(tupid_t cmdid, struct tent_entries *sticky_root,
 		      struct tent_entries *normal_root,
 		      struct tent_entries *group_sticky_root);
+int tup_db_get_group_members(tupid_t groupid, struct tupid_entries **members);
 int tup_db_get_outputs(tupid_t cmdid, struct tent_entries *output_root,
 		       struct tent_entries *exclusion_root,
 		       struct tup_entry **group);
@@ -154,10 +172,14 @@ int tup_db_modify_cmds_by_output(tupid_t output, int *modified);
 int tup_db_modify_cmds_by_input(tupid_t input);
 int tup_db_set_dependent_flags(tupid_t tupid);
 int tup_db_set_dependent_dir_flags(tupid_t tupid);
+int tup_db_dir_interface_changed(tupid_t dt, struct tent_entries *delete_root);
+int tup_db_clear_dir_interface(tupid_t dt);
 int tup_db_set_srcid_dir_flags(tupid_t tupid);
 int tup_db_set_dependent_config_flags(tupid_t tupid);
 int tup_db_select_node_by_link(int (*callback)(void *, struct tup_entry *),
 			       void *arg, tupid_t tupid);
+int tup_db_is_input(tupid_t dt, const char *name, int *is_input);
+int tup_db_check_group_order(void);
 int tup_db_select_node_by_group_link(int (*callback)(void *, struct tup_entry *, struct tup_entry *),
 				     void *arg, tupid_t tupid);
 int tup_db_select_node_by_distinct_group_link(int (*callback)(void *, struct tup_entry *),
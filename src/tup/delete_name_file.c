@@ -22,9 +22,30 @@
 #include "fileio.h"
 #include "db.h"
 #include "entry.h"
+#include "tent_tree.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+
+/* Most files that an unlink thread handles with one directory open. */
+#define DELETE_FILES_PER_JOB 64
+
+struct delete_item {
+	struct tup_entry *tent;
+	int err;
+};
+
+struct delete_work {
+	struct delete_item *items;
+	int num;
+	int next;
+	int rc;
+	void (*deleted)(struct tup_entry *tent, int err);
+	pthread_mutex_t lock;
+};
 
 int delete_name_file(tupid_t tupid)
 {
@@ -78,3 +99,153 @@ out:
 	}
 	return rc;
 }
+
+static int delete_item_cmp(const void *a, const void *b)
+{
+	const struct delete_item *da = a;
+	const struct delete_item *db = b;
+	tupid_t pa = da->tent->parent->tnode.tupid;
+	tupid_t pb = db->tent->parent->tnode.tupid;
+
+	if(pa != pb)
+		return pa < pb ? -1 : 1;
+	return strcmp(da->tent->name.s, db->tent->name.s);
+}
+
+/* Each thread takes a run of up to DELETE_FILES_PER_JOB files in the same
+ * directory, so only one directory is open per thread no matter how many
+ * directories there are (t5120). The files are reported as soon as the run is
+ * done.
+ */
+static void *delete_worker(void *arg)
+{
+	struct delete_work *work = arg;
+
+	while(1) {
+		struct tup_entry *parent;
+		int start;
+		int end;
+		int dfd;
+		int x;
+
+		pthread_mutex_lock(&work->lock);
+		if(work->next >= work->num || work->rc < 0) {
+			pthread_mutex_unlock(&work->lock);
+			break;
+		}
+		start = work->next;
+		parent = work->items[start].tent->parent;
+		for(end=start+1; end<work->num && end-start<DELETE_FILES_PER_JOB; end++) {
+			if(work->items[end].tent->parent != parent)
+				break;
+		}
+		work->next = end;
+		pthread_mutex_unlock(&work->lock);
+
+		dfd = tup_entry_open(parent);
+		if(dfd < 0 && dfd != -ENOENT) {
+			pthread_mutex_lock(&work->lock);
+			work->rc = -1;
+			pthread_mutex_unlock(&work->lock);
+			break;
+		}
+		/* If the directory doesn't exist, the files can't either. */
+		if(dfd >= 0) {
+			for(x=start; x<end; x++) {
+				struct delete_item *item = &work->items[x];
+
+				if(unlinkat(dfd, item->tent->name.s, 0) < 0) {
+					if(errno != ENOENT && errno != ENAMETOOLONG)
+						item->err = errno;
+				}
+			}
+			if(close(dfd) < 0) {
+				perror("close(dirfd)");
+				work->items[start].err = errno;
+			}
+		}
+
+		pthread_mutex_lock(&work->lock);
+		for(x=start; x<end; x++) {
+			struct delete_item *item = &work->items[x];
+
+			if(item->err) {
+				fprintf(stderr, "%s: %s\n", item->tent->name.s, strerror(item->err));
+				work->rc = -1;
+			}
+			if(work->deleted)
+				work->deleted(item->tent, item->err);
+		}
+		pthread_mutex_unlock(&work->lock);
+	}
+	return NULL;
+}
+
+int delete_file_set(struct tent_entries *root, int jobs,
+		    void (*deleted)(struct tup_entry *tent, int err))
+{
+	struct delete_work work;
+	struct tent_tree *tt;
+	pthread_t *pids = NULL;
+	int num_threads;
+	int started = 0;
+	int x;
+
+	/* Same as calling delete_file() on every entry in the tree, except
+	 * that each directory is only opened once per run of files, and the
+	 * runs are split across up to 'jobs' threads. The 'deleted' callback
+	 * is called for each file once it is gone, serialized with the other
+	 * threads.
+	 */
+	work.num = 0;
+	RB_FOREACH(tt, tent_entries, root) {
+		work.num++;
+	}
+	if(work.num == 0)
+		return 0;
+	work.items = malloc(sizeof(*work.items) * work.num);
+	if(!work.items) {
+		perror("malloc");
+		return -1;
+	}
+	work.num = 0;
+	work.next = 0;
+	work.rc = 0;
+	work.deleted = deleted;
+	RB_FOREACH(tt, tent_entries, root) {
+		work.items[work.num].tent = tt->tent;
+		work.items[work.num].err = 0;
+		work.num++;
+	}
+	qsort(work.items, work.num, sizeof(*work.items), delete_item_cmp);
+
+	num_threads = (work.num + DELETE_FILES_PER_JOB - 1) / DELETE_FILES_PER_JOB;
+	if(num_threads > jobs)
+		num_threads = jobs;
+	pthread_mutex_init(&work.lock, NULL);
+	if(num_threads <= 1) {
+		delete_worker(&work);
+	} else {
+		/* This thread counts as one of the jobs. */
+		num_threads--;
+		pids = malloc(sizeof(*pids) * num_threads);
+		if(!pids) {
+			perror("malloc");
+			num_threads = 0;
+		}
+		for(started=0; started<num_threads; started++) {
+			if(pthread_create(&pids[started], NULL, delete_worker, &work) != 0) {
+				perror("pthread_create");
+				break;
+			}
+		}
+		delete_worker(&work);
+		for(x=0; x<started; x++) {
+			pthread_join(pids[x], NULL);
+		}
+		free(pids);
+	}
+	pthread_mutex_destroy(&work.lock);
+	free(work.items);
+	return work.rc;
+}
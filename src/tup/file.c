@@ -27,6 +27,7 @@
 #include "config.h"
 #include "entry.h"
 #include "option.h"
+#include "fsbatch.h"
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
@@ -67,6 +68,7 @@ int init_file_info(struct file_info *info, int do_unlink)
 	info->server_fail = 0;
 	info->open_count = 0;
 	info->do_unlink = do_unlink;
+	info->num_events = 0;
 	return 0;
 }
 
@@ -199,6 +201,7 @@ int handle_open_file(enum access_type at, const char *filename,
 	struct file_entry *fent;
 	int rc = 0;
 
+	info->num_events++;
 	fent = new_entry(filename);
 	if(!fent) {
 		return -1;
@@ -406,7 +409,7 @@ static unsigned filetime_to_epoch(FILETIME *ft)
         return (unsigned)(ticks / WINDOWS_TICK - SEC_TO_UNIX_EPOCH);
 }
 
-static int file_set_mtime(struct tup_entry *tent, const char *file)
+static int file_set_mtime(struct tup_entry *tent, const char *file, struct fsbatch_op *op)
 {
 	WIN32_FILE_ATTRIBUTE_DATA data;
 	wchar_t widefile[WIDE_PATH_MAX];
@@ -415,6 +418,7 @@ static int file_set_mtime(struct tup_entry *tent, const char *file)
 	wchar_t *dest;
 	wchar_t *tmp;
 
+	if(op) {}
 	dest = widefile;
 	/* Everything from the DLL injection is a full path, but we need to
 	 * prefix with \\?\ make GetFileAttributesEx work with >260 character
@@ -440,24 +444,98 @@ static int file_set_mtime(struct tup_entry *tent, const char *file)
 	return 0;
 }
 #else
-static int file_set_mtime(struct tup_entry *tent, const char *file)
+/* The stat of the file was already issued as part of a batch, so this just
+ * checks the result in op.
+ */
+static int file_set_mtime(struct tup_entry *tent, const char *file, struct fsbatch_op *op)
 {
-	struct stat buf;
-	if(fstatat(tup_top_fd(), file, &buf, AT_SYMLINK_NOFOLLOW) < 0) {
+	if(op->res < 0) {
 		fprintf(stderr, "tup error: file_set_mtime() fstatat failed.\n");
+		errno = -op->res;
 		perror(file);
 		return -1;
 	}
-	if(S_ISFIFO(buf.st_mode)) {
+	if(S_ISFIFO(op->st->st_mode)) {
 		fprintf(stderr, "tup error: Unable to create a FIFO as an output file. They can only be used as temporary files.\n");
 		return -1;
 	}
-	if(tup_db_set_mtime(tent, MTIME(buf)) < 0)
+	if(tup_db_set_mtime(tent, MTIME((*op->st))) < 0)
 		return -1;
 	return 0;
 }
 #endif
 
+static int move_outputs(FILE *f, struct mapping_head *head, int *write_bork)
+{
+	struct fsbatch b = FSBATCH_INITIALIZER;
+	struct mapping *map;
+	struct stat *stats = NULL;
+	int num = 0;
+	int rc = -1;
+	int x;
+
+	/* Rename all of the temporary files into place as one batch, and then
+	 * stat the final files as a second batch.
+	 */
+	TAILQ_FOREACH(map, head, list) {
+		/* TODO: strcmp only here for win32 support */
+		if(strcmp(map->tmpname, map->realname) != 0) {
+			if(fsbatch_renameat(&b, tup_top_fd(), map->tmpname, tup_top_fd(), map->realname) < 0)
+				goto out_free;
+		}
+		if(map->tent)
+			num++;
+	}
+	fsbatch_run(&b);
+	for(x=0; x<b.num; x++) {
+		if(b.ops[x].res < 0) {
+			errno = -b.ops[x].res;
+			perror(b.ops[x].newname);
+			fprintf(f, "tup error: Unable to rename temporary file '%s' to destination '%s'\n", b.ops[x].name, b.ops[x].newname);
+			*write_bork = 1;
+		}
+	}
+	fsbatch_clear(&b);
+
+#ifndef _WIN32
+	if(num) {
+		stats = malloc(sizeof(*stats) * num);
+		if(!stats) {
+			perror("malloc");
+			goto out_free;
+		}
+	}
+	x = 0;
+	TAILQ_FOREACH(map, head, list) {
+		if(map->tent) {
+			if(fsbatch_fstatat(&b, tup_top_fd(), map->realname, &stats[x]) < 0)
+				goto out_free;
+			x++;
+		}
+	}
+	fsbatch_run(&b);
+#endif
+
+	x = 0;
+	while(!TAILQ_EMPTY(head)) {
+		map = TAILQ_FIRST(head);
+
+		if(map->tent) {
+			/* tent may not be set (in the case of hidden files) */
+			if(file_set_mtime(map->tent, map->realname, x < b.num ? &b.ops[x] : NULL) < 0)
+				goto out_free;
+			x++;
+		}
+		del_map(head, map);
+	}
+	rc = 0;
+
+out_free:
+	free(stats);
+	fsbatch_free(&b);
+	return rc;
+}
+
 static int add_config_files_locked(struct file_info *finfo, struct tup_entry *tent, int full_deps)
 {
 	struct file_entry *r;
@@ -564,6 +642,8 @@ int handle_rename(const char *from, const char *to, struct file_info *info)
 {
 	struct file_entry *fent;
 
+	info->num_events++;
+
 	TAILQ_FOREACH(fent, &info->write_list, list) {
 		if(name_cmp(fent->filename, from) == 0) {
 			free(fent->filename);
@@ -774,26 +854,8 @@ out_skip:
 	if(tup_db_check_actual_outputs(f, cmdid, &root, &info->output_root, &info->mapping_list, &write_bork, info->do_unlink, check_only==CHECK_SUCCESS) < 0)
 		return -1;
 
-	while(!TAILQ_EMPTY(&info->mapping_list)) {
-		struct mapping *map;
-
-		map = TAILQ_FIRST(&info->mapping_list);
-
-		/* TODO: strcmp only here for win32 support */
-		if(strcmp(map->tmpname, map->realname) != 0) {
-			if(renameat(tup_top_fd(), map->tmpname, tup_top_fd(), map->realname) < 0) {
-				perror(map->realname);
-				fprintf(f, "tup error: Unable to rename temporary file '%s' to destination '%s'\n", map->tmpname, map->realname);
-				write_bork = 1;
-			}
-		}
-		if(map->tent) {
-			/* tent may not be set (in the case of hidden files) */
-			if(file_set_mtime(map->tent, map->realname) < 0)
-				return -1;
-		}
-		del_map(&info->mapping_list, map);
-	}
+	if(move_outputs(f, &info->mapping_list, &write_bork) < 0)
+		return -1;
 
 	free_tent_tree(&root);
 	if(write_bork)
@@ -73,6 +73,7 @@ struct file_info {
 	int server_fail;
 	int open_count;
 	int do_unlink;
+	int num_events; /* File accesses reported by the server, for --profile */
 };
 
 enum check_type_t {
@@ -30,6 +30,7 @@ struct tup_entry;
 struct tup_entry_head;
 struct path_element;
 struct pel_group;
+struct tent_entries;
 
 #define EXTERNAL_DIRECTORY_MTIME 0
 
@@ -58,6 +59,8 @@ int get_outside_tup_mtime(struct tup_entry *parent, struct path_element *pel, ti
 int gimme_tent(const char *name, struct tup_entry **entry);
 
 int delete_file(struct tup_entry *tent);
+int delete_file_set(struct tent_entries *root, int jobs,
+		    void (*deleted)(struct tup_entry *tent, int err));
 int delete_name_file(tupid_t tupid);
 
 #endif
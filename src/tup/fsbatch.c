@@ -0,0 +1,484 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#include "fsbatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+/* Unlink and rename need the 5.11 io_uring ABI, so only build the io_uring
+ * path against headers that are at least that new.
+ */
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_NATIVE_WORKERS) && defined(STATX_BASIC_STATS)
+#define FSBATCH_IO_URING
+#endif
+#endif
+
+/* Small batches aren't worth a trip through the ring. */
+#define FSBATCH_MIN_RING_OPS 4
+
+static int io_uring_enabled = 1;
+
+void fsbatch_set_io_uring(int enabled)
+{
+	io_uring_enabled = enabled;
+}
+
+static struct fsbatch_op *fsbatch_add(struct fsbatch *b, int type, int dfd, const char *name)
+{
+	struct fsbatch_op *op;
+
+	if(b->num == b->size) {
+		struct fsbatch_op *tmp;
+		int size = b->size ? b->size * 2 : 32;
+
+		tmp = realloc(b->ops, sizeof(*tmp) * size);
+		if(!tmp) {
+			perror("realloc");
+			return NULL;
+		}
+		b->ops = tmp;
+		b->size = size;
+	}
+	op = &b->ops[b->num];
+	b->num++;
+	op->type = type;
+	op->dfd = dfd;
+	op->name = name;
+	op->newdfd = -1;
+	op->newname = NULL;
+	op->st = NULL;
+	op->res = 0;
+	return op;
+}
+
+int fsbatch_unlinkat(struct fsbatch *b, int dfd, const char *name)
+{
+	if(!fsbatch_add(b, FSBATCH_UNLINK, dfd, name))
+		return -1;
+	return 0;
+}
+
+int fsbatch_renameat(struct fsbatch *b, int olddfd, const char *oldname,
+		     int newdfd, const char *newname)
+{
+	struct fsbatch_op *op;
+
+	op = fsbatch_add(b, FSBATCH_RENAME, olddfd, oldname);
+	if(!op)
+		return -1;
+	op->newdfd = newdfd;
+	op->newname = newname;
+	return 0;
+}
+
+int fsbatch_fstatat(struct fsbatch *b, int dfd, const char *name, struct stat *st)
+{
+	struct fsbatch_op *op;
+
+	op = fsbatch_add(b, FSBATCH_STAT, dfd, name);
+	if(!op)
+		return -1;
+	op->st = st;
+	return 0;
+}
+
+static void run_sync(struct fsbatch_op *op)
+{
+	int rc = 0;
+
+	switch(op->type) {
+		case FSBATCH_UNLINK:
+			rc = unlinkat(op->dfd, op->name, 0);
+			break;
+		case FSBATCH_RENAME:
+			rc = renameat(op->dfd, op->name, op->newdfd, op->newname);
+			break;
+		case FSBATCH_STAT:
+			rc = fstatat(op->dfd, op->name, op->st, AT_SYMLINK_NOFOLLOW);
+			break;
+	}
+	op->res = rc < 0 ? -errno : 0;
+}
+
+#ifdef FSBATCH_IO_URING
+#define RING_ENTRIES 64
+
+struct fsbatch_ring {
+	int fd;
+	unsigned entries;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* statx results, indexed the same as the sqes in flight */
+	struct statx stx[RING_ENTRIES];
+};
+
+/* Each job thread gets its own ring, created the first time it has a batch
+ * big enough to use it. ring_state is 0 if we haven't tried yet, 1 if the ring
+ * is ready, and -1 if io_uring isn't usable here.
+ */
+static _Thread_local struct fsbatch_ring *ring;
+static _Thread_local int ring_state;
+
+static void ring_free(struct fsbatch_ring *r)
+{
+	if(r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if(r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if(r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_len);
+	if(r->fd >= 0)
+		close(r->fd);
+	free(r);
+}
+
+static int ring_supports_ops(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t len = sizeof(*probe) + sizeof(struct io_uring_probe_op) * 256;
+	int rc = 0;
+
+	probe = calloc(1, len);
+	if(!probe)
+		return 0;
+	if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+		if(probe->last_op >= IORING_OP_UNLINKAT &&
+		   (probe->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED) &&
+		   (probe->ops[IORING_OP_RENAMEAT].flags & IO_URING_OP_SUPPORTED) &&
+		   (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED))
+			rc = 1;
+	}
+	free(probe);
+	return rc;
+}
+
+static struct fsbatch_ring *ring_init(void)
+{
+	struct io_uring_params p;
+	struct fsbatch_ring *r;
+
+	r = calloc(1, sizeof *r);
+	if(!r)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if(r->fd < 0) {
+		/* ENOSYS, EPERM (seccomp, or io_uring_disabled), etc. */
+		free(r);
+		return NULL;
+	}
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !ring_supports_ops(r->fd))
+		goto err_free;
+
+	r->entries = p.sq_entries;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(r->cq_len > r->sq_len)
+		r->sq_len = r->cq_len;
+	r->cq_len = r->sq_len;
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		goto err_free;
+	}
+	r->cq_ptr = r->sq_ptr;
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto err_free;
+	}
+
+	r->sq_head = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+	return r;
+
+err_free:
+	ring_free(r);
+	return NULL;
+}
+
+static void prep_sqe(struct fsbatch_ring *r, struct io_uring_sqe *sqe,
+		     struct fsbatch_op *op, unsigned slot)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = slot;
+	sqe->fd = op->dfd;
+	sqe->addr = (unsigned long)op->name;
+	switch(op->type) {
+		case FSBATCH_UNLINK:
+			sqe->opcode = IORING_OP_UNLINKAT;
+			break;
+		case FSBATCH_RENAME:
+			sqe->opcode = IORING_OP_RENAMEAT;
+			sqe->len = op->newdfd;
+			sqe->addr2 = (unsigned long)op->newname;
+			break;
+		case FSBATCH_STAT:
+			sqe->opcode = IORING_OP_STATX;
+			sqe->len = STATX_BASIC_STATS;
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+			sqe->off = (unsigned long)&r->stx[slot];
+			break;
+	}
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_mode = stx->stx_mode;
+	st->st_ino = stx->stx_ino;
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_size = stx->stx_size;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* Collects whatever completions the kernel has posted so far, filling in the
+ * res (and stat buffer) of each finished op and counting it in *done. Ops
+ * that are still in flight keep res == 1.
+ */
+static void ring_reap(struct fsbatch_ring *r, struct fsbatch_op *ops, unsigned *done)
+{
+	unsigned head;
+	unsigned ctail;
+
+	head = *r->cq_head;
+	ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	while(head != ctail) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		struct fsbatch_op *op = &ops[cqe->user_data];
+
+		op->res = cqe->res < 0 ? cqe->res : 0;
+		if(op->type == FSBATCH_STAT && op->res == 0)
+			statx_to_stat(&r->stx[cqe->user_data], op->st);
+		head++;
+		(*done)++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Waits for every op that the kernel took to complete. This is used after a
+ * failure, since the kernel may still write into r->stx for an in-flight
+ * statx, so the ring can't be freed until everything is back. Returns -1 if
+ * the ring can't even be waited on.
+ */
+static int ring_drain(struct fsbatch_ring *r, struct fsbatch_op *ops, unsigned submitted,
+		      unsigned *done)
+{
+	ring_reap(r, ops, done);
+	while(*done < submitted) {
+		long rc;
+
+		rc = syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(rc < 0 && errno != EINTR)
+			return -1;
+		ring_reap(r, ops, done);
+	}
+	return 0;
+}
+
+/* Issues ops[0..num) through the ring. The kernel may take fewer SQEs than
+ * were queued, so the rest are submitted again until they are all in, and we
+ * only wait for completions that are actually in flight. On failure,
+ * *submitted is the number of ops that the kernel took, and the return value
+ * is -1 if all of those have completed, or -2 if some may still be in flight.
+ */
+static int ring_run(struct fsbatch_ring *r, struct fsbatch_op *ops, unsigned num,
+		    unsigned *submitted)
+{
+	unsigned tail;
+	unsigned x;
+	unsigned done = 0;
+
+	*submitted = 0;
+	tail = *r->sq_tail;
+	for(x=0; x<num; x++) {
+		unsigned idx = (tail + x) & *r->sq_mask;
+
+		ops[x].res = 1;
+		prep_sqe(r, &r->sqes[idx], &ops[x], x);
+		r->sq_array[idx] = idx;
+	}
+	__atomic_store_n(r->sq_tail, tail + num, __ATOMIC_RELEASE);
+
+	while(done < num) {
+		long rc;
+
+		if(*submitted < num) {
+			rc = syscall(__NR_io_uring_enter, r->fd, num - *submitted, 0, 0, NULL, 0);
+			if(rc < 0) {
+				if(errno == EINTR)
+					continue;
+				/* Out of resources is only temporary if
+				 * something is still in flight.
+				 */
+				if((errno != EAGAIN && errno != EBUSY) || done == *submitted)
+					goto err_drain;
+			} else {
+				if(rc == 0 && done == *submitted)
+					goto err_drain;
+				*submitted += rc;
+			}
+		}
+		ring_reap(r, ops, &done);
+		if(done == *submitted)
+			continue;
+		rc = syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(rc < 0 && errno != EINTR)
+			goto err_drain;
+		ring_reap(r, ops, &done);
+	}
+	return 0;
+
+err_drain:
+	if(ring_drain(r, ops, *submitted, &done) < 0)
+		return -2;
+	return -1;
+}
+
+static int run_ring(struct fsbatch *b)
+{
+	int x;
+	int rc;
+
+	if(!io_uring_enabled || b->num < FSBATCH_MIN_RING_OPS || ring_state < 0)
+		return -1;
+	if(ring_state == 0) {
+		ring = ring_init();
+		ring_state = ring ? 1 : -1;
+		if(!ring)
+			return -1;
+	}
+
+	for(x=0; x<b->num; x+=ring->entries) {
+		unsigned num = b->num - x;
+		unsigned submitted;
+
+		if(num > ring->entries)
+			num = ring->entries;
+		rc = ring_run(ring, &b->ops[x], num, &submitted);
+		if(rc < 0) {
+			int y;
+
+			/* Something is wrong with the ring, so don't use it
+			 * again. If ops are still in flight, the kernel may
+			 * yet write to the ring's memory, so it is leaked
+			 * rather than freed. Ops that the kernel took but
+			 * didn't complete may or may not have happened, so
+			 * they can't just be run again and are reported as
+			 * failed. Everything that the kernel never took is
+			 * finished with syscalls.
+			 */
+			if(rc == -2)
+				ring = NULL;
+			fsbatch_thread_exit();
+			ring_state = -1;
+			for(y=x; y<b->num; y++) {
+				if(y >= x + (int)submitted)
+					run_sync(&b->ops[y]);
+				else if(b->ops[y].res == 1)
+					b->ops[y].res = -EIO;
+			}
+			return 0;
+		}
+	}
+	return 0;
+}
+
+void fsbatch_thread_exit(void)
+{
+	if(ring) {
+		ring_free(ring);
+		ring = NULL;
+	}
+	ring_state = 0;
+}
+#else
+static int run_ring(struct fsbatch *b)
+{
+	if(b) {}
+	return -1;
+}
+
+void fsbatch_thread_exit(void)
+{
+}
+#endif
+
+void fsbatch_run(struct fsbatch *b)
+{
+	int x;
+
+	if(run_ring(b) == 0)
+		return;
+	for(x=0; x<b->num; x++)
+		run_sync(&b->ops[x]);
+}
+
+void fsbatch_clear(struct fsbatch *b)
+{
+	b->num = 0;
+}
+
+void fsbatch_free(struct fsbatch *b)
+{
+	free(b->ops);
+	b->ops = NULL;
+	b->num = 0;
+	b->size = 0;
+}
@@ -0,0 +1,79 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef tup_fsbatch_h
+#define tup_fsbatch_h
+
+#include <sys/stat.h>
+
+/* A batch of independent filesystem operations. The operations are queued
+ * with the fsbatch_* calls and then all issued by fsbatch_run(), which uses
+ * io_uring where the kernel supports it and plain syscalls otherwise. There
+ * is no ordering between the operations in a batch, so anything that depends
+ * on an earlier operation (eg: stat after rename) goes in a later batch.
+ */
+enum {
+	FSBATCH_UNLINK,
+	FSBATCH_RENAME,
+	FSBATCH_STAT,
+};
+
+struct fsbatch_op {
+	int type;
+	int dfd;
+	const char *name;
+	int newdfd;
+	const char *newname;
+	struct stat *st;
+	/* Set by fsbatch_run(): 0 on success, or -errno. */
+	int res;
+};
+
+struct fsbatch {
+	struct fsbatch_op *ops;
+	int num;
+	int size;
+};
+
+#define FSBATCH_INITIALIZER {NULL, 0, 0}
+
+/* Enable or disable io_uring for this process (updater.io_uring). */
+void fsbatch_set_io_uring(int enabled);
+
+int fsbatch_unlinkat(struct fsbatch *b, int dfd, const char *name);
+int fsbatch_renameat(struct fsbatch *b, int olddfd, const char *oldname,
+		     int newdfd, const char *newname);
+/* Like fstatat() with AT_SYMLINK_NOFOLLOW. Only the type and permission bits,
+ * inode, device, size and times are filled in.
+ */
+int fsbatch_fstatat(struct fsbatch *b, int dfd, const char *name, struct stat *st);
+
+/* Issues every queued operation. Failures of individual operations are
+ * reported in ops[x].res, which stays valid until fsbatch_clear().
+ */
+void fsbatch_run(struct fsbatch *b);
+void fsbatch_clear(struct fsbatch *b);
+void fsbatch_free(struct fsbatch *b);
+
+/* Releases the calling thread's io_uring instance, if it has one. */
+void fsbatch_thread_exit(void);
+
+#endif
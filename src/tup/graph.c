@@ -28,6 +28,7 @@
 #include "container.h"
 #include "compat.h"
 #include "tent_list.h"
+#include "profile.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -70,8 +71,10 @@ struct node *create_node(struct graph *g, struct tup_entry *tent)
 	n->marked = 0;
 	n->skip = 1;
 	n->counted = 0;
+	n->prefetched = 0;
 	if(node_insert_tail(&g->node_list, n) < 0)
 		return NULL;
+	profile_count(PROFILE_NODES, 1);
 
 	/* The transient field in struct node is used for determining when to
 	 * remove a transient file from the filesystem. It doesn't correspond
@@ -164,6 +167,7 @@ int create_edge(struct node *n1, struct node *n2, int style)
 
 	LIST_INSERT_HEAD(&n1->edges, e, list);
 	LIST_INSERT_HEAD(&n2->incoming, e, destlist);
+	profile_count(PROFILE_EDGES, 1);
 
 	return 0;
 }
@@ -208,6 +212,7 @@ static int create_edge_sorted(struct node *n1, struct node *n2, int style)
 	} else {
 		LIST_INSERT_HEAD(&n2->incoming, e, destlist);
 	}
+	profile_count(PROFILE_EDGES, 1);
 
 	return 0;
 }
@@ -670,12 +675,330 @@ static int add_file_cb(void *arg, struct tup_entry *tent)
 	return 0;
 }
 
+/* Cache of the nodes reachable from each source passed to
+ * nodes_are_connected() while it is enabled (ie: during the update phase).
+ * Each entry is the sorted set of tupids downstream of the source. A walk
+ * that gets to a node with an entry uses that entry instead of going through
+ * the database again. Only walks that finish without finding a valid input
+ * make an entry, since the others stop early. Entries are dropped when a link
+ * out of a node in their set (or out of the source) is added or removed, or
+ * when the cache grows past its limit.
+ */
+struct reach_entry {
+	struct tupid_tree tnode;
+	tupid_t *ids;
+	int num;
+};
+static struct tupid_entries reach_root = RB_INITIALIZER(&reach_root);
+static int reach_enabled = 0;
+static long reach_max = 0;
+static long reach_size = 0;
+
+/* A node seen during one walk, with the same states as in a graph. */
+struct reach_node {
+	struct tupid_tree tnode;
+	int state;
+};
+
+struct reach_data {
+	struct tupid_entries visited;
+	struct tupid_entries merged;
+	tupid_t *stack;
+	int num;
+	int size;
+	tupid_t cur;
+};
+
+static void free_reach_entry(struct reach_entry *re)
+{
+	free(re->ids);
+	free(re);
+}
+
+static void reach_remove(struct reach_entry *re)
+{
+	tupid_tree_rm(&reach_root, &re->tnode);
+	reach_size -= re->num;
+	free_reach_entry(re);
+}
+
+static void reach_flush(void)
+{
+	struct tupid_tree *tt;
+	struct tupid_tree *tmp;
+
+	RB_FOREACH_SAFE(tt, tupid_entries, &reach_root, tmp) {
+		reach_remove(container_of(tt, struct reach_entry, tnode));
+	}
+	reach_size = 0;
+}
+
+void reachability_cache_init(long max_ids)
+{
+	reach_flush();
+	reach_max = max_ids;
+	reach_enabled = max_ids > 0;
+}
+
+void reachability_cache_free(void)
+{
+	reach_flush();
+	reach_enabled = 0;
+}
+
+static int reach_has(const struct reach_entry *re, tupid_t tupid)
+{
+	int left = 0;
+	int right = re->num;
+
+	while(left < right) {
+		int mid = left + (right - left) / 2;
+		if(re->ids[mid] < tupid) {
+			left = mid + 1;
+		} else if(re->ids[mid] > tupid) {
+			right = mid;
+		} else {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void reachability_cache_link_changed(tupid_t from)
+{
+	struct tupid_tree *tt;
+	struct tupid_tree *tmp;
+	struct tup_entry *tent;
+
+	if(RB_EMPTY(&reach_root))
+		return;
+	if(from < 0) {
+		reach_flush();
+		return;
+	}
+
+	/* The entry for the node itself is stale. */
+	tt = tupid_tree_search(&reach_root, from);
+	if(tt)
+		reach_remove(container_of(tt, struct reach_entry, tnode));
+
+	/* Nothing links into source files, ghosts, and variables, so they
+	 * can't be in another entry's set. These are the common case (eg: a
+	 * command reading a header).
+	 */
+	tent = tup_entry_find(from);
+	if(tent && (tent->type == TUP_NODE_FILE ||
+		    tent->type == TUP_NODE_GHOST ||
+		    tent->type == TUP_NODE_VAR))
+		return;
+	RB_FOREACH_SAFE(tt, tupid_entries, &reach_root, tmp) {
+		struct reach_entry *re = container_of(tt, struct reach_entry, tnode);
+		if(reach_has(re, from))
+			reach_remove(re);
+	}
+}
+
+static int reach_cb(void *arg, struct tup_entry *tent)
+{
+	struct reach_data *rd = arg;
+	struct tupid_tree *tt;
+	struct reach_node *rn;
+
+	tt = tupid_tree_search(&rd->visited, tent->tnode.tupid);
+	if(tt) {
+		rn = container_of(tt, struct reach_node, tnode);
+		if(rn->state == STATE_PROCESSING) {
+			/* Same check as in add_file_cb(). */
+			fprintf(stderr, "tup error: Circular dependency detected! "
+				"Last edge was: %lli -> %lli\n",
+				rd->cur, tent->tnode.tupid);
+			return -1;
+		}
+		return 0;
+	}
+
+	rn = malloc(sizeof *rn);
+	if(!rn) {
+		perror("malloc");
+		return -1;
+	}
+	rn->tnode.tupid = tent->tnode.tupid;
+	rn->state = STATE_INITIALIZED;
+	tupid_tree_insert(&rd->visited, &rn->tnode);
+
+	if(rd->num == rd->size) {
+		tupid_t *tmp;
+
+		rd->size = rd->size ? rd->size * 2 : 64;
+		tmp = realloc(rd->stack, sizeof(tupid_t) * rd->size);
+		if(!tmp) {
+			perror("realloc");
+			return -1;
+		}
+		rd->stack = tmp;
+	}
+	rd->stack[rd->num] = tent->tnode.tupid;
+	rd->num++;
+	return 0;
+}
+
+static int reach_entry_connected(const struct reach_entry *re, struct tup_entry *src,
+				 struct tent_entries *valid_root)
+{
+	struct tent_tree *tt;
+
+	RB_FOREACH(tt, tent_entries, valid_root) {
+		if(tt->tent != src && reach_has(re, tt->tent->tnode.tupid))
+			return 1;
+	}
+	return 0;
+}
+
+/* Walks down from src like the uncached version of nodes_are_connected(),
+ * stopping at the first node in valid_root. If there isn't one, *newre is
+ * set to an entry with everything that is downstream of src.
+ */
+static int reach_walk(struct tup_entry *src, struct tent_entries *valid_root,
+		      int *connected, struct reach_entry **newre)
+{
+	struct reach_data rd = {
+		.visited = RB_INITIALIZER(&rd.visited),
+		.merged = RB_INITIALIZER(&rd.merged),
+		.stack = NULL,
+		.num = 0,
+		.size = 0,
+		.cur = src->tnode.tupid,
+	};
+	struct reach_entry *re;
+	struct tupid_tree *tt;
+	struct tupid_tree *tmp;
+	int num = 0;
+	int rc = -1;
+	int x;
+
+	*connected = 0;
+	*newre = NULL;
+	if(reach_cb(&rd, src) < 0)
+		goto out_free;
+	while(rd.num > 0) {
+		tupid_t tupid = rd.stack[rd.num-1];
+		struct reach_node *rn;
+
+		tt = tupid_tree_search(&rd.visited, tupid);
+		rn = container_of(tt, struct reach_node, tnode);
+		if(rn->state == STATE_PROCESSING) {
+			rn->state = STATE_FINISHED;
+			rd.num--;
+			continue;
+		}
+		if(tupid != src->tnode.tupid) {
+			struct tup_entry *tent = tup_entry_find(tupid);
+
+			if(tent && tent_tree_search(valid_root, tent) != NULL) {
+				*connected = 1;
+				rc = 0;
+				goto out_free;
+			}
+			tt = tupid_tree_search(&reach_root, tupid);
+			if(tt) {
+				struct reach_entry *cached = container_of(tt, struct reach_entry, tnode);
+
+				if(reach_entry_connected(cached, src, valid_root)) {
+					*connected = 1;
+					rc = 0;
+					goto out_free;
+				}
+				for(x=0; x<cached->num; x++) {
+					if(tupid_tree_add_dup(&rd.merged, cached->ids[x]) < 0)
+						goto out_free;
+				}
+				rn->state = STATE_FINISHED;
+				rd.num--;
+				continue;
+			}
+		}
+		rd.cur = tupid;
+		if(tup_db_select_node_by_link(reach_cb, &rd, tupid) < 0)
+			goto out_free;
+		rn->state = STATE_PROCESSING;
+	}
+
+	/* Nothing was connected, so everything downstream is known. */
+	RB_FOREACH(tt, tupid_entries, &rd.visited) {
+		if(tt->tupid != src->tnode.tupid)
+			if(tupid_tree_add_dup(&rd.merged, tt->tupid) < 0)
+				goto out_free;
+	}
+	RB_FOREACH(tt, tupid_entries, &rd.merged) {
+		num++;
+	}
+	re = malloc(sizeof *re);
+	if(!re) {
+		perror("malloc");
+		goto out_free;
+	}
+	re->tnode.tupid = src->tnode.tupid;
+	re->num = 0;
+	re->ids = malloc(sizeof(tupid_t) * (num ? num : 1));
+	if(!re->ids) {
+		perror("malloc");
+		free(re);
+		goto out_free;
+	}
+	RB_FOREACH(tt, tupid_entries, &rd.merged) {
+		re->ids[re->num] = tt->tupid;
+		re->num++;
+	}
+	*newre = re;
+	rc = 0;
+
+out_free:
+	free(rd.stack);
+	RB_FOREACH_SAFE(tt, tupid_entries, &rd.visited, tmp) {
+		tupid_tree_rm(&rd.visited, tt);
+		free(container_of(tt, struct reach_node, tnode));
+	}
+	free_tupid_tree(&rd.merged);
+	return rc;
+}
+
+static int cached_nodes_are_connected(struct tup_entry *src, struct tent_entries *valid_root,
+				      int *connected)
+{
+	struct tupid_tree *tnode;
+	struct reach_entry *re;
+
+	tnode = tupid_tree_search(&reach_root, src->tnode.tupid);
+	if(tnode) {
+		re = container_of(tnode, struct reach_entry, tnode);
+		*connected = reach_entry_connected(re, src, valid_root);
+		return 0;
+	}
+
+	if(reach_walk(src, valid_root, connected, &re) < 0)
+		return -1;
+	if(!re)
+		return 0;
+	if(re->num > reach_max) {
+		free_reach_entry(re);
+		return 0;
+	}
+	if(reach_size + re->num > reach_max)
+		reach_flush();
+	tupid_tree_insert(&reach_root, &re->tnode);
+	reach_size += re->num;
+	return 0;
+}
+
 int nodes_are_connected(struct tup_entry *src, struct tent_entries *valid_root,
 			int *connected)
 {
 	struct graph g;
 	struct node *n;
 
+	if(reach_enabled)
+		return cached_nodes_are_connected(src, valid_root, connected);
+
 	if(create_graph(&g, TUP_NODE_CMD) < 0)
 		return -1;
 	n = create_node(&g, src);
@@ -1400,8 +1723,18 @@ int add_group_circ_check(struct tup_entry *tent)
 
 int group_circ_check(void)
 {
+	int rc;
+
 	if(!group_graph_inited)
 		return 0;
+
+	/* The saved group order only needs to look at the new group links.
+	 * If it finds a cycle, build the full graph of the affected groups so
+	 * we can report which groups and commands are involved.
+	 */
+	rc = tup_db_check_group_order();
+	if(rc <= 0)
+		return rc;
 	if(build_graph(&group_graph) < 0)
 		return -1;
 	trim_graph(&group_graph);
@@ -72,6 +72,7 @@ struct node {
 	unsigned char skip;
 	unsigned char counted;
 	unsigned char transient;
+	unsigned char prefetched;
 };
 TAILQ_HEAD(node_head, node);
 
@@ -118,6 +119,9 @@ int prune_graph(struct graph *g, int argc, char **argv, int *num_pruned,
 		enum graph_prune_type gpt, int verbose);
 int nodes_are_connected(struct tup_entry *src, struct tent_entries *valid_root,
 			int *connected);
+void reachability_cache_init(long max_ids);
+void reachability_cache_free(void);
+void reachability_cache_link_changed(tupid_t from);
 void trim_graph(struct graph *g);
 void save_graph(FILE *err, struct graph *g, const char *filename);
 void dump_graph(struct graph *g, FILE *f, int show_dirs, int combine);
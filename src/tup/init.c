@@ -31,6 +31,8 @@
 #include "privs.h"
 #include "variant.h"
 #include "version.h"
+#include "jobserver.h"
+#include "placement.h"
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
@@ -38,6 +40,13 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
+static int for_update = 0;
+
+void tup_init_for_update(void)
+{
+	for_update = 1;
+}
+
 int tup_init(int argc, char **argv)
 {
 	if(find_tup_dir() != 0) {
@@ -49,6 +58,17 @@ int tup_init(int argc, char **argv)
 	if(tup_option_init(argc, argv) < 0) {
 		return -1;
 	}
+	if(for_update) {
+		/* Commands inherit the jobserver from the server, and the
+		 * server needs the CPU topology to place them.
+		 */
+		if(jobserver_pre_init() < 0) {
+			return -1;
+		}
+		if(placement_pre_init() < 0) {
+			return -1;
+		}
+	}
 	if(server_pre_init() < 0) {
 		return -1;
 	}
@@ -18,6 +18,10 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+/* Called before tup_init() by commands that run the updater, so that the
+ * state that has to exist before the server forks is only set up for them.
+ */
+void tup_init_for_update(void);
 int tup_init(int argc, char **argv);
 int tup_cleanup(void);
 void tup_valgrind_cleanup(void);
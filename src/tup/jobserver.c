@@ -0,0 +1,340 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "jobserver.h"
+#include "option.h"
+#include "server.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+static char *makeflags = NULL;
+
+#ifndef _WIN32
+/* The descriptors that commands inherit (pipe_fds), and the ones we use
+ * ourselves (read_fd, write_fd).
+ */
+static int pipe_fds[2] = {-1, -1};
+static int read_fd = -1;
+static int write_fd = -1;
+static int is_client = 0;
+static int tokens_added = 0;
+static int implicit_free = 0;
+static pthread_mutex_t jobserver_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Wakes up the threads waiting for a token when the implicit slot is free. */
+static int wake_fds[2] = {-1, -1};
+
+static int set_makeflags(const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	makeflags = malloc(len + 11);
+	if(!makeflags) {
+		perror("malloc");
+		return -1;
+	}
+	strcpy(makeflags, "MAKEFLAGS=");
+	va_start(ap, fmt);
+	vsnprintf(makeflags + 10, len + 1, fmt, ap);
+	va_end(ap);
+	return 0;
+}
+
+/* Opens a separate file description for a pipe that we share with other
+ * processes, so that it can be non-blocking for us without changing it for
+ * them. Falls back to the shared descriptor where /proc isn't available.
+ */
+static int open_own_fd(int fd)
+{
+	char path[64];
+	int newfd;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%i", fd);
+	newfd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if(newfd < 0)
+		return fd;
+	return newfd;
+}
+
+/* Finds the jobserver in MAKEFLAGS. GNU make 4.4 and newer use a named pipe
+ * (--jobserver-auth=fifo:PATH), and older versions pass a pipe's descriptors
+ * (--jobserver-auth=R,W or --jobserver-fds=R,W). The last one wins, like in
+ * make itself. Returns 1 if we found a usable jobserver.
+ */
+static int jobserver_client(const char *flags)
+{
+	const char *auth = NULL;
+	const char *p;
+	int len;
+
+	for(p = flags; (p = strstr(p, "--jobserver-")) != NULL; p++) {
+		if(strncmp(p, "--jobserver-auth=", 17) == 0)
+			auth = p + 17;
+		else if(strncmp(p, "--jobserver-fds=", 16) == 0)
+			auth = p + 16;
+	}
+	if(!auth)
+		return 0;
+	len = strcspn(auth, " \t");
+
+	if(strncmp(auth, "fifo:", 5) == 0) {
+		char path[PATH_MAX];
+
+		if(len - 5 <= 0 || len - 5 >= (signed)sizeof(path))
+			return 0;
+		memcpy(path, auth + 5, len - 5);
+		path[len - 5] = 0;
+		read_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if(read_fd < 0) {
+			fprintf(stderr, "tup warning: Unable to open the jobserver in MAKEFLAGS: %s: %s\n", path, strerror(errno));
+			return 0;
+		}
+		write_fd = read_fd;
+	} else {
+		int rfd;
+		int wfd;
+
+		if(sscanf(auth, "%d,%d", &rfd, &wfd) != 2 || rfd < 0 || wfd < 0)
+			return 0;
+		/* Make only passes the descriptors to commands that it knows
+		 * are recursive makes (ie: prefixed with '+').
+		 */
+		if(fcntl(rfd, F_GETFD) < 0 || fcntl(wfd, F_GETFD) < 0) {
+			fprintf(stderr, "tup warning: The jobserver in MAKEFLAGS isn't available, so tup will run up to updater.num_jobs commands on its own. Prefix the rule that runs tup with '+' to share make's job slots.\n");
+			return 0;
+		}
+		read_fd = open_own_fd(rfd);
+		write_fd = wfd;
+	}
+	return 1;
+}
+
+int jobserver_pre_init(void)
+{
+	const char *flags;
+
+	if(!tup_option_get_flag("updater.jobserver"))
+		return 0;
+
+	flags = getenv("MAKEFLAGS");
+	if(flags && jobserver_client(flags)) {
+		/* Commands get the same jobserver that we use. */
+		is_client = 1;
+		return set_makeflags("%s", flags);
+	}
+
+	/* Commands inherit the pipe, so it isn't close-on-exec. */
+	if(pipe(pipe_fds) < 0) {
+		perror("pipe");
+		fprintf(stderr, "tup error: Unable to create the jobserver pipe.\n");
+		return -1;
+	}
+	read_fd = open_own_fd(pipe_fds[0]);
+	write_fd = pipe_fds[1];
+	return 0;
+}
+
+static int init_wake_fds(void)
+{
+	if(wake_fds[0] >= 0)
+		return 0;
+	if(pipe(wake_fds) < 0) {
+		perror("pipe");
+		return -1;
+	}
+	if(fcntl(wake_fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+	   fcntl(wake_fds[0], F_SETFD, FD_CLOEXEC) < 0 ||
+	   fcntl(wake_fds[1], F_SETFL, O_NONBLOCK) < 0 ||
+	   fcntl(wake_fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+		perror("fcntl");
+		return -1;
+	}
+	return 0;
+}
+
+int jobserver_init(int num_jobs)
+{
+	char token = '+';
+	int x;
+
+	if(read_fd < 0)
+		return 0;
+	if(init_wake_fds() < 0)
+		return -1;
+	implicit_free = 1;
+	if(is_client)
+		return 0;
+
+	/* We hold one job slot ourselves, like make does. */
+	for(x=1; x<num_jobs; x++) {
+		if(write(write_fd, &token, 1) != 1) {
+			perror("write");
+			fprintf(stderr, "tup error: Unable to fill the jobserver.\n");
+			return -1;
+		}
+		tokens_added++;
+	}
+	free(makeflags);
+	return set_makeflags("-j%i --jobserver-auth=%i,%i", num_jobs, pipe_fds[0], pipe_fds[1]);
+}
+
+void jobserver_exit(void)
+{
+	char token;
+
+	/* Take back the tokens we added. Any that are still out belong to a
+	 * command that was killed, so we stop when the pipe is empty.
+	 */
+	if(read_fd != pipe_fds[0]) {
+		while(tokens_added > 0 && read(read_fd, &token, 1) == 1)
+			tokens_added--;
+	}
+	tokens_added = 0;
+	free(makeflags);
+	makeflags = NULL;
+}
+
+int jobserver_acquire(void)
+{
+	unsigned char token;
+
+	if(read_fd < 0)
+		return JOBSERVER_IMPLICIT_TOKEN;
+
+	while(1) {
+		struct pollfd pfd[2];
+		int rc;
+
+		pthread_mutex_lock(&jobserver_mutex);
+		if(implicit_free) {
+			implicit_free = 0;
+			pthread_mutex_unlock(&jobserver_mutex);
+			return JOBSERVER_IMPLICIT_TOKEN;
+		}
+		pthread_mutex_unlock(&jobserver_mutex);
+
+		if(server_is_dead())
+			return -1;
+		pfd[0].fd = read_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = wake_fds[0];
+		pfd[1].events = POLLIN;
+		rc = poll(pfd, 2, 100);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("poll");
+			return -1;
+		}
+		if(pfd[1].revents & POLLIN) {
+			char c;
+			/* Only one waiter needs the byte. The others go
+			 * back to waiting.
+			 */
+			if(read(wake_fds[0], &c, 1) < 0) {}
+			continue;
+		}
+		if(!(pfd[0].revents & (POLLIN | POLLHUP)))
+			continue;
+
+		/* Another process may take the token before we read it, in
+		 * which case the read fails with EAGAIN (or blocks until the
+		 * next token, if we only have the shared descriptor).
+		 */
+		rc = read(read_fd, &token, 1);
+		if(rc == 1)
+			return token;
+		if(rc < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if(rc == 0) {
+			fprintf(stderr, "tup error: The jobserver was closed.\n");
+		} else {
+			perror("read");
+			fprintf(stderr, "tup error: Unable to read from the jobserver.\n");
+		}
+		return -1;
+	}
+}
+
+void jobserver_release(int token)
+{
+	unsigned char c = token;
+
+	if(token == JOBSERVER_IMPLICIT_TOKEN) {
+		pthread_mutex_lock(&jobserver_mutex);
+		implicit_free = 1;
+		pthread_mutex_unlock(&jobserver_mutex);
+		if(write(wake_fds[1], "", 1) < 0) {
+			/* Full, so a waiter is already on its way. */
+		}
+		return;
+	}
+	while(write(write_fd, &c, 1) != 1) {
+		if(errno == EINTR)
+			continue;
+		perror("write");
+		fprintf(stderr, "tup error: Unable to return a token to the jobserver.\n");
+		return;
+	}
+}
+#else
+int jobserver_pre_init(void)
+{
+	return 0;
+}
+
+int jobserver_init(int num_jobs)
+{
+	if(num_jobs) {}
+	return 0;
+}
+
+void jobserver_exit(void)
+{
+}
+
+int jobserver_acquire(void)
+{
+	return JOBSERVER_IMPLICIT_TOKEN;
+}
+
+void jobserver_release(int token)
+{
+	if(token) {}
+}
+#endif
+
+const char *jobserver_environ(void)
+{
+	return makeflags;
+}
@@ -0,0 +1,58 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef tup_jobserver_h
+#define tup_jobserver_h
+
+/* GNU make jobserver support (updater.jobserver). If tup is run from make
+ * with a jobserver in MAKEFLAGS, each command waits for a job slot from that
+ * jobserver before it runs. Otherwise tup is the jobserver, with
+ * updater.num_jobs slots, so that any make (or other jobserver client) run by
+ * a command shares the same limit as tup's own commands.
+ */
+
+/* Returned by jobserver_acquire() for the slot that every jobserver client
+ * holds implicitly. It is never written to the jobserver.
+ */
+#define JOBSERVER_IMPLICIT_TOKEN 256
+
+/* Creates the jobserver pipe. This must happen before the server forks off
+ * the process that runs commands, so that they inherit it.
+ */
+int jobserver_pre_init(void);
+
+/* Fills our jobserver with tokens (or attaches to make's) before running
+ * commands, and takes them back afterward.
+ */
+int jobserver_init(int num_jobs);
+void jobserver_exit(void);
+
+/* Waits for a job slot, which must be passed back to jobserver_release()
+ * once the command is finished. Returns -1 if tup is shutting down.
+ */
+int jobserver_acquire(void);
+void jobserver_release(int token);
+
+/* Returns the "MAKEFLAGS=..." entry to add to the environment of each
+ * command, or NULL if there is no jobserver.
+ */
+const char *jobserver_environ(void);
+
+#endif
@@ -0,0 +1,407 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#define _ATFILE_SOURCE
+#include "linkcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define LINKCACHE_MAGIC "TUPLNK1"
+
+struct linkcache_header {
+	char magic[8];
+	long long generation;
+	unsigned long long dev;
+	unsigned long long ino;
+	tupid_t num_links;
+	tupid_t num_keys[LINKCACHE_NUM_DIRS];
+};
+
+static int csr_valid(const struct linkcache_csr *csr, tupid_t num_links)
+{
+	if(csr->offsets[0] != 0 || csr->offsets[csr->num_keys] != num_links)
+		return 0;
+	return 1;
+}
+
+int linkcache_map(struct linkcache *lc, int dfd)
+{
+	int fd;
+	struct stat st;
+	const struct linkcache_header *hdr;
+	const tupid_t *p;
+	size_t expected;
+	int x;
+
+	memset(lc, 0, sizeof(*lc));
+	fd = openat(dfd, TUP_LINKCACHE_FILE, O_RDONLY);
+	if(fd < 0) {
+		if(errno == ENOENT)
+			return 1;
+		perror(TUP_LINKCACHE_FILE);
+		return -1;
+	}
+	if(fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	if((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return 1;
+	}
+	lc->len = st.st_size;
+	lc->map = mmap(NULL, lc->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(lc->map == MAP_FAILED) {
+		perror("mmap");
+		lc->map = NULL;
+		return -1;
+	}
+
+	hdr = lc->map;
+	if(memcmp(hdr->magic, LINKCACHE_MAGIC, sizeof(hdr->magic)) != 0)
+		goto out_invalid;
+	if(hdr->num_links < 0)
+		goto out_invalid;
+	expected = sizeof(*hdr);
+	for(x=0; x<LINKCACHE_NUM_DIRS; x++) {
+		if(hdr->num_keys[x] < 0)
+			goto out_invalid;
+		expected += sizeof(tupid_t) * (hdr->num_keys[x] * 2 + 1 + hdr->num_links);
+	}
+	if(expected != lc->len)
+		goto out_invalid;
+
+	p = (const tupid_t*)(const void*)(hdr + 1);
+	for(x=0; x<LINKCACHE_NUM_DIRS; x++) {
+		struct linkcache_csr *csr = &lc->csr[x];
+
+		csr->num_keys = hdr->num_keys[x];
+		csr->keys = p;
+		p += csr->num_keys;
+		csr->offsets = p;
+		p += csr->num_keys + 1;
+		csr->vals = p;
+		p += hdr->num_links;
+		if(!csr_valid(csr, hdr->num_links))
+			goto out_invalid;
+	}
+	lc->id.generation = hdr->generation;
+	lc->id.dev = hdr->dev;
+	lc->id.ino = hdr->ino;
+	return 0;
+
+out_invalid:
+	linkcache_unmap(lc);
+	return 1;
+}
+
+void linkcache_unmap(struct linkcache *lc)
+{
+#ifndef _WIN32
+	if(lc->map)
+		munmap(lc->map, lc->len);
+#endif
+	memset(lc, 0, sizeof(*lc));
+}
+
+static tupid_t find_index(const tupid_t *ids, tupid_t num, tupid_t id)
+{
+	tupid_t left = 0;
+	tupid_t right = num;
+
+	while(left < right) {
+		tupid_t mid = left + (right - left) / 2;
+		if(ids[mid] < id) {
+			left = mid + 1;
+		} else if(ids[mid] > id) {
+			right = mid;
+		} else {
+			return mid;
+		}
+	}
+	return -1;
+}
+
+void linkcache_get(const struct linkcache *lc, int dir, tupid_t key,
+		   const tupid_t **vals, int *num)
+{
+	const struct linkcache_csr *csr = &lc->csr[dir];
+	tupid_t idx;
+
+	idx = find_index(csr->keys, csr->num_keys, key);
+	if(idx < 0) {
+		*vals = NULL;
+		*num = 0;
+		return;
+	}
+	*vals = csr->vals + csr->offsets[idx];
+	*num = csr->offsets[idx+1] - csr->offsets[idx];
+}
+
+int linkcache_has(const struct linkcache *lc, int dir, tupid_t key, tupid_t val)
+{
+	const tupid_t *vals;
+	int num;
+
+	linkcache_get(lc, dir, key, &vals, &num);
+	if(find_index(vals, num, val) < 0)
+		return 0;
+	return 1;
+}
+
+void linkcache_writer_init(struct linkcache_writer *w)
+{
+	memset(w, 0, sizeof(*w));
+}
+
+static int array_add(struct linkcache_array *a, tupid_t id)
+{
+	if(a->num == a->size) {
+		tupid_t *tmp;
+
+		a->size = a->size ? a->size * 2 : 1024;
+		tmp = realloc(a->ids, sizeof(tupid_t) * a->size);
+		if(!tmp) {
+			perror("realloc");
+			return -1;
+		}
+		a->ids = tmp;
+	}
+	a->ids[a->num] = id;
+	a->num++;
+	return 0;
+}
+
+int linkcache_writer_add_key(struct linkcache_writer *w, int dir, tupid_t key)
+{
+	struct linkcache_array *keys = &w->keys[dir];
+
+	if(keys->num == 0 || keys->ids[keys->num-1] != key) {
+		if(array_add(keys, key) < 0)
+			return -1;
+		if(array_add(&w->offsets[dir], w->vals[dir].num) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int linkcache_writer_add(struct linkcache_writer *w, int dir, tupid_t key, tupid_t val)
+{
+	if(linkcache_writer_add_key(w, dir, key) < 0)
+		return -1;
+	if(array_add(&w->vals[dir], val) < 0)
+		return -1;
+	return 0;
+}
+
+static void writer_get(const struct linkcache_writer *w, int dir, tupid_t key,
+		       const tupid_t **vals, int *num)
+{
+	const struct linkcache_array *keys = &w->keys[dir];
+	const tupid_t *offsets = w->offsets[dir].ids;
+	tupid_t idx;
+	tupid_t end;
+
+	idx = find_index(keys->ids, keys->num, key);
+	if(idx < 0) {
+		*vals = NULL;
+		*num = 0;
+		return;
+	}
+	end = idx + 1 < keys->num ? offsets[idx+1] : w->vals[dir].num;
+	*vals = w->vals[dir].ids + offsets[idx];
+	*num = end - offsets[idx];
+}
+
+static int merge_dir(struct linkcache_writer *w, int dir, const struct linkcache *base,
+		     const struct linkcache_writer *changed)
+{
+	const struct linkcache_csr *csr = &base->csr[dir];
+	const struct linkcache_array *dirty = &changed->keys[dir];
+	const struct linkcache_array *other_dirty;
+	int other;
+	tupid_t b = 0;
+	tupid_t d = 0;
+
+	other = dir == LINKCACHE_OUTPUTS ? LINKCACHE_INPUTS : LINKCACHE_OUTPUTS;
+	other_dirty = &changed->keys[other];
+	while(b < csr->num_keys || d < dirty->num) {
+		const tupid_t *vals;
+		int num;
+		tupid_t key;
+		int x;
+
+		if(d < dirty->num && (b == csr->num_keys || dirty->ids[d] <= csr->keys[b])) {
+			key = dirty->ids[d];
+			if(b < csr->num_keys && csr->keys[b] == key)
+				b++;
+			d++;
+			writer_get(changed, dir, key, &vals, &num);
+			for(x=0; x<num; x++) {
+				if(linkcache_writer_add(w, dir, key, vals[x]) < 0)
+					return -1;
+			}
+			continue;
+		}
+
+		/* An unchanged key keeps its links, except for the ones to a
+		 * changed key that no longer links back to it.
+		 */
+		key = csr->keys[b];
+		vals = csr->vals + csr->offsets[b];
+		num = csr->offsets[b+1] - csr->offsets[b];
+		b++;
+		for(x=0; x<num; x++) {
+			if(find_index(other_dirty->ids, other_dirty->num, vals[x]) >= 0) {
+				const tupid_t *other_vals;
+				int other_num;
+
+				writer_get(changed, other, vals[x], &other_vals, &other_num);
+				if(find_index(other_vals, other_num, key) < 0)
+					continue;
+			}
+			if(linkcache_writer_add(w, dir, key, vals[x]) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+int linkcache_writer_merge(struct linkcache_writer *w, const struct linkcache *base,
+			   const struct linkcache_writer *changed)
+{
+	int x;
+
+	for(x=0; x<LINKCACHE_NUM_DIRS; x++) {
+		if(merge_dir(w, x, base, changed) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int write_array(int fd, const struct linkcache_array *a)
+{
+	const char *p = (const char*)a->ids;
+	size_t len = sizeof(tupid_t) * a->num;
+
+	while(len > 0) {
+		ssize_t rc = write(fd, p, len);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		p += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+int linkcache_writer_save(struct linkcache_writer *w, int dfd,
+			  const struct linkcache_id *id)
+{
+	struct linkcache_header hdr;
+	struct linkcache_array hdr_array;
+	char tmpname[64];
+	int fd;
+	int x;
+
+	if(w->vals[LINKCACHE_OUTPUTS].num != w->vals[LINKCACHE_INPUTS].num) {
+		fprintf(stderr, "tup error: Link cache directions have different numbers of links (%lli, %lli).\n", w->vals[LINKCACHE_OUTPUTS].num, w->vals[LINKCACHE_INPUTS].num);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LINKCACHE_MAGIC, sizeof(hdr.magic));
+	hdr.generation = id->generation;
+	hdr.dev = id->dev;
+	hdr.ino = id->ino;
+	hdr.num_links = w->vals[LINKCACHE_OUTPUTS].num;
+	for(x=0; x<LINKCACHE_NUM_DIRS; x++) {
+		hdr.num_keys[x] = w->keys[x].num;
+		if(array_add(&w->offsets[x], w->vals[x].num) < 0)
+			return -1;
+	}
+
+	/* Each process writes to its own temporary file, since two of them
+	 * may save the cache at the same time. This is mkstemp() relative to
+	 * dfd.
+	 */
+	for(x=0; ; x++) {
+		snprintf(tmpname, sizeof(tmpname), "%s.%i.%i", TUP_LINKCACHE_FILE, getpid(), x);
+		fd = openat(dfd, tmpname, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if(fd >= 0)
+			break;
+		if(errno != EEXIST || x == 100) {
+			perror(tmpname);
+			return -1;
+		}
+	}
+	hdr_array.ids = (tupid_t*)(void*)&hdr;
+	hdr_array.num = sizeof(hdr) / sizeof(tupid_t);
+	if(write_array(fd, &hdr_array) < 0)
+		goto out_err;
+	for(x=0; x<LINKCACHE_NUM_DIRS; x++) {
+		if(write_array(fd, &w->keys[x]) < 0)
+			goto out_err;
+		if(write_array(fd, &w->offsets[x]) < 0)
+			goto out_err;
+		if(write_array(fd, &w->vals[x]) < 0)
+			goto out_err;
+	}
+	if(close(fd) < 0) {
+		perror("close");
+		goto out_unlink;
+	}
+	if(renameat(dfd, tmpname, dfd, TUP_LINKCACHE_FILE) < 0) {
+		perror("renameat");
+		fprintf(stderr, "tup error: Unable to rename the link cache into place.\n");
+		goto out_unlink;
+	}
+	return 0;
+
+out_err:
+	close(fd);
+out_unlink:
+	unlinkat(dfd, tmpname, 0);
+	return -1;
+}
+
+void linkcache_writer_free(struct linkcache_writer *w)
+{
+	int x;
+
+	for(x=0; x<LINKCACHE_NUM_DIRS; x++) {
+		free(w->keys[x].ids);
+		free(w->offsets[x].ids);
+		free(w->vals[x].ids);
+	}
+	linkcache_writer_init(w);
+}
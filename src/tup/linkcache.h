@@ -0,0 +1,107 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef tup_linkcache_h
+#define tup_linkcache_h
+
+#include "tupid.h"
+#include <stddef.h>
+
+#define TUP_LINKCACHE_FILE ".tup/linkcache"
+
+/* Directions in the link cache. LINKCACHE_OUTPUTS maps a from_id to its
+ * to_ids in normal_link, and LINKCACHE_INPUTS maps a to_id to its from_ids.
+ */
+enum {
+	LINKCACHE_OUTPUTS,
+	LINKCACHE_INPUTS,
+	LINKCACHE_NUM_DIRS,
+};
+
+/* Identifies the database that the cache was built from. The generation is
+ * bumped in the database whenever a transaction that changed normal_link
+ * commits, and dev/ino guard against a cache left over from a different
+ * .tup/db.
+ */
+struct linkcache_id {
+	long long generation;
+	unsigned long long dev;
+	unsigned long long ino;
+};
+
+/* Each direction is stored in compressed sparse row form: a sorted array of
+ * keys, an array of num_keys+1 offsets, and the neighbors of keys[i] in
+ * vals[offsets[i]] to vals[offsets[i+1]-1], also sorted.
+ */
+struct linkcache_csr {
+	const tupid_t *keys;
+	const tupid_t *offsets;
+	const tupid_t *vals;
+	tupid_t num_keys;
+};
+
+struct linkcache {
+	void *map;
+	size_t len;
+	struct linkcache_id id;
+	struct linkcache_csr csr[LINKCACHE_NUM_DIRS];
+};
+
+struct linkcache_array {
+	tupid_t *ids;
+	tupid_t num;
+	tupid_t size;
+};
+
+struct linkcache_writer {
+	struct linkcache_array keys[LINKCACHE_NUM_DIRS];
+	struct linkcache_array offsets[LINKCACHE_NUM_DIRS];
+	struct linkcache_array vals[LINKCACHE_NUM_DIRS];
+};
+
+/* Returns 0 if the cache file was mapped, 1 if it is missing or invalid (and
+ * so must be rebuilt), and -1 on error.
+ */
+int linkcache_map(struct linkcache *lc, int dfd);
+void linkcache_unmap(struct linkcache *lc);
+void linkcache_get(const struct linkcache *lc, int dir, tupid_t key,
+		   const tupid_t **vals, int *num);
+int linkcache_has(const struct linkcache *lc, int dir, tupid_t key, tupid_t val);
+
+/* Links must be added to each direction in sorted (key, val) order.
+ * linkcache_writer_add_key() starts a key without adding any links to it.
+ */
+void linkcache_writer_init(struct linkcache_writer *w);
+int linkcache_writer_add_key(struct linkcache_writer *w, int dir, tupid_t key);
+int linkcache_writer_add(struct linkcache_writer *w, int dir, tupid_t key, tupid_t val);
+
+/* Fills w with the links in base, except that the links to and from each key
+ * in changed are replaced by the ones in changed. Every key in changed must
+ * have all of its current links in both directions, including none at all
+ * for a key that lost its links.
+ */
+int linkcache_writer_merge(struct linkcache_writer *w, const struct linkcache *base,
+			   const struct linkcache_writer *changed);
+int linkcache_writer_save(struct linkcache_writer *w, int dfd,
+			  const struct linkcache_id *id);
+void linkcache_writer_free(struct linkcache_writer *w);
+
+#endif
@@ -73,11 +73,20 @@
  * and also try to delete the file. Another issue would be deadlocking from the
  * monitor not detecting someone trying to use the object lock. With three
  * locks I don't get those issues.
+ *
+ * Query commands (tup todo, tup graph, etc) can call tup_lock_allow_read_only()
+ * before getting here. If the shared lock is busy, they don't wait for it.
+ * Instead they skip the tri-lock entirely and just read the database, which
+ * SQLite lets them do with a read transaction against whatever the other
+ * process last committed. Since they never touch the object lock, the monitor
+ * doesn't know or care that they exist.
  */
 
 static tup_lock_t sh_lock;
 static tup_lock_t obj_lock;
 static tup_lock_t tri_lock;
+static int read_only_allowed = 0;
+static int read_only = 0;
 
 int tup_lock_init(void)
 {
@@ -86,6 +95,11 @@ int tup_lock_init(void)
 	if(tup_lock_open(tup_top_fd(), TUP_SHARED_LOCK, &sh_lock) < 0)
 		return -1;
 	ret = tup_try_flock(sh_lock);
+	if(ret > 0 && read_only_allowed) {
+		tup_lock_close(sh_lock);
+		read_only = 1;
+		return 0;
+	}
 	if(ret > 0) {
 		printf("Waiting for another tup process (or an autoupdate) to finish...\n");
 		ret = tup_flock(sh_lock);
@@ -106,6 +120,10 @@ int tup_lock_init(void)
 
 void tup_lock_exit(void)
 {
+	if(read_only) {
+		read_only = 0;
+		return;
+	}
 	tup_unflock(obj_lock);
 	tup_lock_close(obj_lock);
 	/* Wait for the monitor to pick up the object lock */
@@ -118,6 +136,8 @@ void tup_lock_exit(void)
 
 void tup_lock_closeall(void)
 {
+	if(read_only)
+		return;
 	tup_lock_close(obj_lock);
 	tup_lock_close(tri_lock);
 	tup_lock_close(sh_lock);
@@ -137,3 +157,13 @@ tup_lock_t tup_tri_lock(void)
 {
 	return tri_lock;
 }
+
+void tup_lock_allow_read_only(void)
+{
+	read_only_allowed = 1;
+}
+
+int tup_lock_read_only(void)
+{
+	return read_only;
+}
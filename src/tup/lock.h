@@ -43,6 +43,17 @@ void tup_lock_exit(void);
 /** Just closes the locks. This should by called by any forked processes. */
 void tup_lock_closeall(void);
 
+/** Lets tup_lock_init() fall back to read-only mode rather than waiting if
+ * another process is using the database. Only commands that never write to
+ * the database should call this.
+ */
+void tup_lock_allow_read_only(void);
+
+/** Returns 1 if tup_lock_init() didn't take the locks, and the database may
+ * only be read.
+ */
+int tup_lock_read_only(void);
+
 /* Tri-lock functions */
 tup_lock_t tup_sh_lock(void);
 tup_lock_t tup_obj_lock(void);
@@ -0,0 +1,148 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "makedeps.h"
+#include "file.h"
+#include "estring.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int add_word(struct estring *list, struct estring *word)
+{
+	if(!word->len)
+		return 0;
+	/* Each word is stored with its nul terminator */
+	if(estring_append(list, word->s, word->len + 1) < 0)
+		return -1;
+	word->len = 0;
+	word->s[0] = 0;
+	return 0;
+}
+
+static int add_files(enum access_type at, struct estring *list,
+		     struct tup_entry *dtent, struct file_info *info)
+{
+	const char *p = list->s;
+	const char *end = list->s + list->len;
+
+	while(p < end) {
+		if(handle_file_dtent(at, dtent, p, info) < 0)
+			return -1;
+		p += strlen(p) + 1;
+	}
+	list->len = 0;
+	list->s[0] = 0;
+	return 0;
+}
+
+int makedeps_import(FILE *f, const char *buf, int len, struct tup_entry *dtent,
+		    struct file_info *info)
+{
+	struct estring targets;
+	struct estring prereqs;
+	struct estring word;
+	int in_prereqs = 0;
+	int line = 1;
+	int rc = -1;
+	int x;
+
+	if(estring_init(&targets) < 0)
+		return -1;
+	if(estring_init(&prereqs) < 0)
+		return -1;
+	if(estring_init(&word) < 0)
+		return -1;
+
+	/* Walk one past the end so the last rule is finished off even if the
+	 * file is missing its trailing newline.
+	 */
+	for(x=0; x<=len; x++) {
+		char c = x < len ? buf[x] : '\n';
+
+		if(c == '\\' && x+1 < len) {
+			char next = buf[x+1];
+			if(next == '\n' || (next == '\r' && x+2 < len && buf[x+2] == '\n')) {
+				/* Line continuation separates words */
+				x += next == '\r' ? 2 : 1;
+				line++;
+				if(add_word(in_prereqs ? &prereqs : &targets, &word) < 0)
+					goto out;
+				continue;
+			}
+			if(next == ' ' || next == '#' || next == ':') {
+				if(estring_append(&word, &next, 1) < 0)
+					goto out;
+				x++;
+				continue;
+			}
+		}
+		if(c == '$' && x+1 < len && buf[x+1] == '$') {
+			if(estring_append(&word, "$", 1) < 0)
+				goto out;
+			x++;
+			continue;
+		}
+		if(c == '#') {
+			while(x < len && buf[x] != '\n')
+				x++;
+			c = '\n';
+		}
+
+		if(c == ':' && !in_prereqs) {
+			if(add_word(&targets, &word) < 0)
+				goto out;
+			if(!targets.len) {
+				fprintf(f, "tup error: Missing target before ':' on line %i of the dependency file.\n", line);
+				goto out;
+			}
+			in_prereqs = 1;
+		} else if(c == ' ' || c == '\t' || c == '\r') {
+			if(add_word(in_prereqs ? &prereqs : &targets, &word) < 0)
+				goto out;
+		} else if(c == '\n') {
+			if(add_word(in_prereqs ? &prereqs : &targets, &word) < 0)
+				goto out;
+			if(targets.len && !in_prereqs) {
+				fprintf(f, "tup error: Missing ':' after the targets on line %i of the dependency file.\n", line);
+				goto out;
+			}
+			if(prereqs.len) {
+				if(add_files(ACCESS_WRITE, &targets, dtent, info) < 0)
+					goto out;
+				if(add_files(ACCESS_READ, &prereqs, dtent, info) < 0)
+					goto out;
+			}
+			targets.len = 0;
+			targets.s[0] = 0;
+			in_prereqs = 0;
+			line++;
+		} else {
+			if(estring_append(&word, &c, 1) < 0)
+				goto out;
+		}
+	}
+	rc = 0;
+
+out:
+	free(targets.s);
+	free(prereqs.s);
+	free(word.s);
+	return rc;
+}
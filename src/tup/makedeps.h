@@ -0,0 +1,38 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef tup_makedeps_h
+#define tup_makedeps_h
+
+#include <stdio.h>
+
+struct file_info;
+struct tup_entry;
+
+/* Reads a Makefile-style dependency file (as written by 'gcc -MD') and
+ * adds the targets as writes and the prerequisites as reads in the
+ * file_info. Relative paths are relative to dtent, which is the directory
+ * that the command ran in. Rules without prerequisites (such as the phony
+ * targets from 'gcc -MP') are ignored.
+ */
+int makedeps_import(FILE *f, const char *buf, int len, struct tup_entry *dtent,
+		    struct file_info *info);
+
+#endif
@@ -92,6 +92,7 @@ static int events_queued(void);
 static int queue_event(struct inotify_event *e);
 static int flush_queue(int do_autoupdate);
 static int autoupdate(const char *cmd);
+static int preempt_autoupdate(struct inotify_event *e);
 static void *wait_thread(void *arg);
 static int skip_event(struct inotify_event *e);
 static int eventcmp(struct inotify_event *e1, struct inotify_event *e2);
@@ -124,6 +125,12 @@ static pthread_cond_t autoupdate_cond = PTHREAD_COND_INITIALIZER;
 #define AUTOUPDATE_EXIT -2
 #define AUTOUPDATE_NONE -1
 static pid_t autoupdate_pid = AUTOUPDATE_NONE;
+/* The autoupdate process that is currently running (if any), and whether we
+ * have already asked it to stop. Unlike autoupdate_pid, which is consumed by
+ * the wait thread, this stays valid until the process exits.
+ */
+static volatile sig_atomic_t autoupdate_running = AUTOUPDATE_NONE;
+static int autoupdate_preempted = 0;
 static volatile sig_atomic_t dircache_debug = 0;
 static volatile sig_atomic_t monitor_quit = 0;
 static struct moved_from_event_head moved_from_list = LIST_HEAD_INITIALIZER(&moved_from_list);
@@ -669,6 +676,10 @@ static int monitor_loop(void)
 				rc = queue_event(e);
 				if(rc < 0)
 					return rc;
+				if(!locked) {
+					if(preempt_autoupdate(e) < 0)
+						return -1;
+				}
 			}
 		}
 	} while(!monitor_quit);
@@ -900,12 +911,23 @@ static int autoupdate(const char *cmd)
 			}
 		}
 		args[update_argc+3] = NULL;
+
+		/* Put the autoupdate in its own process group. The updater
+		 * signals its whole group when it is interrupted, and we don't
+		 * want that to take down the monitor when we preempt it.
+		 */
+		if(setpgid(0, 0) < 0) {
+			perror("setpgid");
+			exit(1);
+		}
 		execvp("tup", args);
 		perror("execvp");
 		exit(1);
 	} else {
 		pthread_mutex_lock(&autoupdate_lock);
 		autoupdate_pid = pid;
+		autoupdate_running = pid;
+		autoupdate_preempted = 0;
 		pthread_cond_signal(&autoupdate_cond);
 		pthread_mutex_unlock(&autoupdate_lock);
 		if(tup_db_begin() < 0)
@@ -957,10 +979,68 @@ static void *wait_thread(void *arg)
 		if(waitpid(mypid, NULL, 0) < 0) {
 			perror("waitpid");
 		}
+		pthread_mutex_lock(&autoupdate_lock);
+		if(autoupdate_running == mypid)
+			autoupdate_running = AUTOUPDATE_NONE;
+		pthread_mutex_unlock(&autoupdate_lock);
 	}
 	return NULL;
 }
 
+static int preempt_autoupdate(struct inotify_event *e)
+{
+	/* An event came in while our autoupdate holds the lock. If it touches
+	 * a file that a command has read (including Tupfiles), anything the
+	 * updater hasn't gotten to yet may be built from stale results. Ask it
+	 * to stop scheduling new jobs - what has finished is committed, and
+	 * the queued events will start a fresh autoupdate once we get the lock
+	 * back. Inputs of commands that have never run have no links yet, but
+	 * those commands will read the new contents anyway.
+	 */
+	struct dircache *dc;
+	pid_t pid;
+	int used = 0;
+	int rc;
+
+	pthread_mutex_lock(&autoupdate_lock);
+	pid = autoupdate_preempted ? AUTOUPDATE_NONE : autoupdate_running;
+	pthread_mutex_unlock(&autoupdate_lock);
+	if(pid <= 0)
+		return 0;
+
+	if(!e->len || (e->mask & IN_ISDIR) || skip_event(e))
+		return 0;
+	dc = dircache_lookup_wd(&droot, e->wd);
+	if(!dc)
+		return 0;
+
+	/* If the autoupdate has the database locked for writing, we can't
+	 * wait for it since events would pile up in the meantime. The event
+	 * is already queued, so it starts a new autoupdate afterward either
+	 * way. Preempting here instead would also stop the autoupdate for its
+	 * own output files.
+	 */
+	if(tup_db_begin() < 0)
+		return -1;
+	rc = tup_db_is_input(dc->dt_node.tupid, e->name, &used);
+	if(tup_db_commit() < 0)
+		return -1;
+	if(rc < 0)
+		return -1;
+
+	if(used) {
+		printf("tup monitor: '%s' changed - restarting the autoupdate.\n", e->name);
+		fflush(stdout);
+		pthread_mutex_lock(&autoupdate_lock);
+		if(autoupdate_running == pid) {
+			kill(pid, SIGUSR2);
+			autoupdate_preempted = 1;
+		}
+		pthread_mutex_unlock(&autoupdate_lock);
+	}
+	return 0;
+}
+
 static int skip_event(struct inotify_event *e)
 {
 	/* Skip hidden files */
@@ -1287,6 +1367,12 @@ static void sighandler(int sig)
 		monitor_quit = 1;
 	} else {
 		monitor_set_pid(-1);
+		/* The autoupdate is in its own process group, so it won't see
+		 * a ctrl-C from the terminal. Pass the signal along so it
+		 * doesn't outlive us.
+		 */
+		if(autoupdate_running > 0)
+			kill(autoupdate_running, sig);
 		/* TODO: gracefully close, or something? */
 		exit(0);
 	}
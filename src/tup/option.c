@@ -84,16 +84,27 @@ static struct option {
 	{"updater.keep_going", "0", NULL, is_flag},
 	{"updater.full_deps", "0", NULL, is_flag},
 	{"updater.warnings", "1", NULL, is_flag},
+	{"updater.dedupe_variants", "0", NULL, is_flag},
+	{"updater.reachability_cache", "1000000", NULL, is_number},
+	{"updater.builtins", "1", NULL, is_flag},
+	{"updater.io_uring", "1", NULL, is_flag},
+	{"updater.jobserver", "1", NULL, is_flag},
+	{"updater.prefetch", "0", NULL, is_number},
+	{"updater.placement", "0", NULL, is_flag},
 	{"display.color", "auto", NULL, is_color},
 	{"display.width", NULL, get_console_width, is_number},
 	{"display.progress", NULL, stdout_isatty, is_flag},
 	{"display.job_numbers", "1", NULL, is_flag},
 	{"display.job_time", "1", NULL, is_flag},
 	{"display.quiet", "0", NULL, is_flag},
+	{"display.profile", "0", NULL, is_flag},
 	{"monitor.autoupdate", "0", NULL, is_flag},
 	{"monitor.autoparse", "0", NULL, is_flag},
 	{"monitor.foreground", "0", NULL, is_flag},
 	{"db.sync", "1", NULL, is_flag},
+	{"db.reclaim_threshold", "0", NULL, is_number},
+	{"db.link_cache", "0", NULL, is_flag},
+	{"db.checkpoint_interval", "1000", NULL, is_number},
 	{"graph.dirs", "0", NULL, is_flag},
 	{"graph.ghosts", "0", NULL, is_flag},
 	{"graph.environment", "0", NULL, is_flag},
@@ -80,9 +80,35 @@ struct build_name_list_args {
 	int orderid;
 };
 
+/* A line from a Tupfile after continuations are joined and trailing
+ * whitespace is removed. The offset is into tupfile_text.split.
+ */
+struct tupfile_line {
+	int offset;
+	int lno;
+};
+
+/* The contents of a Tupfile or an included file. Only evaluating the lines
+ * depends on the directory and variant being parsed, so the file is read and
+ * split into lines once per update and then shared. For example, each
+ * srcdir Tupfile is parsed once per variant, and a Tuprules.tup is included
+ * by every directory below it.
+ */
+struct tupfile_text {
+	struct tupid_tree tnode;
+	struct buf raw;
+	char *split;
+	int split_len;
+	struct tupfile_line *lines;
+	int num_lines;
+};
+
 static int open_tupfile(struct tupfile *tf, struct tup_entry *tent,
-			char *path, int *parser_lua, int *fd);
-static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename);
+			char *path, int *parser_lua, int *fd,
+			struct tup_entry **tupfile_tent);
+static struct tupfile_text *get_tupfile_text(struct tupfile *tf, struct tup_entry *tent,
+					     int fd, int split);
+static int parse_tupfile(struct tupfile *tf, struct tupfile_text *text, const char *filename);
 static int split_roots(struct tent_entries *root, struct graph *g);
 static int parse_internal_definitions(struct tupfile *tf);
 static int var_ifdef(struct tupfile *tf, const char *var);
@@ -143,6 +169,7 @@ static char *tup_printf(struct tupfile *tf, const char *cmd, int cmd_len,
 static int glob_parse(const char *base, int baselen, char *expanded, int *globidx);
 
 static int debug_run = 0;
+static struct tupid_entries text_root = RB_INITIALIZER(&text_root);
 
 void parser_debug_run(void)
 {
@@ -156,7 +183,7 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 	int fd = -1;
 	int rc = -1;
 	int parser_lua = 0;
-	struct buf b = {NULL, 0};
+	struct tup_entry *tupfile_tent = NULL;
 	struct parser_server ps;
 	struct timeval orig_start;
 	char path[PATH_MAX];
@@ -259,7 +286,7 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 		goto out_close_vdb;
 	}
 
-	if(open_tupfile(&tf, n->tent, path, &parser_lua, &fd) < 0)
+	if(open_tupfile(&tf, n->tent, path, &parser_lua, &fd, &tupfile_tent) < 0)
 		goto out_close_dfd;
 	if(fd < 0) {
 		/* No Tupfile means we have nothing to do */
@@ -272,19 +299,20 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 		}
 	}
 	if(fd >= 0) {
-		int tmprc;
-		tmprc = fslurp_null(fd, &b);
+		struct tupfile_text *text;
+
+		text = get_tupfile_text(&tf, tupfile_tent, fd, !parser_lua);
 		if(close(fd) < 0) {
 			parser_error(&tf, "close(fd)");
-			tmprc = -1;
+			text = NULL;
 		}
-		if(tmprc < 0)
+		if(!text)
 			goto out_free_bs;
 		if(!parser_lua) {
-			if(parse_tupfile(&tf, &b, "Tupfile") < 0)
+			if(parse_tupfile(&tf, text, "Tupfile") < 0)
 				goto out_free_bs;
 		} else {
-			if(parse_lua_tupfile(&tf, &b, path) < 0)
+			if(parse_lua_tupfile(&tf, &text->raw, path) < 0)
 				goto out_free_bs;
 		}
 	}
@@ -317,7 +345,6 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 	}
 	rc = 0;
 out_free_bs:
-	free(b.s);
 out_close_dfd:
 	if(tf.cur_dfd >= 0 && close(tf.cur_dfd) < 0) {
 		parser_error(&tf, "close(tf.cur_dfd)");
@@ -392,7 +419,8 @@ out_server_stop:
 	return rc;
 }
 
-static int open_if_entry(struct tupfile *tf, struct tup_entry *dtent, const char *fullpath, const char *path, int *fd)
+static int open_if_entry(struct tupfile *tf, struct tup_entry *dtent, const char *fullpath, const char *path, int *fd,
+			 struct tup_entry **tupfile_tent_out)
 {
 	struct tup_entry *tupfile_tent;
 	if(handle_file_dtent(ACCESS_READ, dtent, path, &tf->ps->s.finfo) < 0)
@@ -417,6 +445,7 @@ static int open_if_entry(struct tupfile *tf, struct tup_entry *dtent, const char
 		parser_error(tf, fullpath);
 		return -1;
 	}
+	*tupfile_tent_out = tupfile_tent;
 	return 0;
 }
 
@@ -436,7 +465,8 @@ static int parser_entry_open(struct tupfile *tf, struct tup_entry *tent)
 }
 
 static int open_tupfile(struct tupfile *tf, struct tup_entry *tent,
-			char *path, int *parser_lua, int *fd)
+			char *path, int *parser_lua, int *fd,
+			struct tup_entry **tupfile_tent)
 {
 	struct tup_entry *dtent;
 	int n = 0;
@@ -455,14 +485,14 @@ static int open_tupfile(struct tupfile *tf, struct tup_entry *tent,
 	}
 
 	strcpy(path, TUPFILE);
-	if(open_if_entry(tf, dtent, path, TUPFILE, fd) < 0)
+	if(open_if_entry(tf, dtent, path, TUPFILE, fd, tupfile_tent) < 0)
 		return -1;
 	if(*fd >= 0) {
 		return 0;
 	}
 
 	strcpy(path, TUPFILE_LUA);
-	if(open_if_entry(tf, dtent, path, TUPFILE_LUA, fd) < 0)
+	if(open_if_entry(tf, dtent, path, TUPFILE_LUA, fd, tupfile_tent) < 0)
 		return -1;
 	if(*fd >= 0) {
 		*parser_lua = 1;
@@ -472,14 +502,14 @@ static int open_tupfile(struct tupfile *tf, struct tup_entry *tent,
 	do {
 		int x;
 		strcpy(path + n*3, TUPDEFAULT);
-		if(open_if_entry(tf, dtent, path, TUPDEFAULT, fd) < 0)
+		if(open_if_entry(tf, dtent, path, TUPDEFAULT, fd, tupfile_tent) < 0)
 			return -1;
 		if(*fd >= 0) {
 			return 0;
 		}
 
 		strcpy(path + n*3, TUPDEFAULT_LUA);
-		if(open_if_entry(tf, dtent, path, TUPDEFAULT_LUA, fd) < 0)
+		if(open_if_entry(tf, dtent, path, TUPDEFAULT_LUA, fd, tupfile_tent) < 0)
 			return -1;
 		if(*fd >= 0) {
 			*parser_lua = 1;
@@ -549,19 +579,42 @@ static char *get_newline(char *p)
 	return newline;
 }
 
-static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename)
+static void free_tupfile_text(struct tupfile_text *text)
+{
+	free(text->raw.s);
+	free(text->split);
+	free(text->lines);
+	free(text);
+}
+
+void parser_free_text_cache(void)
+{
+	struct tupid_tree *tt;
+
+	while((tt = RB_ROOT(&text_root)) != NULL) {
+		struct tupfile_text *text = container_of(tt, struct tupfile_text, tnode);
+		tupid_tree_rm(&text_root, tt);
+		free_tupfile_text(text);
+	}
+}
+
+static int split_tupfile_text(struct tupfile *tf, struct tupfile_text *text)
 {
 	char *p, *e;
 	char *line;
 	int lno = 0;
-	struct if_stmt ifs;
-	int rc = 0;
-	char line_debug[128];
+	int max_lines = 0;
 
-	if_init(&ifs);
+	text->split = malloc(text->raw.len + 1);
+	if(!text->split) {
+		parser_error(tf, "malloc");
+		return -1;
+	}
+	memcpy(text->split, text->raw.s, text->raw.len + 1);
+	text->split_len = text->raw.len + 1;
 
-	p = b->s;
-	e = b->s + b->len;
+	p = text->split;
+	e = text->split + text->raw.len;
 
 	while(p < e) {
 		char *newline;
@@ -612,6 +665,85 @@ static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename
 			continue;
 		}
 
+		if(text->num_lines == max_lines) {
+			struct tupfile_line *tmp;
+
+			max_lines = max_lines ? max_lines * 2 : 64;
+			tmp = realloc(text->lines, max_lines * sizeof(*tmp));
+			if(!tmp) {
+				parser_error(tf, "realloc");
+				return -1;
+			}
+			text->lines = tmp;
+		}
+		text->lines[text->num_lines].offset = line - text->split;
+		text->lines[text->num_lines].lno = lno;
+		text->num_lines++;
+	}
+	return 0;
+}
+
+static struct tupfile_text *get_tupfile_text(struct tupfile *tf, struct tup_entry *tent,
+					     int fd, int split)
+{
+	struct tupid_tree *tt;
+	struct tupfile_text *text;
+
+	tt = tupid_tree_search(&text_root, tent->tnode.tupid);
+	if(tt) {
+		text = container_of(tt, struct tupfile_text, tnode);
+	} else {
+		text = calloc(1, sizeof *text);
+		if(!text) {
+			parser_error(tf, "calloc");
+			return NULL;
+		}
+		if(fslurp_null(fd, &text->raw) < 0) {
+			free(text);
+			return NULL;
+		}
+		text->tnode.tupid = tent->tnode.tupid;
+		if(tupid_tree_insert(&text_root, &text->tnode) < 0) {
+			free_tupfile_text(text);
+			return NULL;
+		}
+	}
+	if(split && !text->split) {
+		if(split_tupfile_text(tf, text) < 0) {
+			free(text->split);
+			text->split = NULL;
+			return NULL;
+		}
+	}
+	return text;
+}
+
+static int parse_tupfile(struct tupfile *tf, struct tupfile_text *text, const char *filename)
+{
+	char *buf;
+	char *line;
+	char *newline;
+	int lno;
+	int x;
+	struct if_stmt ifs;
+	int rc = 0;
+	char line_debug[128];
+
+	if_init(&ifs);
+
+	/* Evaluation modifies the lines, so work on a copy of the text. */
+	buf = malloc(text->split_len);
+	if(!buf) {
+		parser_error(tf, "malloc");
+		return -1;
+	}
+	memcpy(buf, text->split, text->split_len);
+
+	for(x=0; x<text->num_lines; x++) {
+		line = buf + text->lines[x].offset;
+		lno = text->lines[x].lno;
+		newline = line + strlen(line);
+
 		strncpy(line_debug, line, sizeof(line_debug) - 1);
 		memcpy(line_debug + sizeof(line_debug) - 4, "...", 4);
 
@@ -679,23 +811,28 @@ static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename
 
 		if(rc == ERROR_DIRECTIVE_ERROR) {
 			fprintf(tf->f, "tup error: Found 'error' command parsing %s line %i. Quitting.\n", filename, lno);
-			return -1;
+			goto out_err;
 		}
 		if(rc == SYNTAX_ERROR) {
 			fprintf(tf->f, "tup error: Syntax error parsing %s line %i\n  Line was: '%s'\n", filename, lno, line_debug);
-			return -1;
+			goto out_err;
 		}
 		if(rc < 0) {
 			fprintf(tf->f, "tup error: Error parsing %s line %i\n  Line was: '%s'\n", filename, lno, line_debug);
-			return -1;
+			goto out_err;
 		}
 	}
 	if(if_check(&ifs) < 0) {
 		fprintf(tf->f, "tup error: Error parsing %s: missing endif before EOF.\n", filename);
-		return -1;
+		goto out_err;
 	}
 
+	free(buf);
 	return 0;
+
+out_err:
+	free(buf);
+	return -1;
 }
 
 static int eval_eq(struct tupfile *tf, char *expr, char *eol)
@@ -1300,7 +1437,8 @@ out_close:
 
 int parser_include_file(struct tupfile *tf, const char *file)
 {
-	struct buf incb;
+	struct tupfile_text *text;
+	int is_lua;
 	int fd;
 	int rc = -1;
 	struct pel_group pg;
@@ -1356,21 +1494,21 @@ int parser_include_file(struct tupfile *tf, const char *file)
 	if(fd < 0) {
 		goto out_close_dfd;
 	}
-	if(fslurp_null(fd, &incb) < 0)
-		goto out_close;
 
 	lua = strstr(file, ".lua");
 	/* strcmp is to make sure .lua is at the end of the filename */
-	if(lua && strcmp(lua, ".lua") == 0) {
-		if(parse_lua_tupfile(tf, &incb, file) < 0)
-			goto out_free;
+	is_lua = lua && strcmp(lua, ".lua") == 0;
+	text = get_tupfile_text(tf, tent, fd, !is_lua);
+	if(!text)
+		goto out_close;
+	if(is_lua) {
+		if(parse_lua_tupfile(tf, &text->raw, file) < 0)
+			goto out_close;
 	} else {
-		if(parse_tupfile(tf, &incb, file) < 0)
-			goto out_free;
+		if(parse_tupfile(tf, text, file) < 0)
+			goto out_close;
 	}
 	rc = 0;
-out_free:
-	free(incb.s);
 out_close:
 	if(close(fd) < 0) {
 		parser_error(tf, "close(fd)");
@@ -3302,6 +3440,17 @@ static int do_rule_outputs(struct tupfile *tf, struct path_list_head *oplist, st
 	return rc;
 }
 
+static int has_depfile_output(struct name_list *nl)
+{
+	struct name_list_entry *nle;
+
+	TAILQ_FOREACH(nle, &nl->entries, list) {
+		if(nle->len > 2 && strcmp(nle->path + nle->len - 2, ".d") == 0)
+			return 1;
+	}
+	return 0;
+}
+
 struct command_split {
 	const char *flags;
 	int flagslen;
@@ -3435,6 +3584,13 @@ static int do_rule(struct tupfile *tf, struct rule *r, struct name_list *nl,
 		return -1;
 	free(variant_prefix.s);
 
+	if(memchr(cs.flags, 'd', cs.flagslen) != NULL) {
+		if(!has_depfile_output(&onl) && !has_depfile_output(&extra_onl)) {
+			fprintf(tf->f, "tup error: The 'd' flag requires a .d file in the outputs, where the command writes its dependencies (eg: gcc -MD -c %%f -o %%o |> %%B.o | %%B.d).\n");
+			return -1;
+		}
+	}
+
 	if(is_variant_copy) {
 		if(onl.num_entries != 1 || nl->num_entries != 1) {
 			fprintf(tf->f, "tup error: !tup_preserve requires a single input file.\n");
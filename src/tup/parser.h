@@ -173,6 +173,7 @@ struct graph;
 struct timespan;
 
 void parser_debug_run(void);
+void parser_free_text_cache(void);
 int parse(struct node *n, struct graph *g, struct timespan *ts, int refactoring, int use_server, int full_deps);
 char *eval(struct tupfile *tf, const char *string, int allow_nodes);
 
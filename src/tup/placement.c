@@ -0,0 +1,303 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#include "placement.h"
+#include "option.h"
+#include <stdio.h>
+
+#if defined(__linux__)
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+#define MAX_NODES 1024
+#define NODEMASK_LONGS (MAX_NODES / (8 * sizeof(unsigned long)))
+
+struct numa_node {
+	/* -1 if the system has no NUMA information, in which case the
+	 * memory policy is left alone.
+	 */
+	int id;
+	int num_cpus;
+	int *cpus;
+	cpu_set_t set;
+};
+
+static int placement_enabled = 0;
+static int num_nodes = 0;
+static struct numa_node *nodes = NULL;
+static cpu_set_t allowed;
+
+/* Parses a kernel cpulist/nodelist like "0-3,8,10-11" into a callback. */
+static int parse_list(const char *list, int (*callback)(int, void *), void *arg)
+{
+	const char *p = list;
+
+	while(*p && *p != '\n') {
+		char *end;
+		long first;
+		long last;
+		long x;
+
+		first = strtol(p, &end, 10);
+		if(end == p)
+			return -1;
+		last = first;
+		if(*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if(end == p)
+				return -1;
+		}
+		for(x=first; x<=last; x++) {
+			if(callback(x, arg) < 0)
+				return -1;
+		}
+		p = end;
+		if(*p == ',')
+			p++;
+	}
+	return 0;
+}
+
+static int read_list(const char *path, char *buf, int len)
+{
+	FILE *f;
+
+	f = fopen(path, "r");
+	if(!f)
+		return -1;
+	if(fgets(buf, len, f) == NULL) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int add_cpu(int cpu, void *arg)
+{
+	struct numa_node *node = arg;
+	int *tmp;
+
+	/* Only use the CPUs that tup itself is allowed to run on (eg: from
+	 * taskset or a cgroup cpuset).
+	 */
+	if(cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))
+		return 0;
+	tmp = realloc(node->cpus, (node->num_cpus + 1) * sizeof(*tmp));
+	if(!tmp) {
+		perror("realloc");
+		return -1;
+	}
+	node->cpus = tmp;
+	node->cpus[node->num_cpus] = cpu;
+	node->num_cpus++;
+	CPU_SET(cpu, &node->set);
+	return 0;
+}
+
+static int add_node(int id, void *arg)
+{
+	struct numa_node *tmp;
+	struct numa_node *node;
+	char path[64];
+	char buf[4096];
+
+	if(arg) {}
+	if(id >= MAX_NODES)
+		return 0;
+	tmp = realloc(nodes, (num_nodes + 1) * sizeof(*tmp));
+	if(!tmp) {
+		perror("realloc");
+		return -1;
+	}
+	nodes = tmp;
+	node = &nodes[num_nodes];
+	node->id = id;
+	node->num_cpus = 0;
+	node->cpus = NULL;
+	CPU_ZERO(&node->set);
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%i/cpulist", id);
+	if(read_list(path, buf, sizeof(buf)) < 0)
+		return 0;
+	if(parse_list(buf, add_cpu, node) < 0)
+		return -1;
+	/* Memory-only nodes and nodes we can't run on don't get slots. */
+	if(node->num_cpus)
+		num_nodes++;
+	else
+		free(node->cpus);
+	return 0;
+}
+
+int placement_pre_init(void)
+{
+	char buf[4096];
+	int x;
+
+	placement_enabled = tup_option_get_flag("updater.placement");
+	if(!placement_enabled)
+		return 0;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		perror("sched_getaffinity");
+		fprintf(stderr, "tup error: Unable to get the CPUs for updater.placement.\n");
+		return -1;
+	}
+	if(read_list("/sys/devices/system/node/online", buf, sizeof(buf)) == 0) {
+		if(parse_list(buf, add_node, NULL) < 0) {
+			fprintf(stderr, "tup error: Unable to read the NUMA topology for updater.placement.\n");
+			return -1;
+		}
+	}
+	if(num_nodes == 0) {
+		/* No NUMA support, so there's a single node with every CPU.
+		 */
+		nodes = calloc(1, sizeof(*nodes));
+		if(!nodes) {
+			perror("calloc");
+			return -1;
+		}
+		nodes[0].id = -1;
+		CPU_ZERO(&nodes[0].set);
+		for(x=0; x<CPU_SETSIZE; x++) {
+			if(CPU_ISSET(x, &allowed) && add_cpu(x, &nodes[0]) < 0)
+				return -1;
+		}
+		num_nodes = 1;
+	}
+	return 0;
+}
+
+static struct numa_node *slot_node(int slot)
+{
+	return &nodes[slot % num_nodes];
+}
+
+static int slot_cpu(int slot)
+{
+	struct numa_node *node = slot_node(slot);
+
+	return node->cpus[(slot / num_nodes) % node->num_cpus];
+}
+
+void placement_apply(int slot, int pin)
+{
+	struct numa_node *node;
+	cpu_set_t set;
+	unsigned long nodemask[NODEMASK_LONGS];
+
+	if(!placement_enabled || slot < 0 || num_nodes == 0)
+		return;
+	node = slot_node(slot);
+	if(pin) {
+		CPU_ZERO(&set);
+		CPU_SET(slot_cpu(slot), &set);
+	} else {
+		set = node->set;
+	}
+	/* Placement is only an optimization, so a failure here is a warning
+	 * in the command's output rather than a failed command.
+	 */
+	if(sched_setaffinity(0, sizeof(set), &set) < 0) {
+		fprintf(stderr, "tup warning: Unable to set the CPU affinity for updater.placement: %s\n", strerror(errno));
+	}
+	if(node->id >= 0) {
+		memset(nodemask, 0, sizeof(nodemask));
+		nodemask[node->id / (8 * sizeof(unsigned long))] |= 1UL << (node->id % (8 * sizeof(unsigned long)));
+		if(syscall(SYS_set_mempolicy, pin ? MPOL_BIND : MPOL_PREFERRED, nodemask, MAX_NODES) < 0 && errno != ENOSYS) {
+			fprintf(stderr, "tup warning: Unable to set the memory policy for updater.placement: %s\n", strerror(errno));
+		}
+	}
+}
+
+static int describe_cpus(char *buf, int len, struct numa_node *node)
+{
+	int rc = 0;
+	int x = 0;
+
+	while(x < node->num_cpus && rc < len) {
+		int y = x;
+
+		while(y + 1 < node->num_cpus && node->cpus[y + 1] == node->cpus[y] + 1)
+			y++;
+		if(y == x)
+			rc += snprintf(buf + rc, len - rc, "%s%i", x ? "," : "", node->cpus[x]);
+		else
+			rc += snprintf(buf + rc, len - rc, "%s%i-%i", x ? "," : "", node->cpus[x], node->cpus[y]);
+		x = y + 1;
+	}
+	return rc;
+}
+
+int placement_describe(int slot, int pin, char *buf, int len)
+{
+	struct numa_node *node;
+	int rc;
+
+	if(!placement_enabled || slot < 0 || num_nodes == 0)
+		return 0;
+	node = slot_node(slot);
+	if(node->id >= 0)
+		rc = snprintf(buf, len, "slot %i on NUMA node %i, ", slot, node->id);
+	else
+		rc = snprintf(buf, len, "slot %i, ", slot);
+	if(rc >= len)
+		return rc;
+	if(pin) {
+		rc += snprintf(buf + rc, len - rc, "pinned to CPU %i", slot_cpu(slot));
+	} else {
+		rc += snprintf(buf + rc, len - rc, "CPUs ");
+		if(rc < len)
+			rc += describe_cpus(buf + rc, len - rc, node);
+	}
+	return rc;
+}
+#else
+int placement_pre_init(void)
+{
+	if(tup_option_get_flag("updater.placement")) {
+		fprintf(stderr, "tup warning: updater.placement is only supported on Linux.\n");
+	}
+	return 0;
+}
+
+void placement_apply(int slot, int pin)
+{
+	if(slot || pin) {/* unsupported */}
+}
+
+int placement_describe(int slot, int pin, char *buf, int len)
+{
+	if(slot || pin || buf || len) {/* unsupported */}
+	return 0;
+}
+#endif
@@ -0,0 +1,46 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef tup_placement_h
+#define tup_placement_h
+
+/* CPU and NUMA placement of commands (updater.placement). Each job slot (the
+ * updater thread that runs the command) is assigned to a NUMA node
+ * round-robin, and commands run in that slot are limited to the node's CPUs
+ * and prefer its memory. Commands with the ^p flag are pinned to a single
+ * CPU of the node, and their memory is bound to it.
+ */
+
+/* Reads the option and the CPU topology. This happens before the server
+ * forks off the process that runs commands, so that it has the same view.
+ */
+int placement_pre_init(void);
+
+/* Applies the placement for a slot in a forked child before it execs the
+ * command. A slot of -1 means the command is not placed.
+ */
+void placement_apply(int slot, int pin);
+
+/* Writes a description of where a slot's commands run, for --verbose.
+ * Returns 0 if placement is disabled.
+ */
+int placement_describe(int slot, int pin, char *buf, int len);
+
+#endif
@@ -0,0 +1,302 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#include "prefetch.h"
+#include "entry.h"
+#include "db.h"
+#include "config.h"
+#include "tent_tree.h"
+#include "bsd/queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+enum prefetch_state {
+	PREFETCH_QUEUED,
+	PREFETCH_RUNNING,
+	PREFETCH_DONE,
+};
+
+struct prefetch_cmd {
+	TAILQ_ENTRY(prefetch_cmd) list;
+	struct tup_entry *tent;
+	enum prefetch_state state;
+	int dispatched;
+};
+TAILQ_HEAD(prefetch_cmd_head, prefetch_cmd);
+
+static int prefetch_active = 0;
+static int lookahead = 0;
+static int quit = 0;
+static pthread_t tid;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t *dbm;
+static struct prefetch_cmd_head cmd_list = TAILQ_HEAD_INITIALIZER(cmd_list);
+
+/* Commands whose inputs were read ahead before they started, ones that
+ * started while theirs were still queued or in progress, and ones that
+ * started before they were ever queued.
+ */
+static int num_ahead = 0;
+static int num_late = 0;
+static int num_unqueued = 0;
+static int num_files = 0;
+static long long num_bytes = 0;
+
+static int add_path(char ***paths, int *num, int *size, struct tup_entry *tent)
+{
+	char buf[PATH_MAX];
+	int len;
+
+	if(tent->type != TUP_NODE_FILE && tent->type != TUP_NODE_GENERATED)
+		return 0;
+	len = snprint_tup_entry(buf, sizeof(buf), tent);
+	if(len <= 1 || len >= (int)sizeof(buf))
+		return 0;
+	if(*num == *size) {
+		char **tmp;
+
+		*size = *size ? *size * 2 : 16;
+		tmp = realloc(*paths, *size * sizeof(**paths));
+		if(!tmp) {
+			perror("realloc");
+			return -1;
+		}
+		*paths = tmp;
+	}
+	/* Entries print with a leading '/' relative to the top of the tup
+	 * hierarchy, so skipping it gives a path for openat(). Files outside
+	 * of tup (under the "/" entry) end up as absolute paths.
+	 */
+	(*paths)[*num] = strdup(buf + 1);
+	if(!(*paths)[*num]) {
+		perror("strdup");
+		return -1;
+	}
+	(*num)++;
+	return 0;
+}
+
+static void read_ahead(const char *path, int *files, long long *bytes)
+{
+	struct stat st;
+	int fd;
+
+	fd = openat(tup_top_fd(), path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+#if defined(__linux__)
+		readahead(fd, 0, st.st_size);
+#elif defined(POSIX_FADV_WILLNEED)
+		posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+#endif
+		(*files)++;
+		*bytes += st.st_size;
+	}
+	close(fd);
+}
+
+static void prefetch_inputs(struct tup_entry *tent)
+{
+	struct tent_entries sticky_root = TENT_ENTRIES_INITIALIZER;
+	struct tent_entries normal_root = TENT_ENTRIES_INITIALIZER;
+	struct tent_tree *tt;
+	char **paths = NULL;
+	int num = 0;
+	int size = 0;
+	int files = 0;
+	long long bytes = 0;
+	int rc;
+	int x;
+
+	pthread_mutex_lock(dbm);
+	rc = tup_db_get_inputs(tent->tnode.tupid, &sticky_root, &normal_root, NULL);
+	if(rc == 0) {
+		RB_FOREACH(tt, tent_entries, &normal_root) {
+			if(add_path(&paths, &num, &size, tt->tent) < 0)
+				break;
+		}
+		RB_FOREACH(tt, tent_entries, &sticky_root) {
+			if(tent_tree_search(&normal_root, tt->tent))
+				continue;
+			if(add_path(&paths, &num, &size, tt->tent) < 0)
+				break;
+		}
+	}
+	free_tent_tree(&sticky_root);
+	free_tent_tree(&normal_root);
+	pthread_mutex_unlock(dbm);
+
+	for(x=0; x<num; x++) {
+		read_ahead(paths[x], &files, &bytes);
+		free(paths[x]);
+	}
+	free(paths);
+
+	pthread_mutex_lock(&lock);
+	num_files += files;
+	num_bytes += bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+static void *prefetch_thread(void *arg)
+{
+	if(arg) {}
+
+	pthread_mutex_lock(&lock);
+	while(!quit) {
+		struct prefetch_cmd *pc;
+
+		TAILQ_FOREACH(pc, &cmd_list, list) {
+			if(pc->state == PREFETCH_QUEUED)
+				break;
+		}
+		if(!pc) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		pc->state = PREFETCH_RUNNING;
+		pthread_mutex_unlock(&lock);
+
+		prefetch_inputs(pc->tent);
+
+		pthread_mutex_lock(&lock);
+		if(pc->dispatched) {
+			TAILQ_REMOVE(&cmd_list, pc, list);
+			free(pc);
+		} else {
+			pc->state = PREFETCH_DONE;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+int prefetch_init(int depth, pthread_mutex_t *db_mutex)
+{
+	if(depth <= 0)
+		return 0;
+	dbm = db_mutex;
+	lookahead = depth;
+	quit = 0;
+	num_ahead = 0;
+	num_late = 0;
+	num_unqueued = 0;
+	num_files = 0;
+	num_bytes = 0;
+	if(pthread_create(&tid, NULL, prefetch_thread, NULL) != 0) {
+		perror("pthread_create");
+		fprintf(stderr, "tup error: Unable to create the prefetch thread.\n");
+		return -1;
+	}
+	prefetch_active = 1;
+	return 0;
+}
+
+void prefetch_exit(void)
+{
+	struct prefetch_cmd *pc;
+	int total;
+
+	if(!prefetch_active)
+		return;
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(tid, NULL);
+	prefetch_active = 0;
+
+	while(!TAILQ_EMPTY(&cmd_list)) {
+		pc = TAILQ_FIRST(&cmd_list);
+		TAILQ_REMOVE(&cmd_list, pc, list);
+		free(pc);
+	}
+
+	total = num_ahead + num_late + num_unqueued;
+	if(total) {
+		printf("tup: Prefetched inputs ahead of time for %i of %i commands (%i%%), %i late, %i not queued. Read ahead %i files (%.1f MiB).\n",
+		       num_ahead, total, num_ahead * 100 / total, num_late, num_unqueued,
+		       num_files, num_bytes / (1024.0 * 1024.0));
+	}
+}
+
+int prefetch_depth(void)
+{
+	return prefetch_active ? lookahead : 0;
+}
+
+void prefetch_command(struct tup_entry *tent)
+{
+	struct prefetch_cmd *pc;
+
+	if(!prefetch_active)
+		return;
+	pc = malloc(sizeof *pc);
+	if(!pc) {
+		/* Prefetching is only a hint, so just skip it. */
+		perror("malloc");
+		return;
+	}
+	pc->tent = tent;
+	pc->state = PREFETCH_QUEUED;
+	pc->dispatched = 0;
+	pthread_mutex_lock(&lock);
+	TAILQ_INSERT_TAIL(&cmd_list, pc, list);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void prefetch_dispatch(struct tup_entry *tent)
+{
+	struct prefetch_cmd *pc;
+
+	if(!prefetch_active)
+		return;
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH(pc, &cmd_list, list) {
+		if(pc->tent == tent)
+			break;
+	}
+	if(!pc) {
+		num_unqueued++;
+	} else if(pc->state == PREFETCH_DONE) {
+		num_ahead++;
+		TAILQ_REMOVE(&cmd_list, pc, list);
+		free(pc);
+	} else if(pc->state == PREFETCH_RUNNING) {
+		/* The prefetch thread frees it when it is done. */
+		num_late++;
+		pc->dispatched = 1;
+	} else {
+		/* Too late to be useful, so don't bother. */
+		num_late++;
+		TAILQ_REMOVE(&cmd_list, pc, list);
+		free(pc);
+	}
+	pthread_mutex_unlock(&lock);
+}
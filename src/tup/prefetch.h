@@ -0,0 +1,54 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef tup_prefetch_h
+#define tup_prefetch_h
+
+#include <pthread.h>
+
+struct tup_entry;
+
+/* Input readahead (updater.prefetch). As commands become ready in the DAG, a
+ * background thread looks up the inputs they used the last time they ran and
+ * asks the kernel to start reading them into the page cache, so a cold build
+ * doesn't stall each command on synchronous disk I/O.
+ */
+
+/* Starts the prefetch thread if depth is greater than zero. The thread takes
+ * db_mutex while it reads a command's inputs from the database.
+ */
+int prefetch_init(int depth, pthread_mutex_t *db_mutex);
+
+/* Stops the thread and prints the hit-rate statistics. */
+void prefetch_exit(void);
+
+/* Returns how many ready commands to look ahead, or 0 if prefetching is off.
+ */
+int prefetch_depth(void);
+
+/* Queues a command that is ready to run. */
+void prefetch_command(struct tup_entry *tent);
+
+/* Tells the prefetcher that a command is starting, which is where the hits
+ * are counted.
+ */
+void prefetch_dispatch(struct tup_entry *tent);
+
+#endif
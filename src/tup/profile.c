@@ -0,0 +1,147 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "profile.h"
+#include "timespan.h"
+#include <string.h>
+
+#define PROFILE_MAX_DEPTH 4
+
+static const char *phase_names[PROFILE_NUM_PHASES] = {
+	"scan",
+	"config",
+	"parse",
+	"delete",
+	"gitignore",
+	"update",
+	"commit",
+};
+
+struct phase_profile {
+	double seconds;
+	long counts[PROFILE_NUM_COUNTERS];
+	int used;
+};
+
+static int enabled = 0;
+static struct phase_profile phases[PROFILE_NUM_PHASES];
+static long counters[PROFILE_NUM_COUNTERS];
+static long sampled[PROFILE_NUM_COUNTERS];
+static struct timespan phase_ts;
+static int stack[PROFILE_MAX_DEPTH];
+static int depth = 0;
+
+void profile_enable(void)
+{
+	enabled = 1;
+}
+
+int profile_enabled(void)
+{
+	return enabled;
+}
+
+/* Charges the time and counts since the last switch to the current phase. */
+static void charge_current(void)
+{
+	struct phase_profile *pp;
+	int x;
+
+	if(depth == 0)
+		return;
+	pp = &phases[stack[depth-1]];
+	timespan_end(&phase_ts);
+	pp->seconds += timespan_seconds(&phase_ts);
+	for(x=0; x<PROFILE_NUM_COUNTERS; x++) {
+		pp->counts[x] += counters[x] - sampled[x];
+		sampled[x] = counters[x];
+	}
+	pp->used = 1;
+	timespan_start(&phase_ts);
+}
+
+void profile_phase(enum profile_phase phase)
+{
+	if(!enabled)
+		return;
+	charge_current();
+	if(depth == 0) {
+		timespan_start(&phase_ts);
+		memcpy(sampled, counters, sizeof(sampled));
+		depth = 1;
+	}
+	stack[depth-1] = phase;
+}
+
+void profile_push(enum profile_phase phase)
+{
+	if(!enabled || depth == 0 || depth == PROFILE_MAX_DEPTH)
+		return;
+	charge_current();
+	stack[depth] = phase;
+	depth++;
+}
+
+void profile_pop(void)
+{
+	if(!enabled || depth <= 1)
+		return;
+	charge_current();
+	depth--;
+}
+
+void profile_count(enum profile_counter counter, int num)
+{
+	if(enabled)
+		counters[counter] += num;
+}
+
+void profile_print(FILE *f)
+{
+	struct phase_profile total;
+	int x;
+	int y;
+
+	if(!enabled)
+		return;
+	charge_current();
+	depth = 0;
+
+	memset(&total, 0, sizeof(total));
+	fprintf(f, "tup: Update profile:\n");
+	fprintf(f, "%-10s %10s %10s %10s %10s %12s\n", "phase", "time(s)", "nodes", "edges", "sql", "file events");
+	for(x=0; x<PROFILE_NUM_PHASES; x++) {
+		struct phase_profile *pp = &phases[x];
+
+		if(!pp->used)
+			continue;
+		fprintf(f, "%-10s %10.3f %10li %10li %10li %12li\n", phase_names[x], pp->seconds,
+			pp->counts[PROFILE_NODES], pp->counts[PROFILE_EDGES],
+			pp->counts[PROFILE_SQL], pp->counts[PROFILE_FILE_EVENTS]);
+		total.seconds += pp->seconds;
+		for(y=0; y<PROFILE_NUM_COUNTERS; y++)
+			total.counts[y] += pp->counts[y];
+	}
+	fprintf(f, "%-10s %10.3f %10li %10li %10li %12li\n", "total", total.seconds,
+		total.counts[PROFILE_NODES], total.counts[PROFILE_EDGES],
+		total.counts[PROFILE_SQL], total.counts[PROFILE_FILE_EVENTS]);
+	memset(phases, 0, sizeof(phases));
+}
@@ -0,0 +1,59 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef tup_profile_h
+#define tup_profile_h
+
+#include <stdio.h>
+
+/* Per-phase timing and counters for an update, enabled with --profile or the
+ * display.profile option. Time and counts are charged to whichever phase is
+ * current, so a phase pushed on top of another (such as a commit) is not
+ * counted twice.
+ */
+enum profile_phase {
+	PROFILE_SCAN,
+	PROFILE_CONFIG,
+	PROFILE_PARSE,
+	PROFILE_DELETE,
+	PROFILE_GITIGNORE,
+	PROFILE_UPDATE,
+	PROFILE_COMMIT,
+	PROFILE_NUM_PHASES,
+};
+
+enum profile_counter {
+	PROFILE_NODES,
+	PROFILE_EDGES,
+	PROFILE_SQL,
+	PROFILE_FILE_EVENTS,
+	PROFILE_NUM_COUNTERS,
+};
+
+void profile_enable(void);
+int profile_enabled(void);
+void profile_phase(enum profile_phase phase);
+void profile_push(enum profile_phase phase);
+void profile_pop(void);
+void profile_count(enum profile_counter counter, int num);
+void profile_print(FILE *f);
+
+#endif
@@ -40,6 +40,8 @@ struct server {
 	int output_fd;
 	int error_fd;
 	pthread_mutex_t *error_mutex;
+	int slot; /* For updater.placement, or -1 */
+	int pin;
 };
 
 struct parser_directory {
@@ -67,7 +69,10 @@ int server_post_exit(void);
 int server_init(enum server_mode mode);
 int server_quit(void);
 int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
-		struct tup_entry *dtent, int need_namespacing, int run_in_bash);
+		struct tup_entry *dtent, int need_namespacing, int run_in_bash,
+		int untracked);
+int server_exec_worker(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
+		       struct tup_entry *dtent, int untracked);
 int server_postexec(struct server *s);
 int server_unlink(void);
 int server_is_dead(void);
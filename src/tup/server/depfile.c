@@ -18,6 +18,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
 #include "tup/server.h"
 #include "tup/config.h"
 #include "tup/flist.h"
@@ -26,6 +27,7 @@
 #include "tup/variant.h"
 #include "tup/lock.h"
 #include "tup/progress.h"
+#include "tup/placement.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,15 +38,47 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
 
 #define TUP_TMP ".tup/tmp"
 #define LDPRELOAD_NAME "LD_PRELOAD"
+#define WORKER_ENV "TUP_WORKER=1"
+
+/* A long-lived process that runs ^w commands. Each worker has its own
+ * depfile, which the ldpreload library keeps open for the life of the
+ * process. The events written before the worker says it is ready are the
+ * startup accesses (the worker binary, its libraries, etc), and are
+ * attributed to every job the worker runs. Between jobs the depfile is
+ * truncated back to that point, so everything after it belongs to the
+ * job in flight.
+ */
+struct worker {
+	struct worker *next;
+	char *program;
+	dev_t dir_dev;
+	ino_t dir_ino;
+	char *envblock;
+	int block_size;
+	int untracked;
+	int busy;
+	int id;
+	pid_t pid;
+	int req_fd;
+	FILE *resp;
+	int depfd;
+	off_t startup_end;
+	char depfile[PATH_MAX];
+};
 
 static void sighandler(int sig);
-static int process_depfile(struct server *s, int fd);
+static int process_depfile(struct server *s, int fd, off_t len);
+static int worker_wait(struct worker *w);
 static int server_inited = 0;
 static int null_fd = -1;
 static char ldpreload_path[PATH_MAX];
+static struct worker *workers = NULL;
+static int num_workers = 0;
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static struct sigaction sigact = {
 	.sa_handler = sighandler,
@@ -77,7 +111,7 @@ int server_post_exit(void)
 	return 0;
 }
 
-static char **server_setenv(struct tup_env *env, int vardict_fd, const char *depfile)
+static char **server_setenv(struct tup_env *env, int vardict_fd, const char *depfile, int untracked, int worker)
 {
 	char *preloadenv;
 	char **envp;
@@ -88,17 +122,31 @@ static char **server_setenv(struct tup_env *env, int vardict_fd, const char *dep
 	len = strlen(TUP_DEPFILE) + 1 + strlen(depfile) + 1;
 	len += strlen(TUP_VARDICT_NAME) + 1 + 32 + 1;
 	len += strlen(LDPRELOAD_NAME) + 1 + strlen(ldpreload_path) + 1;
+	len += strlen(WORKER_ENV) + 1;
 
 	preloadenv = malloc(len);
 	if(!preloadenv) {
 		perror("malloc");
 		return NULL;
 	}
-	snprintf(preloadenv, len, "%s=%s%c%s=%i%c%s=%s%c", TUP_DEPFILE, depfile, 0, TUP_VARDICT_NAME, vardict_fd, 0, LDPRELOAD_NAME, ldpreload_path, 0);
+	if(untracked) {
+		/* Without the preload library, nothing is written to the
+		 * depfile. The dependencies are imported by the updater.
+		 */
+		snprintf(preloadenv, len, "%s=%s%c%s=%i%c", TUP_DEPFILE, depfile, 0, TUP_VARDICT_NAME, vardict_fd, 0);
+	} else {
+		snprintf(preloadenv, len, "%s=%s%c%s=%i%c%s=%s%c", TUP_DEPFILE, depfile, 0, TUP_VARDICT_NAME, vardict_fd, 0, LDPRELOAD_NAME, ldpreload_path, 0);
+	}
+	if(worker) {
+		int used = 0;
+		while(preloadenv[used])
+			used += strlen(preloadenv + used) + 1;
+		snprintf(preloadenv + used, len - used, "%s%c", WORKER_ENV, 0);
+	}
 
-	/* +3 for our variables, and +1 for the terminating NULL pointer.
+	/* +4 for our variables, and +1 for the terminating NULL pointer.
 	 */
-	envp = malloc((env->num_entries + 4) * sizeof(*envp));
+	envp = malloc((env->num_entries + 5) * sizeof(*envp));
 	if(!envp) {
 		perror("malloc");
 		return NULL;
@@ -201,12 +249,18 @@ int server_init(enum server_mode mode)
 
 int server_quit(void)
 {
+	while(workers) {
+		struct worker *w = workers;
+		workers = w->next;
+		worker_wait(w);
+	}
 	close(null_fd);
 	return 0;
 }
 
-static int run_subprocess(int ofd, int dfd, const char *cmd, const char *depfile, struct tup_env *env, int run_in_bash, int *status)
+static int run_subprocess(struct server *s, int dfd, const char *cmd, const char *depfile, struct tup_env *env, int run_in_bash, int untracked, int *status)
 {
+	int ofd = s->output_fd;
 	int pid;
 	int vardict_fd = -1; /* TODO */
 	pid = fork();
@@ -233,7 +287,8 @@ static int run_subprocess(int ofd, int dfd, const char *cmd, const char *depfile
 			perror("fchdir");
 			exit(1);
 		}
-		envp = server_setenv(env, vardict_fd, depfile);
+		placement_apply(s->slot, s->pin);
+		envp = server_setenv(env, vardict_fd, depfile, untracked, 0);
 		if(!envp) {
 			exit(1);
 		}
@@ -269,7 +324,8 @@ static void server_unlock(struct server *s)
 }
 
 int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
-		struct tup_entry *dtent, int need_namespacing, int run_in_bash)
+		struct tup_entry *dtent, int need_namespacing, int run_in_bash,
+		int untracked)
 {
 	int fd;
 	char depfile[PATH_MAX];
@@ -293,11 +349,11 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 		perror(buf);
 		return -1;
 	}
-	if(run_subprocess(s->output_fd, dfd, cmd, depfile, newenv, run_in_bash, &status) < 0) {
+	if(run_subprocess(s, dfd, cmd, depfile, newenv, run_in_bash, untracked, &status) < 0) {
 		close(fd);
 		return -1;
 	}
-	if(process_depfile(s, fd) < 0)
+	if(process_depfile(s, fd, -1) < 0)
 		return -1;
 	if(close(fd) < 0) {
 		perror("close(fd)");
@@ -324,6 +380,385 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 	return 0;
 }
 
+static int write_all(int fd, const char *data, size_t len)
+{
+	while(len > 0) {
+		ssize_t rc;
+
+		rc = write(fd, data, len);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/* Splits a ^w command into the worker program (the first word) and the
+ * arguments that are sent to the worker for each job.
+ */
+static char *worker_program(const char *cmd, const char **args)
+{
+	const char *p = cmd;
+	const char *end;
+	char *program;
+
+	while(*p == ' ' || *p == '\t')
+		p++;
+	end = p;
+	while(*end && *end != ' ' && *end != '\t')
+		end++;
+	if(end == p) {
+		fprintf(stderr, "tup error: The 'w' flag requires the command to start with the worker program.\n");
+		return NULL;
+	}
+	program = strndup(p, end - p);
+	if(!program) {
+		perror("strndup");
+		return NULL;
+	}
+	while(*end == ' ' || *end == '\t')
+		end++;
+	*args = end;
+	return program;
+}
+
+static int worker_matches(struct worker *w, const char *program, struct stat *dirst,
+			  struct tup_env *newenv, int untracked)
+{
+	if(w->busy || w->untracked != untracked)
+		return 0;
+	if(strcmp(w->program, program) != 0)
+		return 0;
+	/* A relative path like ./cc-worker names a different program in each
+	 * directory.
+	 */
+	if(program[0] != '/' && strchr(program, '/') != NULL) {
+		if(w->dir_dev != dirst->st_dev || w->dir_ino != dirst->st_ino)
+			return 0;
+	}
+	if(w->block_size != newenv->block_size)
+		return 0;
+	return memcmp(w->envblock, newenv->envblock, w->block_size) == 0;
+}
+
+static int worker_start(struct worker *w, int dfd, struct tup_env *newenv)
+{
+	int req[2];
+	int resp[2];
+	char line[64];
+	struct stat st;
+
+	snprintf(w->depfile, PATH_MAX, "%s/%s/worker-deps-%i", get_tup_top(), TUP_TMP, w->id);
+	w->depfile[PATH_MAX-1] = 0;
+	w->depfd = open(w->depfile, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(w->depfd < 0) {
+		perror(w->depfile);
+		fprintf(stderr, "tup error: Unable to create dependency file for the worker.\n");
+		return -1;
+	}
+	if(pipe2(req, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		return -1;
+	}
+	if(pipe2(resp, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		close(req[0]);
+		close(req[1]);
+		return -1;
+	}
+	w->pid = fork();
+	if(w->pid == 0) {
+		char **envp;
+		char *shcmd;
+
+		tup_lock_closeall();
+		if(dup2(req[0], STDIN_FILENO) < 0) {
+			perror("dup2");
+			fprintf(stderr, "tup error: Unable to dup stdin for the worker.\n");
+			exit(1);
+		}
+		if(dup2(resp[1], STDOUT_FILENO) < 0) {
+			perror("dup2");
+			fprintf(stderr, "tup error: Unable to dup stdout for the worker.\n");
+			exit(1);
+		}
+		if(fchdir(dfd) < 0) {
+			perror("fchdir");
+			exit(1);
+		}
+		envp = server_setenv(newenv, -1, w->depfile, w->untracked, 1);
+		if(!envp)
+			exit(1);
+		if(asprintf(&shcmd, "exec %s", w->program) < 0) {
+			perror("asprintf");
+			exit(1);
+		}
+		execle("/bin/sh", "/bin/sh", "-e", "-c", shcmd, NULL, envp);
+		perror("execl");
+		exit(1);
+	}
+	close(req[0]);
+	close(resp[1]);
+	if(w->pid < 0) {
+		perror("fork");
+		close(req[1]);
+		close(resp[0]);
+		return -1;
+	}
+	w->req_fd = req[1];
+	w->resp = fdopen(resp[0], "r");
+	if(!w->resp) {
+		perror("fdopen");
+		close(resp[0]);
+		return -1;
+	}
+
+	/* Everything the worker touched before it is ready to take jobs is
+	 * written to the depfile by now.
+	 */
+	if(fgets(line, sizeof(line), w->resp) == NULL || strcmp(line, "ready\n") != 0) {
+		fprintf(stderr, "tup error: Worker '%s' did not start. It must print 'ready' on stdout when it is able to accept jobs.\n", w->program);
+		return -1;
+	}
+	if(fstat(w->depfd, &st) < 0) {
+		perror("fstat");
+		return -1;
+	}
+	w->startup_end = st.st_size;
+	return 0;
+}
+
+static int worker_wait(struct worker *w)
+{
+	int status = 0;
+
+	if(w->req_fd >= 0)
+		close(w->req_fd);
+	if(w->resp)
+		fclose(w->resp);
+	if(w->pid > 0) {
+		if(waitpid(w->pid, &status, 0) < 0)
+			perror("waitpid");
+	}
+	if(w->depfd >= 0) {
+		close(w->depfd);
+		unlink(w->depfile);
+	}
+	free(w->program);
+	free(w->envblock);
+	free(w);
+	return status;
+}
+
+static struct worker *worker_get(const char *program, int dfd, struct stat *dirst,
+				 struct tup_env *newenv, int untracked)
+{
+	struct worker *w;
+
+	pthread_mutex_lock(&worker_mutex);
+	for(w=workers; w; w=w->next) {
+		if(worker_matches(w, program, dirst, newenv, untracked)) {
+			w->busy = 1;
+			pthread_mutex_unlock(&worker_mutex);
+			return w;
+		}
+	}
+	w = calloc(1, sizeof *w);
+	if(w)
+		w->id = num_workers++;
+	pthread_mutex_unlock(&worker_mutex);
+	if(!w) {
+		perror("calloc");
+		return NULL;
+	}
+
+	w->req_fd = -1;
+	w->depfd = -1;
+	w->busy = 1;
+	w->untracked = untracked;
+	w->dir_dev = dirst->st_dev;
+	w->dir_ino = dirst->st_ino;
+	w->program = strdup(program);
+	w->envblock = malloc(newenv->block_size);
+	if(!w->program || !w->envblock) {
+		perror("malloc");
+		worker_wait(w);
+		return NULL;
+	}
+	memcpy(w->envblock, newenv->envblock, newenv->block_size);
+	w->block_size = newenv->block_size;
+	if(worker_start(w, dfd, newenv) < 0) {
+		worker_wait(w);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&worker_mutex);
+	w->next = workers;
+	workers = w;
+	pthread_mutex_unlock(&worker_mutex);
+	return w;
+}
+
+static int worker_remove(struct worker *w)
+{
+	struct worker **pw;
+
+	pthread_mutex_lock(&worker_mutex);
+	for(pw=&workers; *pw; pw=&(*pw)->next) {
+		if(*pw == w) {
+			*pw = w->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&worker_mutex);
+	return worker_wait(w);
+}
+
+static int worker_request(struct worker *w, const char *dir, const char *args)
+{
+	sigset_t pipeset;
+	sigset_t oldset;
+	int rc;
+
+	/* A worker that died would otherwise take tup down with SIGPIPE. */
+	sigemptyset(&pipeset);
+	sigaddset(&pipeset, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeset, &oldset);
+	rc = write_all(w->req_fd, dir, strlen(dir));
+	if(rc == 0)
+		rc = write_all(w->req_fd, "\n", 1);
+	if(rc == 0)
+		rc = write_all(w->req_fd, args, strlen(args));
+	if(rc == 0)
+		rc = write_all(w->req_fd, "\n", 1);
+	if(rc < 0 && errno == EPIPE) {
+		struct timespec zero = {0, 0};
+		sigtimedwait(&pipeset, NULL, &zero);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	return rc;
+}
+
+static int worker_response(struct worker *w, int ofd, int *status)
+{
+	char line[64];
+	char buf[4096];
+	long outlen;
+
+	if(fgets(line, sizeof(line), w->resp) == NULL)
+		return -1;
+	if(sscanf(line, "%i %li", status, &outlen) != 2 || outlen < 0)
+		return -1;
+	while(outlen > 0) {
+		size_t num = outlen < (long)sizeof(buf) ? (size_t)outlen : sizeof(buf);
+
+		if(fread(buf, 1, num, w->resp) != num)
+			return -1;
+		if(write_all(ofd, buf, num) < 0) {
+			perror("write");
+			return -1;
+		}
+		outlen -= num;
+	}
+	return 0;
+}
+
+int server_exec_worker(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
+		       struct tup_entry *dtent, int untracked)
+{
+	struct worker *w;
+	struct stat dirst;
+	struct stat st;
+	char dir[PATH_MAX];
+	char buf[64];
+	char *program;
+	const char *args;
+	ssize_t dirlen;
+	int status;
+
+	if(dtent) {}
+
+	program = worker_program(cmd, &args);
+	if(!program)
+		return -1;
+	if(fstat(dfd, &dirst) < 0) {
+		perror("fstat");
+		goto err_free;
+	}
+	snprintf(buf, sizeof(buf), "/proc/self/fd/%i", dfd);
+	dirlen = readlink(buf, dir, sizeof(dir) - 1);
+	if(dirlen < 0) {
+		perror(buf);
+		fprintf(stderr, "tup error: Unable to determine the working directory for the worker.\n");
+		goto err_free;
+	}
+	dir[dirlen] = 0;
+
+	snprintf(buf, sizeof(buf), ".tup/tmp/output-%i", s->id);
+	s->output_fd = open(buf, O_CREAT | O_RDWR | O_CLOEXEC | O_TRUNC, 0600);
+	if(s->output_fd < 0) {
+		perror(buf);
+		goto err_free;
+	}
+
+	w = worker_get(program, dfd, &dirst, newenv, untracked);
+	if(!w)
+		goto err_free;
+	if(ftruncate(w->depfd, w->startup_end) < 0) {
+		perror("ftruncate");
+		worker_remove(w);
+		goto err_free;
+	}
+	if(worker_request(w, dir, args) < 0 || worker_response(w, s->output_fd, &status) < 0) {
+		/* The worker went away in the middle of the job, so report
+		 * the job as failed the way a crashed command would be.
+		 */
+		status = worker_remove(w);
+		dprintf(s->output_fd, "tup error: Worker '%s' exited without finishing the job.\n", program);
+		if(WIFSIGNALED(status)) {
+			s->signalled = 1;
+			s->exit_sig = WTERMSIG(status);
+		} else {
+			s->exited = 1;
+			s->exit_status = WEXITSTATUS(status) ? WEXITSTATUS(status) : 1;
+		}
+		free(program);
+		return 0;
+	}
+
+	if(fstat(w->depfd, &st) < 0) {
+		perror("fstat");
+		worker_remove(w);
+		goto err_free;
+	}
+	if(lseek(w->depfd, 0, SEEK_SET) < 0) {
+		perror("lseek");
+		worker_remove(w);
+		goto err_free;
+	}
+	if(process_depfile(s, w->depfd, st.st_size) < 0) {
+		worker_remove(w);
+		goto err_free;
+	}
+
+	pthread_mutex_lock(&worker_mutex);
+	w->busy = 0;
+	pthread_mutex_unlock(&worker_mutex);
+
+	s->exited = 1;
+	s->exit_status = status;
+	free(program);
+	return 0;
+
+err_free:
+	free(program);
+	return -1;
+}
+
 int server_postexec(struct server *s)
 {
 	char buf[64];
@@ -380,12 +815,16 @@ int serverless_run_script(FILE *f, const char *cmdline,
 	return -1;
 }
 
-static int process_depfile(struct server *s, int fd)
+/* Reads len bytes of events from the current position in the depfile, or up
+ * to the end of the file if len is negative.
+ */
+static int process_depfile(struct server *s, int fd, off_t len)
 {
 	char event1[PATH_MAX];
 	char event2[PATH_MAX];
+	off_t consumed = 0;
 
-	while(1) {
+	while(len < 0 || consumed < len) {
 		struct access_event event;
 		int rc;
 
@@ -397,6 +836,7 @@ static int process_depfile(struct server *s, int fd)
 			fprintf(stderr, "tup error: Unable to read the access_event structure from the dependency file.\n");
 			return -1;
 		}
+		consumed += sizeof(event);
 
 		if(!event.len)
 			continue;
@@ -421,6 +861,8 @@ static int process_depfile(struct server *s, int fd)
 			return -1;
 		}
 
+		consumed += event.len + 1 + event.len2 + 1;
+
 		if(event1[event.len] != '\0' || event2[event.len2] != '\0') {
 			fprintf(stderr, "tup error: Missing null terminator in access_event\n");
 			return -1;
@@ -457,6 +899,18 @@ static int process_depfile(struct server *s, int fd)
 
 static void sighandler(int sig)
 {
+	if(sig == SIGUSR2) {
+		/* The monitor preempts an autoupdate with SIGUSR2. Stop
+		 * starting new jobs, but let the running ones finish so their
+		 * results are kept.
+		 */
+		if(sig_quit == 0) {
+			clear_active(stderr);
+			fprintf(stderr, " *** tup: update preempted - waiting for jobs to finish.\n");
+			sig_quit = 1;
+		}
+		return;
+	}
 	if(sig_quit == 0) {
 		clear_active(stderr);
 		fprintf(stderr, " *** tup: signal caught - waiting for jobs to finish.\n");
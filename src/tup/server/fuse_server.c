@@ -457,7 +457,7 @@ static int finfo_wait_open_count(struct server *s)
 
 static int exec_internal(struct server *s, const char *cmd, struct tup_env *newenv,
 			 struct tup_entry *dtent, int single_output, int need_namespacing,
-			 int run_in_bash)
+			 int run_in_bash, int untracked)
 {
 	int status;
 	char buf[64];
@@ -471,6 +471,9 @@ static int exec_internal(struct server *s, const char *cmd, struct tup_env *newe
 	em.single_output = single_output;
 	em.need_namespacing = need_namespacing;
 	em.run_in_bash = run_in_bash;
+	em.untracked = untracked;
+	em.slot = s->slot;
+	em.pin = s->pin;
 	em.envlen = newenv->block_size;
 	em.num_env_entries = newenv->num_entries;
 	em.joblen = snprintf(job, sizeof(job), TUP_MNT "/" TUP_JOB "%i", s->id) + 1;
@@ -557,7 +560,8 @@ static int exec_internal(struct server *s, const char *cmd, struct tup_env *newe
 }
 
 int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
-		struct tup_entry *dtent, int need_namespacing, int run_in_bash)
+		struct tup_entry *dtent, int need_namespacing, int run_in_bash,
+		int untracked)
 {
 	int rc;
 
@@ -566,7 +570,7 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 	if(tup_fuse_add_group(s->id, &s->finfo) < 0)
 		return -1;
 
-	rc = exec_internal(s, cmd, newenv, dtent, 1, need_namespacing, run_in_bash);
+	rc = exec_internal(s, cmd, newenv, dtent, 1, need_namespacing, run_in_bash, untracked);
 
 	if(tup_fuse_rm_group(&s->finfo) < 0)
 		return -1;
@@ -574,6 +578,16 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 	return rc;
 }
 
+/* Persistent workers are only implemented for the ldpreload server. Here the
+ * command runs by itself, so a worker program must also accept being run
+ * once per job.
+ */
+int server_exec_worker(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
+		       struct tup_entry *dtent, int untracked)
+{
+	return server_exec(s, dfd, cmd, newenv, dtent, 0, 0, untracked);
+}
+
 int server_postexec(struct server *s)
 {
 	if(s) {}
@@ -607,7 +621,7 @@ int server_run_script(FILE *f, tupid_t tupid, const char *cmdline,
 	s.error_mutex = NULL;
 	tent = tup_entry_get(tupid);
 	init_file_info(&s.finfo, 0);
-	if(exec_internal(&s, cmdline, &te, tent, 0, 0, 0) < 0)
+	if(exec_internal(&s, cmdline, &te, tent, 0, 0, 0, 0) < 0)
 		return -1;
 	environ_free(&te);
 
@@ -931,6 +945,18 @@ int tup_restore_privs(void)
 
 static void sighandler(int sig)
 {
+	if(sig == SIGUSR2) {
+		/* The monitor preempts an autoupdate with SIGUSR2. Stop
+		 * starting new jobs, but let the running ones finish so their
+		 * results are kept.
+		 */
+		if(sig_quit == 0) {
+			clear_active(stderr);
+			fprintf(stderr, " *** tup: update preempted - waiting for jobs to finish.\n");
+			sig_quit = 1;
+		}
+		return;
+	}
 	if(sig_quit == 0) {
 		clear_active(stderr);
 		fprintf(stderr, " *** tup: signal caught - waiting for jobs to finish.\n");
@@ -29,6 +29,7 @@
 #include "tup/config.h"
 #include "tup/debug.h"
 #include "tup/option.h"
+#include "tup/placement.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -222,7 +223,7 @@ read_rc_again:
 int server_post_exit(void)
 {
 	int status;
-	struct execmsg em = {-1, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	struct execmsg em = {-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
 	if(!inited)
 		return 0;
@@ -333,7 +334,7 @@ static int read_all_internal(int sd, void *dest, int size, int line)
 
 static int setup_subprocess(int sid, const char *job, const char *dir,
 			    const char *dev, const char *proc, int single_output,
-			    int need_namespacing)
+			    int need_namespacing, int untracked)
 {
 	int ofd, efd;
 	char buf[64];
@@ -390,6 +391,25 @@ static int setup_subprocess(int sid, const char *job, const char *dir,
 			return -1;
 		}
 	}
+	if(untracked) {
+		/* Run directly in the real directory instead of the FUSE
+		 * file-system. The dependencies are imported by the updater
+		 * after the command finishes.
+		 */
+		if(tup_drop_privs() < 0)
+			return -1;
+		if(chdir("/") < 0) {
+			perror("chdir");
+			fprintf(stderr, "tup error: Unable to chdir to root directory.\n");
+			return -1;
+		}
+		if(chdir(dir) < 0) {
+			perror("chdir");
+			fprintf(stderr, "tup error: Unable to chdir to '%s'\n", dir);
+			return -1;
+		}
+		return 0;
+	}
 #ifdef __linux__
 	if(use_namespacing) {
 		if(unshare(CLONE_NEWNS) < 0) {
@@ -677,8 +697,9 @@ static int master_fork_loop(void)
 			curp++;
 			*curp = NULL;
 
-			if(setup_subprocess(em.sid, job, dir, waiter->dev, waiter->proc, em.single_output, em.need_namespacing) < 0)
+			if(setup_subprocess(em.sid, job, dir, waiter->dev, waiter->proc, em.single_output, em.need_namespacing, em.untracked) < 0)
 				exit(1);
+			placement_apply(em.slot, em.pin);
 
 			if(em.run_in_bash) {
 				execle("/usr/bin/env", "/usr/bin/env", "bash", "-e", "-o", "pipefail", "-c", cmd, NULL, envp);
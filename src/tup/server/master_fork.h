@@ -35,6 +35,9 @@ struct execmsg {
 	int single_output;
 	int need_namespacing;
 	int run_in_bash;
+	int untracked;
+	int slot;
+	int pin;
 };
 
 #define JOB_MAX 64
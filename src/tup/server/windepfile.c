@@ -249,7 +249,8 @@ static int create_process(struct server *s, int dfd, char *cmdline,
 #define BASHSTR "bash -e -o pipefail -c '"
 #define CMDSTR "CMD.EXE /Q /C "
 int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
-		struct tup_entry *dtent, int need_namespacing, int run_in_bash)
+		struct tup_entry *dtent, int need_namespacing, int run_in_bash,
+		int untracked)
 {
 	int rc = -1;
 	DWORD return_code = 1;
@@ -275,6 +276,10 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 	int append_quote = 0;
 
 	if(need_namespacing) {}
+	/* The DLL is always injected on Windows, so untracked commands are
+	 * still traced here. The imported dependencies are added on top.
+	 */
+	if(untracked) {}
 
 	if(initialize_depfile(s, depfile, &h) < 0) {
 		fprintf(stderr, "Error starting update server.\n");
@@ -413,6 +418,16 @@ err_terminate:
 	return -1;
 }
 
+/* Persistent workers are only implemented for the ldpreload server. Here the
+ * command runs by itself, so a worker program must also accept being run
+ * once per job.
+ */
+int server_exec_worker(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
+		       struct tup_entry *dtent, int untracked)
+{
+	return server_exec(s, dfd, cmd, newenv, dtent, 0, 0, untracked);
+}
+
 int server_postexec(struct server *s)
 {
 	char buf[64];
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -50,6 +51,7 @@
 #include "tup/vardb.h"
 #include "tup/variant.h"
 #include "tup/container.h"
+#include "tup/bench.h"
 
 static int entry(int argc, char **argv);
 static int type(int argc, char **argv);
@@ -73,6 +75,10 @@ static int fake_parser_version(int argc, char **argv);
 static int waitmon(void);
 static int flush(void);
 static int ghost_check(void);
+static int gc(void);
+static int snapshot(int argc, char **argv);
+static int enable_sql_profile_file(const char *file);
+static int is_update_command(const char *cmd);
 
 static void version(void);
 
@@ -85,6 +91,7 @@ int main(int argc, char **argv)
 	int clear_autoupdate = 0;
 	int orig_argc;
 	char **orig_argv;
+	const char *progname = argv[0];
 
 	/* Skip 'tup' executable argument */
 	argc--;
@@ -98,6 +105,11 @@ int main(int argc, char **argv)
 		}
 		if(strcmp(argv[x], "--debug-sql") == 0) {
 			tup_db_enable_sql_debug();
+		} else if(strcmp(argv[x], "--profile-sql") == 0) {
+			tup_db_enable_sql_profile(NULL);
+		} else if(strncmp(argv[x], "--profile-sql=", 14) == 0) {
+			if(enable_sql_profile_file(argv[x] + 14) < 0)
+				return 1;
 		} else if(strcmp(argv[x], "--debug-fuse") == 0) {
 			server_enable_debug();
 		}
@@ -148,6 +160,12 @@ int main(int argc, char **argv)
 			return 1;
 		tup_valgrind_cleanup();
 		return 0;
+	} else if(strcmp(cmd, "bench") == 0) {
+		if(tup_drop_privs() < 0)
+			return 1;
+		if(bench_command(progname, argc, argv) < 0)
+			return 1;
+		return 0;
 	} else if(strcmp(cmd, "privileged") == 0) {
 #ifdef __linux__
 		if(unshare(CLONE_NEWUSER) == 0) {
@@ -191,6 +209,23 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	/* Commands that only read the database don't need to wait for an
+	 * update or autoupdate to finish.
+	 */
+	if(strcmp(cmd, "todo") == 0 ||
+	   strcmp(cmd, "graph") == 0 ||
+	   strcmp(cmd, "entry") == 0 ||
+	   strcmp(cmd, "type") == 0 ||
+	   strcmp(cmd, "tupid") == 0 ||
+	   strcmp(cmd, "inputs") == 0 ||
+	   strcmp(cmd, "varshow") == 0 ||
+	   strcmp(cmd, "options") == 0) {
+		tup_lock_allow_read_only();
+	}
+
+	if(is_update_command(cmd))
+		tup_init_for_update();
+
 	/* Pass all arguments so we capture any flags before the command */
 	if(tup_init(orig_argc, orig_argv) < 0)
 		return 1;
@@ -272,6 +307,10 @@ int main(int argc, char **argv)
 		rc = flush();
 	} else if(strcmp(cmd, "ghost_check") == 0) {
 		rc = ghost_check();
+	} else if(strcmp(cmd, "gc") == 0) {
+		rc = gc();
+	} else if(strcmp(cmd, "snapshot") == 0) {
+		rc = snapshot(argc, argv);
 	} else if(strcmp(cmd, "monitor_supported") == 0) {
 		rc = monitor_supported();
 	} else {
@@ -1185,6 +1224,100 @@ static int ghost_check(void)
 	return 0;
 }
 
+static int gc(void)
+{
+	int rc;
+
+	if(tup_db_begin() < 0)
+		return -1;
+	rc = tup_db_gc();
+	if(rc < 0) {
+		tup_db_rollback();
+		return -1;
+	}
+	if(tup_db_commit() < 0)
+		return -1;
+	printf("tup: Removed %i ghost nodes.\n", rc);
+	return 0;
+}
+
+static int snapshot(int argc, char **argv)
+{
+	char filename[PATH_MAX];
+	int len;
+
+	if(argc != 2 || (strcmp(argv[0], "export") != 0 && strcmp(argv[0], "import") != 0)) {
+		fprintf(stderr, "tup error: Usage: tup snapshot export|import <file>\n");
+		return -1;
+	}
+	/* tup has moved to the top of the hierarchy, so a relative filename
+	 * is relative to the directory that tup was run from.
+	 */
+	if(is_full_path(argv[1])) {
+		len = snprintf(filename, sizeof(filename), "%s", argv[1]);
+	} else if(get_sub_dir_len()) {
+		len = snprintf(filename, sizeof(filename), "%s/%s/%s", get_tup_top(), get_sub_dir(), argv[1]);
+	} else {
+		len = snprintf(filename, sizeof(filename), "%s/%s", get_tup_top(), argv[1]);
+	}
+	if(len >= (signed)sizeof(filename)) {
+		fprintf(stderr, "tup error: Snapshot filename is too long.\n");
+		return -1;
+	}
+	if(strcmp(argv[0], "export") == 0)
+		return tup_db_snapshot_export(filename);
+	return tup_db_snapshot_import(filename);
+}
+
+static int is_update_command(const char *cmd)
+{
+	/* Everything after tup_init() in main() that doesn't run the updater.
+	 * Any other command is an update, including the 'tup <file>' form.
+	 */
+	static const char *other_cmds[] = {
+		"monitor", "entry", "type", "tupid", "inputs", "graph", "scan",
+		"link", "todo", "variant", "node_exists", "normal_exists",
+		"sticky_exists", "flags_exists", "create_flags_exists", "touch",
+		"node", "rm", "varshow", "dbconfig", "options", "fake_mtime",
+		"fake_parser_version", "flush", "ghost_check", "gc", "snapshot",
+		"monitor_supported",
+	};
+	unsigned int x;
+
+	for(x=0; x<sizeof(other_cmds) / sizeof(other_cmds[0]); x++) {
+		if(strcmp(cmd, other_cmds[x]) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+static char sql_profile_filename[PATH_MAX];
+static int enable_sql_profile_file(const char *file)
+{
+	char cwd[PATH_MAX];
+	int len;
+
+	/* The profile is written after tup has moved to the top of the
+	 * hierarchy, so a relative filename is resolved now against the
+	 * directory that tup was run from.
+	 */
+	if(is_full_path(file)) {
+		len = snprintf(sql_profile_filename, sizeof(sql_profile_filename), "%s", file);
+	} else {
+		if(getcwd(cwd, sizeof(cwd)) == NULL) {
+			perror("getcwd");
+			return -1;
+		}
+		len = snprintf(sql_profile_filename, sizeof(sql_profile_filename), "%s/%s", cwd, file);
+	}
+	if(len >= (signed)sizeof(sql_profile_filename)) {
+		fprintf(stderr, "tup error: SQL profile filename is too long.\n");
+		return -1;
+	}
+	tup_db_enable_sql_profile(sql_profile_filename);
+	return 0;
+}
+
 static void version(void)
 {
 	printf("tup %s\n", tup_version);
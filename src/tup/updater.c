@@ -40,10 +40,20 @@
 #include "flist.h"
 #include "estring.h"
 #include "logging.h"
+#include "makedeps.h"
+#include "fslurp.h"
+#include "profile.h"
+#include "builtin.h"
+#include "lock.h"
+#include "fsbatch.h"
+#include "jobserver.h"
+#include "prefetch.h"
+#include "placement.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <pthread.h>
@@ -74,8 +84,18 @@ static int expand_command(char **res,
 			  struct tup_entry *tent, const char *cmd,
 			  struct tent_entries *group_sticky_root,
 			  struct tent_entries *used_groups_root);
+static void free_expand_cache(void);
+static void free_dedupe_cache(void);
 static int update(struct node *n);
 
+/* Returned by update() and update_work() for a node that has to wait for the
+ * same command in another variant (see dedupe_claim()). execute_graph() puts
+ * it back on the plist once another job finishes. update_work() also uses it
+ * for a command that never started because tup caught a signal while it was
+ * waiting for a job slot, so that it isn't counted as a failure.
+ */
+#define UPDATE_DEFERRED 2
+
 static int do_keep_going;
 static int num_jobs;
 static int full_deps;
@@ -83,8 +103,14 @@ static int warnings;
 static int show_warnings;
 static int refactoring;
 static int verbose;
+static int dedupe_variants;
+static int builtins;
+static int num_parses_skipped;
+static int num_deduped;
 
 static pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* The index of the worker thread, which is the job slot for placement. */
+static _Thread_local int job_slot = -1;
 static pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static const char *signal_err[] = {
@@ -132,6 +158,7 @@ struct worker_thread {
 	struct node *retn;
 	int rc;
 	int quit;
+	int slot;
 };
 
 int updater(int argc, char **argv, int phase)
@@ -146,6 +173,11 @@ int updater(int argc, char **argv, int phase)
 	num_jobs = tup_option_get_int("updater.num_jobs");
 	full_deps = tup_option_get_flag("updater.full_deps");
 	show_warnings = tup_option_get_flag("updater.warnings");
+	dedupe_variants = tup_option_get_flag("updater.dedupe_variants");
+	builtins = tup_option_get_flag("updater.builtins");
+	fsbatch_set_io_uring(tup_option_get_flag("updater.io_uring"));
+	if(tup_option_get_flag("display.profile"))
+		profile_enable();
 	progress_init();
 
 	if(check_full_deps_rebuild() < 0)
@@ -163,6 +195,8 @@ int updater(int argc, char **argv, int phase)
 			do_scan = 0;
 		} else if(strcmp(argv[x], "--no-environ-check") == 0) {
 			environ_check = 0;
+		} else if(strcmp(argv[x], "--profile") == 0) {
+			profile_enable();
 		} else if(strcmp(argv[x], "--debug-logging") == 0) {
 			logging_enable(argc, argv);
 		} else if(strcmp(argv[x], "--quiet") == 0 ||
@@ -187,21 +221,25 @@ int updater(int argc, char **argv, int phase)
 		refactoring = 1;
 	}
 
+	profile_phase(PROFILE_SCAN);
 	if(run_scan(do_scan) < 0)
 		return -1;
 
+	profile_phase(PROFILE_CONFIG);
 	if(process_config_nodes(environ_check) < 0)
 		goto out;
 	if(phase == 1) { /* Collect underpants */
 		rc = 0;
 		goto out;
 	}
+	profile_phase(PROFILE_PARSE);
 	if(process_create_nodes() < 0)
 		goto out;
 	if(phase == 2) { /* ? */
 		rc = 0;
 		goto out;
 	}
+	profile_phase(PROFILE_UPDATE);
 	if(process_update_nodes(argc, argv, &num_pruned) < 0)
 		goto out;
 	if(num_pruned) {
@@ -212,8 +250,10 @@ int updater(int argc, char **argv, int phase)
 	}
 	rc = 0;
 out:
+	fsbatch_thread_exit();
 	if(server_quit() < 0)
 		rc = -1;
+	profile_print(stdout);
 	return rc; /* Profit! */
 }
 
@@ -364,6 +404,7 @@ int generate(int argc, char **argv)
 		}
 		remove_node(&g, n);
 	}
+	parser_free_text_cache();
 	if(destroy_graph(&g) < 0)
 		return -1;
 
@@ -410,6 +451,7 @@ int generate(int argc, char **argv)
 	if(tup_entry_add(DOT_DT, &generate_cwd) < 0)
 		return -1;
 	rc = execute_graph(&g, 0, 1, generate_work);
+	free_expand_cache();
 	if(rc < 0)
 		return -1;
 	fclose(generate_f);
@@ -510,7 +552,12 @@ static int run_scan(int do_scan)
 		fprintf(stderr, "tup error: Unable to determine if the file monitor is still running.\n");
 		return -1;
 	}
-	if(pid < 0) {
+	if(tup_lock_read_only()) {
+		/* Another process has the database, so just go with what it
+		 * last committed.
+		 */
+		tup_main_progress("No filesystem scan - another tup process is running.\n");
+	} else if(pid < 0) {
 		if(do_scan) {
 			tup_main_progress("Scanning filesystem...\n");
 			if(tup_scan() < 0)
@@ -569,26 +616,65 @@ static int cleanup_dir(struct tup_entry *tent)
 	return 0;
 }
 
+static void deleted_file(struct tup_entry *tent, int err)
+{
+	show_result(tent, err != 0, NULL, "rm", 1);
+	show_progress(-1, TUP_NODE_GENERATED);
+}
+
+/* Commands are removed from the database in sets of this many, so the
+ * progress bar moves as they go.
+ */
+#define DELETE_CMDS_PER_SET 256
+
+static int delete_cmds(struct tent_entries *root)
+{
+	struct tent_entries set = TENT_ENTRIES_INITIALIZER;
+	struct tent_tree *tt;
+	int num;
+	int x;
+
+	while(!RB_EMPTY(root)) {
+		if(server_is_dead())
+			return -1;
+		for(num=0; num<DELETE_CMDS_PER_SET; num++) {
+			tt = RB_MIN(tent_entries, root);
+			if(!tt)
+				break;
+			if(tent_tree_add(&set, tt->tent) < 0)
+				return -1;
+			tent_tree_rm(root, tt);
+		}
+		/* This empties the set. */
+		if(tup_db_delete_set(&set, TUP_NODE_CMD) < 0)
+			return -1;
+		for(x=0; x<num; x++) {
+			skip_result(NULL);
+			/* Use TUP_NODE_GENERATED to make the bar purple since
+			 * we are deleting (not executing) commands.
+			 */
+			show_progress(-1, TUP_NODE_GENERATED);
+		}
+	}
+	return 0;
+}
+
 static int delete_files(struct graph *g)
 {
 	struct tent_tree *tt;
 	struct tup_entry *tent;
 	int rc = -1;
 
+	/* The files are removed from the filesystem in parallel, and then
+	 * from the database as a set (t5120).
+	 */
 	start_progress(g->gen_delete_root.count, -1, -1);
-	while((tt = RB_ROOT(&g->gen_delete_root)) != NULL) {
-		tent = tt->tent;
-		tent_tree_rm(&g->gen_delete_root, tt);
-		if(server_is_dead())
-			goto out_err;
-		show_result(tent, 0, NULL, "rm", 1);
-		show_progress(-1, TUP_NODE_GENERATED);
-
-		if(delete_file(tent) < 0)
-			goto out_err;
-		if(tup_del_id_force(tent->tnode.tupid, TUP_NODE_GENERATED) < 0)
-			goto out_err;
-	}
+	if(server_is_dead())
+		goto out_err;
+	if(delete_file_set(&g->gen_delete_root, num_jobs, deleted_file) < 0)
+		goto out_err;
+	if(tup_db_delete_set(&g->gen_delete_root, TUP_NODE_GENERATED) < 0)
+		goto out_err;
 
 	if(g->cmd_delete_root.count) {
 		char buf[64];
@@ -597,19 +683,8 @@ static int delete_files(struct graph *g)
 		tup_show_message(buf);
 		start_progress(g->cmd_delete_root.count, -1, -1);
 	}
-	while((tt = RB_ROOT(&g->cmd_delete_root)) != NULL) {
-		tent = tt->tent;
-		tent_tree_rm(&g->cmd_delete_root, tt);
-		if(server_is_dead())
-			goto out_err;
-		if(tup_del_id_force(tent->tnode.tupid, TUP_NODE_CMD) < 0)
-			goto out_err;
-		skip_result(NULL);
-		/* Use TUP_NODE_GENERATED to make the bar purple since
-		 * we are deleting (not executing) commands.
-		 */
-		show_progress(-1, TUP_NODE_GENERATED);
-	}
+	if(delete_cmds(&g->cmd_delete_root) < 0)
+		goto out_err;
 
 	if(!RB_EMPTY(&g->save_root)) {
 		tup_show_message("Converting generated files to normal files...\n");
@@ -671,6 +746,8 @@ static int initialize_server_struct(struct server *s, struct tup_entry *tent)
 	s->output_fd = -1;
 	s->error_fd = -1;
 	s->error_mutex = &display_mutex;
+	s->slot = -1;
+	s->pin = 0;
 	if(init_file_info(&s->finfo, server_unlink()) < 0)
 		return -1;
 
@@ -1044,8 +1121,6 @@ err_rollback:
 static struct tup_entry *get_rel_tent(struct tup_entry *base, struct tup_entry *tent)
 {
 	struct tup_entry *new;
-	struct tup_entry *sub;
-	int do_mkdir = 0;
 
 	if(!tent->parent)
 		return base;
@@ -1054,31 +1129,31 @@ static struct tup_entry *get_rel_tent(struct tup_entry *base, struct tup_entry *
 	if(!new)
 		return NULL;
 
-	sub = tup_db_create_node_srcid(new, tent->name.s, TUP_NODE_DIR, tent->tnode.tupid, &do_mkdir);
-	if(!sub) {
-		fprintf(stderr, "tup error: Unable to create tup node for variant directory: ");
-		print_tup_entry(stderr, base);
-		fprintf(stderr, "\n");
-		return NULL;
-	}
-	if(do_mkdir) {
-		int fd;
-		fd = tup_entry_open(new);
-		if(fd < 0)
-			return NULL;
-		if(mkdirat(fd, tent->name.s, 0777) < 0) {
-			if(errno != EEXIST) {
-				perror(tent->name.s);
-				fprintf(stderr, "tup error: Unable to create sub-directory in variant tree.\n");
-				return NULL;
-			}
-		}
-		if(close(fd) < 0) {
-			perror("close(fd)");
-			return NULL;
-		}
+	return tup_db_variant_mkdir(new, tent, NULL);
+}
+
+/* Like get_rel_tent(), but only looks for an existing variant directory. Sets
+ * *sub to NULL if it hasn't been created.
+ */
+static int find_rel_tent(struct tup_entry *base, struct tup_entry *tent, struct tup_entry **sub)
+{
+	struct tup_entry *new;
+
+	if(!tent->parent) {
+		*sub = base;
+		return 0;
 	}
-	return sub;
+
+	if(find_rel_tent(base, tent->parent, &new) < 0)
+		return -1;
+	*sub = NULL;
+	if(!new)
+		return 0;
+	if(tup_db_select_tent(new, tent->name.s, sub) < 0)
+		return -1;
+	if(*sub && (*sub)->srcid != tent->tnode.tupid)
+		*sub = NULL;
+	return 0;
 }
 
 static int rm_variant_dir_cb(void *arg, struct tup_entry *tent)
@@ -1116,115 +1191,159 @@ static int mark_variant_dir_for_deletion(struct graph *g, struct node *n)
 	return 0;
 }
 
+static int read_gitignore(int fd, struct estring *e)
+{
+	char buf[4096];
+
+	while(1) {
+		int rc;
+
+		rc = read(fd, buf, sizeof(buf));
+		if(rc < 0) {
+			perror("read");
+			return -1;
+		}
+		if(rc == 0)
+			break;
+		if(estring_append(e, buf, rc) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int write_gitignore(int fd, struct estring *e)
+{
+	int written = 0;
+
+	while(written < e->len) {
+		int rc;
+
+		rc = write(fd, e->s + written, e->len - written);
+		if(rc < 0) {
+			perror("write");
+			return -1;
+		}
+		written += rc;
+	}
+	return 0;
+}
+
 static int gitignore(struct tup_entry *tent)
 {
 	int fd_old, fd_new;
 	int dfd;
 	struct tup_entry *gitignore_tent;
+	struct estring old;
+	struct estring e;
 
 	if(tup_db_select_tent(tent, ".gitignore", &gitignore_tent) < 0)
 		return -1;
 	if(gitignore_tent && gitignore_tent->type == TUP_NODE_GENERATED) {
 		const char *tg_str = "##### TUP GITIGNORE #####\n";
-		int tg_idx = 0;
+		const char *header = "##### Lines below automatically generated by Tup.\n"
+			"##### Do not edit.\n";
+		int tg_len = strlen(tg_str);
 		int copied_tg_str = 0;
-		char nextchar;
+		int have_old = 0;
 		struct stat buf;
-		FILE *f;
-		dfd = tup_entry_open(tent);
-		if(dfd < 0)
+		int x;
+
+		if(estring_init(&old) < 0)
+			return -1;
+		if(estring_init(&e) < 0) {
+			free(old.s);
 			return -1;
-		fd_new = openat(dfd, ".gitignore.new", O_CREAT|O_WRONLY|O_TRUNC, 0666);
-		if(fd_new < 0) {
-			perror(".gitignore");
-			goto err_out;
 		}
-		f = fdopen(fd_new, "w");
-		if(!f) {
-			perror("fdopen");
-			goto err_out;
+		dfd = tup_entry_open(tent);
+		if(dfd < 0) {
+			free(old.s);
+			free(e.s);
+			return -1;
 		}
 		fd_old = openat(dfd, ".gitignore", O_RDONLY);
 		if(fd_old < 0 && errno != ENOENT) {
 			perror(".gitignore");
-			goto err_close;
+			goto err_out;
 		}
 		if(fd_old >= 0) {
-			while(1) {
-				int rc;
-
-				rc = read(fd_old, &nextchar, 1);
-				if(rc < 0) {
-					perror("read");
-					goto err_close_both;
-				}
-				if(rc == 0) {
-					break;
-				}
-
-				if(tg_str[tg_idx] == nextchar) {
-					tg_idx++;
-				} else {
-					tg_idx = 0;
-				}
-				if(fprintf(f, "%c", nextchar) < 0) {
-					perror("fprintf");
-					goto err_close_both;
-				}
-				if(tg_idx == 26) {
-					copied_tg_str = 1;
-					break;
-				}
+			have_old = 1;
+			if(read_gitignore(fd_old, &old) < 0) {
+				close(fd_old);
+				goto err_out;
 			}
 			if(close(fd_old) < 0) {
 				perror("close(fd_old)");
-				goto err_close;
+				goto err_out;
 			}
 		}
-		if(!copied_tg_str) {
-			if(fprintf(f, "%s", tg_str) < 0) {
-				perror("fprintf");
-				goto err_close;
+
+		/* Anything above the TUP GITIGNORE line belongs to the user
+		 * and is kept as-is.
+		 */
+		for(x=0; x+tg_len <= old.len; x++) {
+			if(memcmp(old.s + x, tg_str, tg_len) == 0) {
+				if(estring_append(&e, old.s, x + tg_len) < 0)
+					goto err_out;
+				copied_tg_str = 1;
+				break;
 			}
 		}
-		if(fprintf(f, "##### Lines below automatically generated by Tup.\n") < 0) {
-			perror("fprintf");
-			goto err_close;
-		}
-		if(fprintf(f, "##### Do not edit.\n") < 0) {
-			perror("fprintf");
-			goto err_close;
+		if(!copied_tg_str) {
+			if(estring_append(&e, old.s, old.len) < 0)
+				goto err_out;
+			if(estring_append(&e, tg_str, tg_len) < 0)
+				goto err_out;
 		}
+		if(estring_append(&e, header, strlen(header)) < 0)
+			goto err_out;
 		if(tent->tnode.tupid == DOT_DT) {
-			if(fprintf(f, ".tup\n") < 0) {
-				perror("fprintf");
-				goto err_close;
-			}
+			if(estring_append(&e, ".tup\n", 5) < 0)
+				goto err_out;
 		}
-		if(tup_db_write_gitignore(f, tent->tnode.tupid) < 0)
-			goto err_close;
-		fclose(f);
-		if(renameat(dfd, ".gitignore.new", dfd, ".gitignore") < 0) {
-			perror("move(.gitignore)");
+		if(tup_db_write_gitignore(&e, tent->tnode.tupid) < 0)
 			goto err_out;
+
+		/* Only replace the file if the contents actually changed, so
+		 * editors and git don't have to rescan it after every parse.
+		 */
+		if(!have_old || old.len != e.len || memcmp(old.s, e.s, e.len) != 0) {
+			fd_new = openat(dfd, ".gitignore.new", O_CREAT|O_WRONLY|O_TRUNC, 0666);
+			if(fd_new < 0) {
+				perror(".gitignore");
+				goto err_out;
+			}
+			if(write_gitignore(fd_new, &e) < 0) {
+				close(fd_new);
+				goto err_out;
+			}
+			if(close(fd_new) < 0) {
+				perror("close(fd_new)");
+				goto err_out;
+			}
+			if(renameat(dfd, ".gitignore.new", dfd, ".gitignore") < 0) {
+				perror("move(.gitignore)");
+				goto err_out;
+			}
 		}
 		if(fstatat(dfd, ".gitignore", &buf, AT_SYMLINK_NOFOLLOW) < 0) {
 			perror("fstatat(.gitignore)");
 			goto err_out;
 		}
-		if(tup_db_set_mtime(gitignore_tent, MTIME(buf)) < 0)
-			goto err_out;
+		if(MTIME(buf) != gitignore_tent->mtime) {
+			if(tup_db_set_mtime(gitignore_tent, MTIME(buf)) < 0)
+				goto err_out;
+		}
 
 		close(dfd);
+		free(old.s);
+		free(e.s);
 	}
 	return 0;
 
-err_close_both:
-	close(fd_old);
-err_close:
-	close(fd_new);
 err_out:
 	close(dfd);
+	free(old.s);
+	free(e.s);
 	fprintf(stderr, "tup error: Unable to create the .gitignore file in directory: ");
 	print_tup_entry(stderr, tent);
 	fprintf(stderr, "\n");
@@ -1279,19 +1398,46 @@ static int process_create_nodes(void)
 
 		if(node_variant->root_variant) {
 			struct variant *variant;
+			int needed;
+			int tupdefault;
+
+			if(tup_db_variant_dir_needed(n->tent, &needed, &tupdefault) < 0)
+				return -1;
 			LIST_FOREACH(variant, get_variant_list(), list) {
 				/* Add in all other variants to parse */
 				if(!variant->root_variant) {
 					struct tup_entry *new_tent;
-					new_tent = get_rel_tent(variant->tent->parent, n->tent);
-					if(!new_tent) {
-						fprintf(stderr, "tup internal error: Unable to find directory for variant '%s' for subdirectory: ", variant->variant_dir);
-						print_tup_entry(stderr, n->tent);
-						fprintf(stderr, "\n");
-						return -1;
+
+					/* Variant directories are only created
+					 * once there are rules to parse in
+					 * them, but one that already exists
+					 * still needs to be parsed in case its
+					 * rules went away.
+					 */
+					if(needed) {
+						new_tent = get_rel_tent(variant->tent->parent, n->tent);
+						if(!new_tent) {
+							fprintf(stderr, "tup internal error: Unable to find directory for variant '%s' for subdirectory: ", variant->variant_dir);
+							print_tup_entry(stderr, n->tent);
+							fprintf(stderr, "\n");
+							return -1;
+						}
+					} else {
+						if(find_rel_tent(variant->tent->parent, n->tent, &new_tent) < 0)
+							return -1;
+						if(!new_tent)
+							continue;
 					}
 					if(build_graph_cb(&g, new_tent) < 0)
 						return -1;
+					/* A new Tupdefault applies to every
+					 * subdirectory, including the ones that
+					 * don't have a variant directory yet.
+					 */
+					if(tupdefault) {
+						if(tup_db_materialize_variant_dirs(new_tent, n->tent, &g, build_graph_cb) < 0)
+							return -1;
+					}
 				}
 			}
 		} else {
@@ -1389,10 +1535,19 @@ static int process_create_nodes(void)
 	}
 	/* create_work must always use only 1 thread since no locking is done */
 	compat_lock_disable();
+	num_parses_skipped = 0;
 	rc = execute_graph(&g, 0, 1, create_work);
 	compat_lock_enable();
+	parser_free_text_cache();
+	if(rc == 0 && num_parses_skipped) {
+		char buf[128];
+		snprintf(buf, sizeof(buf), "Skipped %i dependent Tupfile%s with unchanged inputs.\n",
+			 num_parses_skipped, num_parses_skipped == 1 ? "" : "s");
+		tup_show_message(buf);
+	}
 
 	if(rc == 0) {
+		profile_phase(PROFILE_DELETE);
 		if(g.gen_delete_root.count) {
 			tup_main_progress("Deleting files...\n");
 		} else {
@@ -1438,6 +1593,7 @@ static int process_create_nodes(void)
 			}
 		}
 		if(rc == 0 && !RB_EMPTY(&g.parse_gitignore_root) && !refactoring) {
+			profile_phase(PROFILE_GITIGNORE);
 			tup_show_message("Generating .gitignore files...\n");
 			RB_FOREACH(tt, tent_entries, &g.parse_gitignore_root) {
 				if(gitignore(tt->tent) < 0) {
@@ -1511,7 +1667,20 @@ static int process_update_nodes(int argc, char **argv, int *num_pruned)
 	if(server_init(SERVER_UPDATER_MODE) < 0) {
 		return -1;
 	}
+	if(jobserver_init(num_jobs) < 0)
+		return -1;
+	reachability_cache_init(tup_option_get_int("updater.reachability_cache"));
+	if(prefetch_init(tup_option_get_int("updater.prefetch"), &db_mutex) < 0)
+		return -1;
 	rc = execute_graph(&g, do_keep_going, num_jobs, update_work);
+	prefetch_exit();
+	reachability_cache_free();
+	jobserver_exit();
+	free_expand_cache();
+	free_dedupe_cache();
+	if(num_deduped) {
+		printf("tup: %i command%s linked outputs from an identical command in another variant.\n", num_deduped, num_deduped == 1 ? "" : "s");
+	}
 	if(warnings) {
 		fprintf(stderr, "tup warning: Update resulted in %i warning%s\n", warnings, warnings == 1 ? "" : "s");
 	}
@@ -1694,11 +1863,60 @@ static int pop_node(struct graph *g, struct node *n)
 	return 0;
 }
 
+/* Queues the inputs of the next few ready commands in plist for readahead,
+ * so they are hopefully in the page cache by the time a worker gets to them.
+ * Only a bounded number of nodes are looked at, since plist also has file
+ * nodes and commands that are still waiting on their inputs.
+ */
+static void prefetch_ready(struct graph *g)
+{
+	struct node *n;
+	int depth = prefetch_depth();
+	int queued = 0;
+	int looked = 0;
+
+	if(!depth)
+		return;
+	TAILQ_FOREACH(n, &g->plist, list) {
+		if(queued >= depth || looked >= depth * 4)
+			break;
+		looked++;
+		if(n->tent->type != TUP_NODE_CMD || !n->expanded || !LIST_EMPTY(&n->incoming))
+			continue;
+		queued++;
+		if(!n->prefetched) {
+			n->prefetched = 1;
+			prefetch_command(n->tent);
+		}
+	}
+}
+
 /* Returns:
  *   0: everything built ok
  *  -1: a command failed
  *  -2: a system call failed (some work threads may still be active)
  */
+/* Waits up to a second for a job to finish. If none does, the commands that
+ * have already finished are committed (see tup_db_checkpoint()), so a long
+ * command at the end of the build doesn't hold the database the whole time.
+ */
+static int wait_checkpoint(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	struct timespec ts;
+	int rc = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec++;
+	if(pthread_cond_timedwait(cond, mutex, &ts) == ETIMEDOUT) {
+		pthread_mutex_unlock(mutex);
+		pthread_mutex_lock(&db_mutex);
+		rc = tup_db_checkpoint();
+		pthread_mutex_unlock(&db_mutex);
+		pthread_mutex_lock(mutex);
+	}
+	return rc;
+}
+
 static int execute_graph(struct graph *g, int keep_going, int jobs,
 			 worker_function work_func)
 {
@@ -1713,7 +1931,9 @@ static int execute_graph(struct graph *g, int keep_going, int jobs,
 	struct worker_thread_head active_list;
 	struct worker_thread_head fin_list;
 	struct worker_thread_head free_list;
+	struct node_head deferred;
 
+	TAILQ_INIT(&deferred);
 	LIST_INIT(&active_list);
 	LIST_INIT(&fin_list);
 	LIST_INIT(&free_list);
@@ -1743,6 +1963,7 @@ static int execute_graph(struct graph *g, int keep_going, int jobs,
 		workers[x].rc = -1;
 		workers[x].quit = 0;
 		workers[x].fn = work_func;
+		workers[x].slot = x;
 		LIST_INSERT_HEAD(&free_list, &workers[x], list);
 
 		if(pthread_create(&workers[x].pid, NULL, &run_thread, &workers[x]) < 0) {
@@ -1766,6 +1987,7 @@ static int execute_graph(struct graph *g, int keep_going, int jobs,
 	 */
 	while(!TAILQ_EMPTY(&g->plist) && !server_is_dead() && (!failed || keep_going)) {
 		struct node *n;
+		struct node *dn;
 		struct worker_thread *wt;
 		n = TAILQ_FIRST(&g->plist);
 		DEBUGP("cur node: %lli\n", n->tnode.tupid);
@@ -1792,6 +2014,8 @@ static int execute_graph(struct graph *g, int keep_going, int jobs,
 		if(node_remove_list(&g->plist, n) < 0)
 			return -2;
 		active++;
+		if(n->tent->type == TUP_NODE_CMD)
+			prefetch_dispatch(n->tent);
 
 		wt = LIST_FIRST(&free_list);
 		pthread_mutex_lock(&list_mutex);
@@ -1804,6 +2028,7 @@ static int execute_graph(struct graph *g, int keep_going, int jobs,
 		wt->rc = -1;
 		pthread_cond_signal(&wt->cond);
 		pthread_mutex_unlock(&wt->lock);
+		prefetch_ready(g);
 
 check_empties:
 		/* Keep looking for dudes to return as long as:
@@ -1816,7 +2041,14 @@ check_empties:
 		      ((TAILQ_EMPTY(&g->plist) || server_is_dead() || (failed && !keep_going)) && active)) {
 			pthread_mutex_lock(&list_mutex);
 			while(LIST_EMPTY(&fin_list)) {
-				pthread_cond_wait(&list_cond, &list_mutex);
+				if(work_func == update_work) {
+					if(wait_checkpoint(&list_cond, &list_mutex) < 0) {
+						pthread_mutex_unlock(&list_mutex);
+						return -2;
+					}
+				} else {
+					pthread_cond_wait(&list_cond, &list_mutex);
+				}
 			}
 			wt = LIST_FIRST(&fin_list);
 			n = wt->retn;
@@ -1826,6 +2058,20 @@ check_empties:
 			pthread_mutex_unlock(&list_mutex);
 			active--;
 
+			if(wt->rc == UPDATE_DEFERRED) {
+				/* If nothing else is running, the command it
+				 * was waiting for has already finished.
+				 */
+				if(node_insert_tail(active ? &deferred : &g->plist, n) < 0)
+					return -2;
+				continue;
+			}
+			while((dn = TAILQ_FIRST(&deferred)) != NULL) {
+				if(node_remove_list(&deferred, dn) < 0)
+					return -2;
+				if(node_insert_tail(&g->plist, dn) < 0)
+					return -2;
+			}
 			if(wt->rc == 0) {
 				if(pop_node(g, n) < 0)
 					return -2;
@@ -1839,6 +2085,13 @@ check_empties:
 			}
 		}
 	}
+	while(!TAILQ_EMPTY(&deferred)) {
+		struct node *n = TAILQ_FIRST(&deferred);
+		if(node_remove_list(&deferred, n) < 0)
+			return -2;
+		if(node_insert_tail(&g->plist, n) < 0)
+			return -2;
+	}
 	clear_progress();
 	if(server_is_dead()) {
 		fprintf(stderr, " *** tup: Remaining nodes skipped due to caught signal.\n");
@@ -1906,6 +2159,7 @@ static void *run_thread(void *arg)
 	struct node *n;
 	int rc;
 
+	job_slot = wt->slot;
 	while(1) {
 		n = worker_wait(wt);
 		if(n == (void*)-1)
@@ -1913,19 +2167,35 @@ static void *run_thread(void *arg)
 		rc = wt->fn(g, n);
 		worker_ret(wt, rc);
 	}
+	fsbatch_thread_exit();
 	return NULL;
 }
 
+/* Directories only need to be parsed if they were flagged, or if a directory
+ * they depend on now has a different set of files than it did the last time
+ * it was parsed. Nodes start out with skip set, and a node that changed
+ * clears it for everything downstream, just like in update_work().
+ */
 static int create_work(struct graph *g, struct node *n)
 {
 	int rc = 0;
+	int changed = !n->skip;
+
 	if(n->tent->type == TUP_NODE_DIR) {
 		if(tup_entry_variant(n->tent)->enabled) {
 			if(n->already_used) {
 				rc = 0;
+			} else if(n->skip) {
+				skip_result(NULL);
+				num_parses_skipped++;
 			} else {
 				rc = parse(n, g, NULL, refactoring, 1, full_deps);
 			}
+			if(rc == 0 && (n->already_used || !n->skip)) {
+				changed = tup_db_dir_interface_changed(n->tnode.tupid, &g->gen_delete_root);
+				if(changed < 0)
+					rc = -1;
+			}
 			show_progress(-1, TUP_NODE_DIR);
 		}
 	} else if(n->tent->type == TUP_NODE_VAR ||
@@ -1940,6 +2210,12 @@ static int create_work(struct graph *g, struct node *n)
 		fprintf(stderr, "tup error: Unknown node type %i with ID %lli named '%s' in create graph.\n", n->tent->type, n->tnode.tupid, n->tent->name.s);
 		rc = -1;
 	}
+	if(rc == 0 && changed > 0) {
+		struct edge *e;
+		LIST_FOREACH(e, &n->edges, list) {
+			e->dest->skip = 0;
+		}
+	}
 	if(tup_db_unflag_create(n->tnode.tupid) < 0)
 		rc = -1;
 
@@ -1973,17 +2249,29 @@ static int update_work(struct graph *g, struct node *n)
 
 	if(n->tent->type == TUP_NODE_CMD) {
 		if(!n->skip) {
+			int token;
+
+			token = jobserver_acquire();
+			if(token < 0) {
+				if(server_is_dead())
+					return UPDATE_DEFERRED;
+				return -1;
+			}
+
 			pthread_mutex_lock(&display_mutex);
 			jobs_active++;
 			show_progress(jobs_active, TUP_NODE_CMD);
 			pthread_mutex_unlock(&display_mutex);
 
 			rc = update(n);
+			jobserver_release(token);
 
 			pthread_mutex_lock(&display_mutex);
 			jobs_active--;
 			show_progress(jobs_active, TUP_NODE_CMD);
 			pthread_mutex_unlock(&display_mutex);
+			if(rc == UPDATE_DEFERRED)
+				return rc;
 		} else {
 			pthread_mutex_lock(&display_mutex);
 			log_debug_tent("Skip cmd", n->tent, "\n");
@@ -2013,6 +2301,9 @@ static int update_work(struct graph *g, struct node *n)
 			if(is_transient_tent(n->tent))
 				if(tup_db_unflag_transient(n->tnode.tupid) < 0)
 					rc = -1;
+			if(rc == 0)
+				if(tup_db_checkpoint() < 0)
+					rc = -1;
 			pthread_mutex_unlock(&db_mutex);
 		}
 	} else {
@@ -2360,65 +2651,221 @@ static int check_outputs(struct node *n)
 	return 0;
 }
 
+/* Most directories that unlink_outputs() keeps open at once. When a command
+ * has outputs in more directories than this, the unlinks queued so far are
+ * issued and the directories closed before opening any more.
+ */
+#define UNLINK_MAX_DIRS 32
+
+struct unlink_dir {
+	tupid_t dt;
+	int dfd;
+};
+
+static int run_unlink_batch(struct fsbatch *b, struct node *n,
+			    struct unlink_dir *dirs, int *num_dirs)
+{
+	int rc = 0;
+	int x;
+
+	fsbatch_run(b);
+	for(x=0; x<b->num; x++) {
+		if(b->ops[x].res < 0 && b->ops[x].res != -ENOENT) {
+			pthread_mutex_lock(&display_mutex);
+			show_result(n->tent, 1, NULL, NULL, 1);
+			errno = -b->ops[x].res;
+			perror("unlinkat");
+			fprintf(stderr, "tup error: Unable to unlink previous output file: %s\n", b->ops[x].name);
+			pthread_mutex_unlock(&display_mutex);
+			rc = -1;
+			break;
+		}
+	}
+	fsbatch_clear(b);
+	for(x=0; x<*num_dirs; x++) {
+		if(close(dirs[x].dfd) < 0) {
+			perror("close(output_dfd)");
+			rc = -1;
+		}
+	}
+	*num_dirs = 0;
+	return rc;
+}
+
 static int unlink_outputs(int dfd, struct node *n)
 {
 	struct edge *e;
 	struct node *output;
+	struct fsbatch b = FSBATCH_INITIALIZER;
+	struct unlink_dir dirs[UNLINK_MAX_DIRS];
+	int num_dirs = 0;
+	int rc = 0;
+	int x;
+
+	/* Queue all of the unlinks so they can be issued as one batch. Each
+	 * other directory that has outputs is opened once, and stays open
+	 * until the batch runs.
+	 */
 	LIST_FOREACH(e, &n->edges, list) {
 		output = e->dest;
 		if(!skip_output(output->tent) && output->transient != TRANSIENT_DELETE) {
 			int output_dfd = dfd;
 			output->skip = 0;
 			if(output->tent->dt != n->tent->dt) {
-				output_dfd = tup_entry_open(output->tent->parent);
-				if(output_dfd < 0) {
-					fprintf(stderr, "tup error: Unable to open directory to unlink previous output files: ");
-					print_tup_entry(stderr, output->tent->parent);
-					fprintf(stderr, "\n");
-					return -1;
+				for(x=0; x<num_dirs; x++) {
+					if(dirs[x].dt == output->tent->dt)
+						break;
 				}
-			}
-			if(unlinkat(output_dfd, output->tent->name.s, 0) < 0) {
-				if(errno != ENOENT) {
-					pthread_mutex_lock(&display_mutex);
-					show_result(n->tent, 1, NULL, NULL, 1);
-					perror("unlinkat");
-					fprintf(stderr, "tup error: Unable to unlink previous output file: %s\n", output->tent->name.s);
-					pthread_mutex_unlock(&display_mutex);
-					return -1;
+				if(x < num_dirs) {
+					output_dfd = dirs[x].dfd;
+				} else {
+					if(num_dirs == UNLINK_MAX_DIRS) {
+						if(run_unlink_batch(&b, n, dirs, &num_dirs) < 0) {
+							rc = -1;
+							goto out_free;
+						}
+					}
+					output_dfd = tup_entry_open(output->tent->parent);
+					if(output_dfd < 0) {
+						fprintf(stderr, "tup error: Unable to open directory to unlink previous output files: ");
+						print_tup_entry(stderr, output->tent->parent);
+						fprintf(stderr, "\n");
+						rc = -1;
+						goto out_close;
+					}
+					dirs[num_dirs].dt = output->tent->dt;
+					dirs[num_dirs].dfd = output_dfd;
+					num_dirs++;
 				}
 			}
-			if(output->tent->dt != n->tent->dt) {
-				if(close(output_dfd) < 0) {
-					perror("close(output_dfd)");
-					return -1;
-				}
+			if(fsbatch_unlinkat(&b, output_dfd, output->tent->name.s) < 0) {
+				rc = -1;
+				goto out_close;
 			}
 		}
 	}
+
+	if(run_unlink_batch(&b, n, dirs, &num_dirs) < 0)
+		rc = -1;
+	goto out_free;
+
+out_close:
+	for(x=0; x<num_dirs; x++) {
+		if(close(dirs[x].dfd) < 0)
+			perror("close(output_dfd)");
+	}
+out_free:
+	fsbatch_free(&b);
+	return rc;
+}
+
+static int is_depfile(struct tup_entry *tent)
+{
+	if(tent->name.len > 2 && strcmp(tent->name.s + tent->name.len - 2, ".d") == 0)
+		return 1;
 	return 0;
 }
 
-static int mark_transient_outputs(struct node *n)
+static int import_depfile(struct server *s, struct node *n, int dfd)
 {
-	/* Put all outputs of a transient command into the transient_list. If
-	 * the build stops due to failure or partial update, we'll be able to
-	 * revisit them on future builds to ensure they are removed when
-	 * appropriate.
+	struct tent_tree *tt;
+	struct tup_entry *depfile = NULL;
+	struct buf b;
+	int depfile_dfd;
+	int fd;
+	int rc;
+
+	/* Commands with the 'd' flag are not traced, so any declared outputs
+	 * that now exist are added as writes. Undeclared outputs can only be
+	 * caught if they are listed as targets in the dependency file.
 	 */
-	struct edge *e;
-	struct node *output;
-	LIST_FOREACH(e, &n->edges, list) {
-		output = e->dest;
-		if(!skip_output(output->tent)) {
-			if(tup_db_add_transient_list(output->tent->tnode.tupid) < 0)
+	RB_FOREACH(tt, tent_entries, &s->finfo.output_root) {
+		struct tup_entry *otent = tt->tent;
+		int output_dfd = dfd;
+		struct stat st;
+
+		if(otent->dt != n->tent->dt) {
+			output_dfd = tup_entry_open(otent->parent);
+			if(output_dfd < 0)
+				return -1;
+		}
+		rc = fstatat(output_dfd, otent->name.s, &st, AT_SYMLINK_NOFOLLOW);
+		if(otent->dt != n->tent->dt) {
+			if(close(output_dfd) < 0) {
+				perror("close(output_dfd)");
+				return -1;
+			}
+		}
+		if(rc == 0) {
+			if(handle_file_dtent(ACCESS_WRITE, otent->parent, otent->name.s, &s->finfo) < 0)
 				return -1;
+			if(!depfile && is_depfile(otent))
+				depfile = otent;
 		}
 	}
-	return 0;
-}
 
-static int process_output(struct server *s, struct node *n,
+	/* A failed command may not have written a complete dependency file. */
+	if(!s->exited || s->exit_status != 0)
+		return 0;
+
+	if(!depfile) {
+		pthread_mutex_lock(&display_mutex);
+		show_result(n->tent, 1, NULL, NULL, 1);
+		fprintf(stderr, "tup error: Command with the 'd' flag did not write a .d dependency file.\n");
+		pthread_mutex_unlock(&display_mutex);
+		return -1;
+	}
+
+	depfile_dfd = tup_entry_open(depfile->parent);
+	if(depfile_dfd < 0)
+		return -1;
+	fd = openat(depfile_dfd, depfile->name.s, O_RDONLY);
+	if(fd < 0) {
+		perror(depfile->name.s);
+		close(depfile_dfd);
+		return -1;
+	}
+	rc = fslurp_null(fd, &b);
+	close(fd);
+	close(depfile_dfd);
+	if(rc < 0)
+		return -1;
+
+	/* The paths in the dependency file are relative to the directory
+	 * the command ran in, which is the source directory for variants.
+	 */
+	pthread_mutex_lock(&display_mutex);
+	rc = makedeps_import(stderr, b.s, b.len, variant_tent_to_srctent(n->tent->parent), &s->finfo);
+	if(rc < 0) {
+		fprintf(stderr, "tup error: Unable to import dependencies from: ");
+		print_tup_entry(stderr, depfile);
+		fprintf(stderr, "\n");
+	}
+	pthread_mutex_unlock(&display_mutex);
+	free(b.s);
+	return rc;
+}
+
+static int mark_transient_outputs(struct node *n)
+{
+	/* Put all outputs of a transient command into the transient_list. If
+	 * the build stops due to failure or partial update, we'll be able to
+	 * revisit them on future builds to ensure they are removed when
+	 * appropriate.
+	 */
+	struct edge *e;
+	struct node *output;
+	LIST_FOREACH(e, &n->edges, list) {
+		output = e->dest;
+		if(!skip_output(output->tent)) {
+			if(tup_db_add_transient_list(output->tent->tnode.tupid) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int process_output(struct server *s, struct node *n,
 			  struct timespan *ts,
 			  const char *expanded_name,
 			  int compare_outputs)
@@ -2509,6 +2956,12 @@ static int process_output(struct server *s, struct node *n,
 			eout = stderr;
 		fprintf(eout, "tup: Expanded command string: %s\n", expanded_name);
 	}
+	if(verbose) {
+		char placement[256];
+
+		if(placement_describe(s->slot, s->pin, placement, sizeof(placement)) > 0)
+			printf("tup: Placement: %s\n", placement);
+	}
 	if(s->output_fd >= 0) {
 		if(display_output(s->output_fd, is_err ? 3 : 0, tent->name.s, 0, NULL) < 0)
 			return -1;
@@ -2542,42 +2995,126 @@ struct expand_info {
 	struct tent_entries *used_groups_root;
 };
 
-static int expand_group(FILE *f, struct estring *e, struct expand_info *info)
+/* Relative paths from a command's (source) directory to group members, so
+ * that commands in the same directory referencing the same large group only
+ * have to walk the directory tree once per member. The outer tree is keyed by
+ * the starting directory, and each relpath_dir has a tree of relpaths keyed
+ * by the member's tupid.
+ */
+struct relpath_dir {
+	struct tupid_tree tnode;
+	struct tupid_entries paths;
+};
+
+struct relpath {
+	struct tupid_tree tnode;
+	char *s;
+	int len;
+};
+
+/* Resource files that have already been written during this update. The key
+ * is the starting directory plus the list of groups that were expanded, which
+ * determines the contents of the file.
+ */
+struct resfile {
+	struct string_tree st;
+	char filename[TMPFILESIZE];
+};
+
+static struct tupid_entries relpath_root = RB_INITIALIZER(&relpath_root);
+static struct string_entries resfile_root = RB_INITIALIZER(&resfile_root);
+
+static void free_expand_cache(void)
+{
+	struct tupid_tree *tt;
+	struct tupid_tree *ttpath;
+	struct string_tree *st;
+
+	while((tt = RB_ROOT(&relpath_root)) != NULL) {
+		struct relpath_dir *rd = container_of(tt, struct relpath_dir, tnode);
+		while((ttpath = RB_ROOT(&rd->paths)) != NULL) {
+			struct relpath *rp = container_of(ttpath, struct relpath, tnode);
+			tupid_tree_rm(&rd->paths, ttpath);
+			free(rp->s);
+			free(rp);
+		}
+		tupid_tree_rm(&relpath_root, tt);
+		free(rd);
+	}
+	while((st = RB_ROOT(&resfile_root)) != NULL) {
+		struct resfile *rf = container_of(st, struct resfile, st);
+		string_tree_remove(&resfile_root, st);
+		free(rf);
+	}
+}
+
+static struct relpath *get_relpath(tupid_t start, tupid_t end)
+{
+	struct tupid_tree *tt;
+	struct relpath_dir *rd;
+	struct relpath *rp;
+	struct estring e;
+
+	tt = tupid_tree_search(&relpath_root, start);
+	if(tt) {
+		rd = container_of(tt, struct relpath_dir, tnode);
+	} else {
+		rd = malloc(sizeof *rd);
+		if(!rd) {
+			perror("malloc");
+			return NULL;
+		}
+		rd->tnode.tupid = start;
+		RB_INIT(&rd->paths);
+		if(tupid_tree_insert(&relpath_root, &rd->tnode) < 0) {
+			free(rd);
+			return NULL;
+		}
+	}
+
+	tt = tupid_tree_search(&rd->paths, end);
+	if(tt)
+		return container_of(tt, struct relpath, tnode);
+
+	if(estring_init(&e) < 0)
+		return NULL;
+	if(get_relative_dir(NULL, &e, start, end) < 0) {
+		free(e.s);
+		return NULL;
+	}
+	rp = malloc(sizeof *rp);
+	if(!rp) {
+		perror("malloc");
+		free(e.s);
+		return NULL;
+	}
+	rp->tnode.tupid = end;
+	rp->s = e.s;
+	rp->len = e.len;
+	if(tupid_tree_insert(&rd->paths, &rp->tnode) < 0) {
+		free(rp->s);
+		free(rp);
+		return NULL;
+	}
+	return rp;
+}
+
+static int find_groups(struct expand_info *info, struct tent_entries *groups)
 {
-	int group_found = 0;
-	int first = 1;
 	struct tent_tree *tt;
 
 	RB_FOREACH(tt, tent_entries, info->group_sticky_root) {
 		struct tup_entry *group_tent = tt->tent;
 
 		if(memcmp(group_tent->name.s, info->groupname, info->grouplen) == 0) {
-			struct tent_entries inputs = TENT_ENTRIES_INITIALIZER;
-			struct tent_tree *ttinput;
-
 			if(info->used_groups_root)
 				if(tent_tree_add_dup(info->used_groups_root, group_tent) < 0)
 					return -1;
-			if(tup_db_get_inputs(group_tent->tnode.tupid, NULL, &inputs, NULL) < 0)
+			if(tent_tree_add(groups, group_tent) < 0)
 				return -1;
-			RB_FOREACH(ttinput, tent_entries, &inputs) {
-				struct tup_entry *input_tent = ttinput->tent;
-				if(input_tent->type == TUP_NODE_GENERATED) {
-					if(e && !first)
-						if(estring_append(e, " ", 1) < 0)
-							return -1;
-					if(get_relative_dir(f, e, variant_tent_to_srctent(info->tent->parent)->tnode.tupid, input_tent->tnode.tupid) < 0)
-						return -1;
-					if(f)
-						fprintf(f, "\n");
-					first = 0;
-				}
-			}
-			free_tent_tree(&inputs);
-			group_found = 1;
 		}
 	}
-	if(!group_found) {
+	if(RB_EMPTY(groups)) {
 		fprintf(stderr, "tup error: Unable to find group '%.*s' as an input for use as a resource file. Make sure it is listed as an input to the command: ", info->grouplen, info->groupname);
 		print_tup_entry(stderr, info->tent);
 		fprintf(stderr, "\n");
@@ -2586,32 +3123,75 @@ static int expand_group(FILE *f, struct estring *e, struct expand_info *info)
 	return 0;
 }
 
+static int expand_group(FILE *f, struct estring *e, struct expand_info *info,
+			struct tent_entries *groups)
+{
+	int first = 1;
+	struct tent_tree *tt;
+	tupid_t start;
+
+	start = variant_tent_to_srctent(info->tent->parent)->tnode.tupid;
+	RB_FOREACH(tt, tent_entries, groups) {
+		struct tupid_entries *members;
+		struct tupid_tree *ttmember;
+
+		if(tup_db_get_group_members(tt->tent->tnode.tupid, &members) < 0)
+			return -1;
+		RB_FOREACH(ttmember, tupid_entries, members) {
+			struct tup_entry *input_tent;
+			struct relpath *rp;
+
+			if(tup_entry_add(ttmember->tupid, &input_tent) < 0)
+				return -1;
+			if(input_tent->type != TUP_NODE_GENERATED)
+				continue;
+			rp = get_relpath(start, input_tent->tnode.tupid);
+			if(!rp)
+				return -1;
+			if(e) {
+				if(!first)
+					if(estring_append(e, " ", 1) < 0)
+						return -1;
+				if(estring_append(e, rp->s, rp->len) < 0)
+					return -1;
+			}
+			if(f) {
+				if(fwrite(rp->s, 1, rp->len, f) != (size_t)rp->len ||
+				   fputc('\n', f) == EOF) {
+					perror("fwrite");
+					return -1;
+				}
+			}
+			first = 0;
+		}
+	}
+	return 0;
+}
+
 static int expand_group_inline(struct estring *expanded_name,
 			       struct expand_info *info)
 {
-	if(expand_group(NULL, expanded_name, info) < 0)
-		return -1;
-	return 0;
+	struct tent_entries groups = TENT_ENTRIES_INITIALIZER;
+	int rc = -1;
+
+	if(find_groups(info, &groups) < 0)
+		goto out;
+	if(expand_group(NULL, expanded_name, info, &groups) < 0)
+		goto out;
+	rc = 0;
+out:
+	free_tent_tree(&groups);
+	return rc;
 }
 
-static int expand_res_file(struct estring *expanded_name,
-			   struct expand_info *info)
+static int write_res_file(struct expand_info *info, struct tent_entries *groups,
+			  char *tmpfilename)
 {
 	static int resfile = 0;
 	FILE *f;
-	char tmpfilename[TMPFILESIZE];
-	int tmpfilenamelen;
-	int x;
-	int num_dotdots = 0;
-	struct tup_entry *tmp;
-
-	tmp = info->tent->parent;
-	while(tmp->parent) {
-		num_dotdots++;
-		tmp = tmp->parent;
-	}
 
 	snprintf(tmpfilename, TMPFILESIZE, ".tup/tmp/res-%i", resfile);
+	tmpfilename[TMPFILESIZE-1] = 0;
 	resfile++;
 	/* Use binary so newlines aren't converted on Windows.
 	 * Both cl and cygwin can handle UNIX line-endings, but
@@ -2623,19 +3203,85 @@ static int expand_res_file(struct estring *expanded_name,
 		fprintf(stderr, "tup error: Unable to create temporary resource file.\n");
 		return -1;
 	}
-	if(expand_group(f, NULL, info) < 0)
+	if(expand_group(f, NULL, info, groups) < 0) {
+		fclose(f);
 		return -1;
-	fclose(f);
-	tmpfilename[TMPFILESIZE-1] = 0;
-	tmpfilenamelen = strlen(tmpfilename);
+	}
+	if(fclose(f) != 0) {
+		perror(tmpfilename);
+		fprintf(stderr, "tup error: Unable to write temporary resource file.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int expand_res_file(struct estring *expanded_name,
+			   struct expand_info *info)
+{
+	struct tent_entries groups = TENT_ENTRIES_INITIALIZER;
+	struct tent_tree *tt;
+	struct string_tree *st;
+	struct resfile *rf;
+	struct estring key;
+	char buf[64];
+	int x;
+	int num_dotdots = 0;
+	struct tup_entry *tmp;
+	int rc = -1;
+
+	tmp = info->tent->parent;
+	while(tmp->parent) {
+		num_dotdots++;
+		tmp = tmp->parent;
+	}
+
+	if(estring_init(&key) < 0)
+		return -1;
+	if(find_groups(info, &groups) < 0)
+		goto out;
+
+	/* Commands in the same directory that use the same groups get the
+	 * same resource file contents, so they can share a single file.
+	 */
+	snprintf(buf, sizeof(buf), "%lli", variant_tent_to_srctent(info->tent->parent)->tnode.tupid);
+	if(estring_append(&key, buf, strlen(buf)) < 0)
+		goto out;
+	RB_FOREACH(tt, tent_entries, &groups) {
+		snprintf(buf, sizeof(buf), ":%lli", tt->tent->tnode.tupid);
+		if(estring_append(&key, buf, strlen(buf)) < 0)
+			goto out;
+	}
+
+	st = string_tree_search(&resfile_root, key.s, key.len);
+	if(st) {
+		rf = container_of(st, struct resfile, st);
+	} else {
+		rf = malloc(sizeof *rf);
+		if(!rf) {
+			perror("malloc");
+			goto out;
+		}
+		if(write_res_file(info, &groups, rf->filename) < 0) {
+			free(rf);
+			goto out;
+		}
+		if(string_tree_add(&resfile_root, &rf->st, key.s) < 0) {
+			free(rf);
+			goto out;
+		}
+	}
 
 	for(x=0; x<num_dotdots; x++) {
 		if(estring_append(expanded_name, "../", 3) < 0)
-			return -1;
+			goto out;
 	}
-	if(estring_append(expanded_name, tmpfilename, tmpfilenamelen) < 0)
-		return -1;
-	return 0;
+	if(estring_append(expanded_name, rf->filename, strlen(rf->filename)) < 0)
+		goto out;
+	rc = 0;
+out:
+	free_tent_tree(&groups);
+	free(key.s);
+	return rc;
 }
 
 static int expand_command(char **res,
@@ -2736,6 +3382,527 @@ static int do_ln(struct server *s, struct tup_entry *dtent, int dfd, const char
 	return 0;
 }
 
+/* Commands that are identical across variants (same command string once the
+ * variant directory is factored out, same inputs, same @-variable values) are
+ * only executed once when updater.dedupe_variants is set. The first variant to
+ * get to a command runs it, and the others hardlink its outputs into their
+ * own variant directory. Each variant still gets its own dependency records,
+ * which are copied from the command that actually ran. A variant that gets to
+ * a command while another one is still running it gives up its worker and
+ * job token (see UPDATE_DEFERRED) and tries again later.
+ */
+enum {
+	DEDUPE_RUNNING,
+	DEDUPE_DONE,
+	DEDUPE_FAILED,
+};
+
+struct dedupe_cmd {
+	struct string_tree st;
+	struct tup_entry *tent;
+	int state;
+};
+
+static struct string_entries dedupe_root = RB_INITIALIZER(&dedupe_root);
+static pthread_mutex_t dedupe_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_dedupe_cache(void)
+{
+	struct string_tree *st;
+
+	while((st = RB_ROOT(&dedupe_root)) != NULL) {
+		struct dedupe_cmd *dc = container_of(st, struct dedupe_cmd, st);
+		string_tree_remove(&dedupe_root, st);
+		free(dc);
+	}
+}
+
+static int is_path_char(char c)
+{
+	return isalnum(c) || c == '_' || c == '-' || c == '.' || c == '/';
+}
+
+/* Append the command string to the key, replacing each reference to the
+ * variant directory (relative to the directory the command runs in) with a
+ * placeholder.
+ */
+static int dedupe_append_cmd(struct estring *key, const char *cmd,
+			     const char *prefix, int prefixlen)
+{
+	const char *p = cmd;
+	const char *match;
+
+	while((match = strstr(p, prefix)) != NULL) {
+		const char *end = match + prefixlen;
+		int replace = 1;
+
+		if(match != cmd && is_path_char(match[-1]))
+			replace = 0;
+		if(*end && *end != '/' && is_path_char(*end))
+			replace = 0;
+		if(estring_append(key, p, match - p) < 0)
+			return -1;
+		if(replace) {
+			if(estring_append(key, "\001", 1) < 0)
+				return -1;
+		} else {
+			if(estring_append(key, match, prefixlen) < 0)
+				return -1;
+		}
+		p = end;
+	}
+	return estring_append(key, p, strlen(p));
+}
+
+static int dedupe_add_item(struct string_entries *items, const char *s)
+{
+	struct string_tree *st;
+
+	if(string_tree_search(items, s, strlen(s)) != NULL)
+		return 0;
+	st = malloc(sizeof *st);
+	if(!st) {
+		perror("malloc");
+		return -1;
+	}
+	if(string_tree_add(items, st, s) < 0) {
+		free(st);
+		return -1;
+	}
+	return 0;
+}
+
+static int dedupe_add_input(struct string_entries *items, struct tup_entry *tent,
+			    struct variant *variant)
+{
+	char buf[PATH_MAX + 64];
+	struct estring e;
+	struct stat st;
+	int rc;
+
+	if(tent->dt == env_dt() || tup_entry_variant(tent) != variant) {
+		/* Source files, environment variables, and anything from other
+		 * variants are shared, so the tupid identifies them.
+		 */
+		snprintf(buf, sizeof(buf), "I%lli", tent->tnode.tupid);
+		return dedupe_add_item(items, buf);
+	}
+
+	if(tent->parent == variant->tent) {
+		/* @-variables match if they have the same value. */
+		if(estring_init(&e) < 0)
+			return -1;
+		if(estring_append(&e, "@", 1) < 0 ||
+		   estring_append(&e, tent->name.s, tent->name.len) < 0 ||
+		   estring_append(&e, "=", 1) < 0)
+			return -1;
+		if(!tup_db_get_var(variant, tent->name.s, tent->name.len, &e)) {
+			free(e.s);
+			return -1;
+		}
+		if(estring_append(&e, "\0", 1) < 0)
+			return -1;
+		rc = dedupe_add_item(items, e.s);
+		free(e.s);
+		return rc;
+	}
+
+	/* Generated files in this variant can only be shared if they are the
+	 * same file, which is the case when they were linked from another
+	 * variant.
+	 */
+	if(tent->type == TUP_NODE_GENERATED || tent->type == TUP_NODE_FILE) {
+		if(snprint_tup_entry(buf, sizeof(buf), tent) >= (signed)sizeof(buf)) {
+			fprintf(stderr, "tup internal error: path is too long in dedupe_add_input()\n");
+			return -1;
+		}
+		if(fstatat(tup_top_fd(), buf + 1, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			snprintf(buf, sizeof(buf), "F%lli:%lli", (long long)st.st_dev, (long long)st.st_ino);
+			return dedupe_add_item(items, buf);
+		}
+	}
+	snprintf(buf, sizeof(buf), "V%i:%lli/%s", tent->type,
+		 variant_tent_to_srctent(tent->parent)->tnode.tupid, tent->name.s);
+	return dedupe_add_item(items, buf);
+}
+
+/* Build the key that identifies a command in a variant. Must be called with
+ * the db_mutex held.
+ */
+static int dedupe_key(struct estring *key, struct node *n, struct server *s,
+		      const char *cmd, struct variant *variant)
+{
+	struct string_entries items = RB_INITIALIZER(&items);
+	struct string_tree *st;
+	struct tent_tree *tt;
+	struct tup_entry *srctent;
+	struct estring prefix;
+	char buf[PATH_MAX + 64];
+	int rc = -1;
+
+	srctent = variant_tent_to_srctent(n->tent->parent);
+	if(estring_init(&prefix) < 0)
+		return -1;
+	if(get_relative_dir(NULL, &prefix, srctent->tnode.tupid, variant->tent->parent->tnode.tupid) < 0)
+		goto out;
+
+	snprintf(buf, sizeof(buf), "%lli:", srctent->tnode.tupid);
+	if(estring_append(key, buf, strlen(buf)) < 0)
+		goto out;
+	if(n->tent->flags)
+		if(estring_append(key, n->tent->flags, n->tent->flagslen) < 0)
+			goto out;
+	if(estring_append(key, "\n", 1) < 0)
+		goto out;
+	if(dedupe_append_cmd(key, cmd, prefix.s, prefix.len) < 0)
+		goto out;
+
+	RB_FOREACH(tt, tent_entries, &s->finfo.output_root) {
+		snprintf(buf, sizeof(buf), "O%lli/%s",
+			 variant_tent_to_srctent(tt->tent->parent)->tnode.tupid, tt->tent->name.s);
+		if(dedupe_add_item(&items, buf) < 0)
+			goto out;
+	}
+	RB_FOREACH(tt, tent_entries, &s->finfo.sticky_root) {
+		if(dedupe_add_input(&items, tt->tent, variant) < 0)
+			goto out;
+	}
+	RB_FOREACH(tt, tent_entries, &s->finfo.normal_root) {
+		if(dedupe_add_input(&items, tt->tent, variant) < 0)
+			goto out;
+	}
+	RB_FOREACH(st, string_entries, &items) {
+		if(estring_append(key, "\n", 1) < 0)
+			goto out;
+		if(estring_append(key, st->s, st->len) < 0)
+			goto out;
+	}
+	if(estring_append(key, "\0", 1) < 0)
+		goto out;
+	rc = 0;
+out:
+	while((st = RB_ROOT(&items)) != NULL) {
+		string_tree_remove(&items, st);
+		free(st);
+	}
+	free(prefix.s);
+	return rc;
+}
+
+/* Look up the key. If nobody has run this command yet, we become the owner
+ * and *owner is set. If it ran successfully in another variant, *source is
+ * set to that command. Returns 1 if another variant is still running it.
+ */
+static int dedupe_claim(const char *key, struct tup_entry *tent,
+			struct dedupe_cmd **owner, struct tup_entry **source)
+{
+	struct string_tree *st;
+	struct dedupe_cmd *dc;
+	int rc = 0;
+
+	*owner = NULL;
+	*source = NULL;
+	pthread_mutex_lock(&dedupe_mutex);
+	st = string_tree_search(&dedupe_root, key, strlen(key));
+	if(st) {
+		dc = container_of(st, struct dedupe_cmd, st);
+		if(dc->state == DEDUPE_RUNNING)
+			rc = 1;
+		else if(dc->state == DEDUPE_DONE)
+			*source = dc->tent;
+	} else {
+		dc = malloc(sizeof *dc);
+		if(!dc) {
+			perror("malloc");
+			rc = -1;
+		} else if(string_tree_add(&dedupe_root, &dc->st, key) < 0) {
+			free(dc);
+			rc = -1;
+		} else {
+			dc->tent = tent;
+			dc->state = DEDUPE_RUNNING;
+			*owner = dc;
+		}
+	}
+	pthread_mutex_unlock(&dedupe_mutex);
+	return rc;
+}
+
+static void dedupe_finish(struct dedupe_cmd *dc, int success)
+{
+	pthread_mutex_lock(&dedupe_mutex);
+	dc->state = success ? DEDUPE_DONE : DEDUPE_FAILED;
+	pthread_mutex_unlock(&dedupe_mutex);
+}
+
+/* Find the node at the same path in another variant. Sets *dest to NULL if
+ * it doesn't exist there.
+ */
+static int map_variant_tent(struct tup_entry *tent, struct variant *from,
+			    struct variant *to, struct tup_entry **dest)
+{
+	struct tup_entry *parent;
+
+	*dest = NULL;
+	if(tent == from->tent->parent) {
+		*dest = to->tent->parent;
+		return 0;
+	}
+	if(!tent->parent)
+		return 0;
+	if(map_variant_tent(tent->parent, from, to, &parent) < 0)
+		return -1;
+	if(!parent)
+		return 0;
+	return tup_db_select_tent(parent, tent->name.s, dest);
+}
+
+static int copy_output(int srcdfd, int destdfd, const char *name)
+{
+	char buf[65536];
+	struct stat st;
+	int infd;
+	int outfd;
+	int rc = -1;
+	ssize_t len;
+
+	infd = openat(srcdfd, name, O_RDONLY);
+	if(infd < 0) {
+		perror(name);
+		return -1;
+	}
+	if(fstat(infd, &st) < 0) {
+		perror("fstat");
+		goto out_close_in;
+	}
+	outfd = openat(destdfd, name, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+	if(outfd < 0) {
+		perror(name);
+		goto out_close_in;
+	}
+	while((len = read(infd, buf, sizeof(buf))) > 0) {
+		if(write(outfd, buf, len) != len) {
+			perror("write");
+			goto out_close_out;
+		}
+	}
+	if(len < 0) {
+		perror("read");
+		goto out_close_out;
+	}
+	rc = 0;
+out_close_out:
+	if(close(outfd) < 0) {
+		perror("close(outfd)");
+		rc = -1;
+	}
+out_close_in:
+	close(infd);
+	return rc;
+}
+
+/* Adding a link changes the ctime of the inode, which is the mtime that tup
+ * saves on some platforms. So every variant that already shares the file
+ * needs its mtime saved again, or the next scan thinks it was modified.
+ */
+static int refresh_linked_mtimes(struct tup_entry *src, const struct stat *srcst)
+{
+	struct variant *from = tup_entry_variant(src->parent);
+	struct variant *variant;
+	char buf[PATH_MAX];
+
+	LIST_FOREACH(variant, get_variant_list(), list) {
+		struct tup_entry *tent;
+		struct stat st;
+
+		if(variant->root_variant)
+			continue;
+		if(map_variant_tent(src, from, variant, &tent) < 0)
+			return -1;
+		if(!tent || tent->type != TUP_NODE_GENERATED)
+			continue;
+		if(snprint_tup_entry(buf, sizeof(buf), tent) >= (signed)sizeof(buf)) {
+			fprintf(stderr, "tup internal error: path is too long in refresh_linked_mtimes()\n");
+			return -1;
+		}
+		if(fstatat(tup_top_fd(), buf + 1, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+		if(st.st_dev != srcst->st_dev || st.st_ino != srcst->st_ino)
+			continue;
+		if(tup_db_set_mtime(tent, MTIME(st)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int link_output(struct tup_entry *src, struct tup_entry *dest)
+{
+	int srcdfd;
+	int destdfd;
+	int rc = 0;
+
+	srcdfd = tup_entry_open(src->parent);
+	if(srcdfd < 0)
+		return -1;
+	destdfd = tup_entry_open(dest->parent);
+	if(destdfd < 0) {
+		close(srcdfd);
+		return -1;
+	}
+	if(linkat(srcdfd, src->name.s, destdfd, dest->name.s, 0) < 0) {
+		if(errno == EXDEV || errno == EPERM || errno == EMLINK) {
+			rc = copy_output(srcdfd, destdfd, dest->name.s);
+		} else {
+			perror("linkat");
+			rc = -1;
+		}
+	} else {
+		struct stat st;
+
+		if(fstatat(srcdfd, src->name.s, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			perror(src->name.s);
+			rc = -1;
+		} else {
+			rc = refresh_linked_mtimes(src, &st);
+		}
+	}
+	close(destdfd);
+	close(srcdfd);
+	return rc;
+}
+
+/* The key is built from the inputs that were recorded the last time the
+ * command ran, so it can't include anything the command reads for the first
+ * time (eg: the @-variables read by a new varsed command). Check that each
+ * variant-specific input that the other variant's command actually read is
+ * the same here. Returns 1 if it is, and 0 if it isn't.
+ */
+static int dedupe_same_input(struct tup_entry *tent, struct tup_entry *mapped,
+			     struct variant *from, struct variant *to)
+{
+	char buf[PATH_MAX];
+	struct stat st1;
+	struct stat st2;
+
+	if(tent->type != mapped->type)
+		return 0;
+	if(tent->parent == from->tent) {
+		struct estring e1;
+		struct estring e2;
+		int rc = -1;
+
+		if(estring_init(&e1) < 0)
+			return -1;
+		if(estring_init(&e2) < 0) {
+			free(e1.s);
+			return -1;
+		}
+		if(tup_db_get_var(from, tent->name.s, tent->name.len, &e1) &&
+		   tup_db_get_var(to, mapped->name.s, mapped->name.len, &e2)) {
+			rc = e1.len == e2.len && memcmp(e1.s, e2.s, e1.len) == 0;
+		}
+		free(e2.s);
+		free(e1.s);
+		return rc;
+	}
+	if(tent->type != TUP_NODE_GENERATED && tent->type != TUP_NODE_FILE)
+		return 1;
+	if(snprint_tup_entry(buf, sizeof(buf), tent) >= (signed)sizeof(buf)) {
+		fprintf(stderr, "tup internal error: path is too long in dedupe_same_input()\n");
+		return -1;
+	}
+	if(fstatat(tup_top_fd(), buf + 1, &st1, AT_SYMLINK_NOFOLLOW) < 0)
+		return 0;
+	if(snprint_tup_entry(buf, sizeof(buf), mapped) >= (signed)sizeof(buf)) {
+		fprintf(stderr, "tup internal error: path is too long in dedupe_same_input()\n");
+		return -1;
+	}
+	if(fstatat(tup_top_fd(), buf + 1, &st2, AT_SYMLINK_NOFOLLOW) < 0)
+		return 0;
+	return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+/* Fill in the file_info for a command as if it had executed, by linking the
+ * outputs of the identical command 'src' from another variant and copying its
+ * dependencies. Returns 1 if the command can't be shared after all (eg: one
+ * of the inputs doesn't exist in this variant), in which case it should just
+ * be run. Must be called with the db_mutex held.
+ */
+static int dedupe_outputs(struct server *s, struct node *n, struct tup_entry *src)
+{
+	struct tent_entries normal_root = TENT_ENTRIES_INITIALIZER;
+	struct tent_entries read_root = TENT_ENTRIES_INITIALIZER;
+	struct variant *from = tup_entry_variant(src->parent);
+	struct variant *to = tup_entry_variant(n->tent->parent);
+	struct tent_tree *tt;
+	struct tup_entry *mapped;
+	int same;
+	int rc = -1;
+
+	RB_FOREACH(tt, tent_entries, &s->finfo.output_root) {
+		if(map_variant_tent(tt->tent, to, from, &mapped) < 0)
+			return -1;
+		if(!mapped || mapped->type != TUP_NODE_GENERATED)
+			return 1;
+	}
+
+	if(tup_db_get_inputs(src->tnode.tupid, NULL, &normal_root, NULL) < 0)
+		return -1;
+	RB_FOREACH(tt, tent_entries, &normal_root) {
+		struct tup_entry *tent = tt->tent;
+
+		if(tent->type == TUP_NODE_GROUP || tent->dt == env_dt())
+			continue;
+		if(tup_entry_variant(tent) == from) {
+			if(map_variant_tent(tent, from, to, &mapped) < 0)
+				goto out;
+			if(!mapped) {
+				rc = 1;
+				goto out;
+			}
+			same = dedupe_same_input(tent, mapped, from, to);
+			if(same < 0)
+				goto out;
+			if(!same) {
+				rc = 1;
+				goto out;
+			}
+			tent = mapped;
+		}
+		if(tent_tree_add_dup(&read_root, tent) < 0)
+			goto out;
+	}
+
+	RB_FOREACH(tt, tent_entries, &s->finfo.output_root) {
+		if(map_variant_tent(tt->tent, to, from, &mapped) < 0)
+			goto out;
+		if(link_output(mapped, tt->tent) < 0) {
+			fprintf(stderr, "tup error: Unable to link output file from another variant: ");
+			print_tup_entry(stderr, mapped);
+			fprintf(stderr, "\n");
+			goto out;
+		}
+		if(handle_file_dtent(ACCESS_WRITE, tt->tent->parent, tt->tent->name.s, &s->finfo) < 0)
+			goto out;
+	}
+	RB_FOREACH(tt, tent_entries, &read_root) {
+		if(tt->tent->parent == to->tent) {
+			if(handle_file(ACCESS_VAR, tt->tent->name.s, "", &s->finfo) < 0)
+				goto out;
+		} else {
+			if(handle_file_dtent(ACCESS_READ, tt->tent->parent, tt->tent->name.s, &s->finfo) < 0)
+				goto out;
+		}
+	}
+	s->exited = 1;
+	s->exit_status = 0;
+	rc = 0;
+out:
+	free_tent_tree(&read_root);
+	free_tent_tree(&normal_root);
+	return rc;
+}
+
 static int update(struct node *n)
 {
 	int dfd;
@@ -2751,7 +3918,14 @@ static int update(struct node *n)
 	int run_in_bash = 0;
 	int use_server = 0;
 	int remove_transients = 0;
+	int untracked = 0;
+	int use_worker = 0;
+	int pin = 0;
 	int is_variant;
+	char *key = NULL;
+	struct dedupe_cmd *dedupe_owner = NULL;
+	struct tup_entry *dedupe_src = NULL;
+	int shared = 0;
 
 	timespan_start(&ts);
 	if(n->tent->flags) {
@@ -2770,6 +3944,15 @@ static int update(struct node *n)
 				case 't':
 					remove_transients = 1;
 					break;
+				case 'd':
+					untracked = 1;
+					break;
+				case 'w':
+					use_worker = 1;
+					break;
+				case 'p':
+					pin = 1;
+					break;
 				default:
 					pthread_mutex_lock(&display_mutex);
 					show_result(n->tent, 1, NULL, NULL, 1);
@@ -2814,6 +3997,8 @@ static int update(struct node *n)
 	}
 	if(rc == 0)
 		rc = initialize_server_struct(&s, n->tent);
+	s.slot = job_slot;
+	s.pin = pin;
 	if(rc == 0)
 		rc = tup_db_get_environ(&s.finfo.sticky_root, &s.finfo.normal_root, &newenv);
 	if(rc == 0) {
@@ -2822,16 +4007,69 @@ static int update(struct node *n)
 		if(expanded_name)
 			cmd = expanded_name;
 	}
+	if(rc == 0 && dedupe_variants && is_variant && !untracked && !remove_transients && cmd[0] != '!') {
+		struct estring e;
+
+		if(estring_init(&e) < 0)
+			rc = -1;
+		else if(dedupe_key(&e, n, &s, cmd, tup_entry_variant(n->tent->parent)) < 0)
+			rc = -1;
+		key = e.s;
+	}
 	pthread_mutex_unlock(&db_mutex);
-	if(rc < 0)
+	if(rc < 0) {
+		free(key);
 		goto err_close_srcdfd;
-	if(strncmp(cmd, "!tup_ln ", 8) == 0) {
+	}
+	if(key) {
+		rc = dedupe_claim(key, n->tent, &dedupe_owner, &dedupe_src);
+		free(key);
+		if(rc == 1) {
+			/* Another variant is running it. Rather than sit on
+			 * a job slot until it's done, hand the node back to
+			 * execute_graph() to try again later.
+			 */
+			environ_free(&newenv);
+			cleanup_file_info(&s.finfo);
+			free(expanded_name);
+			if(is_variant)
+				close(srcdfd);
+			close(dfd);
+			return UPDATE_DEFERRED;
+		}
+		if(rc == 0 && dedupe_src) {
+			pthread_mutex_lock(&db_mutex);
+			rc = dedupe_outputs(&s, n, dedupe_src);
+			pthread_mutex_unlock(&db_mutex);
+			if(rc == 0)
+				shared = 1;
+			if(rc == 1)
+				rc = 0;
+		}
+		if(rc < 0)
+			goto err_close_srcdfd;
+	}
+	if(shared) {
+		/* Outputs were linked from another variant. */
+	} else if(strncmp(cmd, "!tup_ln ", 8) == 0) {
 		rc = do_ln(&s, n->tent->parent, srcdfd, cmd + 8);
 	} else if (strncmp(cmd, "!tup_preserve ", 14) == 0) {
 		rc = do_ln(&s, n->tent->parent, srcdfd, cmd + 14);
 	} else {
-		rc = server_exec(&s, srcdfd, cmd, &newenv, n->tent->parent, need_namespacing, run_in_bash);
-		use_server = 1;
+		rc = 0;
+		if(builtins && !need_namespacing && !untracked && !use_worker)
+			rc = builtin_exec(&s, srcdfd, cmd, n->tent->parent);
+		if(rc == 0 && use_worker) {
+			rc = server_exec_worker(&s, srcdfd, cmd, &newenv, n->tent->parent, untracked);
+			use_server = 1;
+		} else if(rc == 0) {
+			rc = server_exec(&s, srcdfd, cmd, &newenv, n->tent->parent, need_namespacing, run_in_bash, untracked);
+			use_server = 1;
+		} else if(rc == 1) {
+			rc = 0;
+		}
+		if(rc == 0 && untracked)
+			rc = import_depfile(&s, n, dfd);
 	}
 	if(rc < 0) {
 		pthread_mutex_lock(&display_mutex);
@@ -2854,11 +4092,16 @@ static int update(struct node *n)
 
 	pthread_mutex_lock(&db_mutex);
 	pthread_mutex_lock(&display_mutex);
+	profile_count(PROFILE_FILE_EVENTS, s.finfo.num_events);
 	rc = process_output(&s, n, &ts, expanded_name, compare_outputs);
 	if(rc == 0 && remove_transients) {
 		if(mark_transient_outputs(n) < 0)
 			rc = -1;
 	}
+	if(rc == 0 && shared)
+		num_deduped++;
+	if(dedupe_owner)
+		dedupe_finish(dedupe_owner, rc == 0);
 	pthread_mutex_unlock(&display_mutex);
 	pthread_mutex_unlock(&db_mutex);
 	free(expanded_name);
@@ -2879,5 +4122,7 @@ err_close_dfd:
 		perror("close(dfd)");
 	}
 err_out:
+	if(dedupe_owner)
+		dedupe_finish(dedupe_owner, 0);
 	return -1;
 }
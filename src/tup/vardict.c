@@ -25,43 +25,32 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
-struct vardict {
-	unsigned int len;
-	unsigned int num_entries;
-	unsigned int *offsets;
-	const char *entries;
-	void *map;
-};
-
 static struct vardict tup_vars;
 
-int tup_vardict_init(void)
+static void vardict_empty(struct vardict *vd)
+{
+	vd->len = 0;
+	vd->num_entries = 0;
+	vd->offsets = NULL;
+	vd->entries = NULL;
+	vd->map = NULL;
+}
+
+static int vardict_map(struct vardict *vd, int fd, const char *path)
 {
-	char *path;
-	int fd;
 	struct stat buf;
 	unsigned int expected = 0;
 
-	path = getenv(TUP_VARDICT_NAME);
-	if(!path) {
-		fprintf(stderr, "tup client error: Couldn't find path for '%s'\n",
-			TUP_VARDICT_NAME);
-		return -1;
-	}
-	fd = open(path, O_RDONLY);
 	if(fd < 0) {
 		if(errno == ENOENT) {
 			/* If we don't have a vardict file, it's because there are
 			 * no variables.
 			 */
-			tup_vars.len = 0;
-			tup_vars.num_entries = 0;
-			tup_vars.offsets = NULL;
-			tup_vars.entries = NULL;
-			tup_vars.map = NULL;
+			vardict_empty(vd);
 			return 0;
 		}
 		perror(path);
@@ -71,67 +60,78 @@ int tup_vardict_init(void)
 
 	if(fstat(fd, &buf) < 0) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
-	tup_vars.len = buf.st_size;
-	if(tup_vars.len == 0) {
+	vd->len = buf.st_size;
+	if(vd->len == 0) {
 		/* Empty file is ok - no variables will be read */
-		tup_vars.num_entries = 0;
-		tup_vars.offsets = NULL;
-		tup_vars.entries = NULL;
-		tup_vars.map = NULL;
+		vardict_empty(vd);
+		close(fd);
 		return 0;
 	}
 
 	expected += sizeof(unsigned int);
-	if(tup_vars.len < expected) {
-		fprintf(stderr, "tup error: var-tree should be at least sizeof(unsigned int) bytes, but got %i bytes\n", tup_vars.len);
+	if(vd->len < expected) {
+		fprintf(stderr, "tup error: var-tree should be at least sizeof(unsigned int) bytes, but got %i bytes\n", vd->len);
+		close(fd);
 		return -1;
 	}
-	tup_vars.map = mmap(NULL, tup_vars.len, PROT_READ, MAP_PRIVATE, fd, 0);
-	if(tup_vars.map == MAP_FAILED) {
+	vd->map = mmap(NULL, vd->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(vd->map == MAP_FAILED) {
 		perror("mmap");
+		vd->map = NULL;
 		return -1;
 	}
 
-	tup_vars.num_entries = *(unsigned int*)tup_vars.map;
-	tup_vars.offsets = (unsigned int*)(void*)((char*)tup_vars.map + expected);
-	expected += sizeof(unsigned int) * tup_vars.num_entries;
-	tup_vars.entries = (const char*)tup_vars.map + expected;
-	if(tup_vars.len < expected) {
-		fprintf(stderr, "tup error: var-tree should have at least %i bytes to accommodate the index, but got %i bytes\n", expected, tup_vars.len);
+	vd->num_entries = *(unsigned int*)vd->map;
+	vd->offsets = (unsigned int*)(void*)((char*)vd->map + expected);
+	expected += sizeof(unsigned int) * vd->num_entries;
+	vd->entries = (const char*)vd->map + expected;
+	if(vd->len < expected) {
+		fprintf(stderr, "tup error: var-tree should have at least %i bytes to accommodate the index, but got %i bytes\n", expected, vd->len);
+		vardict_close(vd);
 		return -1;
 	}
 
 	return 0;
 }
 
-const char *tup_config_var(const char *key, int keylen)
+int vardict_open(struct vardict *vd, int dfd, const char *path)
+{
+	return vardict_map(vd, openat(dfd, path, O_RDONLY), path);
+}
+
+void vardict_close(struct vardict *vd)
+{
+	if(vd->map)
+		munmap(vd->map, vd->len);
+	vardict_empty(vd);
+}
+
+const char *vardict_lookup(struct vardict *vd, const char *key, int keylen)
 {
 	int left = -1;
-	int right = tup_vars.num_entries;
+	int right = vd->num_entries;
 	int cur;
 	const char *p;
 	const char *k;
 	int bytesleft;
 
-	if(keylen == -1)
-		keylen = strlen(key);
-
-	tup_send_event(key, keylen, "", 0, ACCESS_VAR);
 	while(1) {
 		cur = (right - left) >> 1;
 		if(cur <= 0)
 			break;
 		cur += left;
-		if(cur >= (signed)tup_vars.num_entries)
+		if(cur >= (signed)vd->num_entries)
 			break;
 
-		if(tup_vars.offsets[cur] >= tup_vars.len) {
+		if(vd->offsets[cur] >= vd->len) {
 			fprintf(stderr, "tup error: Offset for element %i is out of bounds.\n", cur);
 			break;
 		}
-		p = tup_vars.entries + tup_vars.offsets[cur];
+		p = vd->entries + vd->offsets[cur];
 		k = key;
 		bytesleft = keylen;
 		while(bytesleft > 0) {
@@ -162,3 +162,25 @@ out_next:
 	}
 	return NULL;
 }
+
+int tup_vardict_init(void)
+{
+	char *path;
+
+	path = getenv(TUP_VARDICT_NAME);
+	if(!path) {
+		fprintf(stderr, "tup client error: Couldn't find path for '%s'\n",
+			TUP_VARDICT_NAME);
+		return -1;
+	}
+	return vardict_map(&tup_vars, open(path, O_RDONLY), path);
+}
+
+const char *tup_config_var(const char *key, int keylen)
+{
+	if(keylen == -1)
+		keylen = strlen(key);
+
+	tup_send_event(key, keylen, "", 0, ACCESS_VAR);
+	return vardict_lookup(&tup_vars, key, keylen);
+}
@@ -21,6 +21,18 @@
 #ifndef tup_vardict_h
 #define tup_vardict_h
 
+struct vardict {
+	unsigned int len;
+	unsigned int num_entries;
+	unsigned int *offsets;
+	const char *entries;
+	void *map;
+};
+
+int vardict_open(struct vardict *vd, int dfd, const char *path);
+void vardict_close(struct vardict *vd);
+const char *vardict_lookup(struct vardict *vd, const char *key, int keylen);
+
 int tup_vardict_init(void);
 const char *tup_config_var(const char *key, int keylen);
 
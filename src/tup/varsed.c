@@ -21,6 +21,7 @@
 #include "varsed.h"
 #include "vardict.h"
 #include "fslurp.h"
+#include "estring.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -78,27 +79,51 @@ int varsed(int argc, char **argv)
 	return 0;
 }
 
+static const char *config_var_lookup(void *arg, const char *var, int varlen)
+{
+	if(arg) {/* unused */}
+	return tup_config_var(var, varlen);
+}
+
 static int var_replace(int ifd, int ofd, int binmode)
 {
 	struct buf b;
-	char *p, *e;
+	struct estring e;
+	int rc = 0;
 
 	if(fslurp(ifd, &b) < 0)
 		return -1;
+	if(estring_init(&e) < 0) {
+		free(b.s);
+		return -1;
+	}
+	if(varsed_buf(b.s, b.len, &e, binmode, config_var_lookup, NULL) < 0)
+		rc = -1;
+	if(rc == 0 && write(ofd, e.s, e.len) != e.len) {
+		perror("write");
+		rc = -1;
+	}
+	free(e.s);
+	free(b.s);
+	return rc;
+}
 
-	p = b.s;
-	e = b.s + b.len;
-	do {
-		char *at;
-		char *rat;
+int varsed_buf(const char *s, int len, struct estring *out, int binmode,
+	       varsed_lookup_t lookup, void *arg)
+{
+	const char *p, *e;
+
+	p = s;
+	e = s + len;
+	while(p < e) {
+		const char *at;
+		const char *rat;
 		at = p;
 		while(at < e && *at != '@') {
 			at++;
 		}
-		if(write(ofd, p, at-p) != at-p) {
-			perror("write");
+		if(estring_append(out, p, at-p) < 0)
 			return -1;
-		}
 		if(at >= e)
 			break;
 
@@ -110,32 +135,25 @@ static int var_replace(int ifd, int ofd, int binmode)
 		if(rat < e && *rat == '@') {
 			const char *value;
 
-			value = tup_config_var(p+1, rat-(p+1));
+			value = lookup(arg, p+1, rat-(p+1));
 			if(value) {
-				int len;
-				len = strlen(value);
-				if(binmode && len == 1) {
+				int vlen;
+				vlen = strlen(value);
+				if(binmode && vlen == 1) {
 					if(value[0] == 'y')
 						value = "1";
 					else if(value[0] == 'n')
 						value = "0";
 				}
-				if(write(ofd, value, len) != len) {
-					perror("write");
+				if(estring_append(out, value, vlen) < 0)
 					return -1;
-				}
 			}
 			p = rat + 1;
 		} else {
-			if(write(ofd, p, rat-p) != rat-p) {
-				perror("write");
+			if(estring_append(out, p, rat-p) < 0)
 				return -1;
-			}
 			p = rat;
 		}
-		
-	} while(p < e);
-	free(b.s);
-
+	}
 	return 0;
 }
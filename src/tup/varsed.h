@@ -21,6 +21,13 @@
 #ifndef tup_varsed_h
 #define tup_varsed_h
 
+struct estring;
+
+typedef const char *(*varsed_lookup_t)(void *arg, const char *var, int varlen);
+
 int varsed(int argc, char **argv);
+/* Appends buf with each @VARIABLE@ replaced by its value to 'out'. */
+int varsed_buf(const char *buf, int len, struct estring *out, int binmode,
+	       varsed_lookup_t lookup, void *arg);
 
 #endif
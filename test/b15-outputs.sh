@@ -0,0 +1,23 @@
+#! /bin/sh -e
+
+# Commands with many outputs, which spend most of their non-command time
+# removing the old outputs and moving the new ones into place. Compare with
+# b16-outputs-sync.sh, which runs the same thing without io_uring.
+cat > gen.sh << HERE
+#! /bin/sh
+n=\$1
+shift
+for i in \`seq 1 $1\`; do echo \$n > \$n-\$i.out; done
+HERE
+chmod +x gen.sh
+outputs=""
+for i in `seq 1 $1`; do outputs="$outputs %B-$i.out"; done
+echo ": foreach *.txt |> ./gen.sh %B |> $outputs" > Tupfile
+for i in `seq 1 10`; do echo $i > $i.txt; done
+tup upd
+for i in `seq 1 10`; do echo "$i again" > $i.txt; done
+tup upd
+if [ "`cat 10-$1.out`" != "10" ]; then
+	echo "Outputs not built!" 1>&2
+	exit 1
+fi
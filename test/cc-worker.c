@@ -0,0 +1,137 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A stand-in for an expensive compiler frontend that runs under tup's ^w
+ * flag. Usage:
+ *
+ *   cc-worker -o OUT IN...
+ *
+ * Each input is copied to OUT, with lines of the form "#include FILE"
+ * replaced by the contents of FILE. When TUP_WORKER is set, it instead
+ * prints "ready" and serves jobs from stdin: a line with the directory to
+ * run in, and a line with the arguments. Each response is a line with the
+ * exit status and the number of bytes of output, followed by the output.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int jobs = 0;
+
+static int copy_file(FILE *out, FILE *msg, const char *name, int depth)
+{
+	FILE *in;
+	char line[1024];
+
+	in = fopen(name, "r");
+	if(!in) {
+		fprintf(msg, "cc-worker: unable to open %s\n", name);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), in) != NULL) {
+		if(strncmp(line, "#include ", 9) == 0 && depth < 16) {
+			line[strcspn(line, "\n")] = 0;
+			if(copy_file(out, msg, line + 9, depth + 1) < 0) {
+				fclose(in);
+				return -1;
+			}
+		} else {
+			fputs(line, out);
+		}
+	}
+	fclose(in);
+	return 0;
+}
+
+static int compile(int argc, char **argv, FILE *msg)
+{
+	FILE *out;
+	int x;
+
+	jobs++;
+	if(argc < 3 || strcmp(argv[0], "-o") != 0) {
+		fprintf(msg, "usage: cc-worker -o OUT IN...\n");
+		return 1;
+	}
+	fprintf(msg, "cc-worker[%i]: job %i %s\n", (int)getpid(), jobs, argv[1]);
+	out = fopen(argv[1], "w");
+	if(!out) {
+		fprintf(msg, "cc-worker: unable to create %s\n", argv[1]);
+		return 1;
+	}
+	for(x=2; x<argc; x++) {
+		if(copy_file(out, msg, argv[x], 0) < 0) {
+			fclose(out);
+			return 1;
+		}
+	}
+	fclose(out);
+	return 0;
+}
+
+static int serve(void)
+{
+	char dir[4096];
+	char args[4096];
+
+	printf("ready\n");
+	fflush(stdout);
+	while(fgets(dir, sizeof(dir), stdin) != NULL && fgets(args, sizeof(args), stdin) != NULL) {
+		char *argv[64];
+		int argc = 0;
+		char *p;
+		char *msgbuf = NULL;
+		size_t msglen = 0;
+		FILE *msg;
+		int rc;
+
+		dir[strcspn(dir, "\n")] = 0;
+		args[strcspn(args, "\n")] = 0;
+		for(p=strtok(args, " "); p && argc < 63; p=strtok(NULL, " "))
+			argv[argc++] = p;
+		argv[argc] = NULL;
+
+		msg = open_memstream(&msgbuf, &msglen);
+		if(!msg)
+			return 1;
+		if(chdir(dir) < 0) {
+			fprintf(msg, "cc-worker: unable to chdir to %s\n", dir);
+			rc = 1;
+		} else {
+			rc = compile(argc, argv, msg);
+		}
+		fclose(msg);
+		printf("%i %zu\n", rc, msglen);
+		fwrite(msgbuf, 1, msglen, stdout);
+		fflush(stdout);
+		free(msgbuf);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if(getenv("TUP_WORKER"))
+		return serve();
+	return compile(argc - 1, argv + 1, stdout);
+}
@@ -0,0 +1,54 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# Make sure --profile-sql prints the statement summary, or writes it as JSON.
+
+. ./tup.sh
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+HERE
+touch foo.c bar.c
+tup --profile-sql > .tup/profile.txt 2>&1
+if ! grep 'SQL profile' .tup/profile.txt > /dev/null; then
+	echo "Error: Expected an SQL profile summary" 1>&2
+	exit 1
+fi
+if ! grep 'insert into node' .tup/profile.txt > /dev/null; then
+	echo "Error: Expected the node insert statement in the SQL profile" 1>&2
+	exit 1
+fi
+check_exist foo.o bar.o
+
+touch foo.c
+tup --profile-sql=.tup/profile.json
+if ! grep '"sql": "commit"' .tup/profile.json > /dev/null; then
+	echo "Error: Expected the commit statement in the JSON profile" 1>&2
+	exit 1
+fi
+
+# A relative filename is relative to where tup was run, not the top.
+tmkdir sub
+touch foo.c
+cd sub
+tup --profile-sql=profile.json
+cd ..
+check_exist sub/profile.json
+check_not_exist profile.json
+
+eotup
@@ -0,0 +1,95 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# Make sure the db.link_cache option builds a link cache, keeps it in sync
+# with link changes, and rebuilds it if the file is damaged.
+
+. ./tup.sh
+
+# The commit at the end of an update merges the changed links into the cache.
+# That must give the same file as rebuilding it from scratch, and no
+# temporary files may be left behind.
+check_merged()
+{
+	cp .tup/linkcache merged.linkcache
+	rm .tup/linkcache
+	tup graph . > /dev/null
+	if ! cmp merged.linkcache .tup/linkcache; then
+		echo "Error: Merged link cache differs from a rebuilt one" 1>&2
+		exit 1
+	fi
+	rm merged.linkcache
+	if ls .tup/linkcache.* > /dev/null 2>&1; then
+		echo "Error: Temporary link cache files left behind" 1>&2
+		exit 1
+	fi
+}
+cat >> .tup/options << HERE
+[db]
+link_cache = 1
+HERE
+
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+: foo.o |> cp %f %o |> foo.copy
+HERE
+touch foo.c bar.c
+update
+check_exist .tup/linkcache
+check_updates foo.c foo.o
+check_updates foo.c foo.copy
+check_no_updates bar.c foo.o
+
+# New links must be seen after the cache was built.
+echo '#include "foo.h"' > bar.c
+tup touch bar.c foo.h
+update
+check_merged
+tup_dep_exist . foo.h . 'gcc -c bar.c -o bar.o'
+check_updates foo.h bar.o
+check_no_updates foo.h foo.o
+
+# Removed links must not be followed.
+echo 'int bar;' > bar.c
+tup touch bar.c
+update
+tup_dep_no_exist . foo.h . 'gcc -c bar.c -o bar.o'
+check_no_updates foo.h bar.o
+
+echo garbage > .tup/linkcache
+check_updates foo.c foo.copy
+if grep garbage .tup/linkcache > /dev/null; then
+	echo "Error: Expected the damaged link cache to be rebuilt" 1>&2
+	exit 1
+fi
+
+rm .tup/linkcache
+check_updates bar.c bar.o
+check_exist .tup/linkcache
+
+# Deleting a command removes all of its links at once.
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+HERE
+tup touch Tupfile
+update
+check_merged
+check_not_exist foo.copy
+
+eotup
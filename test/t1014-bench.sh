@@ -0,0 +1,66 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# Make sure 'tup bench' generates a project, runs every scenario, and writes
+# a JSON report.
+
+. ./tup.sh
+check_no_windows bench
+
+tup bench --dirs=2 --files=3 --depth=2 --rules=2 --variants=1 --set=db.sync=0 --output=bench.json proj > summary.txt
+for i in scan parse full_build noop_update one_file_update full_rebuild; do
+	if ! grep "\"name\": \"$i\", \"status\": 0" bench.json > /dev/null; then
+		echo "Error: Expected scenario '$i' to succeed in the bench report" 1>&2
+		exit 1
+	fi
+	if ! grep "^$i " summary.txt > /dev/null; then
+		echo "Error: Expected scenario '$i' in the bench summary" 1>&2
+		exit 1
+	fi
+done
+if ! grep '"commands": 20' bench.json > /dev/null; then
+	echo "Error: Expected 20 commands in the bench report" 1>&2
+	exit 1
+fi
+if ! grep '"name": "Executing Commands"' bench.json > /dev/null; then
+	echo "Error: Expected per-phase times in the bench report" 1>&2
+	exit 1
+fi
+check_exist proj/build-0/d1/all.txt proj/build-0/d0/f2.s1
+if ! grep 'sync = 0' proj/.tup/options > /dev/null; then
+	echo "Error: Expected --set to be written to the options file" 1>&2
+	exit 1
+fi
+
+# With a fan-out, the directories are nested under d0.
+tup bench --dirs=4 --fanout=2 --files=1 --depth=1 --rules=0 --output=tree.json tree > /dev/null
+if ! grep '"fanout": 2' tree.json > /dev/null; then
+	echo "Error: Expected the fan-out in the bench report" 1>&2
+	exit 1
+fi
+check_exist tree/d0/d1/d3/all.txt tree/d0/d2/f0.i
+check_not_exist tree/d1 tree/d0/d3
+
+# The directory must not already exist.
+if tup bench proj 2>/dev/null; then
+	echo "Error: Expected 'tup bench' to fail with an existing directory" 1>&2
+	exit 1
+fi
+
+eotup
@@ -0,0 +1,57 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# Make sure --profile and display.profile print the per-phase table.
+
+. ./tup.sh
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+HERE
+touch foo.c bar.c
+tup --profile > .tup/profile.txt
+for i in scan config parse update commit total; do
+	if ! grep "^$i " .tup/profile.txt > /dev/null; then
+		echo "Error: Expected phase '$i' in the profile" 1>&2
+		exit 1
+	fi
+done
+if ! awk '$1 == "update" && $3 >= 2 && $6 > 0 {found=1} END {exit !found}' .tup/profile.txt; then
+	echo "Error: Expected nodes and file events in the update phase" 1>&2
+	exit 1
+fi
+check_exist foo.o bar.o
+
+update > .tup/profile.txt
+if grep 'Update profile' .tup/profile.txt > /dev/null; then
+	echo "Error: Expected no profile without --profile" 1>&2
+	exit 1
+fi
+
+cat >> .tup/options << HERE
+[display]
+profile = 1
+HERE
+touch foo.c
+update > .tup/profile.txt
+if ! grep 'Update profile' .tup/profile.txt > /dev/null; then
+	echo "Error: Expected display.profile to print the profile" 1>&2
+	exit 1
+fi
+
+eotup
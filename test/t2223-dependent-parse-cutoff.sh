@@ -0,0 +1,81 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# A directory that uses another directory's outputs only needs to be re-parsed
+# if the set of files in that directory changes, not every time its Tupfile
+# is re-parsed.
+
+. ./tup.sh
+
+tmkdir lib
+tmkdir app
+cat > lib/Tupfile << HERE
+: foreach *.txt |> cp %f %o |> %B.out
+HERE
+cat > app/Tupfile << HERE
+: ../lib/*.out |> cat %f > %o |> all.txt
+HERE
+echo a > lib/a.txt
+echo b > lib/b.txt
+tup touch lib/a.txt lib/b.txt lib/Tupfile app/Tupfile
+update
+printf "a\nb\n" | diff - app/all.txt
+
+# Changing only the command in lib doesn't change what app sees.
+cat > lib/Tupfile << HERE
+: foreach *.txt |> cp %f %o && true |> %B.out
+HERE
+tup touch lib/Tupfile
+tup parse > .parse-output 2>&1
+if ! grep 'Skipped 1 dependent Tupfile' .parse-output > /dev/null; then
+	cat .parse-output
+	echo "Error: app should not have been re-parsed" 1>&2
+	exit 1
+fi
+update
+printf "a\nb\n" | diff - app/all.txt
+
+# A new output in lib is picked up by app's glob.
+echo c > lib/c.txt
+tup touch lib/c.txt
+tup parse > .parse-output 2>&1
+if grep 'Skipped' .parse-output > /dev/null; then
+	cat .parse-output
+	echo "Error: app should have been re-parsed" 1>&2
+	exit 1
+fi
+update
+printf "a\nb\nc\n" | diff - app/all.txt
+
+# So is removing one.
+rm lib/b.txt
+tup rm lib/b.txt
+update
+printf "a\nc\n" | diff - app/all.txt
+
+# And a new output from a changed Tupfile.
+cat > lib/Tupfile << HERE
+: foreach *.txt |> cp %f %o |> %B.out
+: a.txt |> cp %f %o |> z.out
+HERE
+tup touch lib/Tupfile
+update
+printf "a\nc\na\n" | diff - app/all.txt
+
+eotup
@@ -0,0 +1,70 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Re-parsing a directory shouldn't rewrite its .gitignore unless the list of
+# generated files actually changed.
+
+. ./tup.sh
+
+inode()
+{
+	ls -i $1 | awk '{print $1}'
+}
+
+cat > Tupfile << HERE
+.gitignore
+: |> touch foo |> foo
+HERE
+printf 'user-entry\n##### TUP GITIGNORE #####\n' > .gitignore
+tup touch Tupfile
+update
+
+gitignore_good user-entry .gitignore
+gitignore_good foo .gitignore
+before=`inode .gitignore`
+
+cat > Tupfile << HERE
+.gitignore
+: |> touch foo |> foo
+: |> echo hi |>
+HERE
+tup touch Tupfile
+update
+
+if [ "`inode .gitignore`" != "$before" ]; then
+	echo "Error: .gitignore should not have been rewritten." 1>&2
+	exit 1
+fi
+
+cat > Tupfile << HERE
+.gitignore
+: |> touch foo |> foo
+: |> touch bar |> bar
+HERE
+tup touch Tupfile
+update
+
+if [ "`inode .gitignore`" = "$before" ]; then
+	echo "Error: .gitignore should have been rewritten." 1>&2
+	exit 1
+fi
+gitignore_good user-entry .gitignore
+gitignore_good foo .gitignore
+gitignore_good bar .gitignore
+
+eotup
@@ -0,0 +1,57 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# Commands in the same directory that use the same group as a resource file
+# share the file, and changes to the group are still picked up.
+. ./tup.sh
+
+cat > Tupfile << HERE
+: foreach a.c b.c |> touch %o |> %B.o <objs>
+: <objs> |> echo %<objs>.res > %o |> res1.txt
+: <objs> |> echo %<objs>.res > %o |> res2.txt
+: <objs> |> cat %<objs>.res > %o |> files.txt
+HERE
+tup touch a.c b.c
+update
+
+if ! cmp res1.txt res2.txt > /dev/null; then
+	echo "Error: Expected res1.txt and res2.txt to reference the same resource file" 1>&2
+	exit 1
+fi
+echo "a.o" > expected.txt
+echo "b.o" >> expected.txt
+if ! diff expected.txt files.txt > /dev/null; then
+	echo "Error: Unexpected contents of files.txt" 1>&2
+	exit 1
+fi
+
+cat > Tupfile << HERE
+: foreach a.c b.c c.c |> touch %o |> %B.o <objs>
+: <objs> |> cat %<objs>.res > %o |> files.txt
+HERE
+tup touch c.c
+update
+
+echo "c.o" >> expected.txt
+if ! diff expected.txt files.txt > /dev/null; then
+	echo "Error: Expected c.o to be in files.txt" 1>&2
+	exit 1
+fi
+
+eotup
@@ -0,0 +1,92 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# The groups are kept in dependency order between updates, and a new group
+# link that goes against the order moves just the groups it affects.
+. ./tup.sh
+check_no_windows sqlite3 executable
+
+ord()
+{
+	sqlite3 .tup/db "select ord from group_order where id=(select id from node where name='<$1>')"
+}
+
+check_order()
+{
+	if [ "`ord $1`" -ge "`ord $2`" ]; then
+		echo "Error: Expected <$1> to be ordered before <$2>" 1>&2
+		sqlite3 .tup/db "select name, ord from group_order, node where group_order.id=node.id" 1>&2
+		exit 1
+	fi
+}
+
+cat > Tupfile << HERE
+: |> echo a > %o |> a.txt | <ga>
+: <ga> |> echo b > %o |> b.txt | <gb>
+HERE
+update
+check_order ga gb
+
+# <gc> is new, so it starts at the end, but it has to move in front of <ga>.
+cat > Tupfile << HERE
+: |> echo c > %o |> c.txt | <gc>
+: <gc> |> echo a > %o |> a.txt | <ga>
+: <ga> |> echo b > %o |> b.txt | <gb>
+HERE
+tup touch Tupfile
+update
+check_order gc ga
+check_order ga gb
+
+cat > Tupfile << HERE
+: <gb> |> echo c > %o |> c.txt | <gc>
+: <gc> |> echo a > %o |> a.txt | <ga>
+: <ga> |> echo b > %o |> b.txt | <gb>
+HERE
+tup touch Tupfile
+update_fail_msg 'Circular dependency found among the following groups'
+
+# Once the cycle is removed, the order is rebuilt from the existing links.
+cat > Tupfile << HERE
+: |> echo c > %o |> c.txt | <gc>
+: <gb> |> echo d > %o |> d.txt | <gd>
+: <gc> |> echo a > %o |> a.txt | <ga>
+: <ga> |> echo b > %o |> b.txt | <gb>
+HERE
+tup touch Tupfile
+update
+check_order gc ga
+check_order ga gb
+check_order gb gd
+
+# Removing a group removes its place in the order.
+cat > Tupfile << HERE
+: |> echo c > %o |> c.txt | <gc>
+: <gc> |> echo a > %o |> a.txt | <ga>
+: <ga> |> echo b > %o |> b.txt | <gb>
+HERE
+tup touch Tupfile
+update
+tup_object_no_exist . '<gd>'
+if [ "`sqlite3 .tup/db 'select count(*) from group_order where id not in (select id from node)'`" != "0" ]; then
+	echo "Error: Expected the order of a deleted group to be removed" 1>&2
+	exit 1
+fi
+
+eotup
@@ -24,15 +24,25 @@ if [ ! "$tupos" = "Linux" ]; then
 	eotup
 fi
 cat > Tupfile << HERE
-: |> ls -l /proc/\$\$/fd > %o |> fds.txt
+: |> ls -l /proc/\$\$/fd > fds.txt; echo "\$MAKEFLAGS" > makeflags.txt |> fds.txt makeflags.txt
 HERE
 tup touch Tupfile
 update
 
+# The jobserver pipe is the only thing that commands should inherit on
+# purpose (t5123), so exactly the descriptors in MAKEFLAGS are allowed.
+jobserver=`sed -n 's/.*--jobserver-auth=\([0-9]*\),\([0-9]*\).*/\1 \2/p' makeflags.txt`
+set -- $jobserver
+if [ $# != 2 ]; then
+	echo "Error: Expected the jobserver descriptors in MAKEFLAGS: `cat makeflags.txt`" 1>&2
+	exit 1
+fi
+
 # On Gentoo, stdout points to output-0, while on Ubuntu, it points to the
-# redirected file (fds.txt). This might be a bash vs dash thing.
+# redirected file (fds.txt). This might be a bash vs dash thing. The deps
+# file comes after the jobserver descriptors.
 # On Fedora, something keeps /var/lib/sss/mc/passwd open (maybe https://bugzilla.redhat.com/show_bug.cgi?id=1356542)
-text=`cat fds.txt | grep -v ' 0 .*/dev/null' | grep -v ' 1 .*output-' | grep -v ' 1 .*fds.txt' | grep -v ' 2 .*errors' | grep -v ' 3 .*deps-' | grep -v '/var/lib/sss/mc/passwd'`
+text=`cat fds.txt | grep -v ' 0 .*/dev/null' | grep -v ' 1 .*output-' | grep -v ' 1 .*fds.txt' | grep -v ' 2 .*errors' | grep -v ' [0-9]* -> .*deps-' | grep -v '/var/lib/sss/mc/passwd' | grep -v " $1 -> pipe:" | grep -v " $2 -> pipe:"`
 if [ "$text" != "total 0" ]; then
 	echo "Error: These fds shouldn't be open: $text" 1>&2
 	exit 1
@@ -0,0 +1,51 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# With db.reclaim_threshold set, removing a rule that left behind more ghosts
+# than the threshold keeps them around until 'tup gc' is run.
+
+. ./tup.sh
+cat >> .tup/options << HERE
+[db]
+reclaim_threshold = 1
+HERE
+
+cat > ok.sh << HERE
+cat secret/ghost1 2>/dev/null
+cat secret/ghost2 2>/dev/null
+echo nofile
+HERE
+cat > Tupfile << HERE
+: |> sh ok.sh > %o |> output.txt
+HERE
+update
+tup_object_exist . secret
+tup_object_exist secret ghost1 ghost2
+
+rm -f Tupfile
+update
+
+tup_object_exist . secret
+tup_object_exist secret ghost1 ghost2
+
+tup gc | grep 'Removed 3 ghost nodes' > /dev/null || (echo "Error: Expected tup gc to remove 3 ghost nodes" 1>&2; exit 1)
+tup_object_no_exist . secret
+tup_object_no_exist secret ghost1 ghost2
+
+eotup
@@ -0,0 +1,61 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# Use the ^d flag to import dependencies from the compiler's .d file instead
+# of tracing the command.
+
+. ./tup.sh
+check_no_windows
+
+cat > Tupfile << HERE
+: foreach *.c |> ^d^ cat secret.txt > /dev/null && gcc -MD -c %f -o %o |> %B.o | %B.d
+HERE
+echo '#define FOO 3' > foo.h
+echo 'secret' > secret.txt
+cat > foo.c << HERE
+#include "foo.h"
+int foo(void) {return FOO;}
+HERE
+update
+
+cmd="cat secret.txt > /dev/null && gcc -MD -c foo.c -o foo.o"
+tup_dep_exist . foo.c . "$cmd"
+tup_dep_exist . foo.h . "$cmd"
+tup_dep_exist . "$cmd" . foo.o
+tup_dep_exist . "$cmd" . foo.d
+tup_dep_no_exist . secret.txt . "$cmd"
+
+echo '#define FOO 4' > foo.h
+check_updates foo.h foo.o
+
+# The .d file must be declared as an output.
+cat > Tupfile << HERE
+: foreach *.c |> ^d^ gcc -c %f -o %o |> %B.o
+HERE
+tup touch Tupfile
+parse_fail_msg "The 'd' flag requires a .d file in the outputs"
+
+# Targets in the .d file are still checked against the declared outputs.
+cat > Tupfile << HERE
+: |> ^d^ echo 'bar.o: foo.h' > %o |> bar.d
+HERE
+tup touch Tupfile
+update_fail_msg "File '.*bar.o' was written to, but is not in .tup/db"
+
+eotup
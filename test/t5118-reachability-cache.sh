@@ -0,0 +1,60 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# Many commands read 'foo' without declaring it, which is fine since foo is
+# upstream of their declared input 'bar'. Make sure the reachability cache
+# answers these the same way as a full graph walk, including when the cache
+# is too small to hold an entry, and still reports real missing inputs.
+
+. ./tup.sh
+
+cat > Tupfile << HERE
+: |> echo blah > %o |> foo
+: foo |> cat foo > %o |> bar
+: foreach a b c d e | bar |> cat foo bar %f > %o |> %f.out
+HERE
+touch a b c d e
+update
+
+cat >> .tup/options << HERE
+[updater]
+reachability_cache = 1
+HERE
+echo 'a2' > a
+echo 'b2' > b
+tup touch a b
+update
+
+cat > .tup/options << HERE
+[updater]
+reachability_cache = 0
+HERE
+echo 'c2' > c
+tup touch c
+update
+
+cat > .tup/options << HERE
+HERE
+cat >> Tupfile << HERE
+: |> cat foo > %o |> bad
+HERE
+tup touch Tupfile
+update_fail_msg "Missing input dependency"
+
+eotup
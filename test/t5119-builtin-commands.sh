@@ -0,0 +1,115 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# Plain 'tup varsed', 'cp', and 'touch' commands run inside tup. Make sure they
+# produce the same files and dependencies as running them through the shell.
+
+. ./tup.sh
+
+cat > Tupfile << HERE
+: foo.txt |> tup varsed %f %o |> out.txt
+: foo.txt |> tup varsed --binary %f %o |> bin.txt
+: bar.sh |> cp %f %o |> copy.sh
+: out.txt |> cp %f %o |> out-copy.txt
+: |> touch %o |> stamp
+: bar.sh |> cp %f %o && echo hi > %o |> quoted.sh
+HERE
+echo "hey @FOO@ yo @BAR@" > foo.txt
+printf '#! /bin/sh\necho hi\n' > bar.sh
+chmod +x bar.sh
+tup touch foo.txt bar.sh Tupfile
+varsetall FOO=sup BAR=y
+update
+
+echo "hey sup yo y" | diff out.txt -
+echo "hey sup yo 1" | diff bin.txt -
+echo "hey sup yo y" | diff out-copy.txt -
+diff bar.sh copy.sh
+if [ ! -x copy.sh ]; then
+	echo "Error: copy.sh should be executable" 1>&2
+	exit 1
+fi
+if [ -s stamp ] || [ ! -f stamp ]; then
+	echo "Error: stamp should be an empty file" 1>&2
+	exit 1
+fi
+echo hi | diff quoted.sh -
+
+tup_dep_exist . foo.txt . 'tup varsed foo.txt out.txt'
+tup_dep_exist tup.config FOO . 'tup varsed foo.txt out.txt'
+tup_dep_exist tup.config BAR . 'tup varsed foo.txt out.txt'
+tup_dep_exist . out.txt . 'cp out.txt out-copy.txt'
+tup_dep_exist . bar.sh . 'cp bar.sh copy.sh'
+
+varsetall FOO=sup BAR=n
+update
+echo "hey sup yo n" | diff out.txt -
+echo "hey sup yo 0" | diff bin.txt -
+echo "hey sup yo n" | diff out-copy.txt -
+
+# An output that isn't declared is still caught.
+cat > Tupfile << HERE
+: bar.sh |> cp %f copy.sh |>
+HERE
+tup touch Tupfile
+update_fail_msg "copy.sh' was written to, but is not in .tup/db"
+
+# A file that isn't an output is never overwritten.
+echo "hey there" > user.txt
+cat > Tupfile << HERE
+: |> touch user.txt |>
+HERE
+tup touch user.txt Tupfile
+update_fail_msg "\(tup error.*utimens\|Unspecified output files\)"
+echo "hey there" | diff - user.txt
+
+# The built-ins never run the real programs, so a cp and touch that always
+# fail earlier in PATH aren't used.
+cat > Tupfile << HERE
+: bar.sh |> cp %f %o |> copy.sh
+: |> touch %o |> stamp
+HERE
+mkdir .fakebin
+for i in cp touch; do
+	printf '#! /bin/sh\necho "fake %s" 1>&2\nexit 1\n' $i > .fakebin/$i
+	chmod +x .fakebin/$i
+done
+oldpath="$PATH"
+PATH="$PWD/.fakebin:$PATH"
+export PATH
+printf '#! /bin/sh\necho bye\n' > bar.sh
+tup touch bar.sh Tupfile
+update
+diff bar.sh copy.sh
+check_exist stamp
+
+# With built-ins disabled, the commands run through the shell as before.
+cat > .tup/options << HERE
+[updater]
+builtins = 0
+HERE
+tup touch bar.sh Tupfile
+update_fail_msg "fake cp"
+
+PATH="$oldpath"
+export PATH
+update
+diff bar.sh copy.sh
+
+eotup
@@ -0,0 +1,92 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Remove a large number of commands and outputs at once. The outputs are
+# unlinked in parallel, and the nodes are removed from the database as a set,
+# so make sure nothing is left behind in either place.
+
+. ./tup.sh
+
+for d in a b; do
+	tmkdir $d
+	for i in `seq 1 150`; do
+		touch $d/file$i.c
+	done
+	cat > $d/Tupfile << HERE
+: foreach *.c |> cp %f %o |> %B.o | ../<objs>
+: |> (cat ghost.txt 2>/dev/null || true) > %o |> ghost.out
+HERE
+done
+cat > Tupfile << HERE
+: a/<objs> |> echo %<objs> > %o |> objs.txt
+HERE
+tup touch a/Tupfile b/Tupfile Tupfile
+update -j4
+
+check_exist a/file1.o a/file150.o b/file1.o b/file150.o a/ghost.out
+tup_object_exist a ghost.txt
+
+cat > Tupfile << HERE
+HERE
+for d in a b; do
+	cat > $d/Tupfile << HERE
+HERE
+done
+tup touch a/Tupfile b/Tupfile Tupfile
+update -j4 > .tup/delete-output.txt
+
+for d in a b; do
+	for i in `seq 1 150`; do
+		check_not_exist $d/file$i.o
+		tup_object_no_exist $d file$i.o
+		tup_object_no_exist $d "cp file$i.c file$i.o"
+	done
+	check_not_exist $d/ghost.out
+	tup_object_no_exist $d ghost.txt
+done
+check_not_exist objs.txt
+tup_object_no_exist . objs.txt
+
+# Each output is still reported as it is removed.
+if [ `grep -c ') rm: ' .tup/delete-output.txt` != 303 ]; then
+	echo "Error: Expected 303 'rm' lines in the output:" 1>&2
+	cat .tup/delete-output.txt 1>&2
+	exit 1
+fi
+if ! grep 'Deleting 303 commands' .tup/delete-output.txt > /dev/null; then
+	echo "Error: Expected 303 commands to be deleted:" 1>&2
+	cat .tup/delete-output.txt 1>&2
+	exit 1
+fi
+
+# Outputs spread over more directories than there are file descriptors, as
+# when switching branches.
+for i in `seq 1 400`; do
+	mkdir d$i
+	echo ': |> touch %o |> out.txt' > d$i/Tupfile
+done
+update -j4
+for i in `seq 1 400`; do
+	rm d$i/Tupfile
+done
+(ulimit -n 200; update -j4)
+for i in `seq 1 400`; do
+	check_not_exist d$i/out.txt
+done
+
+eotup
@@ -0,0 +1,119 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Query commands like 'tup todo' shouldn't have to wait for an update to
+# finish. They read the database as it was last committed instead.
+
+. ./tup.sh
+
+cat > Tupfile << HERE
+: |> touch started.txt; while [ ! -f ../release.txt ]; do sleep 0.1; done; touch %o |> started.txt out.txt
+HERE
+tup touch Tupfile
+tup parse
+
+rm -f ../release.txt
+tup upd > .tup/upd-output.txt 2>&1 &
+pid=$!
+
+i=0
+while [ ! -f started.txt ]; do
+	sleep 0.1
+	i=$((i+1))
+	if [ $i -gt 100 ]; then
+		touch ../release.txt
+		echo "Error: The update never started." 1>&2
+		exit 1
+	fi
+done
+
+tup todo > .tup/todo-output.txt 2>&1 &
+todo_pid=$!
+i=0
+while kill -0 $todo_pid 2>/dev/null; do
+	sleep 0.1
+	i=$((i+1))
+	if [ $i -gt 50 ]; then
+		touch ../release.txt
+		echo "Error: 'tup todo' is waiting for the update to finish." 1>&2
+		exit 1
+	fi
+done
+tup entry out.txt > /dev/null
+touch ../release.txt
+wait $pid
+rm -f ../release.txt
+
+if ! grep "another tup process is running" .tup/todo-output.txt > /dev/null; then
+	echo "Error: Expected 'tup todo' to skip the scan:" 1>&2
+	cat .tup/todo-output.txt 1>&2
+	exit 1
+fi
+if ! grep "Run 'tup upd'" .tup/todo-output.txt > /dev/null; then
+	echo "Error: Expected 'tup todo' to show the command that was running:" 1>&2
+	cat .tup/todo-output.txt 1>&2
+	exit 1
+fi
+check_exist out.txt
+
+# With nothing else running, todo still scans.
+tup todo > .tup/todo-output.txt 2>&1
+if ! grep "Everything is up-to-date" .tup/todo-output.txt > /dev/null; then
+	cat .tup/todo-output.txt 1>&2
+	exit 1
+fi
+
+# Commands that finish during an update are committed as it goes, so a query
+# in the middle of a long command sees what is already done.
+cat > Tupfile << HERE
+: |> touch %o |> first.txt
+: first.txt |> touch started.txt; while [ ! -f ../release.txt ]; do sleep 0.1; done; touch %o |> started.txt last.txt
+HERE
+rm -f started.txt
+tup touch Tupfile
+tup parse
+tup upd > .tup/upd-output.txt 2>&1 &
+pid=$!
+i=0
+while [ ! -f started.txt ]; do
+	sleep 0.1
+	i=$((i+1))
+	if [ $i -gt 100 ]; then
+		touch ../release.txt
+		echo "Error: The update never started." 1>&2
+		exit 1
+	fi
+done
+sleep 2
+tup todo > .tup/todo-output.txt 2>&1
+touch ../release.txt
+wait $pid
+rm -f ../release.txt
+if grep 'first.txt' .tup/todo-output.txt | grep -v 'started.txt' > /dev/null; then
+	echo "Error: Expected the finished command to be committed:" 1>&2
+	cat .tup/todo-output.txt 1>&2
+	exit 1
+fi
+if ! grep 'last.txt' .tup/todo-output.txt > /dev/null; then
+	echo "Error: Expected the running command to still be listed:" 1>&2
+	cat .tup/todo-output.txt 1>&2
+	exit 1
+fi
+check_exist last.txt
+
+eotup
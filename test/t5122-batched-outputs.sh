@@ -0,0 +1,62 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Outputs are removed before a command runs and stat'd afterward in batches,
+# which use io_uring when updater.io_uring is set. Make sure a command with
+# lots of outputs, most in another directory, works the same either way.
+
+. ./tup.sh
+
+tmkdir sub
+cat > gen.sh << HERE
+#! /bin/sh
+for i in \`seq 1 300\`; do cat in.txt > out-\$i.txt; cat in.txt > sub/out-\$i.txt; done
+HERE
+chmod +x gen.sh
+outputs=""
+for i in `seq 1 300`; do outputs="$outputs out-$i.txt sub/out-$i.txt"; done
+echo ": in.txt |> ./gen.sh |> $outputs" > Tupfile
+
+for uring in 1 0; do
+	(echo "[updater]"; echo "io_uring=$uring") > .tup/options
+	echo "first $uring" > in.txt
+	tup touch in.txt
+	update
+	for i in `seq 1 300`; do
+		if [ "`cat out-$i.txt`" != "first $uring" ]; then
+			echo "Error: out-$i.txt wasn't built with io_uring=$uring" 1>&2
+			exit 1
+		fi
+		check_exist sub/out-$i.txt
+	done
+
+	echo "second $uring" > in.txt
+	tup touch in.txt
+	# The outputs in sub/ are more than the fd limit, so they have to
+	# share one directory fd.
+	(ulimit -n 150; update)
+	for i in `seq 1 300`; do
+		if [ "`cat sub/out-$i.txt`" != "second $uring" ]; then
+			echo "Error: sub/out-$i.txt wasn't rebuilt with io_uring=$uring" 1>&2
+			exit 1
+		fi
+	done
+	check_updates in.txt out-300.txt
+done
+
+eotup
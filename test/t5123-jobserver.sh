@@ -0,0 +1,138 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Tup is a GNU make jobserver for its commands, and a client of the jobserver
+# in MAKEFLAGS if it is run from make. A fake make counts the tokens.
+
+. ./tup.sh
+check_no_windows jobserver
+
+cat > fakemake.c << HERE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+static int count_tokens(int rfd, int wfd)
+{
+	struct pollfd pfd = {rfd, POLLIN, 0};
+	char c;
+	int count = 0;
+	int x;
+
+	while(poll(&pfd, 1, 0) == 1 && read(rfd, &c, 1) == 1)
+		count++;
+	for(x=0; x<count; x++)
+		if(write(wfd, "+", 1) != 1)
+			return -1;
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	const char *flags;
+	const char *auth;
+	int fds[2];
+
+	/* fakemake serve N cmd...: run cmd as a sub-make with N tokens, and
+	 * print how many came back.
+	 */
+	if(argc > 3 && strcmp(argv[1], "serve") == 0) {
+		char buf[64];
+		int status;
+		int x;
+
+		if(pipe(fds) < 0)
+			return 1;
+		for(x=0; x<atoi(argv[2]); x++)
+			if(write(fds[1], "+", 1) != 1)
+				return 1;
+		snprintf(buf, sizeof(buf), "-j%i --jobserver-auth=%i,%i", atoi(argv[2]) + 1, fds[0], fds[1]);
+		setenv("MAKEFLAGS", buf, 1);
+		if(fork() == 0) {
+			execvp(argv[3], argv + 3);
+			return 1;
+		}
+		wait(&status);
+		printf("returned %i\n", count_tokens(fds[0], fds[1]));
+		return WEXITSTATUS(status);
+	}
+
+	/* fakemake: print how many tokens are available. */
+	flags = getenv("MAKEFLAGS");
+	if(!flags || !(auth = strstr(flags, "--jobserver-auth="))) {
+		printf("none\n");
+		return 0;
+	}
+	if(sscanf(auth + 17, "%d,%d", &fds[0], &fds[1]) != 2)
+		return 1;
+	printf("%i\n", count_tokens(fds[0], fds[1]));
+	return 0;
+}
+HERE
+gcc fakemake.c -o ../fakemake
+
+cat > Tupfile << HERE
+: |> ../fakemake > %o |> tokens1.txt
+HERE
+(echo "[updater]"; echo "num_jobs=4") > .tup/options
+update
+echo "3" | diff - tokens1.txt
+
+# Exporting MAKEFLAGS takes the environment's value instead.
+cat > Tupfile << HERE
+export MAKEFLAGS
+: |> ../fakemake > %o |> tokens2.txt
+HERE
+tup touch Tupfile
+MAKEFLAGS= update
+echo "none" | diff - tokens2.txt
+
+(echo "[updater]"; echo "num_jobs=4"; echo "jobserver=0") > .tup/options
+cat > Tupfile << HERE
+: |> ../fakemake > %o |> tokens3.txt
+HERE
+tup touch Tupfile
+update
+echo "none" | diff - tokens3.txt
+
+# Run from a make with 2 spare tokens, the command sees them all since tup
+# uses the implicit slot for it.
+(echo "[updater]"; echo "num_jobs=4") > .tup/options
+cat > Tupfile << HERE
+: |> ../fakemake > %o |> tokens4.txt
+HERE
+tup touch Tupfile
+../fakemake serve 2 tup upd > .tup/serve.txt
+grep "returned 2" .tup/serve.txt > /dev/null
+echo "2" | diff - tokens4.txt
+
+# With no spare tokens, only one command runs at a time.
+rm -rf ../lock
+for i in 1 2 3 4; do
+	echo ": |> mkdir ../lock && sleep 0.2 && rmdir ../lock && touch %o |> $i.out"
+done > Tupfile
+tup touch Tupfile
+../fakemake serve 0 tup upd > .tup/serve.txt
+grep "returned 0" .tup/serve.txt > /dev/null
+check_exist 1.out 2.out 3.out 4.out
+
+rm -f ../fakemake
+eotup
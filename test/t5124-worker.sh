@@ -0,0 +1,81 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# The ^w flag runs commands in a long-lived worker process. Each job's
+# accesses still show up as its dependencies, and the worker's own startup
+# (such as reading its binary) counts for every job.
+
+. ./tup.sh
+check_ldpreload worker
+
+gcc ../cc-worker.c -o cc-worker
+cat > Tupfile << HERE
+: foreach *.in |> ^w^ ./cc-worker -o %o %f |> %B.out
+HERE
+echo foo > a.in
+printf 'bar\n#include inc.h\n' > b.in
+echo header > inc.h
+echo baz > c.in
+update -j1 > log.txt
+
+if [ "`grep -c 'cc-worker\[' log.txt`" != 3 ]; then
+	echo "Error: Expected 3 jobs to run in the worker." 1>&2
+	cat log.txt 1>&2
+	exit 1
+fi
+if [ "`grep -o 'cc-worker\[[0-9]*\]' log.txt | sort -u | wc -l`" != 1 ]; then
+	echo "Error: Expected all jobs to run in the same worker." 1>&2
+	cat log.txt 1>&2
+	exit 1
+fi
+if ! grep 'job 3 c.out' log.txt > /dev/null; then
+	echo "Error: Expected the third job to be handled by the same process." 1>&2
+	cat log.txt 1>&2
+	exit 1
+fi
+diff a.out a.in
+printf 'bar\nheader\n' | diff - b.out
+
+tup_dep_exist . inc.h . './cc-worker -o b.out b.in'
+tup_dep_no_exist . inc.h . './cc-worker -o a.out a.in'
+tup_dep_no_exist . inc.h . './cc-worker -o c.out c.in'
+tup_dep_no_exist . b.in . './cc-worker -o c.out c.in'
+tup_dep_exist . cc-worker . './cc-worker -o a.out a.in'
+tup_dep_exist . cc-worker . './cc-worker -o c.out c.in'
+
+echo newheader > inc.h
+tup touch inc.h
+update -j1 > log.txt
+if [ "`grep -c 'cc-worker\[' log.txt`" != 1 ]; then
+	echo "Error: Expected only b.out to be rebuilt." 1>&2
+	cat log.txt 1>&2
+	exit 1
+fi
+printf 'bar\nnewheader\n' | diff - b.out
+
+# A failed job is reported like a failed command, and the worker keeps
+# serving.
+printf '#include missing.h\n' > c.in
+tup touch c.in
+update_fail_msg 'cc-worker: unable to open missing.h'
+
+echo baz > c.in
+tup touch c.in
+update -j1
+
+eotup
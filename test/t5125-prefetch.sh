@@ -0,0 +1,62 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# With updater.prefetch, the inputs of ready commands are read ahead, and the
+# hit rate is shown at the end of the update.
+
+. ./tup.sh
+
+cat > .tup/options << HERE
+[updater]
+prefetch = 4
+HERE
+
+cat > Tupfile << HERE
+: foreach *.c |> cat %f inc.h > %o |> %B.out
+HERE
+for i in a b c d e; do echo $i > $i.c; done
+echo header > inc.h
+update -j1 > log.txt
+if ! grep 'tup: Prefetched inputs ahead of time for [0-9]* of 5 commands' log.txt > /dev/null; then
+	echo "Error: Expected prefetch statistics for 5 commands." 1>&2
+	cat log.txt 1>&2
+	exit 1
+fi
+tup_dep_exist . inc.h . 'cat c.c inc.h > c.out'
+
+echo newheader > inc.h
+tup touch inc.h
+update -j1 > log.txt
+if ! grep 'tup: Prefetched inputs ahead of time for [0-9]* of 5 commands.*Read ahead [1-9][0-9]* files' log.txt > /dev/null; then
+	echo "Error: Expected the recorded inputs to be read ahead." 1>&2
+	cat log.txt 1>&2
+	exit 1
+fi
+printf 'c\nnewheader\n' | diff - c.out
+
+# Prefetching is off by default.
+cat > .tup/options << HERE
+HERE
+tup touch inc.h
+update -j1 > log.txt
+if grep 'Prefetched' log.txt > /dev/null; then
+	echo "Error: Expected no prefetch statistics." 1>&2
+	exit 1
+fi
+
+eotup
@@ -0,0 +1,73 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# With updater.placement, commands run on the CPUs of their job slot, and
+# ^p commands are pinned to a single CPU. --verbose shows the placement.
+
+. ./tup.sh
+check_no_windows placement
+if ! grep Cpus_allowed_list /proc/self/status > /dev/null 2>&1; then
+	echo "[33mNo Cpus_allowed_list in /proc - skipping test.[0m" 1>&2
+	eotup
+fi
+
+cat > .tup/options << HERE
+[updater]
+placement = 1
+HERE
+
+cat > Tupfile << HERE
+: |> grep Cpus_allowed_list /proc/self/status > %o |> node.txt
+: |> ^p^ grep Cpus_allowed_list /proc/self/status > %o |> pinned.txt
+HERE
+tup upd --verbose -j1 > log.txt
+
+if ! grep 'tup: Placement: slot 0.*CPUs ' log.txt > /dev/null; then
+	echo "Error: Expected the placement in the verbose output." 1>&2
+	cat log.txt 1>&2
+	exit 1
+fi
+cpu=`sed -n 's/.*tup: Placement: slot 0.*pinned to CPU \([0-9]*\)$/\1/p' log.txt`
+if [ "$cpu" = "" ]; then
+	echo "Error: Expected the pinned placement in the verbose output." 1>&2
+	cat log.txt 1>&2
+	exit 1
+fi
+if ! grep "Cpus_allowed_list:[[:space:]]*$cpu\$" pinned.txt > /dev/null; then
+	echo "Error: Expected the ^p command to be pinned to CPU $cpu." 1>&2
+	cat pinned.txt 1>&2
+	exit 1
+fi
+
+cat > .tup/options << HERE
+HERE
+cat > Tupfile << HERE
+: |> ^p^ grep Cpus_allowed_list /proc/self/status > %o |> default.txt
+HERE
+tup touch Tupfile
+tup upd --verbose -j1 > log.txt
+if ! grep 'default.txt' log.txt > /dev/null; then
+	echo "Error: Expected the command to run." 1>&2
+	exit 1
+fi
+if grep 'tup: Placement' log.txt > /dev/null; then
+	echo "Error: Expected no placement by default." 1>&2
+	exit 1
+fi
+
+eotup
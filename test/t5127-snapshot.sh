@@ -0,0 +1,85 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# A snapshot exported from one checkout can be imported into a fresh
+# database. Files whose contents still match are not rebuilt, and the
+# Tupfiles aren't parsed again.
+
+. ./tup.sh
+check_no_windows snapshot
+
+tmkdir sub
+cat > sub/Tupfile << HERE
+: foreach *.c |> cat %f > %o |> %B.out
+HERE
+echo a > sub/a.c
+echo b > sub/b.c
+tmkdir build
+touch build/tup.config
+update
+
+tup snapshot export ../snapshot-t5127.db
+
+# Simulate a fresh checkout: new timestamps and no database or outputs.
+rm -rf .tup build/sub
+tup init --no-sync --force > /dev/null
+touch sub/Tupfile sub/a.c build/tup.config
+echo b2 > sub/b.c
+# A link cache from the old database must not survive the import.
+echo stale > .tup/linkcache
+
+tup snapshot import ../snapshot-t5127.db > .tup/.import.out
+check_not_exist .tup/linkcache
+if ! grep '3 changed or missing' .tup/.import.out > /dev/null; then
+	echo "Error: Expected one changed source file and two missing outputs." 1>&2
+	cat .tup/.import.out
+	exit 1
+fi
+# The database has commands now, so a second import is refused.
+if tup snapshot import ../snapshot-t5127.db 2>/dev/null; then
+	echo "Error: Import should fail into a database with commands." 1>&2
+	exit 1
+fi
+
+tup > .tup/.update.out
+if ! grep 'No Tupfiles to parse' .tup/.update.out > /dev/null; then
+	echo "Error: Tupfiles should not be re-parsed after the import." 1>&2
+	cat .tup/.update.out
+	exit 1
+fi
+if grep 'deleted outside of tup' .tup/.update.out | grep -v 'generated file' > /dev/null; then
+	echo "Error: Variant directories should be created by the import." 1>&2
+	exit 1
+fi
+check_exist build/sub/a.out build/sub/b.out
+echo b2 | diff - build/sub/b.out
+
+# Snapshots from another database version are rejected.
+if which sqlite3 > /dev/null 2>&1; then
+	tup snapshot export ../snapshot-t5127.db
+	sqlite3 ../snapshot-t5127.db "update config set rval=rval+1 where lval='db_version'"
+	rm -rf .tup
+	tup init --no-sync --force > /dev/null
+	if tup snapshot import ../snapshot-t5127.db 2>/dev/null; then
+		echo "Error: Import should fail with a different db_version." 1>&2
+		exit 1
+	fi
+fi
+rm -f ../snapshot-t5127.db
+
+eotup
@@ -0,0 +1,80 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+# Changing a file while an autoupdate is running should make the monitor stop
+# that update and start a new one. The command that was already running gets
+# to finish, but the commands after it only run once, with the new contents.
+
+. ./tup.sh
+check_monitor_supported
+
+cleanup()
+{
+	rm -f ../release.txt
+}
+
+wait_for()
+{
+	for i in `seq 1 100`; do
+		if eval "$1"; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "Monitor output:" 1>&2
+	cat .tup/.monitor.output 1>&2
+	echo "Error: timed out waiting for: $1" 1>&2
+	touch ../release.txt
+	stop_monitor
+	cleanup
+	exit 1
+}
+
+cleanup
+touch ../release.txt
+monitor --autoupdate > .tup/.monitor.output 2>&1
+cat > Tupfile << HERE
+: a.txt |> cat a.txt > %o |> a.out
+: a.out |> cat a.out > started.txt; while [ ! -f ../release.txt ]; do sleep 0.1; done; cat a.out > slow.out |> started.txt slow.out
+: slow.out |> cat slow.out > %o |> c.out
+HERE
+echo one > a.txt
+tup flush
+echo one | diff - c.out
+
+rm -f ../release.txt
+echo two > a.txt
+wait_for "grep two started.txt > /dev/null"
+echo three > a.txt
+wait_for "grep 'restarting the autoupdate' .tup/.monitor.output > /dev/null"
+touch ../release.txt
+tup flush
+
+echo three | diff - c.out
+if [ "`grep -c '\] cat slow.out > c.out' .tup/.monitor.output`" != "2" ]; then
+	echo "Monitor output:" 1>&2
+	cat .tup/.monitor.output 1>&2
+	echo "Error: c.out should not be built from the stale slow.out" 1>&2
+	stop_monitor
+	cleanup
+	exit 1
+fi
+cleanup
+
+eotup
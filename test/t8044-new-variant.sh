@@ -26,7 +26,8 @@ tmkdir build2
 tup touch build1/tup.config
 update
 
-check_exist build1/build2
+# Variant directories are only created for directories with rules in them.
+check_not_exist build1/build2
 check_not_exist build2/build1
 
 tup touch build2/tup.config
@@ -39,6 +40,6 @@ rm build1/tup.config
 update
 
 check_not_exist build1/build2
-check_exist build2/build1
+check_not_exist build2/build1
 
 eotup
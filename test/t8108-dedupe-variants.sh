@@ -0,0 +1,102 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Make sure identical commands in different variants are only run once when
+# updater.dedupe_variants is set, and that each variant still gets its own
+# dependencies.
+
+. ./tup.sh
+check_no_windows shell
+
+cat >> .tup/options << HERE
+[updater]
+dedupe_variants = 1
+HERE
+
+tmkdir sub
+cat > sub/Tupfile << HERE
+: |> sh -c 'if [ @(NAME) = c ]; then sleep 1; fi; echo @(NAME) > %o' |> stamp.txt <stamp>
+: foreach *.c | <stamp> |> gcc -c %f -o %o |> %B.o
+: foo.o |> cp %f %o |> foo.copy
+: |> echo @(FLAG) > %o |> flag.txt
+: |> echo @(NAME) > %o |> name.txt
+: val.in |> tup varsed %f %o |> val.txt
+HERE
+echo 'int foo(void) {return 3;}' > sub/foo.c
+echo 'val=@NAME@' > sub/val.in
+tmkdir build-a
+tmkdir build-b
+echo 'CONFIG_FLAG=y' > build-a/tup.config
+echo 'CONFIG_NAME=a' >> build-a/tup.config
+echo 'CONFIG_FLAG=y' > build-b/tup.config
+echo 'CONFIG_NAME=b' >> build-b/tup.config
+# A third variant adds another link to each shared file, which changes the
+# inode's ctime for the variants that already have it. Its stamp.txt
+# command makes sure that happens in a later second.
+tmkdir build-c
+echo 'CONFIG_FLAG=y' > build-c/tup.config
+echo 'CONFIG_NAME=c' >> build-c/tup.config
+update -j3 > .output.txt
+
+inode()
+{
+	ls -i $1 | awk '{print $1}'
+}
+
+check_same()
+{
+	for i in b c; do
+		if [ "$(inode build-a/$1)" != "$(inode build-$i/$1)" ]; then
+			echo "Error: Expected build-a/$1 and build-$i/$1 to be linked" 1>&2
+			exit 1
+		fi
+	done
+}
+
+check_same sub/foo.o
+check_same sub/foo.copy
+check_same sub/flag.txt
+if [ "$(inode build-a/sub/name.txt)" = "$(inode build-b/sub/name.txt)" ]; then
+	echo "Error: Expected name.txt to be built separately in each variant" 1>&2
+	exit 1
+fi
+# The varsed command has no recorded @-variables on the first build, so it
+# can only be shared once the variable it read is known to match.
+echo 'val=a' | diff - build-a/sub/val.txt
+echo 'val=b' | diff - build-b/sub/val.txt
+echo 'val=c' | diff - build-c/sub/val.txt
+if ! grep 'tup: 6 commands linked outputs' .output.txt > /dev/null; then
+	cat .output.txt
+	echo "Error: Expected 6 commands to be linked" 1>&2
+	exit 1
+fi
+
+tup_dep_exist sub foo.c build-b/sub 'gcc -c foo.c -o ../build-b/sub/foo.o'
+tup_dep_exist build-b/sub foo.o build-b/sub 'cp ../build-b/sub/foo.o ../build-b/sub/foo.copy'
+tup_dep_no_exist build-a/sub foo.o build-b/sub 'cp ../build-b/sub/foo.o ../build-b/sub/foo.copy'
+tup_dep_exist build-b/tup.config FLAG build-b sub
+tup_dep_exist build-b/sub 'echo y > ../build-b/sub/flag.txt' build-b/sub flag.txt
+
+update_null "No commands should run after linking outputs"
+
+echo 'int foo(void) {return 4;}' > sub/foo.c
+update
+check_same sub/foo.o
+check_same sub/foo.copy
+
+eotup
@@ -0,0 +1,71 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Tupfiles and included files are only read once per update, and shared
+# between variants and directories. Make sure each variant and directory
+# still evaluates them with its own variables.
+
+. ./tup.sh
+
+cat > Tuprules.tup << HERE
+ifeq (@(DEBUG),y)
+CFLAGS = -g
+else
+CFLAGS = -O2
+endif
+: |> echo \$(CFLAGS) \\
+  \$(DIRNAME) > %o |> flags.txt
+HERE
+tmkdir sub1
+tmkdir sub2
+cat > sub1/Tupfile << HERE
+DIRNAME = one
+include_rules
+HERE
+cat > sub2/Tupfile << HERE
+DIRNAME = two
+include_rules
+HERE
+tmkdir build-debug
+tmkdir build-release
+echo 'CONFIG_DEBUG=y' > build-debug/tup.config
+echo '' > build-release/tup.config
+update
+
+check_flags()
+{
+	if ! grep "^$2 $3\s*$" $1 > /dev/null; then
+		cat $1
+		echo "Error: Expected '$2 $3' in $1" 1>&2
+		exit 1
+	fi
+}
+check_flags build-debug/sub1/flags.txt -g one
+check_flags build-debug/sub2/flags.txt -g two
+check_flags build-release/sub1/flags.txt -O2 one
+check_flags build-release/sub2/flags.txt -O2 two
+
+# Errors in a shared file still report the right line in each directory.
+cat >> Tuprules.tup << HERE
+
+ error Stop in \$(DIRNAME)
+HERE
+tup touch Tuprules.tup
+parse_fail_msg "Found 'error' command parsing ../Tuprules.tup line 9"
+
+eotup
@@ -0,0 +1,74 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2021  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Variant directories are only created for directories that have rules in
+# them, or that a rule refers to.
+
+. ./tup.sh
+
+tmkdir build
+tmkdir empty
+tmkdir empty/deep
+tmkdir inc
+tmkdir lib
+tmkdir lib/sub
+tmkdir out
+tmkdir dflt
+tmkdir dflt/one
+tmkdir dflt/one/two
+tmkdir later
+
+echo "int x;" > inc/foo.h
+echo ': ../../inc/foo.h |> cp %f %o |> foo.h' > lib/sub/Tupfile
+echo ': |> echo hi > %o |> out/hi.txt' > Tupfile
+echo "" > build/tup.config
+update
+
+check_exist build/lib/sub/foo.h build/out/hi.txt
+check_not_exist build/empty build/dflt build/later
+
+# build/inc is created since lib/sub refers to it, but it has nothing to parse.
+tup_object_exist build inc
+tup_object_exist build/lib sub
+tup_object_no_exist build empty
+tup_object_no_exist build dflt
+
+# A new Tupfile gets its variant directory.
+echo ': |> echo later > %o |> later.txt' > later/Tupfile
+update
+check_exist build/later/later.txt
+
+# A new Tupdefault covers all of the directories below it.
+echo ': |> echo dflt > %o |> dflt.txt' > dflt/Tupdefault
+update
+check_exist build/dflt/dflt.txt build/dflt/one/dflt.txt build/dflt/one/two/dflt.txt
+check_not_exist build/empty
+
+# Removing the Tupfile still removes the variant's outputs.
+rm later/Tupfile
+update
+check_not_exist build/later/later.txt
+
+# Adding a new variant only creates the directories that are needed.
+tmkdir build2
+echo "" > build2/tup.config
+update
+check_exist build2/lib/sub/foo.h build2/out/hi.txt build2/dflt/one/two/dflt.txt
+check_not_exist build2/empty build2/later
+
+eotup
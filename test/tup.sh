@@ -642,6 +642,17 @@ check_no_ldpreload()
 	esac
 }
 
+check_ldpreload()
+{
+	case `tup server` in
+	ldpreload)
+		;;
+	*)
+		echo "[33mOnly supported with the LD_PRELOAD shim. Skipping test: $1[0m"
+		eotup
+	esac
+}
+
 check_no_windows()
 {
 	case `tup server` in